@@ -0,0 +1,105 @@
+#include "admission.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+
+namespace {
+
+// A latency average older than this no longer counts as a load signal, so
+// a server that sheds every post still lets one through now and then to
+// find out whether it has recovered.
+const int64_t kLatencyHorizonNs = 1000000000;
+
+// What a shed request is told to wait
+const int64_t kShedRetryMs = 1000;
+
+}  // namespace
+
+bool AdmissionLimits::Parse(const std::string& spec, std::string* error) {
+  std::stringstream in(spec);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    if (item.empty()) continue;
+    size_t eq = item.find('=');
+    char* end = nullptr;
+    double v = eq == std::string::npos ? 0 : strtod(item.c_str() + eq + 1, &end);
+    if (eq == std::string::npos || end == item.c_str() + eq + 1 || *end || v < 0) {
+      *error = item;
+      return false;
+    }
+    std::string key = item.substr(0, eq);
+    if (key == "user_posts") user_posts = v;
+    else if (key == "user_post_burst") user_post_burst = v;
+    else if (key == "user_rpcs") user_rpcs = v;
+    else if (key == "user_rpc_burst") user_rpc_burst = v;
+    else if (key == "server_posts") server_posts = v;
+    else if (key == "server_post_burst") server_post_burst = v;
+    else if (key == "server_rpcs") server_rpcs = v;
+    else if (key == "server_rpc_burst") server_rpc_burst = v;
+    else if (key == "shed_backlog") shed_backlog = static_cast<int64_t>(v);
+    else if (key == "shed_latency_us") shed_latency_us = static_cast<int64_t>(v);
+    else {
+      *error = item;
+      return false;
+    }
+  }
+  return true;
+}
+
+Admission::Admission(const AdmissionLimits& limits) : limits_(limits) {
+  server_posts_.Configure(limits.server_posts, limits.server_post_burst);
+  server_rpcs_.Configure(limits.server_rpcs, limits.server_rpc_burst);
+}
+
+int64_t Admission::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Admission::Overloaded(int64_t now) const {
+  if (limits_.shed_backlog && backlog_.load(std::memory_order_relaxed) > limits_.shed_backlog) return true;
+  return limits_.shed_latency_us &&
+         latency_ns_.load(std::memory_order_relaxed) > limits_.shed_latency_us * 1000 &&
+         now - latency_at_.load(std::memory_order_relaxed) < kLatencyHorizonNs;
+}
+
+bool Admission::Admit(Kind kind, TokenBucket* user, int64_t* retry_ms) {
+  int64_t now = Now();
+  if (Overloaded(now)) {
+    shed_.fetch_add(1, std::memory_order_relaxed);
+    *retry_ms = kShedRetryMs;
+    return false;
+  }
+  int64_t retry_ns = 0;
+  if (user && !user->Take(now, &retry_ns)) {
+    user_limited_.fetch_add(1, std::memory_order_relaxed);
+    *retry_ms = retry_ns / 1000000 + 1;
+    return false;
+  }
+  TokenBucket& server = kind == kPost ? server_posts_ : server_rpcs_;
+  if (!server.Take(now, &retry_ns)) {
+    server_limited_.fetch_add(1, std::memory_order_relaxed);
+    *retry_ms = retry_ns / 1000000 + 1;
+    return false;
+  }
+  return true;
+}
+
+void Admission::RecordPost(int64_t nanos) {
+  // Exponential moving average with weight 1/8. Concurrent updates may lose
+  // a sample, which does not matter for a load signal.
+  int64_t avg = latency_ns_.load(std::memory_order_relaxed);
+  latency_ns_.store(avg + (nanos - avg) / 8, std::memory_order_relaxed);
+  latency_at_.store(Now(), std::memory_order_relaxed);
+}
+
+AdmissionStats Admission::Stats() const {
+  AdmissionStats stats;
+  stats.user_limited = user_limited_.load(std::memory_order_relaxed);
+  stats.server_limited = server_limited_.load(std::memory_order_relaxed);
+  stats.shed = shed_.load(std::memory_order_relaxed);
+  stats.backlog = backlog_.load(std::memory_order_relaxed);
+  stats.latency_us = latency_ns_.load(std::memory_order_relaxed) / 1000;
+  return stats;
+}
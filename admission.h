@@ -0,0 +1,113 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Token bucket kept as a single "theoretical arrival time" (GCRA): the time
+ * at which the bucket would be full again. Taking a token is one atomic
+ * compare-and-swap, so a bucket can be checked on every message and shared
+ * by any number of threads without a lock. rate 0 means unlimited.
+ */
+class TokenBucket {
+public:
+  // Not thread safe; call before the bucket is shared.
+  void Configure(double rate, double burst) {
+    interval_ = rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0;
+    tolerance_ = burst > 1 ? static_cast<int64_t>((burst - 1) * interval_) : 0;
+  }
+
+  // Takes one token at now (nanoseconds on any monotonic clock). On failure
+  // *retry_ns, if given, is how long until one is available.
+  bool Take(int64_t now, int64_t* retry_ns = nullptr) {
+    if (!interval_) return true;
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    while (true) {
+      int64_t start = tat > now ? tat : now;
+      if (start - now > tolerance_) {
+        if (retry_ns) *retry_ns = start - now - tolerance_;
+        return false;
+      }
+      if (tat_.compare_exchange_weak(tat, start + interval_, std::memory_order_relaxed)) return true;
+    }
+  }
+
+  bool limited() const { return interval_ != 0; }
+
+private:
+  int64_t interval_ = 0;     // ns per token
+  int64_t tolerance_ = 0;    // how far ahead of now tat_ may run: burst - 1 tokens
+  std::atomic<int64_t> tat_{0};
+};
+
+// Rates are per second; 0 = unlimited. Shedding thresholds of 0 are off.
+struct AdmissionLimits {
+  double user_posts = 20;            // per user, on the Timeline stream
+  double user_post_burst = 100;
+  double user_rpcs = 20;             // per user: Follow, UnFollow, List, GetHomeTimeline
+  double user_rpc_burst = 50;
+  double server_posts = 20000;       // all users together
+  double server_post_burst = 40000;
+  double server_rpcs = 10000;        // all users together, Search included
+  double server_rpc_burst = 20000;
+  int64_t shed_backlog = 1 << 20;    // posts queued on follower streams
+  int64_t shed_latency_us = 50000;   // mean time to store and fan out one post
+
+  // Applies "key=value,key=value" overrides (keys as the fields above).
+  // Returns false, with the offending item in *error, on a bad item.
+  bool Parse(const std::string& spec, std::string* error);
+};
+
+struct AdmissionStats {
+  uint64_t user_limited = 0;         // requests over a per-user rate
+  uint64_t server_limited = 0;       // requests over the server rate
+  uint64_t shed = 0;                 // requests turned away while overloaded
+  int64_t backlog = 0;
+  int64_t latency_us = 0;
+};
+
+/*
+ * Server-wide half of admission control: the server buckets, and the load
+ * signals that make the server shed posts and RPCs before its own buckets run
+ * dry -- the number of posts queued on follower streams (PostStream adds to
+ * backlog()) and a moving average of how long a post takes to store and fan
+ * out. Per-user buckets live with each user; Admit checks one against these.
+ */
+class Admission {
+public:
+  enum Kind { kPost, kRpc };
+
+  explicit Admission(const AdmissionLimits& limits = AdmissionLimits());
+
+  const AdmissionLimits& limits() const { return limits_; }
+
+  // Whether one request of kind by the owner of user (null = no per-user
+  // limit) may proceed. If not, *retry_ms is when to try again.
+  bool Admit(Kind kind, TokenBucket* user, int64_t* retry_ms);
+
+  // Feeds the post latency average.
+  void RecordPost(int64_t nanos);
+
+  std::atomic<int64_t>* backlog() { return &backlog_; }
+
+  AdmissionStats Stats() const;
+
+  static int64_t Now();
+
+private:
+  bool Overloaded(int64_t now) const;
+
+  AdmissionLimits limits_;
+  TokenBucket server_posts_;
+  TokenBucket server_rpcs_;
+  std::atomic<int64_t> backlog_{0};
+  std::atomic<int64_t> latency_ns_{0};     // moving average over recent posts
+  std::atomic<int64_t> latency_at_{0};     // when it was last fed
+  std::atomic<uint64_t> user_limited_{0};
+  std::atomic<uint64_t> server_limited_{0};
+  std::atomic<uint64_t> shed_{0};
+};
+
+#endif
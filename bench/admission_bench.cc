@@ -0,0 +1,75 @@
+// Benchmarks admission control: what one decision costs, alone and with
+// several threads sharing the server bucket, and how closely a tight-loop
+// sender is held to the configured rate.
+//
+//   ./bench/admission_bench [threads]      (default: 4)
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "admission.h"
+#include "bench/bench_util.h"
+
+namespace {
+
+const int kDecisions = 10000000;
+
+// ns per Admit with each of threads threads making kDecisions / threads
+// calls, each against its own user bucket and the shared server bucket
+double TimeAdmit(Admission* admission, int threads) {
+  std::vector<TokenBucket> users(threads);
+  for (auto& u : users) u.Configure(1e12, 1e6);   // never the limiting bucket
+  std::atomic<uint64_t> admitted{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      int64_t retry_ms;
+      uint64_t n = 0;
+      for (int i = 0; i < kDecisions / threads; i++) n += admission->Admit(Admission::kPost, &users[t], &retry_ms);
+      admitted += n;
+    });
+  }
+  for (auto& w : workers) w.join();
+  double s = Seconds(start);
+  if (!admitted) printf("nothing admitted\n");
+  return s * 1e9 / kDecisions * threads;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+
+  AdmissionLimits limits;
+  limits.server_posts = 1e12;   // as fast as the loop runs, but still checked
+  limits.server_post_burst = 1e6;
+  {
+    Admission admission(limits);
+    printf("1 thread:  %6.1f ns per decision\n", TimeAdmit(&admission, 1));
+  }
+  {
+    Admission admission(limits);
+    printf("%d threads: %6.1f ns per decision per thread (shared server bucket)\n", threads,
+           TimeAdmit(&admission, threads));
+  }
+
+  // A sender that never stops, against a per-user limit
+  printf("\n%10s %8s %12s %12s\n", "rate/s", "burst", "admitted/s", "error");
+  for (double rate : {20.0, 1000.0, 100000.0}) {
+    TokenBucket bucket;
+    double burst = rate / 10;
+    bucket.Configure(rate, burst);
+    const double secs = 2;
+    uint64_t n = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (Seconds(start) < secs) n += bucket.Take(Admission::Now());
+    double got = (n - burst) / secs;   // the initial burst comes free
+    printf("%10.0f %8.0f %12.1f %11.2f%%\n", rate, burst, got, (got - rate) / rate * 100);
+  }
+  return 0;
+}
@@ -0,0 +1,677 @@
+// In-process cluster simulation: a CoordServiceImpl and several tsd
+// instances (SNSServiceImpl, each with its own data directory) in one
+// process, wired together with in-process channels and driven by scripted
+// clients that behave like tsc (Login, Follow, a Timeline stream, pipelined
+// posts re-sent after a failover). Nothing listens on a network port.
+//
+// Heartbeat timings are tsd's and the coordinator's divided by kScale, so a
+// failover that takes tens of seconds in a real deployment takes a fraction
+// of a second here; the detection parts of the results scale back up by
+// kScale, the rest does not.
+//
+// Scenarios:
+//   delivery   one author and N followers on a healthy cluster: post-to-
+//              delivery latency.
+//   failover   the author keeps posting while the cluster's tsd is killed and
+//              a standby takes over its data directory: time until the
+//              coordinator routes to the standby and until every client is
+//              back, latency of the posts made meanwhile, lost and
+//              duplicated deliveries.
+//   heartbeat  a healthy tsd's heartbeats are delayed: how long its cluster
+//              is unroutable, for several delays.
+//   migration  the author keeps posting while the coordinator moves its
+//              followers, in two batches, and then the author itself to a
+//              second cluster: time per batch, latency of the posts made
+//              before, during and after each move, lost and duplicated
+//              deliveries.
+//
+//   ./bench/cluster_sim [followers [posts]]   (default: 20 2000)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <unistd.h>
+
+#include "coord_service.h"
+#include "coordinator.grpc.pb.h"
+#include "sns.grpc.pb.h"
+#include "sns_service.h"
+
+#include <glog/logging.h>
+
+using csce438::CoordService;
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+const int kScale = 50;
+// tsd heartbeats every 5 s; the coordinator sweeps every 3 s with a 10 s timeout
+const std::chrono::milliseconds kHeartbeatInterval(5000 / kScale);
+const std::chrono::milliseconds kHeartbeatTimeout(10000 / kScale);
+const std::chrono::milliseconds kSweepInterval(3000 / kScale);
+// Pause between a client's failed attempt to reach a server and the next
+const std::chrono::milliseconds kRetry(5);
+const std::chrono::milliseconds kPostGap(1);
+
+// Simulated clients post every kPostGap, far above the per-user default, and
+// the run measures failover rather than admission control
+AdmissionLimits Unlimited() {
+  AdmissionLimits limits;
+  limits.user_posts = limits.user_rpcs = 0;
+  limits.server_posts = limits.server_rpcs = 0;
+  limits.shed_backlog = limits.shed_latency_us = 0;
+  return limits;
+}
+
+double Ms(Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+
+// Sleeps for d in small steps; returns early once stop is set.
+void SleepUnless(const std::atomic<bool>& stop, Clock::duration d) {
+  auto until = Clock::now() + d;
+  while (!stop && Clock::now() < until) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+double Percentile(std::vector<double> v, double p) {
+  if (v.empty()) return 0;
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+class Sim {
+public:
+  struct Node {
+    int cluster = 0;
+    std::string name;   // advertised to the coordinator as the port
+    std::unique_ptr<SNSServiceImpl> service;
+    std::unique_ptr<grpc::Server> server;
+    std::unique_ptr<SNSService::Stub> stub;   // over an in-process channel
+    std::shared_mutex gate;   // held shared while a call starts; see Call()
+    std::thread heartbeat;
+    std::atomic<bool> dead{false};
+    std::atomic<int64_t> heartbeat_delay_ms{0};
+    double recover_ms = 0;
+  };
+
+  explicit Sim(std::string root) : root_(std::move(root)), coord_(kHeartbeatTimeout) {
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&coord_);
+    coord_server_ = builder.BuildAndStart();
+    coord_stub_ = CoordService::NewStub(coord_server_->InProcessChannel(grpc::ChannelArguments()));
+    coord_.setServerChannels([this](const std::string& address) { return Channel(address); });
+    sweeper_ = std::thread([this]() {
+      while (!stop_) {
+        coord_.checkHeartbeat();
+        SleepUnless(stop_, kSweepInterval);
+      }
+    });
+  }
+
+  ~Sim() {
+    // Servers call each other to forward posts; that stops before any goes away
+    for (auto& n : nodes_) n->service->Stop();
+    for (auto& n : nodes_) Kill(n.get());
+    stop_ = true;
+    sweeper_.join();
+    coord_server_->Shutdown(std::chrono::system_clock::now());
+    std::filesystem::remove_all(root_);
+  }
+
+  // Starts a tsd instance on <root>/<dir>, recovering whatever is there.
+  Node* Start(int cluster, const std::string& name, const std::string& dir) {
+    std::filesystem::create_directories(root_ + "/" + dir);
+    auto n = std::make_unique<Node>();
+    n->cluster = cluster;
+    n->name = name;
+    n->service = std::make_unique<SNSServiceImpl>(root_ + "/" + dir, Unlimited());
+    n->service->set_address("inproc:" + name, [this](const std::string& address) { return Channel(address); });
+    auto start = Clock::now();
+    n->service->Recover();
+    n->recover_ms = Ms(Clock::now() - start);
+    n->service->Start();
+
+    grpc::ServerBuilder builder;
+    builder.RegisterService(n->service.get());
+    n->server = builder.BuildAndStart();
+    n->stub = SNSService::NewStub(n->server->InProcessChannel(grpc::ChannelArguments()));
+
+    Node* node = n.get();
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      nodes_.push_back(std::move(n));
+    }
+    node->heartbeat = std::thread([this, node]() {
+      csce438::ServerInfo info;
+      info.set_serverid(node->cluster);
+      info.set_hostname("inproc");
+      info.set_port(node->name);
+      info.set_type("SERVER");
+      while (!node->dead) {
+        grpc::ClientContext ctx;
+        csce438::Confirmation conf;
+        coord_stub_->Heartbeat(&ctx, info, &conf);
+        SleepUnless(node->dead, kHeartbeatInterval);
+        int64_t delay = node->heartbeat_delay_ms.exchange(0);
+        SleepUnless(node->dead, std::chrono::milliseconds(delay));
+      }
+    });
+    return node;
+  }
+
+  // Crashes a node: its streams break and its heartbeats stop. The objects
+  // stay around until the simulation ends, since clients may still hold it.
+  void Kill(Node* n) {
+    {
+      std::unique_lock<std::shared_mutex> lock(n->gate);
+      if (n->dead.exchange(true)) return;
+    }
+    n->heartbeat.join();
+    n->server->Shutdown(std::chrono::system_clock::now());
+    n->service->Stop();
+  }
+
+  // The node the coordinator assigns client_id to, as tsc asks at startup
+  // and after a broken stream; nullptr if there is none.
+  Node* Resolve(int client_id) {
+    grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(1));
+    csce438::ID id;
+    id.set_id(client_id);
+    csce438::ServerInfo info;
+    if (!coord_stub_->GetServer(&ctx, id, &info).ok()) return nullptr;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto& n : nodes_) {
+      if (n->name == info.port()) return n.get();
+    }
+    return nullptr;
+  }
+
+  // Channel to the node advertised as address, for the coordinator and the
+  // nodes to call each other; one that leads nowhere if there is none.
+  std::shared_ptr<grpc::Channel> Channel(const std::string& address) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto& n : nodes_) {
+      if ("inproc:" + n->name == address) return n->server->InProcessChannel(grpc::ChannelArguments());
+    }
+    return grpc::CreateChannel("unix:/nonexistent", grpc::InsecureChannelCredentials());
+  }
+
+  // Moves users to cluster through the coordinator, batch at a time
+  grpc::Status Migrate(const std::vector<int>& users, int cluster, uint32_t batch, csce438::MoveUsersReply* reply) {
+    grpc::ClientContext ctx;
+    csce438::MoveUsersRequest request;
+    for (int u : users) request.add_users(u);
+    request.set_cluster(cluster);
+    request.set_batch(batch);
+    return coord_stub_->Migrate(&ctx, request, reply);
+  }
+
+  // Starts calls on n through fn, or returns false if n is dead. A real
+  // client would get "connection refused" from a dead tsd, but gRPC's
+  // in-process transport crashes if a call starts after its server shut
+  // down, so Kill() waits for calls being started here.
+  bool Call(Node* n, const std::function<void(SNSService::Stub*)>& fn) {
+    std::shared_lock<std::shared_mutex> lock(n->gate);
+    if (n->dead) return false;
+    fn(n->stub.get());
+    return true;
+  }
+
+private:
+  std::string root_;
+  CoordServiceImpl coord_;
+  std::unique_ptr<grpc::Server> coord_server_;
+  std::unique_ptr<CoordService::Stub> coord_stub_;
+  std::thread sweeper_;
+  std::atomic<bool> stop_{false};
+  std::mutex mu_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
+
+// A scripted tsc: stays logged in with a Timeline stream open, reconnecting
+// through the coordinator whenever the stream breaks, and re-sends posts
+// that were not acknowledged yet.
+class SimClient {
+public:
+  SimClient(Sim* sim, int id, std::function<void(const Message&)> on_post)
+      : sim_(sim), id_(id), user_(std::to_string(id)), on_post_(std::move(on_post)) {}
+
+  ~SimClient() { Stop(); }
+
+  void Run() { session_thread_ = std::thread(&SimClient::Session, this); }
+
+  void Stop() {
+    stop_ = true;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (ctx_) ctx_->TryCancel();
+    }
+    if (session_thread_.joinable()) session_thread_.join();
+  }
+
+  bool Follow(int other) {
+    Sim::Node* node = sim_->Resolve(id_);
+    if (!node) return false;
+    grpc::ClientContext ctx;
+    Request req;
+    req.set_username(user_);
+    req.set_session(session_);
+    req.add_arguments(std::to_string(other));
+    Reply reply;
+    grpc::Status status;
+    sim_->Call(node, [&](SNSService::Stub* stub) { status = stub->Follow(&ctx, req, &reply); });
+    return status.ok() && reply.msg() == "OK";
+  }
+
+  void Post(uint64_t seq) {
+    Message m;
+    m.set_username(user_);
+    m.set_msg("post " + std::to_string(seq));
+    m.set_seq(seq);
+    m.mutable_timestamp()->set_seconds(time(nullptr));
+    std::lock_guard<std::mutex> lock(mu_);
+    inflight_.push_back(m);
+    if (stream_) stream_->Write(m);
+  }
+
+  // Number of Timeline streams opened so far
+  int attaches() const { return attaches_; }
+
+private:
+  void Session() {
+    while (!stop_) {
+      Sim::Node* node = sim_->Resolve(id_);
+      if (!node) { std::this_thread::sleep_for(kRetry); continue; }
+      {
+        grpc::ClientContext ctx;
+        ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(1));
+        Request req;
+        req.set_username(user_);
+        req.set_session(session_);
+        Reply reply;
+        grpc::Status status(grpc::StatusCode::UNAVAILABLE, "");
+        sim_->Call(node, [&](SNSService::Stub* stub) { status = stub->Login(&ctx, req, &reply); });
+        if (!status.ok() || reply.msg() == "User already logged in") {
+          std::this_thread::sleep_for(kRetry);
+          continue;
+        }
+        session_ = reply.session();
+      }
+
+      grpc::ClientContext ctx;
+      ctx.AddMetadata("username", user_);
+      ctx.AddMetadata("session", std::to_string(session_.load()));
+      std::unique_ptr<grpc::ClientReaderWriter<Message, Message>> stream;
+      Message handshake;
+      handshake.set_username(user_);
+      handshake.set_msg("[handshake]");
+      bool started = false;
+      sim_->Call(node, [&](SNSService::Stub* stub) {
+        stream = stub->Timeline(&ctx);
+        started = stream->Write(handshake);
+      });
+      if (!stream) { std::this_thread::sleep_for(kRetry); continue; }
+      if (!started) {
+        stream->Finish();
+        std::this_thread::sleep_for(kRetry);
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& m : inflight_) stream->Write(m);
+        stream_ = stream.get();
+        ctx_ = &ctx;
+        if (stop_) ctx.TryCancel();
+      }
+      attaches_++;
+
+      Message m;
+      while (stream->Read(&m)) {
+        if (m.ack()) {
+          std::lock_guard<std::mutex> lock(mu_);
+          while (!inflight_.empty() && inflight_.front().seq() <= m.ack()) inflight_.pop_front();
+          continue;
+        }
+        if (!m.inbox_resume().empty()) continue;
+        on_post_(m);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        stream_ = nullptr;
+        ctx_ = nullptr;
+      }
+      stream->Finish();
+    }
+  }
+
+  Sim* sim_;
+  int id_;
+  std::string user_;
+  std::function<void(const Message&)> on_post_;
+  std::atomic<uint64_t> session_{0};
+  std::atomic<bool> stop_{false};
+  std::atomic<int> attaches_{0};
+  std::thread session_thread_;
+  std::mutex mu_;   // guards inflight_, stream_ and ctx_
+  std::deque<Message> inflight_;
+  grpc::ClientReaderWriter<Message, Message>* stream_ = nullptr;
+  grpc::ClientContext* ctx_ = nullptr;
+};
+
+// Delivery bookkeeping for one author's posts, numbered 1..posts, to a fixed
+// set of followers.
+class Tally {
+public:
+  Tally(size_t followers, size_t posts)
+      : sent_(posts + 1), seen_(followers, std::vector<uint8_t>(posts + 1)),
+        delivered_(followers, std::vector<Clock::time_point>(posts + 1)) {}
+
+  void Sent(uint64_t seq) { sent_[seq] = Clock::now(); }
+
+  void Received(size_t follower, const Message& m) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (m.seq() == 0 || m.seq() >= sent_.size()) return;
+    if (seen_[follower][m.seq()]++ == 0) delivered_[follower][m.seq()] = Clock::now();
+  }
+
+  bool Complete() {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto& s : seen_) {
+      if (std::count(s.begin() + 1, s.end(), 0)) return false;
+    }
+    return true;
+  }
+
+  // Latencies in ms of the deliveries of posts first sent in [from, to)
+  std::vector<double> Latencies(Clock::time_point from, Clock::time_point to) {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::vector<double> out;
+    for (size_t f = 0; f < seen_.size(); f++) {
+      for (size_t p = 1; p < sent_.size(); p++) {
+        if (seen_[f][p] && sent_[p] >= from && sent_[p] < to) out.push_back(Ms(delivered_[f][p] - sent_[p]));
+      }
+    }
+    return out;
+  }
+
+  void Count(size_t* lost, size_t* duplicated) {
+    std::lock_guard<std::mutex> lock(mu_);
+    *lost = *duplicated = 0;
+    for (auto& s : seen_) {
+      for (size_t p = 1; p < s.size(); p++) {
+        if (s[p] == 0) (*lost)++;
+        if (s[p] > 1) *duplicated += s[p] - 1;
+      }
+    }
+  }
+
+private:
+  std::vector<Clock::time_point> sent_;
+  std::mutex mu_;
+  std::vector<std::vector<uint8_t>> seen_;
+  std::vector<std::vector<Clock::time_point>> delivered_;
+};
+
+bool WaitFor(const std::function<bool()>& done, std::chrono::seconds timeout) {
+  auto until = Clock::now() + timeout;
+  while (!done()) {
+    if (Clock::now() > until) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+// Client ids 1, 4, 7, ... all map to cluster 1
+int ClusterOneClient(size_t i) { return static_cast<int>(1 + 3 * i); }
+
+struct Cast {
+  std::unique_ptr<SimClient> author;
+  std::vector<std::unique_ptr<SimClient>> followers;
+};
+
+// Brings up the author and its followers and waits for every stream to open
+bool Assemble(Sim* sim, Tally* tally, size_t followers, Cast* cast) {
+  cast->author = std::make_unique<SimClient>(sim, ClusterOneClient(0), [](const Message&) {});
+  cast->author->Run();
+  for (size_t i = 0; i < followers; i++) {
+    cast->followers.push_back(std::make_unique<SimClient>(
+        sim, ClusterOneClient(i + 1), [tally, i](const Message& m) { tally->Received(i, m); }));
+    cast->followers.back()->Run();
+  }
+  auto all_attached = [&]() {
+    if (cast->author->attaches() < 1) return false;
+    for (auto& f : cast->followers) if (f->attaches() < 1) return false;
+    return true;
+  };
+  if (!WaitFor(all_attached, std::chrono::seconds(5))) return false;
+  for (size_t i = 0; i < followers; i++) {
+    if (!cast->followers[i]->Follow(ClusterOneClient(0))) return false;
+  }
+  return true;
+}
+
+void PrintLatencies(const char* label, const std::vector<double>& ms) {
+  printf("  %-26s %8zu %9.2f %9.2f %9.2f\n", label, ms.size(), Percentile(ms, 0.5), Percentile(ms, 0.99),
+         ms.empty() ? 0 : *std::max_element(ms.begin(), ms.end()));
+}
+
+int Delivery(const std::string& root, size_t followers, size_t posts) {
+  Sim sim(root + "/delivery");
+  sim.Start(1, "a1", "c1");
+  Tally tally(followers, posts);
+  Cast cast;
+  if (!Assemble(&sim, &tally, followers, &cast)) {
+    fprintf(stderr, "delivery: clients failed to attach\n");
+    return 1;
+  }
+
+  auto start = Clock::now();
+  for (size_t p = 1; p <= posts; p++) {
+    tally.Sent(p);
+    cast.author->Post(p);
+    std::this_thread::sleep_for(kPostGap);
+  }
+  bool complete = WaitFor([&]() { return tally.Complete(); }, std::chrono::seconds(3));
+  double secs = Ms(Clock::now() - start) / 1000;
+  size_t lost, duplicated;
+  tally.Count(&lost, &duplicated);
+
+  printf("delivery: 1 author, %zu followers, %zu posts %lld ms apart\n", followers, posts,
+         static_cast<long long>(kPostGap.count()));
+  printf("  %-26s %8s %9s %9s %9s\n", "", "samples", "p50 ms", "p99 ms", "max ms");
+  PrintLatencies("post -> follower", tally.Latencies(start, Clock::now()));
+  printf("  %.0f deliveries/s, lost %zu, duplicated %zu%s\n\n", followers * posts / secs, lost, duplicated,
+         complete ? "" : " (timed out)");
+  return 0;
+}
+
+int Failover(const std::string& root, size_t followers, size_t posts) {
+  Sim sim(root + "/failover");
+  Sim::Node* primary = sim.Start(1, "a1", "c1");
+  Tally tally(followers, posts);
+  Cast cast;
+  if (!Assemble(&sim, &tally, followers, &cast)) {
+    fprintf(stderr, "failover: clients failed to attach\n");
+    return 1;
+  }
+
+  // The primary crashes a third of the way through the posts, and a
+  // supervisor starts a standby that mounts the same data directory.
+  Clock::time_point killed, routed, reattached;
+  std::atomic<bool> failed_over{false};
+  Sim::Node* standby = nullptr;
+  std::thread crash([&]() {
+    while (!failed_over) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    killed = Clock::now();
+    sim.Kill(primary);
+    standby = sim.Start(1, "b1", "c1");
+
+    WaitFor([&]() { return sim.Resolve(ClusterOneClient(0)) == standby; }, std::chrono::seconds(30));
+    routed = Clock::now();
+    WaitFor([&]() {
+      if (cast.author->attaches() < 2) return false;
+      for (auto& f : cast.followers) if (f->attaches() < 2) return false;
+      return true;
+    }, std::chrono::seconds(30));
+    reattached = Clock::now();
+  });
+
+  size_t crash_at = std::max<size_t>(1, posts / 3);
+  auto start = Clock::now();
+  for (size_t p = 1; p <= posts; p++) {
+    if (p == crash_at) failed_over = true;
+    tally.Sent(p);
+    cast.author->Post(p);
+    std::this_thread::sleep_for(kPostGap);
+  }
+  crash.join();
+  bool complete = WaitFor([&]() { return tally.Complete(); }, std::chrono::seconds(3));
+  size_t lost, duplicated;
+  tally.Count(&lost, &duplicated);
+
+  printf("failover: tsd killed after %zu of %zu posts, standby takes over its data directory\n", crash_at - 1, posts);
+  printf("  standby recovery            %9.2f ms\n", standby->recover_ms);
+  printf("  coordinator routes standby  %9.2f ms after the crash\n", Ms(routed - killed));
+  printf("  all clients reattached      %9.2f ms after the crash\n", Ms(reattached - killed));
+  printf("  %-26s %8s %9s %9s %9s\n", "", "samples", "p50 ms", "p99 ms", "max ms");
+  PrintLatencies("posted before the crash", tally.Latencies(start, killed));
+  PrintLatencies("posted during failover", tally.Latencies(killed, reattached));
+  PrintLatencies("posted after failover", tally.Latencies(reattached, Clock::now()));
+  printf("  lost %zu, duplicated %zu%s\n\n", lost, duplicated, complete ? "" : " (timed out)");
+  return 0;
+}
+
+int Heartbeat(const std::string& root) {
+  Sim sim(root + "/heartbeat");
+  Sim::Node* node = sim.Start(2, "a2", "c2");
+  std::this_thread::sleep_for(2 * kHeartbeatInterval);
+
+  printf("heartbeat: one heartbeat of a healthy tsd is late\n");
+  printf("  %10s %12s %14s\n", "delay ms", "gap ms", "unroutable ms");
+  for (int factor : {1, 2, 4, 8}) {
+    auto delay = factor * kHeartbeatInterval;
+    node->heartbeat_delay_ms = delay.count();
+    // Probe cluster 2 the way clients would until well after the beat is due
+    Clock::duration unroutable{0};
+    auto until = Clock::now() + kHeartbeatInterval + delay + 3 * kHeartbeatTimeout;
+    auto last = Clock::now();
+    while (Clock::now() < until) {
+      bool ok = sim.Resolve(2) != nullptr;
+      auto now = Clock::now();
+      if (!ok) unroutable += now - last;
+      last = now;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    printf("  %10lld %12lld %14.1f\n", static_cast<long long>(delay.count()),
+           static_cast<long long>((kHeartbeatInterval + delay).count()), Ms(unroutable));
+  }
+  printf("\n");
+  return 0;
+}
+
+int Migration(const std::string& root, size_t followers, size_t posts) {
+  Sim sim(root + "/migration");
+  sim.Start(1, "a1", "c1");
+  sim.Start(2, "a2", "c2");
+  Tally tally(followers, posts);
+  Cast cast;
+  if (!Assemble(&sim, &tally, followers, &cast)) {
+    fprintf(stderr, "migration: clients failed to attach\n");
+    return 1;
+  }
+
+  // A quarter of the way through the posts the followers move in two
+  // batches; halfway the author follows them
+  std::vector<int> follower_ids;
+  for (size_t i = 0; i < followers; i++) follower_ids.push_back(ClusterOneClient(i + 1));
+  uint32_t batch = static_cast<uint32_t>(std::max<size_t>(1, (followers + 1) / 2));
+  std::atomic<int> phase{0};
+  Clock::time_point followers_from, followers_to, author_from, author_to;
+  csce438::MoveUsersReply moved_followers, moved_author;
+  grpc::Status followers_status, author_status;
+  std::thread mover([&]() {
+    while (phase < 1) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    followers_from = Clock::now();
+    followers_status = sim.Migrate(follower_ids, 2, batch, &moved_followers);
+    followers_to = Clock::now();
+    while (phase < 2) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    author_from = Clock::now();
+    author_status = sim.Migrate({ClusterOneClient(0)}, 2, 1, &moved_author);
+    author_to = Clock::now();
+  });
+
+  auto start = Clock::now();
+  for (size_t p = 1; p <= posts; p++) {
+    if (p == std::max<size_t>(1, posts / 4)) phase = std::max(phase.load(), 1);
+    if (p == std::max<size_t>(1, posts / 2)) phase = 2;
+    tally.Sent(p);
+    cast.author->Post(p);
+    std::this_thread::sleep_for(kPostGap);
+  }
+  phase = 2;
+  mover.join();
+  bool complete = WaitFor([&]() { return tally.Complete(); }, std::chrono::seconds(5));
+  size_t lost, duplicated;
+  tally.Count(&lost, &duplicated);
+
+  if (!followers_status.ok() || !author_status.ok() || moved_followers.failed() || moved_author.failed()) {
+    fprintf(stderr, "migration: %s%s\n", followers_status.error_message().c_str(),
+            (moved_followers.error() + moved_author.error()).c_str());
+  }
+  printf("migration: %zu followers move to cluster 2 in batches of %u, then the author; %zu posts\n", followers,
+         batch, posts);
+  printf("  followers moved             %9.2f ms (%u users, %u failed)\n", Ms(followers_to - followers_from),
+         moved_followers.moved(), moved_followers.failed());
+  printf("  author moved                %9.2f ms (%llu posts copied)\n", Ms(author_to - author_from),
+         static_cast<unsigned long long>(moved_author.posts()));
+  printf("  %-26s %8s %9s %9s %9s\n", "", "samples", "p50 ms", "p99 ms", "max ms");
+  PrintLatencies("posted before", tally.Latencies(start, followers_from));
+  PrintLatencies("while followers move", tally.Latencies(followers_from, followers_to));
+  PrintLatencies("split across clusters", tally.Latencies(followers_to, author_from));
+  PrintLatencies("while the author moves", tally.Latencies(author_from, author_to));
+  PrintLatencies("after", tally.Latencies(author_to, Clock::now()));
+  printf("  lost %zu, duplicated %zu%s\n\n", lost, duplicated, complete ? "" : " (timed out)");
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t followers = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20;
+  size_t posts = argc > 2 ? strtoull(argv[2], nullptr, 10) : 2000;
+
+  // The services log every heartbeat and routing decision; keep the report readable
+  FLAGS_minloglevel = google::FATAL;
+  std::cout.setstate(std::ios::badbit);
+  std::cerr.setstate(std::ios::badbit);
+
+  std::string root = std::filesystem::temp_directory_path() / ("cluster_sim." + std::to_string(getpid()));
+  printf("heartbeat every %lld ms, timeout %lld ms, sweep every %lld ms (1/%d of tsd and coordinator)\n\n",
+         static_cast<long long>(kHeartbeatInterval.count()), static_cast<long long>(kHeartbeatTimeout.count()),
+         static_cast<long long>(kSweepInterval.count()), kScale);
+
+  int rc = Delivery(root, followers, posts);
+  if (rc == 0) rc = Failover(root, followers, posts);
+  if (rc == 0) rc = Heartbeat(root);
+  if (rc == 0) rc = Migration(root, followers, posts);
+  std::filesystem::remove_all(root);
+  return rc;
+}
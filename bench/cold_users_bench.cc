@@ -0,0 +1,177 @@
+// Measures tsd with far more registered users than it keeps in memory: writes
+// a checkpoint of U users, none of them logged in, and E follows (skewed
+// towards popular users), recovers it under a memory budget, then times
+// requests that bring a paged-out user back in against requests for resident
+// ones, and runs a skewed workload to see where memory settles.
+//
+//   ./bench/cold_users_bench [users [edges [budget_mb [ops]]]]   (default: 10000000 30000000 256 2000000)
+//
+// A budget of 0 pages nothing out, for comparison. Memory is the
+// process's resident set (VmRSS) and the heap part of it (RssAnon); the rest
+// is mostly page file pages mapped in, which the kernel can take back.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "snapshot.h"
+#include "sns_service.h"
+#include "social_graph.h"
+
+using csce438::Reply;
+using csce438::Request;
+using grpc::ServerContext;
+
+namespace {
+
+const size_t kSamples = 20000;
+const size_t kHotUsers = 50000;
+
+// Discards tsd's log lines
+struct NullBuf : std::streambuf {
+  int overflow(int c) override { return c; }
+};
+
+// A line of /proc/self/status, such as "RssAnon:", in MB
+size_t StatusMB(const std::string& key) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, key.size(), key) == 0) return strtoull(line.c_str() + key.size(), nullptr, 10) >> 10;
+  }
+  return 0;
+}
+
+double Percentile(std::vector<double> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v.empty() ? 0 : v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+// Writes the checkpoint in a child process, so building the graph leaves no
+// memory behind in the one measured
+bool WriteSnapshot(const std::string& path, size_t users, size_t edges) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<uint32_t> any(0, users - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    Snapshot snap;
+    SocialGraph graph;
+    graph.Resize(users);
+    for (size_t i = 0; i < users; i++) snap.names.push_back(std::to_string(i + 1));
+    snap.sessions.assign(users, 0);
+    while (graph.edges() < edges) {
+      uint32_t a = any(rng), b = static_cast<uint32_t>(std::pow(static_cast<double>(users), unit(rng))) - 1;
+      if (a != b) graph.Follow(a, b);
+    }
+    graph.Serialize(&snap.graph);
+    _exit(SaveSnapshot(path, snap) ? 0 : 1);
+  }
+  int status = 0;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Handlers are called directly, as from a gRPC thread
+void Call(csce438::SNSService::Service* service, bool follow, const std::string& user, const std::string& other) {
+  ServerContext ctx;
+  Request req;
+  Reply rep;
+  req.set_username(user);
+  if (follow) {
+    req.add_arguments(other);
+    service->Follow(&ctx, &req, &rep);
+  } else {
+    service->KeepAlive(&ctx, &req, &rep);
+  }
+}
+
+void PrintResidency(const char* label, SNSServiceImpl* service) {
+  ResidencyStats rs = service->Residency();
+  printf("%-10s rss %5zu MB (%zu MB heap) | %zu in memory (%zu MB counted), directory %zu MB, %zu paged out "
+         "(%lu MB on disk), %lu faults, %lu evictions\n",
+         label, StatusMB("VmRSS:"), StatusMB("RssAnon:"), rs.resident, rs.resident_bytes >> 20, rs.directory_bytes >> 20, rs.paged,
+         static_cast<unsigned long>(rs.page_file_bytes >> 20), static_cast<unsigned long>(rs.faults),
+         static_cast<unsigned long>(rs.evictions));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t users = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+  size_t edges = argc > 2 ? strtoull(argv[2], nullptr, 10) : 30000000;
+  size_t budget_mb = argc > 3 ? strtoull(argv[3], nullptr, 10) : 256;
+  size_t ops = argc > 4 ? strtoull(argv[4], nullptr, 10) : 2000000;
+
+  std::string root = std::filesystem::temp_directory_path() / ("cold_users_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(root);
+  auto start = std::chrono::steady_clock::now();
+  if (!WriteSnapshot(root + "/tsd.snapshot", users, edges)) {
+    fprintf(stderr, "writing the snapshot failed\n");
+    return 1;
+  }
+  printf("%zu users, %zu follows checkpointed in %.1f s; budget %zu MB\n\n", users, edges, Seconds(start),
+         budget_mb);
+
+  NullBuf null_buf;
+  std::cerr.rdbuf(&null_buf);
+  printf("%-10s rss %5zu MB (%zu MB heap)\n", "empty", StatusMB("VmRSS:"), StatusMB("RssAnon:"));
+  {
+    AdmissionLimits unlimited;
+    unlimited.user_rpcs = unlimited.server_rpcs = 0;
+    SNSServiceImpl service(root, unlimited);
+    service.set_memory_budget(budget_mb << 20);
+    start = std::chrono::steady_clock::now();
+    service.Recover();
+    printf("recovered in %.1f s\n", Seconds(start));
+    PrintResidency("recovered", &service);
+
+    // The same users twice: paged out the first time, resident the second
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<uint32_t> any(1, users);
+    std::vector<std::string> sample;
+    for (size_t i = 0; i < std::min(kSamples, users); i++) sample.push_back(std::to_string(any(rng)));
+    std::vector<double> cold_us, hot_us;
+    for (auto* lat : {&cold_us, &hot_us}) {
+      for (const auto& user : sample) {
+        auto t = std::chrono::steady_clock::now();
+        Call(&service, false, user, "");
+        lat->push_back(Seconds(t) * 1e6);
+      }
+    }
+    printf("\n%-24s %10s %10s\n", "KeepAlive latency", "p50 us", "p99 us");
+    printf("%-24s %10.2f %10.2f\n", "paged out (fault in)", Percentile(cold_us, 0.5), Percentile(cold_us, 0.99));
+    printf("%-24s %10.2f %10.2f\n\n", "resident", Percentile(hot_us, 0.5), Percentile(hot_us, 0.99));
+
+    // 90% of calls go to a hot set, the rest to anyone; one in ten is a Follow
+    service.Start();
+    std::uniform_int_distribution<uint32_t> hot(1, std::min(kHotUsers, users));
+    std::uniform_int_distribution<int> pct(0, 99);
+    auto pick = [&]() { return std::to_string(pct(rng) < 90 ? hot(rng) : any(rng)); };
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) {
+      bool follow = pct(rng) < 10;
+      Call(&service, follow, pick(), follow ? pick() : std::string());
+    }
+    double run = Seconds(start);
+    printf("workload: %zu calls in %.1f s (%.0f/s)\n", ops, run, ops / run);
+    PrintResidency("after", &service);
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    PrintResidency("settled", &service);
+  }
+  std::filesystem::remove_all(root);
+  return 0;
+}
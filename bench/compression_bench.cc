@@ -0,0 +1,220 @@
+// Bytes on the wire and CPU per message for the ways a post can travel:
+//
+//   live      one post on a Timeline stream: plain; gzip per message, which is
+//             what gRPC's own compression would do to each follower's copy;
+//             and the deflate-d1 frame tsd sends readers that ask for it
+//             (post_codec.h), with the username interned; and each half of
+//             that, interning alone and deflate-d1 alone
+//   replay    inbox catch-up: deflate-d1 frames of up to kFrameBytes
+//   page      a GetTimeline page of 512 posts: plain and gzip
+//
+// Posts are synthetic: 5-30 words drawn from a skewed vocabulary of common
+// and uncommon words, with the odd number, mention, hashtag or link, by one
+// of 10,000 users. Bytes count the protobuf message, without gRPC's 5-byte
+// frame header. Pack CPU is per post and shared by every follower that gets
+// the frame; gzip per message is paid for each follower.
+//
+//   ./bench/compression_bench [posts]      (default: 20000)
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "bench/bench_util.h"
+#include "post_codec.h"
+#include "sns.pb.h"
+
+using csce438::Message;
+using csce438::TimelinePage;
+
+namespace {
+
+const char* kWords[] = {
+    "the", "a", "to", "and", "of", "I", "in", "is", "it", "for", "you", "on", "my", "this", "that",
+    "with", "so", "just", "was", "at", "be", "me", "have", "are", "but", "not", "we", "all", "new",
+    "get", "out", "today", "now", "up", "can", "love", "like", "day", "good", "great", "time",
+    "one", "what", "your", "from", "about", "night", "back", "game", "work", "week", "going",
+    "really", "people", "first", "last", "still", "think", "know", "need", "want", "see",
+    "weekend", "coffee", "team", "release", "finally", "amazing", "tomorrow", "morning",
+    "build", "server", "deploy", "latency", "timeline", "cluster", "benchmark", "rollout",
+    "quarterly", "kubernetes", "sourdough", "marathon", "espresso", "vinyl", "hiking", "bicycle",
+    "thunderstorm", "cathedral", "algorithm", "spreadsheet", "dumpling", "telescope", "podcast",
+    "synthesizer", "migration", "nebula", "origami", "saxophone", "avocado", "glacier",
+    "refactor", "compiler", "deadline", "keynote", "playoffs", "quarterback", "penalty",
+    "goalkeeper", "festival", "headliner", "setlist", "encore", "premiere", "trailer", "sequel",
+};
+
+// One of many users, with names of a typical length
+std::string User(std::mt19937& rng) { return "user" + std::to_string(rng() % 10000); }
+
+std::string PostText(std::mt19937& rng) {
+  const size_t n = sizeof(kWords) / sizeof(kWords[0]);
+  std::string text;
+  int words = 5 + rng() % 26;
+  for (int i = 0; i < words; i++) {
+    if (i) text += ' ';
+    uint32_t r = rng() % 100;
+    if (r < 3) {
+      text += std::to_string(rng() % 10000);
+    } else if (r < 5) {
+      text += "@" + User(rng);
+    } else if (r < 7) {
+      text += "#" + std::string(kWords[rng() % n]);
+    } else if (r < 8) {
+      text += "https://example.com/p/" + std::to_string(rng());
+    } else {
+      // Skewed towards the common words at the front
+      double u = std::uniform_real_distribution<double>(0, 1)(rng);
+      text += kWords[static_cast<size_t>(u * u * u * n)];
+    }
+  }
+  return text + "\n";
+}
+
+// gzip of one buffer, as gRPC's message compression does it
+size_t Gzip(const std::string& in, std::string* out) {
+  z_stream z = {};
+  deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+  out->resize(deflateBound(&z, in.size()));
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  z.avail_in = static_cast<uInt>(in.size());
+  z.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  z.avail_out = static_cast<uInt>(out->size());
+  deflate(&z, Z_FINISH);
+  out->resize(z.total_out);
+  deflateEnd(&z);
+  return out->size();
+}
+
+void Row(const char* name, double bytes, double plain, double cpu_us, double read_us) {
+  printf("  %-34s %8.1f %7.0f%%", name, bytes, 100 * bytes / plain);
+  if (cpu_us >= 0) printf(" %10.2f", cpu_us);
+  if (read_us >= 0) printf(" %10.2f", read_us);
+  printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+  std::mt19937 rng(42);
+  std::vector<Message> posts(count);
+  std::vector<std::string> wires(count);
+  size_t plain = 0;
+  for (size_t i = 0; i < count; i++) {
+    posts[i].set_username(User(rng));
+    posts[i].set_msg(PostText(rng));
+    posts[i].mutable_timestamp()->set_seconds(1700000000 + i * 7);
+    posts[i].set_seq(1700000000000000ull + i);
+    wires[i] = posts[i].SerializeAsString();
+    plain += wires[i].size();
+  }
+  double per_post = static_cast<double>(plain) / count;
+  printf("%zu posts, %.1f bytes each plain\n\n", count, per_post);
+  printf("  %-34s %8s %8s %10s %10s\n", "", "bytes", "of plain", "pack us", "unpack us");
+
+  printf("live, per post\n");
+  Row("plain", per_post, per_post, 0, -1);
+
+  std::string out, raw;
+  size_t bytes = 0;
+  double start = CpuSeconds();
+  for (const auto& w : wires) bytes += Gzip(w, &out);
+  Row("gzip per message (per follower)", static_cast<double>(bytes) / count, per_post,
+      (CpuSeconds() - start) / count * 1e6, -1);
+
+  // Each half of the encoding on its own
+  size_t interned = 0, kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    Message m = posts[i];
+    m.clear_username();
+    m.set_author(static_cast<uint32_t>(i % 10000) + 1);
+    interned += m.ByteSizeLong();
+    raw.clear();
+    AppendToFrame(&raw, wires[i].data(), wires[i].size());
+    PackFrame(raw, &out);
+    Message packed;
+    packed.set_packed(out);
+    kept += packed.ByteSizeLong();
+  }
+  Row("username interned, uncompressed", static_cast<double>(interned) / count, per_post, 0, -1);
+  Row("deflate-d1, username kept", static_cast<double>(kept) / count, per_post, -1, -1);
+
+  // What OutgoingPost::packed() does
+  std::vector<std::string> frames(count);
+  bytes = 0;
+  start = CpuSeconds();
+  for (size_t i = 0; i < count; i++) {
+    Message m;
+    m.ParseFromString(wires[i]);
+    m.clear_username();
+    m.set_author(static_cast<uint32_t>(i % 10000) + 1);
+    std::string inner = m.SerializeAsString();
+    raw.clear();
+    AppendToFrame(&raw, inner.data(), inner.size());
+    std::string frame;
+    PackFrame(raw, &frame);
+    Message packed;
+    packed.set_packed(frame);
+    frames[i] = packed.SerializeAsString();
+    bytes += frames[i].size();
+  }
+  double pack = (CpuSeconds() - start) / count;
+  start = CpuSeconds();
+  for (const auto& f : frames) {
+    Message packed;
+    packed.ParseFromString(f);
+    UnpackFrame(packed.packed(), &raw);
+    const char* data;
+    size_t size;
+    for (size_t pos = 0; NextInFrame(raw, &pos, &data, &size);) {
+      Message m;
+      m.ParseFromArray(data, static_cast<int>(size));
+    }
+  }
+  double unpack = (CpuSeconds() - start) / count;
+  Row("deflate-d1, username interned", static_cast<double>(bytes) / count, per_post, pack * 1e6, unpack * 1e6);
+  Message name;
+  name.set_author(10000);
+  name.set_username(posts[0].username());
+  printf("  (plus a %zu-byte frame naming each author, once per stream)\n", name.ByteSizeLong());
+
+  printf("replay, per post\n");
+  bytes = 0;
+  size_t packed_frames = 0;
+  start = CpuSeconds();
+  raw.clear();
+  for (size_t i = 0; i < count; i++) {
+    AppendToFrame(&raw, wires[i].data(), wires[i].size());
+    if (raw.size() < kFrameBytes && i + 1 < count) continue;
+    PackFrame(raw, &out);
+    Message packed;
+    packed.set_packed(out);
+    bytes += packed.ByteSizeLong();
+    packed_frames++;
+    raw.clear();
+  }
+  Row("deflate-d1 frames", static_cast<double>(bytes) / count, per_post, (CpuSeconds() - start) / count * 1e6, -1);
+
+  printf("GetTimeline pages of 512, per post\n");
+  size_t page_plain = 0;
+  bytes = 0;
+  std::vector<std::string> pages;
+  for (size_t i = 0; i < count; i += 512) {
+    TimelinePage page;
+    for (size_t j = i; j < std::min(count, i + 512); j++) *page.add_posts() = posts[j];
+    pages.push_back(page.SerializeAsString());
+    page_plain += pages.back().size();
+  }
+  Row("plain", static_cast<double>(page_plain) / count, per_post, 0, -1);
+  start = CpuSeconds();
+  for (const auto& p : pages) bytes += Gzip(p, &out);
+  Row("gzip", static_cast<double>(bytes) / count, per_post, (CpuSeconds() - start) / count * 1e6, -1);
+  return 0;
+}
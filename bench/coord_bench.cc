@@ -0,0 +1,145 @@
+// Benchmarks coordinator read replicas: one leader plus R-1 replicas that
+// follow it over Watch streams, each behind its own in-process gRPC server.
+// Client threads spread over all R and call GetServer as fast as they can;
+// the aggregate rate is reported for each R. Also reports how long a change
+// made on the leader (a create) takes to be visible through exists on every
+// replica.
+//
+// Every coordinator runs in this one process and shares its cores, so the
+// aggregate rate only grows with R where there are cores to spare.
+//
+//   ./bench/coord_bench [seconds [threads]]      (default: 2 8)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "coord_service.h"
+#include "coordinator.grpc.pb.h"
+
+using csce438::CoordService;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Discards everything, from any number of threads
+struct NullBuf : std::streambuf {
+    int overflow(int c) override { return c; }
+};
+
+struct Coordinator {
+    std::unique_ptr<CoordServiceImpl> service;
+    std::unique_ptr<grpc::Server> server;
+    std::unique_ptr<CoordService::Stub> stub;
+};
+
+std::unique_ptr<Coordinator> StartCoordinator(Coordinator* leader) {
+    auto c = std::make_unique<Coordinator>();
+    c->service = std::make_unique<CoordServiceImpl>();
+    if (leader) c->service->followLeader(leader->server->InProcessChannel(grpc::ChannelArguments()));
+    grpc::ServerBuilder builder;
+    builder.RegisterService(c->service.get());
+    c->server = builder.BuildAndStart();
+    c->stub = CoordService::NewStub(c->server->InProcessChannel(grpc::ChannelArguments()));
+    return c;
+}
+
+bool Exists(Coordinator* c, const std::string& path) {
+    grpc::ClientContext ctx;
+    csce438::Path p;
+    csce438::Status st;
+    p.set_path(path);
+    return c->stub->exists(&ctx, p, &st).ok() && st.status();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    // The coordinator reports every request on stdout and stderr
+    NullBuf sink;
+    std::streambuf* out = std::cout.rdbuf(&sink);
+    std::streambuf* err = std::cerr.rdbuf(&sink);
+
+    printf("%9s %8s %14s %18s %18s\n", "replicas", "threads", "GetServer/s", "per coordinator/s",
+           "create->exists ms");
+    for (int replicas : {1, 3, 5}) {
+        std::vector<std::unique_ptr<Coordinator>> coords;
+        coords.push_back(StartCoordinator(nullptr));
+        for (int i = 1; i < replicas; i++) coords.push_back(StartCoordinator(coords[0].get()));
+
+        // Two servers per cluster, registered with the leader
+        for (int cluster = 1; cluster <= 3; cluster++) {
+            for (int s = 0; s < 2; s++) {
+                grpc::ClientContext ctx;
+                csce438::ServerInfo info;
+                csce438::Confirmation conf;
+                info.set_serverid(cluster);
+                info.set_hostname("127.0.0.1");
+                info.set_port(std::to_string(5000 + cluster * 10 + s));
+                info.set_type("SERVER");
+                coords[0]->stub->Heartbeat(&ctx, info, &conf);
+            }
+        }
+
+        // Replication lag: create on the leader, poll exists on every replica
+        auto start = Clock::now();
+        {
+            grpc::ClientContext ctx;
+            csce438::PathAndData pd;
+            csce438::Status st;
+            pd.set_path("/bench/ready");
+            pd.set_data("1");
+            coords[0]->stub->create(&ctx, pd, &st);
+        }
+        for (auto& c : coords) {
+            while (!Exists(c.get(), "/bench/ready")) std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        double lag_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        std::atomic<bool> stop{false};
+        std::atomic<uint64_t> total{0};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                Coordinator* c = coords[t % coords.size()].get();
+                csce438::ID id;
+                uint64_t n = 0;
+                for (int i = 0; !stop; i++) {
+                    grpc::ClientContext ctx;
+                    csce438::ServerInfo info;
+                    id.set_id(i % 300 + 1);
+                    if (c->stub->GetServer(&ctx, id, &info).ok()) n++;
+                }
+                total += n;
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (auto& w : workers) w.join();
+
+        double rate = total / seconds;
+        printf("%9d %8d %14.0f %18.0f %18.3f\n", replicas, threads, rate, rate / replicas, lag_ms);
+
+        // Replicas first, so none is left watching a stopped leader
+        while (!coords.empty()) {
+            coords.back()->server->Shutdown(std::chrono::system_clock::now());
+            coords.pop_back();
+        }
+    }
+    std::cout.rdbuf(out);
+    std::cerr.rdbuf(err);
+    return 0;
+}
@@ -0,0 +1,90 @@
+// CPU cost of fanning one post out to N follower streams, comparing a
+// serialization per follower (what ServerReaderWriter::Write did) with one
+// shared serialized buffer queued on every PostStream. Also reports the cost
+// of parsing the incoming post, which is paid once whatever the fan-out.
+//
+//   ./bench/fanout_bench [followers ...]    (default: 1 10 100 1000 10000 100000)
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "bench/bench_util.h"
+#include "post_stream.h"
+#include "sns.pb.h"
+
+using csce438::Message;
+
+namespace {
+
+// Stands in for a follower's Timeline stream; every write completes at once.
+class MockStream : public PostStream {
+public:
+  size_t bytes = 0;
+
+protected:
+  void StartSend(const grpc::ByteBuffer* buf) override {
+    bytes += buf->Length();
+    SendDone(true);
+  }
+  void EndStream(grpc::Status) override {}
+};
+
+Message SamplePost() {
+  Message m;
+  m.set_username("1042");
+  m.set_msg("just shipped the new timeline page builder, numbers look good\n");
+  m.mutable_timestamp()->set_seconds(1700000000);
+  m.set_seq(1700000000000000ull);
+  return m;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<size_t> counts;
+  for (int i = 1; i < argc; i++) counts.push_back(strtoull(argv[i], nullptr, 10));
+  if (counts.empty()) counts = {1, 10, 100, 1000, 10000, 100000};
+
+  Message post = SamplePost();
+  const std::string wire = post.SerializeAsString();
+
+  // Parsing the incoming post happens once per post regardless of fan-out.
+  const int kParses = 200000;
+  double start = CpuSeconds();
+  for (int i = 0; i < kParses; i++) {
+    Message m;
+    m.ParseFromString(wire);
+  }
+  double parse = (CpuSeconds() - start) / kParses;
+  printf("parse per post: %.0f ns\n\n", parse * 1e9);
+
+  printf("%10s %20s %20s %10s\n", "followers", "per-follower us/post", "serialize-once us/post", "speedup");
+  for (size_t n : counts) {
+    std::vector<MockStream> streams(n);
+    // Keep the total number of deliveries per measurement roughly constant.
+    size_t posts = std::max<size_t>(10, 2000000 / n);
+
+    start = CpuSeconds();
+    for (size_t p = 0; p < posts; p++) {
+      for (auto& s : streams) s.Send(SerializeShared(post));
+    }
+    double per_follower = (CpuSeconds() - start) / posts;
+
+    start = CpuSeconds();
+    for (size_t p = 0; p < posts; p++) {
+      auto shared = SharedBuffer(wire);
+      for (auto& s : streams) s.Send(shared);
+    }
+    double once = (CpuSeconds() - start) / posts;
+
+    printf("%10zu %20.2f %22.2f %9.1fx\n", n, per_follower * 1e6, once * 1e6, per_follower / once);
+  }
+  return 0;
+}
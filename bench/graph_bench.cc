@@ -0,0 +1,120 @@
+// Benchmarks the follow graph: builds a graph of E edges over U users with a
+// skewed followee distribution (a few users collect most followers), then
+// reports build rate, bytes per edge, membership test and UnFollow cost, and
+// fan-out iteration speed. A final table compares the "already following?"
+// check against the linear username scan over vector<Client*> it replaced.
+//
+//   ./bench/graph_bench [edges [users]]      (default: 10000000 1000000)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench/bench_util.h"
+#include "social_graph.h"
+
+namespace {
+
+// Stand-in for tsd's old Client with its pointer follow lists.
+struct OldClient {
+  std::string username;
+  std::vector<OldClient*> client_following;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t edges = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+  size_t users = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<uint32_t> any(0, users - 1);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  // Followee ids follow a power law: id ~ users^u, so low ids are celebrities.
+  auto popular = [&]() {
+    return static_cast<uint32_t>(std::pow(static_cast<double>(users), unit(rng))) - 1;
+  };
+
+  SocialGraph graph;
+  graph.Resize(users);
+  auto start = std::chrono::steady_clock::now();
+  size_t attempts = 0;
+  while (graph.edges() < edges) {
+    uint32_t a = any(rng), b = popular();
+    if (a != b) graph.Follow(a, b);
+    attempts++;
+  }
+  double build = Seconds(start);
+  size_t bytes = graph.MemoryBytes();
+  graph.Compact();
+  size_t compact_bytes = graph.MemoryBytes();
+
+  size_t max_followers = 0;
+  for (uint32_t u = 0; u < users; u++) max_followers = std::max(max_followers, graph.Followers(u).size());
+
+  printf("graph: %zu users, %zu edges, largest follower list %zu\n", users, graph.edges(), max_followers);
+  printf("build:       %.2f M follows/s (%zu attempts)\n", attempts / build / 1e6, attempts);
+  printf("memory:      %.2f bytes/edge as built, %.2f bytes/edge compacted (%.1f MB)\n",
+         static_cast<double>(bytes) / graph.edges(), static_cast<double>(compact_bytes) / graph.edges(),
+         compact_bytes / 1e6);
+
+  const size_t kProbes = 2000000;
+  std::vector<std::pair<uint32_t, uint32_t>> probes(kProbes);
+  for (auto& p : probes) p = {any(rng), popular()};
+  start = std::chrono::steady_clock::now();
+  size_t hits = 0;
+  for (const auto& p : probes) hits += graph.Follows(p.first, p.second);
+  printf("Follows():   %.0f ns/test (%zu hits)\n", Seconds(start) / kProbes * 1e9, hits);
+
+  start = std::chrono::steady_clock::now();
+  uint64_t sum = 0;
+  for (uint32_t u = 0; u < users; u++) {
+    for (auto f : graph.Followers(u)) sum += f;
+  }
+  printf("fan-out:     %.2f ns/edge walking every follower list (checksum %llu)\n",
+         Seconds(start) / graph.edges() * 1e9, static_cast<unsigned long long>(sum));
+
+  // Unfollow a sample of existing edges, the most popular followee included.
+  std::vector<std::pair<uint32_t, uint32_t>> victims;
+  for (uint32_t u = 0; victims.size() < 100000 && u < users; u++) {
+    for (auto f : graph.Following(u)) victims.push_back({u, f});
+  }
+  start = std::chrono::steady_clock::now();
+  for (const auto& v : victims) graph.UnFollow(v.first, v.second);
+  printf("UnFollow():  %.0f ns/edge over %zu edges\n\n", Seconds(start) / victims.size() * 1e9, victims.size());
+
+  printf("%10s %18s %18s\n", "following", "old scan ns/check", "Follows() ns/check");
+  for (size_t degree : {10, 1000, 100000}) {
+    std::vector<OldClient> old(degree + 1);
+    SocialGraph g;
+    for (size_t i = 0; i <= degree; i++) old[i].username = std::to_string(1000000 + i);
+    for (size_t i = 1; i <= degree; i++) {
+      old[0].client_following.push_back(&old[i]);
+      g.Follow(0, i);
+    }
+    size_t checks = std::max<size_t>(1000, 20000000 / degree);
+    std::vector<size_t> targets(checks);
+    for (auto& t : targets) t = 1 + rng() % degree;
+
+    start = std::chrono::steady_clock::now();
+    size_t found = 0;
+    for (size_t t : targets) {
+      const std::string& name = old[t].username;
+      for (auto c : old[0].client_following) {
+        if (c->username == name) { found++; break; }
+      }
+    }
+    double old_ns = Seconds(start) / checks * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t t : targets) found += g.Follows(0, t);
+    double new_ns = Seconds(start) / checks * 1e9;
+    printf("%10zu %18.0f %18.0f   (%zu)\n", degree, old_ns, new_ns, found);
+  }
+  return 0;
+}
@@ -0,0 +1,351 @@
+// Measures replacing a running tsd, as for an upgrade, two ways: a cold
+// restart (stop, recover from the checkpoint on disk, listen again) and a
+// handover to a successor (handover.h). Both sides run in this process on one
+// port, over a checkpoint of U users and E follows.
+//
+// Throughout, a prober keeps calling KeepAlive with a session and S users keep
+// a Timeline stream open, reconnecting the way tsc does. Reported per switch:
+//
+//   prep     what the successor did before the old tsd stopped accepting
+//   gap      from the last accept of the old tsd to the first of the new one
+//   stall    the longest the prober went without an answer, while the
+//            successor prepared (a handover only) and around the cutover
+//   stream   the longest a Timeline stream was down
+//   sessions lost   times the prober had to log in again
+//
+//   ./bench/handover_bench [users [edges [streams]]]   (default: 1000000 3000000 50)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "handover.h"
+#include "snapshot.h"
+#include "sns.grpc.pb.h"
+#include "sns_service.h"
+#include "social_graph.h"
+
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double Ms(Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+
+// Discards tsd's log lines
+struct NullBuf : std::streambuf {
+  int overflow(int c) override { return c; }
+};
+
+// Writes the checkpoint in a child process, so building the graph leaves no
+// memory behind in this one
+bool WriteSnapshot(const std::string& path, size_t users, size_t edges) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<uint32_t> any(0, users - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    Snapshot snap;
+    SocialGraph graph;
+    graph.Resize(users);
+    for (size_t i = 0; i < users; i++) snap.names.push_back(std::to_string(i + 1));
+    snap.sessions.assign(users, 0);
+    while (graph.edges() < edges) {
+      uint32_t a = any(rng), b = static_cast<uint32_t>(std::pow(static_cast<double>(users), unit(rng))) - 1;
+      if (a != b) graph.Follow(a, b);
+    }
+    graph.Serialize(&snap.graph);
+    _exit(SaveSnapshot(path, snap) ? 0 : 1);
+  }
+  int status = 0;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// One tsd: a service, and a gRPC server fed by an Acceptor
+struct Tsd {
+  std::unique_ptr<SNSServiceImpl> service;
+  std::unique_ptr<grpc::Server> server;
+  std::unique_ptr<Acceptor> acceptor;
+  CallCounter calls;
+  int fd = -1;
+
+  void Build() {
+    grpc::ServerBuilder builder;
+    builder.RegisterService(service.get());
+    std::vector<std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>> interceptors;
+    interceptors.push_back(calls.Factory());
+    builder.experimental().SetInterceptorCreators(std::move(interceptors));
+    server = builder.BuildAndStart();
+  }
+
+  void Accept(int listen_fd) {
+    fd = listen_fd;
+    acceptor.reset(new Acceptor(fd, server.get()));
+    acceptor->Start();
+  }
+
+  // What is left once the server is shut down
+  void Release() {
+    acceptor.reset();
+    server.reset();
+    service.reset();
+    if (fd >= 0) close(fd);
+    fd = -1;
+  }
+};
+
+std::unique_ptr<SNSServiceImpl> NewService(const std::string& root, const std::string& address) {
+  AdmissionLimits unlimited;
+  unlimited.user_rpcs = unlimited.server_rpcs = 0;
+  std::unique_ptr<SNSServiceImpl> service(new SNSServiceImpl(root, unlimited));
+  service->set_address(address);
+  return service;
+}
+
+// What the clients saw since the last Reset()
+struct Observed {
+  std::atomic<int64_t> stall_ns{0};
+  std::atomic<int64_t> stream_down_ns{0};
+  std::atomic<uint64_t> failed{0};
+  std::atomic<uint64_t> no_session{0};
+  std::atomic<uint64_t> reconnects{0};
+
+  void Reset() {
+    stall_ns = stream_down_ns = 0;
+    failed = no_session = reconnects = 0;
+  }
+  static void Max(std::atomic<int64_t>* v, int64_t x) {
+    int64_t cur = *v;
+    while (x > cur && !v->compare_exchange_weak(cur, x)) {}
+  }
+};
+
+// Short reconnect backoff, so the stall is the server's rather than gRPC's
+// default backoff of a second or more; and a connection of its own, as tsc
+// uses for its stream
+std::shared_ptr<grpc::Channel> Channel(const std::string& address) {
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, 20);
+  args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, 20);
+  args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, 100);
+  return grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+}
+
+uint64_t Login(SNSService::Stub* stub, const std::string& user) {
+  grpc::ClientContext ctx;
+  ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+  Request req;
+  Reply rep;
+  req.set_username(user);
+  return stub->Login(&ctx, req, &rep).ok() ? rep.session() : 0;
+}
+
+void Probe(const std::string& address, const std::atomic<bool>* stop, Observed* seen) {
+  auto stub = SNSService::NewStub(Channel(address));
+  Request req;
+  req.set_username("prober");
+  req.set_session(Login(stub.get(), "prober"));
+  auto last = Clock::now();
+  while (!*stop) {
+    grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+    ctx.set_wait_for_ready(true);
+    Reply rep;
+    if (!stub->KeepAlive(&ctx, req, &rep).ok()) {
+      seen->failed++;
+      continue;
+    }
+    // A session the new tsd does not know: log in again, as tsc would
+    if (rep.msg() != "OK") {
+      seen->no_session++;
+      req.set_session(Login(stub.get(), "prober"));
+    }
+    auto now = Clock::now();
+    Observed::Max(&seen->stall_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+    last = now;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// A Timeline stream, reopened as tsc does: on the same server after the
+// reconnect hint, otherwise after a pause standing in for asking the
+// coordinator
+void Watch(const std::string& address, const std::string& user, const std::atomic<bool>* stop, Observed* seen) {
+  uint64_t session;
+  {
+    auto stub = SNSService::NewStub(Channel(address));
+    session = Login(stub.get(), user);
+  }
+  Clock::time_point down;
+  bool was_down = false;
+  while (!*stop) {
+    long wait_ms = 100;
+    {
+      grpc::ClientContext ctx;
+      ctx.AddMetadata("username", user);
+      ctx.AddMetadata("session", std::to_string(session));
+      ctx.set_wait_for_ready(true);
+      auto stub = SNSService::NewStub(Channel(address));
+      auto stream = stub->Timeline(&ctx);
+      Message hello;
+      hello.set_username(user);
+      hello.set_msg("[handshake]");
+      stream->Write(hello);
+      Message msg;
+      while (stream->Read(&msg)) {
+        if (!was_down) continue;
+        Observed::Max(&seen->stream_down_ns,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - down).count());
+        was_down = false;
+      }
+      grpc::Status st = stream->Finish();
+      if (!was_down) down = Clock::now();
+      was_down = true;
+      seen->reconnects++;
+      const auto& trailers = ctx.GetServerTrailingMetadata();
+      auto it = trailers.find("reconnect-after-ms");
+      if (st.error_code() == grpc::StatusCode::UNAVAILABLE && it != trailers.end()) {
+        wait_ms = atol(std::string(it->second.data(), it->second.length()).c_str());
+      }
+      // A session the tsd does not know: log in again, as tsc would
+      if (st.error_code() == grpc::StatusCode::UNAUTHENTICATED) session = Login(stub.get(), user);
+    }
+    // Once the call is released, as tsc does: the old tsd waits for that
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+  }
+}
+
+int BoundPort(int fd) {
+  sockaddr_in addr = {};
+  socklen_t len = sizeof(addr);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+  return ntohs(addr.sin_port);
+}
+
+// A prep_stall_ms below 0 is not reported
+void Print(const char* label, double prep_ms, double prep_stall_ms, double gap_ms, Observed* seen) {
+  std::string prep_stall = prep_stall_ms < 0 ? "-" : std::to_string(static_cast<int>(prep_stall_ms));
+  printf("%-13s %9.0f %12s %9.1f %9.1f %11.1f %7lu %13lu %11lu\n", label, prep_ms, prep_stall.c_str(), gap_ms,
+         seen->stall_ns / 1e6, seen->stream_down_ns / 1e6, static_cast<unsigned long>(seen->failed.load()),
+         static_cast<unsigned long>(seen->no_session.load()), static_cast<unsigned long>(seen->reconnects.load()));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t users = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+  size_t edges = argc > 2 ? strtoull(argv[2], nullptr, 10) : 3000000;
+  size_t streams = argc > 3 ? strtoull(argv[3], nullptr, 10) : 50;
+
+  std::string root = std::filesystem::temp_directory_path() / ("handover_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(root);
+  if (!WriteSnapshot(root + "/tsd.snapshot", users, edges)) {
+    fprintf(stderr, "writing the snapshot failed\n");
+    return 1;
+  }
+  NullBuf null_buf;
+  std::cerr.rdbuf(&null_buf);
+
+  int fd = ListenTcp("127.0.0.1", "0");
+  if (fd < 0) {
+    fprintf(stderr, "cannot listen\n");
+    return 1;
+  }
+  std::string address = "127.0.0.1:" + std::to_string(BoundPort(fd));
+  Tsd tsd;
+  tsd.service = NewService(root, address);
+  tsd.service->Recover();
+  tsd.Build();
+  tsd.Accept(fd);
+  tsd.service->Start();
+
+  std::atomic<bool> stop(false);
+  Observed seen;
+  std::vector<std::thread> clients;
+  clients.emplace_back(Probe, address, &stop, &seen);
+  for (size_t i = 0; i < streams; i++) clients.emplace_back(Watch, address, std::to_string(i + 1), &stop, &seen);
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+
+  printf("%zu users, %zu follows, %zu streams\n\n", users, edges, streams);
+  printf("%-13s %9s %12s %9s %9s %11s %7s %13s %11s\n", "", "prep ms", "prep stall", "gap ms", "stall ms",
+         "stream ms", "failed", "sessions lost", "reconnects");
+
+  // Cold: the port closes until the new tsd has recovered
+  seen.Reset();
+  auto start = Clock::now();
+  tsd.acceptor->Stop();
+  tsd.server->Shutdown(std::chrono::system_clock::now());
+  tsd.Release();
+  tsd.service = NewService(root, address);
+  tsd.service->Recover();
+  double prep_ms = Ms(Clock::now() - start);
+  tsd.Build();
+  fd = ListenTcp("127.0.0.1", address.substr(address.rfind(':') + 1));
+  tsd.Accept(fd);
+  tsd.service->Start();
+  double gap_ms = Ms(Clock::now() - start);
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  Print("cold restart", prep_ms, -1, gap_ms, &seen);
+
+  // Handover: the successor recovers while the old tsd serves
+  HandoverServer old_side(HandoverPath(root));
+  if (!old_side.Open()) {
+    fprintf(stderr, "cannot listen on %s\n", HandoverPath(root).c_str());
+    return 1;
+  }
+  std::thread serving([&]() { old_side.Serve(tsd.service.get(), tsd.server.get(), tsd.acceptor.get(), &tsd.calls); });
+  seen.Reset();
+  start = Clock::now();
+  Tsd next;
+  next.service = NewService(root, address);
+  HandoverClient new_side(HandoverPath(root));
+  if (!new_side.Prepare(next.service.get())) {
+    fprintf(stderr, "handover failed\n");
+    return 1;
+  }
+  next.Build();
+  prep_ms = Ms(Clock::now() - start);
+  double prep_stall_ms = seen.stall_ns.exchange(0) / 1e6;
+  fd = new_side.Cutover(next.service.get());
+  next.Accept(fd);
+  next.service->Start();
+  gap_ms = (std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count() -
+            new_side.stopped_ns()) / 1e6;
+  serving.join();
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  Print("handover", prep_ms, prep_stall_ms, gap_ms, &seen);
+  // Only now: the old tsd would exit, rather than take CPU from the new one
+  // freeing its users
+  tsd.server->Wait();
+  tsd.Release();
+
+  stop = true;
+  next.acceptor->Stop();
+  next.server->Shutdown(std::chrono::system_clock::now());
+  for (auto& t : clients) t.join();
+  next.Release();
+  std::filesystem::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Benchmarks the fan-out-on-read home timeline: gives each of F followees a
+// log of posts spread over the same stretch of time, then times pages of 20
+// built by BuildHomePage -- the first page alone, and the first 10 pages in a
+// row through cursors. Half the followees were followed midway, so their older posts are
+// cut off by the follow time. For comparison, "read all" reads every
+// followee's posts in range and sorts them, which is what a merge without
+// early termination costs.
+//
+//   ./bench/home_bench [followees ...]      (default: 10 100 1000 10000)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "home_timeline.h"
+#include "sns.pb.h"
+#include "timeline_store.h"
+
+using csce438::Message;
+
+namespace {
+
+const size_t kPostsPerFollowee = 200;
+const size_t kPage = 20;
+const int64_t kStart = 1700000000;
+const int64_t kSpan = 30 * 24 * 3600;   // posts fall within 30 days
+
+struct Latency {
+  double p50_ms, p99_ms;
+};
+
+template <class Fn>
+Latency Time(int runs, Fn fn) {
+  std::vector<double> ms;
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    ms.push_back(Seconds(start) * 1e3);
+  }
+  std::sort(ms.begin(), ms.end());
+  return {ms[ms.size() / 2], ms[ms.size() * 99 / 100]};
+}
+
+// Newest page of kPage posts by reading every followee's posts in range
+void ReadAll(TimelineStore& store, const std::vector<HomeSource>& sources) {
+  std::vector<TimelineRecord> all;
+  for (const auto& s : sources) {
+    TimelineRange range;
+    range.since = s.since;
+    store.Scan(s.username, range, &all);
+  }
+  size_t n = std::min(kPage, all.size());
+  std::partial_sort(all.begin(), all.begin() + n, all.end(),
+                    [](const TimelineRecord& a, const TimelineRecord& b) { return a.time > b.time; });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) sizes.push_back(strtoull(argv[i], nullptr, 10));
+  if (sizes.empty()) sizes = {10, 100, 1000, 10000};
+
+  printf("%10s %12s %12s %14s %14s %14s %14s\n", "followees", "page1 p50", "page1 p99",
+         "10 pages p50", "10 pages p99", "read-all p50", "read-all p99");
+  for (size_t f : sizes) {
+    std::string root = std::filesystem::temp_directory_path() / ("home_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    {
+      TimelineStore store(root);
+      std::mt19937_64 rng(7);
+      std::vector<HomeSource> sources(f);
+      Message m;
+      m.set_msg("what everyone I follow has been up to lately, merged at read time\n");
+      for (size_t i = 0; i < f; i++) {
+        sources[i].username = "u" + std::to_string(i);
+        if (i % 2) sources[i].since = kStart + kSpan / 2;
+        std::vector<int64_t> times(kPostsPerFollowee);
+        for (auto& t : times) t = kStart + rng() % kSpan;
+        std::sort(times.begin(), times.end());
+        m.set_username(sources[i].username);
+        for (int64_t t : times) {
+          m.mutable_timestamp()->set_seconds(t);
+          store.Append(sources[i].username, m);
+        }
+      }
+
+      std::vector<HomeEntry> page;
+      HomePosition next;
+      auto first_page = [&] {
+        page.clear();
+        BuildHomePage(store, sources, nullptr, kPage, &page, &next);
+      };
+      auto ten_pages = [&] {
+        HomePosition at;
+        bool more = true;
+        for (int p = 0; p < 10 && more; p++) {
+          page.clear();
+          more = BuildHomePage(store, sources, p ? &at : nullptr, kPage, &page, &next);
+          at = next;
+        }
+      };
+      first_page();   // opens every log once
+      int runs = f >= 10000 ? 50 : 200;
+      Latency p1 = Time(runs, first_page);
+      Latency p10 = Time(runs, ten_pages);
+      Latency all = Time(f >= 10000 ? 5 : 50, [&] { ReadAll(store, sources); });
+      printf("%10zu %9.3f ms %9.3f ms %11.3f ms %11.3f ms %11.3f ms %11.3f ms\n", f, p1.p50_ms, p1.p99_ms,
+             p10.p50_ms, p10.p99_ms, all.p50_ms, all.p99_ms);
+    }
+    std::filesystem::remove_all(root);
+  }
+  return 0;
+}
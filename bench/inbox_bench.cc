@@ -0,0 +1,118 @@
+// Benchmarks offline catch-up: fills one follower's inbox with references to
+// posts of several authors, then replays it the way tsd does on reconnect --
+// reading references in batches and fetching each run of consecutive posts of
+// one author with a single Scan. Reports append cost, inbox bytes per pending
+// post, and replay throughput for interleaved and per-author reference order.
+//
+//   ./bench/inbox_bench [refs ...]      (default: 10000 1000000)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+
+#include "bench/bench_util.h"
+#include "inbox_store.h"
+#include "sns.pb.h"
+#include "timeline_store.h"
+
+using csce438::Message;
+
+namespace {
+
+const uint32_t kAuthors = 16;
+const size_t kBatch = 4096;   // tsd's kReplayBatch
+
+// Replays the whole inbox; returns the number of posts and bytes handed out.
+void Replay(InboxStore& inbox, TimelineStore& store, const std::vector<std::string>& names,
+            size_t* posts, size_t* bytes) {
+  std::vector<InboxRef> refs;
+  std::vector<TimelineRecord> records;
+  uint64_t pos = inbox.Cursor("follower");
+  while (true) {
+    refs.clear();
+    uint64_t next = inbox.Read("follower", pos, kBatch, &refs);
+    if (refs.empty()) break;
+    for (size_t i = 0, j; i < refs.size(); i = j) {
+      for (j = i + 1; j < refs.size() && refs[j].author == refs[i].author &&
+                      refs[j].ordinal == refs[j - 1].ordinal + 1; j++) {}
+      TimelineRange range;
+      range.cursor = refs[i].ordinal;
+      range.limit = j - i;
+      records.clear();
+      store.Scan(names[refs[i].author], range, &records);
+      for (auto& r : records) {
+        grpc::ByteBuffer buf(&r.payload, 1);
+        *bytes += buf.Length();
+        ++*posts;
+      }
+    }
+    pos = next;
+  }
+  inbox.Commit("follower", pos);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) sizes.push_back(strtoull(argv[i], nullptr, 10));
+  if (sizes.empty()) sizes = {10000, 1000000};
+
+  printf("%10s %12s %10s %12s %16s %16s\n", "refs", "append ns", "B/post",
+         "order", "replay posts/s", "replay MB/s");
+  for (size_t n : sizes) {
+    std::string root = std::filesystem::temp_directory_path() / ("inbox_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    {
+      TimelineStore store(root);
+      std::vector<std::string> names;
+      size_t per_author = (n + kAuthors - 1) / kAuthors;
+      Message m;
+      m.set_msg("catching up on what happened while I was away from the timeline\n");
+      for (uint32_t a = 0; a < kAuthors; a++) {
+        names.push_back(std::to_string(a + 1));
+        m.set_username(names.back());
+        for (size_t i = 0; i < per_author; i++) {
+          m.mutable_timestamp()->set_seconds(1700000000 + i);
+          store.Append(names.back(), m);
+        }
+      }
+
+      for (int interleaved = 1; interleaved >= 0; interleaved--) {
+        InboxStore inbox(root);
+        // Interleaved: authors take turns, so every run is one post long.
+        // Per-author: one author's posts are contiguous, the best case.
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n; i++) {
+          InboxRef ref;
+          ref.author = interleaved ? i % kAuthors : i / per_author;
+          ref.ordinal = interleaved ? i / kAuthors : i % per_author;
+          inbox.Append("follower", ref);
+          if (i % 1024 == 1023) inbox.Flush();
+        }
+        inbox.Flush();
+        double append = Seconds(start);
+        InboxStats stats = inbox.Stats();
+
+        size_t posts = 0, bytes = 0;
+        start = std::chrono::steady_clock::now();
+        Replay(inbox, store, names, &posts, &bytes);
+        double replay = Seconds(start);
+        inbox.Flush();
+
+        printf("%10zu %12.0f %10.1f %12s %16.0f %16.1f\n", n, append / n * 1e9,
+               static_cast<double>(stats.disk_bytes) / std::max<uint64_t>(stats.pending, 1),
+               interleaved ? "interleaved" : "per-author", posts / replay, bytes / replay / 1e6);
+      }
+    }
+    std::filesystem::remove_all(root);
+  }
+  return 0;
+}
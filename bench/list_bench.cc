@@ -0,0 +1,116 @@
+// Benchmarks versioned List: on a server with N users, one of whom has 1000
+// followers, compares the reply a client without versions gets (the whole
+// directory and follower list) with what a client holding the last versions
+// gets when nothing changed, and after 10 new users and 10 follow changes.
+// Calls the handlers directly, without a channel, so the times are the
+// handler's alone.
+//
+//   ./bench/list_bench [users ...]      (default: 10000 100000 1000000)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "sns_service.h"
+
+using csce438::ListReply;
+using csce438::Reply;
+using csce438::Request;
+using grpc::ServerContext;
+using grpc::Status;
+// The handlers are public on the generated base class
+using Service = csce438::SNSService::Service;
+
+namespace {
+
+const int kFollowers = 1000;
+const int kChanges = 10;
+
+std::string Name(int i) { return "user" + std::to_string(i); }
+
+void Call(Service* service, Status (Service::*rpc)(ServerContext*, const Request*, Reply*),
+          const std::string& user, const std::string& arg) {
+  ServerContext ctx;
+  Request req;
+  Reply rep;
+  req.set_username(user);
+  if (!arg.empty()) req.add_arguments(arg);
+  (service->*rpc)(&ctx, &req, &rep);
+}
+
+// List by Name(0), passing the versions in *last if given. Prints the reply
+// size and the handler's mean time, and leaves the reply in *last.
+void TimeList(Service* service, const char* what, bool versioned, ListReply* last) {
+  Request req;
+  req.set_username(Name(0));
+  if (versioned) {
+    req.set_list_epoch(last->list_epoch());
+    req.set_users_version(last->users_version());
+    req.set_followers_version(last->followers_version());
+  }
+  const int runs = 20;
+  ListReply reply;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    ServerContext ctx;
+    reply.Clear();
+    service->List(&ctx, &req, &reply);
+  }
+  double us = Seconds(start) * 1e6 / runs;
+  printf("  %-28s %12zu bytes %12.1f us\n", what, reply.ByteSizeLong(), us);
+  *last = reply;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<int> sizes;
+  for (int i = 1; i < argc; i++) sizes.push_back(atoi(argv[i]));
+  if (sizes.empty()) sizes = {10000, 100000, 1000000};
+
+  AdmissionLimits unlimited;
+  unlimited.user_rpcs = unlimited.server_rpcs = 0;
+  for (int n : sizes) {
+    std::string root = std::filesystem::temp_directory_path() / ("list_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    {
+      SNSServiceImpl service(root, unlimited);
+      service.Recover();
+      Service* rpcs = &service;
+      for (int i = 0; i < n; i++) Call(rpcs, &Service::Login, Name(i), "");
+      for (int i = 1; i <= std::min(kFollowers, n - 1); i++) Call(rpcs, &Service::Follow, Name(i), Name(0));
+
+      printf("%d users, %d followers\n", n, std::min(kFollowers, n - 1));
+      ListReply last;
+      TimeList(rpcs, "no versions (full)", false, &last);
+      TimeList(rpcs, "not modified", true, &last);
+      for (int i = 0; i < kChanges; i++) {
+        Call(rpcs, &Service::Login, Name(n + i), "");
+        if (i % 2) Call(rpcs, &Service::UnFollow, Name(i + 1), Name(0));
+        else Call(rpcs, &Service::Follow, Name(n + i), Name(0));
+      }
+      // Only the first call sees the changes; time it alone
+      ListReply delta;
+      Request req;
+      req.set_username(Name(0));
+      req.set_list_epoch(last.list_epoch());
+      req.set_users_version(last.users_version());
+      req.set_followers_version(last.followers_version());
+      ServerContext ctx;
+      auto start = std::chrono::steady_clock::now();
+      rpcs->List(&ctx, &req, &delta);
+      printf("  %-28s %12zu bytes %12.1f us\n", "after 10 users, 10 follows", delta.ByteSizeLong(),
+             Seconds(start) * 1e6);
+      service.Stop();
+    }
+    std::filesystem::remove_all(root);
+  }
+  return 0;
+}
@@ -0,0 +1,361 @@
+// Microbenchmark suite over the server hot paths, for catching performance
+// regressions. Each case is run in batches sized to take at least 50 ms;
+// the median of 5 batches is reported in ns per operation.
+//
+//   directory.keepalive      KeepAlive: user lookup in the directory and lease renewal, 100k users
+//   graph.follow_unfollow    a Follow and an UnFollow handler call over 64 users, with their log writes
+//   timeline.append          appending a 100-byte post to a user's TimelineStore log
+//   fanout.<N>               SNSServiceImpl::FanOut of a post to N followers, one in ten of them online
+//   coord.get_server         coordinator GetServer over 3 clusters of 2 servers
+//   coord.heartbeat          coordinator Heartbeat from one of those servers
+//
+// RPC handlers are called directly, each with a fresh ServerContext, so no
+// channel or serialization is involved. The server's data directory is put
+// on /dev/shm where there is one, so Follow's append to the follower's
+// _follow_time.txt does not time the disk.
+//
+//   ./bench/micro_bench [--filter substr] [--json out.json] [--baseline old.json] [--threshold pct]
+//
+// --json writes the results, one case per line; --baseline compares against
+// such a file and exits with 1 if any case got slower by more than
+// --threshold percent (default 10). `make bench` runs it; see the Makefile.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "coord_service.h"
+#include "post_stream.h"
+#include "sns_service.h"
+#include "timeline_store.h"
+
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using grpc::ServerContext;
+
+namespace {
+
+const double kMinBatchSeconds = 0.05;
+const int kBatches = 5;
+const int kUsers = 100000;
+const int kGraphUsers = 64;
+
+struct Result {
+  std::string name;
+  double ns_per_op = 0;      // median batch
+  double min_ns_per_op = 0;  // fastest batch
+  uint64_t ops = 0;          // per batch
+};
+
+// Discards everything, from any number of threads
+struct NullBuf : std::streambuf {
+  int overflow(int c) override { return c; }
+};
+
+// Stands in for a follower's Timeline stream; every write completes at once.
+class MockStream : public PostStream {
+protected:
+  void StartSend(const grpc::ByteBuffer*) override { SendDone(true); }
+  void EndStream(grpc::Status) override {}
+};
+
+std::string Name(int i) { return "user" + std::to_string(i); }
+
+Message SamplePost() {
+  Message m;
+  m.set_username("user1042");
+  m.set_msg("just shipped the new timeline page builder, numbers look good, more to come\n");
+  m.mutable_timestamp()->set_seconds(1700000000);
+  m.set_seq(1700000000000000ull);
+  return m;
+}
+
+// Runs op(i) with i counting up across batches, so cases that alternate
+// (follow, then unfollow) keep their state consistent between batches.
+class Suite {
+public:
+  explicit Suite(std::string filter) : filter_(std::move(filter)) {}
+
+  bool Wants(const std::string& name) const {
+    return filter_.empty() || name.find(filter_) != std::string::npos;
+  }
+
+  void Run(const std::string& name, const std::function<void(uint64_t)>& op) {
+    if (!Wants(name)) return;
+    uint64_t i = 0;
+    uint64_t n = 1;
+    while (true) {
+      auto start = std::chrono::steady_clock::now();
+      for (uint64_t end = i + n; i < end; i++) op(i);
+      if (Seconds(start) >= kMinBatchSeconds) break;
+      n *= 2;
+    }
+    std::vector<double> ns;
+    for (int b = 0; b < kBatches; b++) {
+      auto start = std::chrono::steady_clock::now();
+      for (uint64_t end = i + n; i < end; i++) op(i);
+      ns.push_back(Seconds(start) * 1e9 / n);
+    }
+    std::sort(ns.begin(), ns.end());
+    Result r;
+    r.name = name;
+    r.ns_per_op = ns[kBatches / 2];
+    r.min_ns_per_op = ns[0];
+    r.ops = n;
+    fprintf(stderr, "  %-24s %12.1f ns/op\n", name.c_str(), r.ns_per_op);
+    results_.push_back(r);
+  }
+
+  const std::vector<Result>& results() const { return results_; }
+
+private:
+  std::string filter_;
+  std::vector<Result> results_;
+};
+
+void DirectoryAndGraph(Suite* suite, const std::string& root) {
+  if (!suite->Wants("directory.") && !suite->Wants("graph.")) return;
+  AdmissionLimits unlimited;
+  unlimited.user_rpcs = unlimited.server_rpcs = 0;
+  SNSServiceImpl service(root, unlimited);
+  service.Recover();
+  // The handlers are public on the generated base class
+  csce438::SNSService::Service* rpcs = &service;
+
+  std::vector<uint64_t> sessions(kUsers);
+  for (int i = 0; i < kUsers; i++) {
+    ServerContext ctx;
+    Request req;
+    Reply rep;
+    req.set_username(Name(i));
+    rpcs->Login(&ctx, &req, &rep);
+    sessions[i] = rep.session();
+  }
+
+  Request req;
+  Reply rep;
+  suite->Run("directory.keepalive", [&](uint64_t i) {
+    // A stride through the ids, so lookups do not stay in one cache line
+    int u = static_cast<int>(i * 7919 % kUsers);
+    ServerContext ctx;
+    req.set_username(Name(u));
+    req.set_session(sessions[u]);
+    rpcs->KeepAlive(&ctx, &req, &rep);
+  });
+
+  // Few enough users that their follow-time files are all created in the
+  // warm-up batch and stay cached
+  req.Clear();
+  req.add_arguments("");
+  suite->Run("graph.follow_unfollow", [&](uint64_t i) {
+    int u = static_cast<int>(i % kGraphUsers);
+    req.set_username(Name(u));
+    *req.mutable_arguments(0) = Name((u + 1) % kGraphUsers);
+    ServerContext follow_ctx;
+    rpcs->Follow(&follow_ctx, &req, &rep);
+    ServerContext unfollow_ctx;
+    rpcs->UnFollow(&unfollow_ctx, &req, &rep);
+  });
+  service.Stop();
+}
+
+void TimelineAppend(Suite* suite, const std::string& root) {
+  if (!suite->Wants("timeline.")) return;
+  TimelineStore store(root);
+  const std::string wire = SamplePost().SerializeAsString();
+  suite->Run("timeline.append", [&](uint64_t i) { store.Append("user1042", wire, 1700000000 + i); });
+}
+
+// An author with followers on a real SNSServiceImpl, one in ten of them
+// online with a stand-in stream attached as a Timeline stream would be.
+// Post times FanOut: the walk over the online list, the post queued on each
+// stream and an inbox reference for everyone else, in ranges on the fan-out
+// pool sized as tsd sizes it.
+class FanoutCase {
+public:
+  FanoutCase(const std::string& root, size_t followers)
+      : service_(root, AdmissionLimits()), wire_(SamplePost().SerializeAsString()) {
+    unsigned hw = std::thread::hardware_concurrency();
+    service_.set_fanout_threads(hw > 1 ? hw - 1 : 0);
+    service_.Recover();
+    for (size_t i = 0; i < followers; i++) {
+      MockStream* stream = nullptr;
+      if (i % 10 == 0) {
+        streams_.emplace_back(new MockStream());
+        stream = streams_.back().get();
+      }
+      author_ = service_.AddFollowerForTest("author", Name(static_cast<int>(i)), stream);
+    }
+  }
+  ~FanoutCase() { service_.Stop(); }
+
+  void Post(uint64_t i) { service_.FanOutForTest(author_, i, wire_); }
+
+private:
+  // Declared first so the service, which points at them, goes first
+  std::vector<std::unique_ptr<MockStream>> streams_;
+  SNSServiceImpl service_;
+  std::string wire_;
+  Client* author_ = nullptr;
+};
+
+void Fanout(Suite* suite, const std::string& root, size_t followers) {
+  std::string name = "fanout." + std::to_string(followers);
+  if (!suite->Wants(name)) return;
+  FanoutCase fanout(root, followers);
+  suite->Run(name, [&](uint64_t i) { fanout.Post(i); });
+}
+
+void Coordinator(Suite* suite) {
+  if (!suite->Wants("coord.")) return;
+  // The coordinator reports every request on stdout and stderr
+  NullBuf sink;
+  std::streambuf* out = std::cout.rdbuf(&sink);
+  std::streambuf* err = std::cerr.rdbuf(&sink);
+  {
+    CoordServiceImpl coord;
+    std::vector<csce438::ServerInfo> servers;
+    for (int cluster = 1; cluster <= 3; cluster++) {
+      for (int s = 0; s < 2; s++) {
+        csce438::ServerInfo info;
+        info.set_serverid(cluster);
+        info.set_hostname("127.0.0.1");
+        info.set_port(std::to_string(5000 + cluster * 10 + s));
+        info.set_type("SERVER");
+        servers.push_back(info);
+        ServerContext ctx;
+        csce438::Confirmation conf;
+        coord.Heartbeat(&ctx, &info, &conf);
+      }
+    }
+
+    csce438::ID id;
+    csce438::ServerInfo info;
+    suite->Run("coord.get_server", [&](uint64_t i) {
+      ServerContext ctx;
+      id.set_id(static_cast<int>(i % 300) + 1);
+      coord.GetServer(&ctx, &id, &info);
+    });
+    csce438::Confirmation conf;
+    suite->Run("coord.heartbeat", [&](uint64_t i) {
+      ServerContext ctx;
+      coord.Heartbeat(&ctx, &servers[i % servers.size()], &conf);
+    });
+  }
+  std::cout.rdbuf(out);
+  std::cerr.rdbuf(err);
+}
+
+void WriteJson(const std::string& path, const std::vector<Result>& results) {
+  std::ofstream out(path);
+  out << "{\"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    char line[256];
+    snprintf(line, sizeof(line), "  {\"name\": \"%s\", \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"ops\": %llu}%s\n",
+             r.name.c_str(), r.ns_per_op, r.min_ns_per_op, static_cast<unsigned long long>(r.ops),
+             i + 1 < results.size() ? "," : "");
+    out << line;
+  }
+  out << "]}\n";
+}
+
+// Reads name -> ns_per_op back from a file written by WriteJson
+bool ReadJson(const std::string& path, std::map<std::string, double>* out) {
+  std::ifstream in(path);
+  if (!in) return false;
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t name = line.find("\"name\": \"");
+    size_t ns = line.find("\"ns_per_op\": ");
+    if (name == std::string::npos || ns == std::string::npos) continue;
+    name += 9;
+    size_t end = line.find('"', name);
+    if (end == std::string::npos) continue;
+    (*out)[line.substr(name, end - name)] = atof(line.c_str() + ns + 13);
+  }
+  return true;
+}
+
+// Prints each case against the baseline; returns the number of regressions
+int Compare(const std::vector<Result>& results, const std::map<std::string, double>& baseline, double threshold) {
+  int regressions = 0;
+  printf("%-24s %14s %14s %9s\n", "case", "baseline ns", "ns/op", "change");
+  for (const auto& r : results) {
+    auto it = baseline.find(r.name);
+    if (it == baseline.end() || it->second <= 0) {
+      printf("%-24s %14s %14.1f %9s\n", r.name.c_str(), "-", r.ns_per_op, "new");
+      continue;
+    }
+    double change = (r.ns_per_op - it->second) / it->second * 100;
+    bool regressed = change > threshold;
+    regressions += regressed;
+    printf("%-24s %14.1f %14.1f %+8.1f%%%s\n", r.name.c_str(), it->second, r.ns_per_op, change,
+           regressed ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string filter, json, baseline_path;
+  double threshold = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--filter")) filter = argv[i + 1];
+    else if (!strcmp(argv[i], "--json")) json = argv[i + 1];
+    else if (!strcmp(argv[i], "--baseline")) baseline_path = argv[i + 1];
+    else if (!strcmp(argv[i], "--threshold")) threshold = atof(argv[i + 1]);
+    else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  std::map<std::string, double> baseline;
+  if (!baseline_path.empty() && !ReadJson(baseline_path, &baseline)) {
+    fprintf(stderr, "cannot read baseline %s\n", baseline_path.c_str());
+    return 2;
+  }
+
+  std::filesystem::path tmp = std::filesystem::is_directory("/dev/shm") ? "/dev/shm" : std::filesystem::temp_directory_path();
+  std::string root = tmp / ("micro_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(root + "/sns");
+  std::filesystem::create_directories(root + "/timeline");
+
+  Suite suite(filter);
+  DirectoryAndGraph(&suite, root + "/sns");
+  TimelineAppend(&suite, root + "/timeline");
+  for (size_t n : {100, 10000}) {
+    std::string dir = root + "/fanout." + std::to_string(n);
+    std::filesystem::create_directories(dir);
+    Fanout(&suite, dir, n);
+  }
+  Coordinator(&suite);
+  std::filesystem::remove_all(root);
+
+  if (!json.empty()) WriteJson(json, suite.results());
+  if (baseline.empty()) {
+    printf("%-24s %14s %14s\n", "case", "ns/op", "min ns/op");
+    for (const auto& r : suite.results()) printf("%-24s %14.1f %14.1f\n", r.name.c_str(), r.ns_per_op, r.min_ns_per_op);
+    return 0;
+  }
+  int regressions = Compare(suite.results(), baseline, threshold);
+  if (regressions) printf("%d case(s) slower than the baseline by more than %.0f%%\n", regressions, threshold);
+  return regressions ? 1 : 0;
+}
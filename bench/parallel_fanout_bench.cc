@@ -0,0 +1,144 @@
+// Post-to-last-delivery latency of one post's fan-out versus follower count
+// and cores, with the work tsd does per follower: a follower with an open
+// stream gets the shared post queued on its PostStream, an offline one gets a
+// reference appended to its inbox. The followers are split into ranges and
+// run on a FanoutPool the way TimelineSession fans a post out; "cores" counts
+// the posting thread plus the pool's workers, and 1 is the inline loop.
+//
+// Times are from the start of the fan-out to the last delivery (the end of
+// the range that finished last), median and worst of the posts run. More
+// cores than the machine has only add switching; the machine's count is
+// printed first.
+//
+//   ./bench/parallel_fanout_bench [-o online%] [-c cores,...] [followers ...]
+//       (default: -o 10 -c 1,2,4,8 1000 10000 100000 1000000)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "fanout_pool.h"
+#include "inbox_store.h"
+#include "post_stream.h"
+#include "sns.pb.h"
+
+using csce438::Message;
+
+namespace {
+
+const size_t kGrain = 1024;   // tsd's kFanoutGrain
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Latest(std::atomic<int64_t>* last, int64_t t) {
+  int64_t seen = last->load(std::memory_order_relaxed);
+  while (seen < t && !last->compare_exchange_weak(seen, t, std::memory_order_relaxed)) {}
+}
+
+std::atomic<int64_t> last_delivery{0};
+
+// A follower's Timeline stream; every write completes at once.
+class MockStream : public PostStream {
+protected:
+  void StartSend(const grpc::ByteBuffer*) override { SendDone(true); }
+  void EndStream(grpc::Status) override {}
+};
+
+struct Follower {
+  std::string name;
+  std::unique_ptr<MockStream> stream;   // null while offline
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int online_pct = 10;
+  std::vector<unsigned> cores = {1, 2, 4, 8};
+  std::vector<size_t> counts;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      online_pct = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      cores.clear();
+      std::stringstream list(argv[++i]);
+      std::string c;
+      while (std::getline(list, c, ',')) cores.push_back(std::max(1, atoi(c.c_str())));
+    } else {
+      counts.push_back(strtoull(argv[i], nullptr, 10));
+    }
+  }
+  if (counts.empty()) counts = {1000, 10000, 100000, 1000000};
+
+  char dir[] = "/tmp/parallel_fanout_bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  // Never flushed or freed: writing out a million inboxes is not what is
+  // measured here
+  InboxStore* inboxes = new InboxStore(dir);
+
+  Message post;
+  post.set_username("1042");
+  post.set_msg("just shipped the new timeline page builder, numbers look good\n");
+  post.mutable_timestamp()->set_seconds(1700000000);
+  auto shared = SharedBuffer(post.SerializeAsString());
+
+  printf("hardware threads: %u, online followers: %d%%\n\n", std::thread::hardware_concurrency(), online_pct);
+  printf("%10s %6s %12s %12s %10s\n", "followers", "cores", "median us", "worst us", "stolen");
+  uint64_t ordinal = 0;
+  for (size_t n : counts) {
+    std::vector<Follower> followers(n);
+    for (size_t i = 0; i < n; i++) {
+      followers[i].name = "f" + std::to_string(n) + "_" + std::to_string(i);
+      if (static_cast<int>(i % 100) < online_pct) followers[i].stream.reset(new MockStream);
+    }
+    InboxRef ref;
+    ref.author = 1;
+    auto fanout = [&](size_t begin, size_t end) {
+      std::vector<std::string> offline;
+      for (size_t i = begin; i < end; i++) {
+        Follower& f = followers[i];
+        if (f.stream) {
+          f.stream->Send(shared);
+        } else {
+          offline.push_back(f.name);
+        }
+      }
+      inboxes->Append(offline, ref);
+      Latest(&last_delivery, Now());
+    };
+    // Opens every inbox once, as a server that has run a while would have
+    FanoutPool(0).Run(n, kGrain, fanout);
+
+    size_t posts = std::max<size_t>(5, 200000 / n);
+    for (unsigned c : cores) {
+      FanoutPool pool(c - 1);
+      std::vector<int64_t> took;
+      for (size_t p = 0; p < posts; p++) {
+        ref.ordinal = ++ordinal;
+        last_delivery = 0;
+        int64_t start = Now();
+        pool.Run(n, kGrain, fanout);
+        took.push_back(last_delivery - start);
+      }
+      std::sort(took.begin(), took.end());
+      printf("%10zu %6u %12.1f %12.1f %10.1f\n", n, c, took[took.size() / 2] / 1e3, took.back() / 1e3,
+             static_cast<double>(pool.Stats().stolen) / posts);
+    }
+  }
+  return 0;
+}
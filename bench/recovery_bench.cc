@@ -0,0 +1,119 @@
+// Measures tsd's time-to-ready after a restart: builds a directory of U users
+// and a follow graph of E edges, checkpoints it, appends a tail of graph log
+// records, then recovers the way tsd's Recover() does -- load the snapshot
+// (graph filled in parallel), intern the usernames, replay the log tail.
+//
+//   ./bench/recovery_bench [users [edges [tail]]]   (default: 1000000 50000000 1000000)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "snapshot.h"
+#include "social_graph.h"
+
+int main(int argc, char** argv) {
+  size_t users = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+  size_t edges = argc > 2 ? strtoull(argv[2], nullptr, 10) : 50000000;
+  size_t tail = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000000;
+
+  std::string root = std::filesystem::temp_directory_path() / ("recovery_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(root);
+  std::string snapshot_path = root + "/tsd.snapshot";
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<uint32_t> any(0, users - 1);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  auto popular = [&]() {
+    return static_cast<uint32_t>(std::pow(static_cast<double>(users), unit(rng))) - 1;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  double save = 0;
+  {
+    Snapshot snap;
+    SocialGraph graph;
+    graph.Resize(users);
+    for (size_t i = 0; i < users; i++) {
+      snap.names.push_back(std::to_string(i + 1));
+      snap.sessions.push_back(rng());
+    }
+    while (graph.edges() < edges) {
+      uint32_t a = any(rng), b = popular();
+      if (a != b) graph.Follow(a, b);
+    }
+    printf("built %zu users, %zu edges in %.1f s\n", users, graph.edges(), Seconds(start));
+
+    start = std::chrono::steady_clock::now();
+    graph.Serialize(&snap.graph);
+    if (!SaveSnapshot(snapshot_path, snap)) {
+      fprintf(stderr, "SaveSnapshot failed\n");
+      return 1;
+    }
+    save = Seconds(start);
+
+    GraphLog log(root + "/graph.log");
+    for (size_t i = 0; i < tail; i++) {
+      log.Append(i % 4 ? GraphLog::kFollow : GraphLog::kUnFollow, any(rng), popular());
+    }
+  }
+
+  struct stat st;
+  stat(snapshot_path.c_str(), &st);
+  printf("checkpoint: %.1f MB written in %.2f s (%.2f bytes/edge)\n\n", st.st_size / 1e6, save,
+         static_cast<double>(st.st_size) / edges);
+
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned> thread_counts = {1};
+  if (cores > 1) thread_counts.push_back(cores);
+
+  printf("%8s %12s %12s %12s %14s\n", "threads", "snapshot s", "intern s", "log tail s", "time-to-ready s");
+  for (unsigned threads : thread_counts) {
+    // Drop the file from the page cache so every run reads it from disk.
+    int fd = open(snapshot_path.c_str(), O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    auto ready = std::chrono::steady_clock::now();
+
+    Snapshot snap;
+    SocialGraph graph;
+    start = std::chrono::steady_clock::now();
+    if (!LoadSnapshot(snapshot_path, &snap, &graph, threads)) {
+      fprintf(stderr, "LoadSnapshot failed\n");
+      return 1;
+    }
+    double load = Seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    std::unordered_map<std::string, uint32_t> ids;
+    ids.reserve(snap.names.size());
+    for (size_t i = 0; i < snap.names.size(); i++) ids[snap.names[i]] = static_cast<uint32_t>(i);
+    double intern = Seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    GraphLog log(root + "/graph.log");
+    log.Replay([&](GraphLog::Op op, uint32_t a, uint32_t b) {
+      if (op == GraphLog::kFollow) graph.Follow(a, b);
+      if (op == GraphLog::kUnFollow) graph.UnFollow(a, b);
+    });
+    double replay = Seconds(start);
+
+    printf("%8u %12.2f %12.2f %12.2f %14.2f\n", threads, load, intern, replay, Seconds(ready));
+  }
+
+  std::filesystem::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,155 @@
+// Benchmarks the search index: indexes synthetic posts the way tsd does
+// (Add per post, Flush every 4096 posts standing in for the 100 ms flush
+// thread), then times queries against the full index. Post words follow a
+// Zipf distribution over a 100k word vocabulary, so word rank decides how
+// long a posting list is; one post in 20 carries one of 1000 hashtags.
+// Reports index cost per post, on-disk bytes per post, and query latency for
+// rare, mid-frequency and common words, a two-word AND, a hashtag, and the
+// third page of a common word.
+//
+//   ./bench/search_bench [posts ...]      (default: 1000000 10000000)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "search_index.h"
+
+namespace {
+
+const size_t kVocabulary = 100000;
+const size_t kWordsPerPost = 12;
+const size_t kHashtags = 1000;
+const size_t kBatch = 4096;
+const size_t kQueries = 200;
+
+std::string Word(size_t rank) {
+  return "w" + std::to_string(rank);
+}
+
+// Draws word ranks (0 = most frequent) from a Zipf(1) distribution through a
+// precomputed inverse CDF table.
+class Zipf {
+public:
+  Zipf() : table_(1 << 22) {
+    double h = 0;
+    for (size_t r = 1; r <= kVocabulary; r++) h += 1.0 / r;
+    double cdf = 0;
+    size_t r = 0;
+    for (size_t i = 0; i < table_.size(); i++) {
+      double at = (i + 0.5) / table_.size();
+      while (r + 1 < kVocabulary && cdf + 1.0 / (r + 1) / h < at) cdf += 1.0 / (++r) / h;
+      table_[i] = static_cast<uint32_t>(r);
+    }
+  }
+  size_t operator()(std::mt19937_64& rng) const { return table_[rng() & (table_.size() - 1)]; }
+
+private:
+  std::vector<uint32_t> table_;
+};
+
+struct Latency {
+  double p50_us, p99_us, hits;
+};
+
+Latency Time(SearchIndex& index, const std::vector<std::string>& queries, int pages) {
+  std::vector<double> us;
+  size_t hits = 0;
+  std::vector<SearchHit> out;
+  for (const auto& q : queries) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t cursor = 0;
+    for (int p = 0; p < pages; p++) {
+      out.clear();
+      cursor = index.Search(q, 20, cursor, &out);
+      if (!cursor) break;
+    }
+    us.push_back(Seconds(start) * 1e6);
+    hits += out.size();
+  }
+  std::sort(us.begin(), us.end());
+  return {us[us.size() / 2], us[us.size() * 99 / 100], static_cast<double>(hits) / queries.size()};
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) sizes.push_back(strtoull(argv[i], nullptr, 10));
+  if (sizes.empty()) sizes = {1000000, 10000000};
+
+  Zipf zipf;
+  for (size_t n : sizes) {
+    std::string root = std::filesystem::temp_directory_path() / ("search_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    {
+      SearchIndex index(root);
+      index.Open();
+      std::mt19937_64 rng(42);
+      std::vector<std::string> batch(kBatch);
+      double indexing = 0;
+      for (size_t done = 0; done < n;) {
+        size_t count = std::min(kBatch, n - done);
+        for (size_t i = 0; i < count; i++) {
+          std::string& text = batch[i];
+          text.clear();
+          for (size_t w = 0; w < kWordsPerPost; w++) {
+            text += Word(zipf(rng));
+            text += ' ';
+          }
+          if (rng() % 20 == 0) text += "#tag" + std::to_string(rng() % kHashtags);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) index.Add((done + i) % 50000, done + i, batch[i]);
+        index.Flush();
+        indexing += Seconds(start);
+        done += count;
+      }
+      auto start = std::chrono::steady_clock::now();
+      index.Flush(true);
+      indexing += Seconds(start);
+      SearchStats stats = index.Stats();
+      printf("%zu posts: %.0f ns/post to index, %.1f B/post on disk, %zu segments\n", n,
+             indexing / n * 1e9, static_cast<double>(stats.disk_bytes) / n, stats.segments);
+
+      auto words = [&](size_t lo, size_t hi) {
+        std::vector<std::string> q;
+        for (size_t i = 0; i < kQueries; i++) q.push_back(Word(lo + rng() % (hi - lo)));
+        return q;
+      };
+      std::vector<std::string> pairs, tags;
+      for (size_t i = 0; i < kQueries; i++) {
+        pairs.push_back(Word(rng() % 20) + " " + Word(20 + rng() % 80));
+        tags.push_back("#tag" + std::to_string(rng() % kHashtags));
+      }
+      struct {
+        const char* name;
+        std::vector<std::string> queries;
+        int pages;
+      } cases[] = {
+          {"rare word (rank 50k-100k)", words(50000, 100000), 1},
+          {"mid word (rank 1k-2k)", words(1000, 2000), 1},
+          {"common word (rank 0-10)", words(0, 10), 1},
+          {"common AND mid-common", pairs, 1},
+          {"hashtag", tags, 1},
+          {"common word, page 3", words(0, 10), 3},
+      };
+      printf("  %-28s %10s %10s %10s\n", "query", "p50 us", "p99 us", "hits");
+      for (auto& c : cases) {
+        Latency l = Time(index, c.queries, c.pages);
+        printf("  %-28s %10.1f %10.1f %10.1f\n", c.name, l.p50_us, l.p99_us, l.hits);
+      }
+    }
+    std::filesystem::remove_all(root);
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+// Benchmarks the GetTimeline read path: appends N posts to one user's log,
+// then pages through all of them twice -- once with the zero-copy page
+// builder used by tsd, once by parsing and re-serializing every record.
+//
+//   ./bench/timeline_bench [posts ...]      (default: 10000 1000000)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <grpcpp/grpcpp.h>
+
+#include "bench/bench_util.h"
+#include "sns.pb.h"
+#include "timeline_store.h"
+
+using csce438::Message;
+using csce438::TimelinePage;
+
+namespace {
+
+// Pages through the whole log; build() turns one page of records into a buffer.
+template <class Build>
+size_t PageAll(TimelineStore& store, const std::string& user, Build build) {
+  size_t bytes = 0;
+  TimelineRange range;
+  range.limit = 512;
+  range.max_bytes = 1 << 20;
+  do {
+    std::vector<TimelineRecord> records;
+    range.cursor = store.Scan(user, range, &records);
+    grpc::ByteBuffer page = build(records, range.cursor);
+    bytes += page.Length();
+  } while (range.cursor);
+  return bytes;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; i++) sizes.push_back(strtoull(argv[i], nullptr, 10));
+  if (sizes.empty()) sizes = {10000, 1000000};
+
+  printf("%10s %12s %14s %14s %10s\n", "posts", "append/s", "zero-copy MB/s", "reserial MB/s", "speedup");
+  for (size_t n : sizes) {
+    std::string root = std::filesystem::temp_directory_path() / ("timeline_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+    {
+      TimelineStore store(root);
+      Message m;
+      m.set_username("1");
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < n; i++) {
+        m.set_msg("post number " + std::to_string(i) + " with a typical short body\n");
+        m.mutable_timestamp()->set_seconds(1700000000 + i / 10);
+        store.Append("1", m);
+      }
+      double append = Seconds(start);
+
+      start = std::chrono::steady_clock::now();
+      size_t zc_bytes = PageAll(store, "1", BuildTimelinePage);
+      double zero_copy = Seconds(start);
+
+      start = std::chrono::steady_clock::now();
+      size_t rs_bytes = PageAll(store, "1", [](const std::vector<TimelineRecord>& records, uint64_t next) {
+        TimelinePage page;
+        for (const auto& r : records) {
+          page.add_posts()->ParseFromArray(r.payload.begin(), static_cast<int>(r.payload.size()));
+        }
+        page.set_next_cursor(next);
+        std::string wire;
+        page.SerializeToString(&wire);
+        grpc::Slice slice(wire);
+        return grpc::ByteBuffer(&slice, 1);
+      });
+      double reserialize = Seconds(start);
+
+      if (zc_bytes != rs_bytes) fprintf(stderr, "page size mismatch: %zu vs %zu\n", zc_bytes, rs_bytes);
+      printf("%10zu %12.0f %14.1f %14.1f %9.1fx\n", n, n / append,
+             zc_bytes / zero_copy / 1e6, rs_bytes / reserialize / 1e6, reserialize / zero_copy);
+    }
+    std::filesystem::remove_all(root);
+  }
+  return 0;
+}
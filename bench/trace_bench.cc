@@ -0,0 +1,72 @@
+// Benchmarks tracing overhead: a sampling decision, a span on an untraced
+// post (id 0), and recording a span, alone and on several threads at once.
+//
+//   ./bench/trace_bench [threads]      (default: 4)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bench/bench_util.h"
+#include "trace.h"
+
+namespace {
+
+const int kOps = 10000000;
+const int kRecords = 204800;
+
+template <class Fn>
+double NsPerOp(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kOps; i++) fn();
+  return Seconds(start) * 1e9 / kOps;
+}
+
+// ns per Record on each of threads threads, recording in bursts of half a
+// ring and draining the rings between bursts so nothing is dropped. Only
+// the bursts are timed.
+double TimeRecord(int threads) {
+  const int kBurst = 2048;
+  std::vector<double> ns(threads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      double total = 0;
+      for (int i = 0; i < kRecords / threads; i += kBurst) {
+        auto start = std::chrono::steady_clock::now();
+        for (int j = i; j < i + kBurst; j++) Tracer::Record("bench", 1, j, j + 1);
+        total += Seconds(start);
+        Tracer::Flush();
+      }
+      ns[t] = total * 1e9 / (kRecords / threads);
+    });
+  }
+  for (auto& w : workers) w.join();
+  double sum = 0;
+  for (double v : ns) sum += v;
+  return sum / threads;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  std::string path = std::filesystem::temp_directory_path() / ("trace_bench." + std::to_string(getpid()));
+  Tracer::Start(path, "trace_bench", 0.01);
+
+  volatile uint64_t sink = 0;
+  printf("Sample() at 1%%:           %6.1f ns\n", NsPerOp([&] { sink = sink + Tracer::Sample(); }));
+  printf("TraceSpan, untraced:      %6.1f ns\n", NsPerOp([&] { TraceSpan span("bench", 0); }));
+  printf("Record, 1 thread:         %6.1f ns\n", TimeRecord(1));
+  printf("Record, %d threads:        %6.1f ns per thread\n", threads, TimeRecord(threads));
+  Tracer::Flush();
+  printf("trace file: %.1f MB\n", std::filesystem::file_size(path) / 1e6);
+  std::filesystem::remove(path);
+  return 0;
+}
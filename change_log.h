@@ -0,0 +1,56 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Version counter over a set of 32-bit ids, with the most recent additions
+ * and removals kept so a reader holding an older version can be sent only
+ * what changed. Each Record bumps the version by one. Once more than kKeep
+ * changes are held the older half is dropped; a reader further behind than
+ * that gets the whole set instead. Empty until the first change, so an idle
+ * set costs one counter and an empty vector. Not thread safe.
+ */
+class ChangeLog {
+public:
+  static const size_t kKeep = 64;
+
+  // Starts at version with no changes held, e.g. for a set paged back in
+  explicit ChangeLog(uint64_t version = 0) : version_(version) {}
+
+  void Record(uint32_t id, bool added) {
+    changes_.push_back({id, added});
+    version_++;
+    if (changes_.size() > 2 * kKeep) changes_.erase(changes_.begin(), changes_.end() - kKeep);
+  }
+
+  uint64_t version() const { return version_; }
+
+  // Appends the net changes after version since to added and removed, in the
+  // order they last changed. Returns false if since is not a version this log
+  // can answer for: too old, or ahead of it.
+  bool Since(uint64_t since, std::vector<uint32_t>* added, std::vector<uint32_t>* removed) const {
+    if (since > version_ || version_ - since > changes_.size()) return false;
+    size_t first = changes_.size() - (version_ - since);
+    for (size_t i = first; i < changes_.size(); i++) {
+      // Only an id's last change in the range counts
+      bool last = true;
+      for (size_t j = i + 1; j < changes_.size() && last; j++) last = changes_[j].id != changes_[i].id;
+      if (last) (changes_[i].added ? added : removed)->push_back(changes_[i].id);
+    }
+    return true;
+  }
+
+private:
+  struct Change {
+    uint32_t id;
+    bool added;
+  };
+
+  uint64_t version_ = 0;
+  std::vector<Change> changes_;
+};
+
+#endif
@@ -0,0 +1,464 @@
+#include "coord_service.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+// ✅ glog logging
+#include <glog/logging.h>
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity);
+
+using grpc::ServerContext;
+using grpc::Status;
+using csce438::ServerInfo;
+using csce438::Confirmation;
+using csce438::ID;
+using csce438::Path;
+using csce438::PathAndData;
+using csce438::RoutingState;
+using csce438::WatchRequest;
+using csce438::MoveUsersRequest;
+using csce438::MoveUsersReply;
+
+// How long a replica waits for the leader before handling a heartbeat
+// itself, and between attempts to reopen its Watch stream
+static const std::chrono::milliseconds kLeaderTimeout(1000);
+static const std::chrono::milliseconds kRewatchInterval(500);
+
+// Users moved per MigrateOut round trip when the request sets no batch size
+static const size_t kMigrateBatch = 500;
+
+// The cluster a user lives in unless a migration routed it elsewhere
+static int defaultCluster(int user) {
+    return ((user - 1) % 3) + 1;
+}
+
+bool zNode::isActive(std::chrono::milliseconds timeout){
+    bool status = false;
+    if(!missed_heartbeat){
+        status = true;
+    }else if(std::chrono::steady_clock::now() - last_heartbeat < timeout){
+        status = true;
+    }
+    return status;
+}
+
+CoordServiceImpl::~CoordServiceImpl() {
+    {
+        std::lock_guard<std::mutex> lock(v_mutex);
+        stopping = true;
+        if (watch_ctx) watch_ctx->TryCancel();
+    }
+    state_cv.notify_all();
+    if (watcher.joinable()) watcher.join();
+    for (auto& c : clusters) {
+        for (auto s : c) delete s;
+    }
+}
+
+void CoordServiceImpl::followLeader(std::shared_ptr<grpc::Channel> leader_channel) {
+    leader = csce438::CoordService::NewStub(leader_channel);
+    watcher = std::thread(&CoordServiceImpl::watchLeader, this);
+}
+
+Status CoordServiceImpl::Heartbeat(ServerContext* context, const ServerInfo* serverinfo, Confirmation* confirmation) {
+    // A replica hands heartbeats to the leader and sees them come back
+    // through its Watch stream; only without a leader does it apply them
+    if (leader) {
+        grpc::ClientContext ctx;
+        ctx.set_deadline(std::chrono::system_clock::now() + kLeaderTimeout);
+        Status s = leader->Heartbeat(&ctx, *serverinfo, confirmation);
+        if (s.ok() || s.error_code() == grpc::StatusCode::CANCELLED) return s;
+        log(WARNING, "Leader unreachable, applying heartbeat locally: " + s.error_message());
+    }
+
+    std::lock_guard<std::mutex> lock(v_mutex);
+    if (!applyHeartbeat(*serverinfo)) {
+        confirmation->set_status(false);
+        return Status::CANCELLED;
+    }
+    changed();
+    confirmation->set_status(true);
+    return Status::OK;
+}
+
+bool CoordServiceImpl::applyHeartbeat(const ServerInfo& serverinfo) {
+    int cluster_id = serverinfo.serverid();  // Server's cluster ID
+    std::string host = serverinfo.hostname();
+    std::string port = serverinfo.port();
+
+    // Make sure cluster_id is valid
+    if (cluster_id < 1 || cluster_id > 3) {
+        std::cerr << "Invalid cluster ID: " << cluster_id << std::endl;
+        log(ERROR, "Invalid cluster ID received: " + std::to_string(cluster_id));
+        return false;
+    }
+
+    // Search for this server among the cluster's servers
+    int pos = findServer(clusters[cluster_id - 1], host, port);
+
+    if (pos == -1) {
+        // Register new server
+        zNode* node = new zNode();
+        node->serverID = cluster_id;
+        node->hostname = host;
+        node->port = port;
+        node->type = "SERVER";
+        node->last_heartbeat = std::chrono::steady_clock::now();
+        node->missed_heartbeat = false;
+
+        clusters[cluster_id - 1].push_back(node);
+        std::cout << "✅ Registered new server (Cluster " << cluster_id
+                << ") at " << host << ":" << port << std::endl;
+        log(INFO, "Registered new server (Cluster " + std::to_string(cluster_id) + 
+                  ") at " + host + ":" + port);
+    } else {
+        // Update existing server's heartbeat
+        clusters[cluster_id - 1][pos]->last_heartbeat = std::chrono::steady_clock::now();
+        clusters[cluster_id - 1][pos]->missed_heartbeat = false;
+        std::cout << "💓 Heartbeat updated from Server " << cluster_id
+                << " (" << host << ":" << port << ")" << std::endl;
+        log(INFO, "Heartbeat updated from Server " + std::to_string(cluster_id) + 
+                  " (" + host + ":" + port + ")");
+    }
+    return true;
+}
+
+//function returns the server information for requested client id
+//this function assumes there are always 3 clusters and has math
+//hardcoded to represent this.
+Status CoordServiceImpl::GetServer(ServerContext* context, const ID* id, ServerInfo* serverinfo) {
+    std::lock_guard<std::mutex> lock(v_mutex);
+
+    int client_id = id->id();
+    int cluster_id = clusterOf(client_id);
+    std::cout << "Client " << client_id << " requesting connection → Cluster " << cluster_id << std::endl;
+    log(INFO, "Client " + std::to_string(client_id) + " requesting connection → Cluster " + std::to_string(cluster_id));
+
+    auto& cluster = clusters[cluster_id - 1];
+
+    // Check if the cluster has any servers
+    if (cluster.empty()) {
+        std::cerr << "❌ No server found in cluster " << cluster_id << std::endl;
+        log(ERROR, "No active server found in cluster " + std::to_string(cluster_id));
+        return Status(grpc::StatusCode::UNAVAILABLE, "No server in this cluster");
+    }
+
+    // Find the first active server in the cluster
+    for (auto& node : cluster) {
+        if (node->isActive(heartbeat_timeout)) {
+            serverinfo->set_serverid(node->serverID);
+            serverinfo->set_hostname(node->hostname);
+            serverinfo->set_port(node->port);
+            serverinfo->set_type(node->type);
+            std::cout << "✅ Assigned Client " << client_id
+                    << " → Server " << node->hostname << ":" << node->port << std::endl;
+            log(INFO, "Assigned Client " + std::to_string(client_id) + 
+                      " to Server " + node->hostname + ":" + node->port);
+            return Status::OK;
+        }
+    }
+
+    std::cerr << "❌ All servers in cluster " << cluster_id << " are inactive" << std::endl;
+    log(ERROR, "All servers in cluster " + std::to_string(cluster_id) + " are inactive");
+    return Status(grpc::StatusCode::UNAVAILABLE, "All servers in cluster inactive");
+}
+
+int CoordServiceImpl::clusterOf(int user) {
+    auto it = routes.find(user);
+    return it != routes.end() ? it->second : defaultCluster(user);
+}
+
+// host:port of the first active server of a cluster, or empty if there is none
+std::string CoordServiceImpl::activeServer(int cluster_id) {
+    for (auto& node : clusters[cluster_id - 1]) {
+        if (node->isActive(heartbeat_timeout)) return node->hostname + ":" + node->port;
+    }
+    return "";
+}
+
+void CoordServiceImpl::loadRoutes(const std::string& path) {
+    std::lock_guard<std::mutex> lock(v_mutex);
+    routes_file = path;
+    std::ifstream in(path);
+    int user, cluster_id;
+    while (in >> user >> cluster_id) {
+        if (cluster_id == defaultCluster(user)) routes.erase(user);
+        else routes[user] = cluster_id;
+    }
+    if (!routes.empty()) log(INFO, "Loaded " + std::to_string(routes.size()) + " user routes from " + path);
+}
+
+// Moves users to request->cluster() batch by batch, each batch from the
+// cluster it is in now. A batch that fails stays where it was; the others
+// still move.
+Status CoordServiceImpl::Migrate(ServerContext* context, const MoveUsersRequest* request, MoveUsersReply* reply) {
+    if (leader) {
+        grpc::ClientContext ctx;
+        return leader->Migrate(&ctx, *request, reply);
+    }
+    int to = request->cluster();
+    if (to < 1 || to > 3) return Status(grpc::StatusCode::INVALID_ARGUMENT, "Invalid cluster ID");
+    size_t batch = request->batch() ? request->batch() : kMigrateBatch;
+
+    std::lock_guard<std::mutex> migrating(migrate_mutex);
+    std::map<int, std::vector<int>> by_source;
+    {
+        std::lock_guard<std::mutex> lock(v_mutex);
+        for (int user : request->users()) {
+            int from = clusterOf(user);
+            if (from != to) by_source[from].push_back(user);
+        }
+    }
+    for (auto& source : by_source) {
+        const std::vector<int>& users = source.second;
+        for (size_t i = 0; i < users.size(); i += batch) {
+            std::vector<int> ids(users.begin() + i, users.begin() + std::min(users.size(), i + batch));
+            Status s = migrateBatch(ids, source.first, to, reply);
+            if (s.ok()) continue;
+            reply->set_failed(reply->failed() + ids.size());
+            reply->set_error(s.error_message());
+            log(ERROR, "Moving " + std::to_string(ids.size()) + " users from cluster " + std::to_string(source.first) +
+                       " to " + std::to_string(to) + " failed: " + s.error_message());
+        }
+    }
+    return Status::OK;
+}
+
+Status CoordServiceImpl::migrateBatch(const std::vector<int>& users, int from, int to, MoveUsersReply* reply) {
+    std::string source, destination;
+    {
+        std::lock_guard<std::mutex> lock(v_mutex);
+        source = activeServer(from);
+        destination = activeServer(to);
+    }
+    if (source.empty() || destination.empty()) {
+        return Status(grpc::StatusCode::UNAVAILABLE,
+                      "No active server in cluster " + std::to_string(source.empty() ? from : to));
+    }
+
+    auto channel = server_channels ? server_channels(source)
+                                   : grpc::CreateChannel(source, grpc::InsecureChannelCredentials());
+    auto stub = csce438::SNSService::NewStub(channel);
+    csce438::MigrateRequest request;
+    for (int user : users) request.add_usernames(std::to_string(user));
+    request.set_destination(destination);
+    request.set_source(source);
+
+    // The bulk copy runs while the users stay online; the cutover then only
+    // has to send what they did meanwhile
+    csce438::MigrateReply copied, moved;
+    {
+        grpc::ClientContext ctx;
+        Status s = stub->MigrateOut(&ctx, request, &copied);
+        if (!s.ok()) return s;
+    }
+    request.set_cutover(true);
+    grpc::ClientContext ctx;
+    Status s = stub->MigrateOut(&ctx, request, &moved);
+    if (!s.ok()) return s;
+
+    std::lock_guard<std::mutex> lock(v_mutex);
+    std::ofstream out;
+    if (!routes_file.empty()) out.open(routes_file, std::ios::app);
+    for (int user : users) {
+        setRoute(user, to);
+        if (out.is_open()) out << user << " " << to << "\n";
+    }
+    changed();
+    reply->set_moved(reply->moved() + users.size());
+    reply->set_posts(reply->posts() + copied.posts() + moved.posts());
+    reply->set_inbox(reply->inbox() + moved.inbox());
+    log(INFO, "Moved " + std::to_string(users.size()) + " users from " + source + " to " + destination + " (" +
+              std::to_string(copied.posts() + moved.posts()) + " posts)");
+    return Status::OK;
+}
+
+Status CoordServiceImpl::create(ServerContext* context, const PathAndData* request, csce438::Status* status) {
+    if (leader) {
+        grpc::ClientContext ctx;
+        ctx.set_deadline(std::chrono::system_clock::now() + kLeaderTimeout);
+        return leader->create(&ctx, *request, status);
+    }
+    std::lock_guard<std::mutex> lock(v_mutex);
+    bool created = paths.emplace(request->path(), request->data()).second;
+    if (created) changed();
+    status->set_status(created);
+    return Status::OK;
+}
+
+Status CoordServiceImpl::exists(ServerContext* context, const Path* request, csce438::Status* status) {
+    std::lock_guard<std::mutex> lock(v_mutex);
+    status->set_status(paths.count(request->path()) > 0);
+    return Status::OK;
+}
+
+// Sends the whole registry now and after every change until the replica
+// goes away. Servers and paths are a few dozen bytes each and are always
+// sent whole; routes, one per migrated user, only as they change.
+Status CoordServiceImpl::Watch(ServerContext* context, const WatchRequest* request,
+                               grpc::ServerWriter<RoutingState>* writer) {
+    log(INFO, "Replica watching from " + context->peer());
+    std::unique_lock<std::mutex> lock(v_mutex);
+    bool first = true;
+    uint64_t sent = 0;
+    // Routes version the replica holds; none yet
+    uint64_t routes_sent = UINT64_MAX;
+    while (!stopping && !context->IsCancelled()) {
+        if (first || version != sent) {
+            RoutingState state;
+            fillState(&state, &routes_sent);
+            sent = version;
+            first = false;
+            lock.unlock();
+            bool ok = writer->Write(state);
+            lock.lock();
+            if (!ok) break;
+            continue;
+        }
+        state_cv.wait_for(lock, kRewatchInterval);
+    }
+    log(INFO, "Replica stopped watching from " + context->peer());
+    return Status::OK;
+}
+
+void CoordServiceImpl::changed() {
+    version++;
+    state_cv.notify_all();
+}
+
+void CoordServiceImpl::setRoute(int user, int cluster_id) {
+    if (cluster_id == defaultCluster(user)) routes.erase(user);
+    else routes[user] = cluster_id;
+    csce438::UserRoute r;
+    r.set_user(user);
+    r.set_cluster(cluster_id);
+    route_log.push_back(r);
+    routes_version++;
+}
+
+// A replica holding routes version *routes_sent gets the changes since, if
+// route_log still has them, and all routes otherwise
+void CoordServiceImpl::fillState(RoutingState* state, uint64_t* routes_sent) {
+    auto now = std::chrono::steady_clock::now();
+    state->set_version(version);
+    for (auto& c : clusters) {
+        for (auto s : c) {
+            auto* out = state->add_servers();
+            out->set_serverid(s->serverID);
+            out->set_hostname(s->hostname);
+            out->set_port(s->port);
+            out->set_type(s->type);
+            out->set_heartbeat_age_ms(std::chrono::duration_cast<std::chrono::milliseconds>(now - s->last_heartbeat).count());
+            out->set_missed_heartbeat(s->missed_heartbeat);
+        }
+    }
+    for (auto& p : paths) {
+        auto* out = state->add_znodes();
+        out->set_path(p.first);
+        out->set_data(p.second);
+    }
+    state->set_routes_version(routes_version);
+    if (*routes_sent >= route_log_base && *routes_sent <= routes_version) {
+        state->set_routes_delta(true);
+        for (uint64_t v = *routes_sent; v < routes_version; v++) {
+            *state->add_routes() = route_log[v - route_log_base];
+        }
+    } else {
+        for (auto& r : routes) {
+            auto* out = state->add_routes();
+            out->set_user(r.first);
+            out->set_cluster(r.second);
+        }
+    }
+    *routes_sent = routes_version;
+}
+
+// Replaces the registry with the leader's. Heartbeat times travel as ages so
+// the two clocks need not agree.
+void CoordServiceImpl::applyState(const RoutingState& state) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(v_mutex);
+    for (auto& c : clusters) {
+        for (auto s : c) delete s;
+        c.clear();
+    }
+    for (const auto& in : state.servers()) {
+        if (in.serverid() < 1 || in.serverid() > 3) continue;
+        zNode* node = new zNode();
+        node->serverID = in.serverid();
+        node->hostname = in.hostname();
+        node->port = in.port();
+        node->type = in.type();
+        node->last_heartbeat = now - std::chrono::milliseconds(in.heartbeat_age_ms());
+        node->missed_heartbeat = in.missed_heartbeat();
+        clusters[in.serverid() - 1].push_back(node);
+    }
+    paths.clear();
+    for (const auto& p : state.znodes()) paths[p.path()] = p.data();
+    if (state.routes_delta()) {
+        for (const auto& r : state.routes()) setRoute(r.user(), r.cluster());
+    } else {
+        routes.clear();
+        for (const auto& r : state.routes()) routes[r.user()] = r.cluster();
+        route_log.clear();
+        route_log_base = state.routes_version();
+    }
+    routes_version = state.routes_version();
+    version = state.version();
+}
+
+void CoordServiceImpl::watchLeader() {
+    while (true) {
+        grpc::ClientContext ctx;
+        {
+            std::lock_guard<std::mutex> lock(v_mutex);
+            if (stopping) return;
+            watch_ctx = &ctx;
+        }
+        auto reader = leader->Watch(&ctx, WatchRequest());
+        RoutingState state;
+        uint64_t updates = 0;
+        while (reader->Read(&state)) {
+            applyState(state);
+            if (updates++ == 0) log(INFO, "Following leader registry at version " + std::to_string(state.version()));
+        }
+        Status s = reader->Finish();
+
+        std::unique_lock<std::mutex> lock(v_mutex);
+        watch_ctx = nullptr;
+        if (stopping) return;
+        log(WARNING, "Watch stream to leader closed: " + s.error_message());
+        state_cv.wait_for(lock, kRewatchInterval, [this] { return stopping; });
+    }
+}
+
+// Servers of a cluster all report the cluster id, so they are told apart by address
+int CoordServiceImpl::findServer(const std::vector<zNode*>& v, const std::string& host, const std::string& port) {
+    for (int i = 0; i < v.size(); i++) {
+        if (v[i]->hostname == host && v[i]->port == port) return i;
+    }
+    return -1;
+}
+
+void CoordServiceImpl::checkHeartbeat(){
+    //check servers for heartbeat > timeout
+    //if true turn missed heartbeat = true
+    std::lock_guard<std::mutex> lock(v_mutex);
+
+    // iterating through the clusters vector of vectors of znodes
+    for (auto& c : clusters){
+        for(auto& s : c){
+            if(std::chrono::steady_clock::now() - s->last_heartbeat > heartbeat_timeout){
+                std::cout << "missed heartbeat from server " << s->serverID << std::endl;
+                log(WARNING, "Missed heartbeat from server " + std::to_string(s->serverID) +
+                             " (" + s->hostname + ":" + s->port + ")");
+                if(!s->missed_heartbeat){
+                    s->missed_heartbeat = true;
+                    s->last_heartbeat = std::chrono::steady_clock::now();
+                    changed();
+                }
+            }
+        }
+    }
+}
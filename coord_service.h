@@ -0,0 +1,141 @@
+#ifndef COORD_SERVICE_H
+#define COORD_SERVICE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "coordinator.grpc.pb.h"
+#include "sns.grpc.pb.h"
+
+struct zNode{
+    int serverID;
+    std::string hostname;
+    std::string port;
+    std::string type;
+    std::chrono::steady_clock::time_point last_heartbeat;
+    bool missed_heartbeat;
+    bool isActive(std::chrono::milliseconds timeout);
+};
+
+// Registry of SNS servers per cluster, kept alive by their heartbeats.
+// A server silent for longer than the heartbeat timeout is marked as having
+// missed its heartbeat by checkHeartbeat(), and clients stop being assigned
+// to it once it stays silent for another timeout.
+//
+// Any number of read replicas can follow one coordinator (the leader). A
+// replica mirrors the leader's registry through a Watch stream and answers
+// GetServer and exists itself, so client lookups spread over all of them.
+// It passes Heartbeat and create on to the leader; while the leader is
+// unreachable it applies heartbeats itself, so it keeps routing.
+//
+// Users normally live in cluster ((id - 1) % 3) + 1. Migrate moves them to
+// another cluster batch by batch: the source server copies each batch to the
+// destination (MigrateOut), hands it over, and only then is the batch's route
+// recorded, so GetServer sends a reconnecting client to the new server.
+// Routes are appended to the file given to loadRoutes. Replicas get them in
+// full when they connect and then only the changes, which are versioned apart
+// from the rest of the registry: heartbeats change that every few seconds.
+class CoordServiceImpl final : public csce438::CoordService::Service {
+public:
+    explicit CoordServiceImpl(std::chrono::milliseconds heartbeat_timeout = std::chrono::seconds(10))
+        : heartbeat_timeout(heartbeat_timeout), clusters(3) {}
+    ~CoordServiceImpl();
+
+    // Makes this coordinator a read replica of the one behind leader_channel.
+    // Call once, before serving.
+    void followLeader(std::shared_ptr<grpc::Channel> leader_channel);
+
+    // Reads the routes recorded in path and appends new ones to it. Call
+    // once, before serving; without it routes last until shutdown.
+    void loadRoutes(const std::string& path);
+
+    // How Migrate opens channels to SNS servers, by host:port (insecure TCP
+    // if unset)
+    using ServerChannels = std::function<std::shared_ptr<grpc::Channel>(const std::string& address)>;
+    void setServerChannels(ServerChannels channels) { server_channels = std::move(channels); }
+
+    // One pass of the heartbeat watchdog over every registered server
+    void checkHeartbeat();
+
+    grpc::Status Heartbeat(grpc::ServerContext* context, const csce438::ServerInfo* serverinfo,
+                           csce438::Confirmation* confirmation) override;
+    grpc::Status GetServer(grpc::ServerContext* context, const csce438::ID* id,
+                           csce438::ServerInfo* serverinfo) override;
+    grpc::Status create(grpc::ServerContext* context, const csce438::PathAndData* request,
+                        csce438::Status* status) override;
+    grpc::Status exists(grpc::ServerContext* context, const csce438::Path* request,
+                        csce438::Status* status) override;
+    grpc::Status Watch(grpc::ServerContext* context, const csce438::WatchRequest* request,
+                       grpc::ServerWriter<csce438::RoutingState>* writer) override;
+    grpc::Status Migrate(grpc::ServerContext* context, const csce438::MoveUsersRequest* request,
+                         csce438::MoveUsersReply* reply) override;
+
+private:
+    int findServer(const std::vector<zNode*>& v, const std::string& host, const std::string& port);
+    // These four expect v_mutex held
+    bool applyHeartbeat(const csce438::ServerInfo& serverinfo);
+    void fillState(csce438::RoutingState* state, uint64_t* routes_sent);
+    void changed();
+    void setRoute(int user, int cluster_id);
+    void applyState(const csce438::RoutingState& state);
+    void watchLeader();
+    // These two expect v_mutex held
+    int clusterOf(int user);
+    std::string activeServer(int cluster_id);
+    grpc::Status migrateBatch(const std::vector<int>& users, int from, int to, csce438::MoveUsersReply* reply);
+
+    std::chrono::milliseconds heartbeat_timeout;
+
+    //potentially thread safe 
+    std::mutex v_mutex;
+    // creating a vector of vectors containing znodes, one per cluster
+    std::vector<std::vector<zNode*>> clusters;
+    // paths and data stored by create
+    std::map<std::string, std::string> paths;
+    // users that live outside the cluster their id maps to, by id
+    std::map<int, int> routes;
+    // route changes in order, the first being version route_log_base + 1;
+    // Watch sends a replica those past the routes_version it has
+    std::vector<csce438::UserRoute> route_log;
+    uint64_t route_log_base = 0;
+    uint64_t routes_version = 0;
+    std::string routes_file;
+    // one migration at a time
+    std::mutex migrate_mutex;
+    ServerChannels server_channels;
+    // bumped on every change; Watch streams wait on state_cv for it
+    uint64_t version = 0;
+    std::condition_variable state_cv;
+    bool stopping = false;
+
+    // Replica only
+    std::unique_ptr<csce438::CoordService::Stub> leader;
+    std::thread watcher;
+    grpc::ClientContext* watch_ctx = nullptr;   // the open Watch call, under v_mutex
+};
+
+// Coordinator addresses from tsc's and tsd's -h/-k flags: -h may list
+// several hosts separated by commas, each optionally with its own :port.
+inline std::vector<std::string> coordinatorAddresses(const std::string& hosts, const std::string& port) {
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= hosts.size()) {
+        size_t end = hosts.find(',', start);
+        if (end == std::string::npos) end = hosts.size();
+        std::string host = hosts.substr(start, end - start);
+        if (!host.empty()) out.push_back(host.find(':') == std::string::npos ? host + ":" + port : host);
+        start = end + 1;
+    }
+    return out;
+}
+
+#endif
@@ -27,6 +27,7 @@
 
 #include "coordinator.grpc.pb.h"
 #include "coordinator.pb.h"
+#include "coord_service.h"
 
 using google::protobuf::Timestamp;
 using google::protobuf::Duration;
@@ -44,148 +45,23 @@ using csce438::ID;
 using csce438::ServerList;
 using csce438::SynchService;
 
-struct zNode{
-    int serverID;
-    std::string hostname;
-    std::string port;
-    std::string type;
-    std::time_t last_heartbeat;
-    bool missed_heartbeat;
-    bool isActive();
-
-};
-
-//potentially thread safe 
-std::mutex v_mutex;
-std::vector<zNode*> cluster1;
-std::vector<zNode*> cluster2;
-std::vector<zNode*> cluster3;
-
-// creating a vector of vectors containing znodes
-std::vector<std::vector<zNode*>> clusters = {cluster1, cluster2, cluster3};
-
-
 //func declarations
-int findServer(std::vector<zNode*> v, int id); 
-std::time_t getTimeNow();
-void checkHeartbeat();
-
-
-bool zNode::isActive(){
-    bool status = false;
-    if(!missed_heartbeat){
-        status = true;
-    }else if(difftime(getTimeNow(),last_heartbeat) < 10){
-        status = true;
-    }
-    return status;
-}
-
-
-class CoordServiceImpl final : public CoordService::Service {
-
-    Status Heartbeat(ServerContext* context, const ServerInfo* serverinfo, Confirmation* confirmation) override {
-        std::lock_guard<std::mutex> lock(v_mutex);
-
-        int cluster_id = serverinfo->serverid();  // Server's cluster ID
-        std::string host = serverinfo->hostname();
-        std::string port = serverinfo->port();
-
-        // Make sure cluster_id is valid
-        if (cluster_id < 1 || cluster_id > 3) {
-            std::cerr << "Invalid cluster ID: " << cluster_id << std::endl;
-            log(ERROR, "Invalid cluster ID received: " + std::to_string(cluster_id));
-            confirmation->set_status(false);
-            return Status::CANCELLED;
-        }
-
-        // Search for existing server in the cluster
-        int pos = findServer(clusters[cluster_id - 1], cluster_id);
-
-        if (pos == -1) {
-            // Register new server
-            zNode* node = new zNode();
-            node->serverID = cluster_id;
-            node->hostname = host;
-            node->port = port;
-            node->type = "SERVER";
-            node->last_heartbeat = getTimeNow();
-            node->missed_heartbeat = false;
-
-            clusters[cluster_id - 1].push_back(node);
-            std::cout << "✅ Registered new server (Cluster " << cluster_id
-                    << ") at " << host << ":" << port << std::endl;
-            log(INFO, "Registered new server (Cluster " + std::to_string(cluster_id) + 
-                      ") at " + host + ":" + port);
-        } else {
-            // Update existing server's heartbeat
-            clusters[cluster_id - 1][pos]->last_heartbeat = getTimeNow();
-            clusters[cluster_id - 1][pos]->missed_heartbeat = false;
-            std::cout << "💓 Heartbeat updated from Server " << cluster_id
-                    << " (" << host << ":" << port << ")" << std::endl;
-            log(INFO, "Heartbeat updated from Server " + std::to_string(cluster_id) + 
-                      " (" + host + ":" + port + ")");
-        }
-
-        confirmation->set_status(true);
-        return Status::OK;
-    }
+void checkHeartbeat(CoordServiceImpl* service);
 
-    //function returns the server information for requested client id
-    //this function assumes there are always 3 clusters and has math
-    //hardcoded to represent this.
-    Status GetServer(ServerContext* context, const ID* id, ServerInfo* serverinfo) override {
-        std::lock_guard<std::mutex> lock(v_mutex);
-
-        int client_id = id->id();
-        int cluster_id = ((client_id - 1) % 3) + 1;
-        std::cout << "Client " << client_id << " requesting connection → Cluster " << cluster_id << std::endl;
-        log(INFO, "Client " + std::to_string(client_id) + " requesting connection → Cluster " + std::to_string(cluster_id));
-
-        auto& cluster = clusters[cluster_id - 1];
-
-        // Check if the cluster has any servers
-        if (cluster.empty()) {
-            std::cerr << "❌ No server found in cluster " << cluster_id << std::endl;
-            log(ERROR, "No active server found in cluster " + std::to_string(cluster_id));
-            return Status(grpc::StatusCode::UNAVAILABLE, "No server in this cluster");
-        }
-
-        // Find the first active server in the cluster
-        for (auto& node : cluster) {
-            if (node->isActive()) {
-                serverinfo->set_serverid(node->serverID);
-                serverinfo->set_hostname(node->hostname);
-                serverinfo->set_port(node->port);
-                serverinfo->set_type(node->type);
-                std::cout << "✅ Assigned Client " << client_id
-                        << " → Server " << node->hostname << ":" << node->port << std::endl;
-                log(INFO, "Assigned Client " + std::to_string(client_id) + 
-                          " to Server " + node->hostname + ":" + node->port);
-                return Status::OK;
-            }
-        }
-
-        std::cerr << "❌ All servers in cluster " << cluster_id << " are inactive" << std::endl;
-        log(ERROR, "All servers in cluster " + std::to_string(cluster_id) + " are inactive");
-        return Status(grpc::StatusCode::UNAVAILABLE, "All servers in cluster inactive");
-    }
-    
-    int findServer(std::vector<zNode*> v, int id) {
-        for (int i = 0; i < v.size(); i++) {
-            if (v[i]->serverID == id) return i;
-        }
-        return -1;
+void RunServer(std::string port_no, std::string leader_addr){
+    CoordServiceImpl service;
+    // With -f this is a read replica of the coordinator at leader_addr
+    if (!leader_addr.empty()) {
+        service.followLeader(grpc::CreateChannel(leader_addr, grpc::InsecureChannelCredentials()));
+        log(INFO, "Coordinator is a read replica of " + leader_addr);
+    } else {
+        // Where migrated users live; replicas get it through Watch
+        service.loadRoutes("routes-" + port_no + ".log");
     }
-
-};
-
-void RunServer(std::string port_no){
     //start thread to check heartbeats
-    std::thread hb(checkHeartbeat);
+    std::thread hb(checkHeartbeat, &service);
     //localhost = 127.0.0.1
     std::string server_address("0.0.0.0:"+port_no);
-    CoordServiceImpl service;
     //grpc::EnableDefaultHealthCheckService(true);
     //grpc::reflection::InitProtoReflectionServerBuilderPlugin();
     ServerBuilder builder;
@@ -207,12 +83,16 @@ void RunServer(std::string port_no){
 int main(int argc, char** argv) {
 
     std::string port = "3010";
+    std::string leader_addr;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "p:")) != -1){
+    while ((opt = getopt(argc, argv, "p:f:")) != -1){
         switch(opt) {
             case 'p':
                 port = optarg;
                 break;
+            case 'f':
+                leader_addr = optarg;
+                break;
             default:
                 std::cerr << "Invalid Command Line Argument\n";
         }
@@ -223,7 +103,7 @@ int main(int argc, char** argv) {
     google::InitGoogleLogging(log_file_name.c_str());
     log(INFO, "Logging initialized. Coordinator starting...");
 
-    RunServer(port);
+    RunServer(port, leader_addr);
 
     log(INFO, "Coordinator shutting down...");
     google::ShutdownGoogleLogging(); // ✅ Close glog before exit
@@ -232,35 +112,9 @@ int main(int argc, char** argv) {
 
 
 
-void checkHeartbeat(){
+void checkHeartbeat(CoordServiceImpl* service){
     while(true){
-        //check servers for heartbeat > 10
-        //if true turn missed heartbeat = true
-
-        v_mutex.lock();
-
-        // iterating through the clusters vector of vectors of znodes
-        for (auto& c : clusters){
-            for(auto& s : c){
-                if(difftime(getTimeNow(),s->last_heartbeat)>10){
-                    std::cout << "missed heartbeat from server " << s->serverID << std::endl;
-                    log(WARNING, "Missed heartbeat from server " + std::to_string(s->serverID) +
-                                 " (" + s->hostname + ":" + s->port + ")");
-                    if(!s->missed_heartbeat){
-                        s->missed_heartbeat = true;
-                        s->last_heartbeat = getTimeNow();
-                    }
-                }
-            }
-        }
-
-        v_mutex.unlock();
-
+        service->checkHeartbeat();
         sleep(3);
     }
 }
-
-
-std::time_t getTimeNow(){
-    return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "executor.h"
+
+#include <algorithm>
+
+Executor::Executor(unsigned threads) {
+  threads = std::max(threads, 1u);
+  for (unsigned i = 0; i < threads; i++) workers_.emplace_back(&Executor::Work, this);
+}
+
+Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& t : workers_) t.join();
+}
+
+void Executor::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    tasks_.push_back(std::move(task));
+  }
+  wake_.notify_one();
+}
+
+void Executor::Work() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      wake_.wait(lock, [&] { return stopping_ || !tasks_.empty(); });
+      // Stopping still drains the queue, so no posted task is dropped
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of threads that run posted tasks in the order they were posted.
+ *
+ * tsd runs the steps of a Timeline stream that may block here, so that they
+ * do not hold up one of gRPC's few callback threads: replaying an inbox from
+ * disk, storing and fanning out a post, and waiting for running fan-outs
+ * before the user goes online or offline. A task may run on any thread, and
+ * tasks posted one after another may run at the same time.
+ *
+ * The destructor runs every task already posted, then joins the threads.
+ */
+class Executor {
+public:
+  explicit Executor(unsigned threads);
+  ~Executor();
+
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  void Post(std::function<void()> task);
+
+private:
+  void Work();
+
+  std::mutex mu_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> tasks_;   // guarded by mu_
+  bool stopping_ = false;                      // guarded by mu_
+  std::vector<std::thread> workers_;
+};
+
+#endif
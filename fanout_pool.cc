@@ -0,0 +1,125 @@
+#include "fanout_pool.h"
+
+#include <algorithm>
+
+struct FanoutPool::Job {
+  const std::function<void(size_t, size_t)>* fn;
+  std::atomic<size_t> left;
+  std::mutex mu;
+  std::condition_variable done;
+  bool finished = false;   // guarded by mu
+};
+
+FanoutPool::FanoutPool(unsigned threads) {
+  for (unsigned i = 0; i < threads; i++) queues_.emplace_back(new Queue);
+  for (unsigned i = 0; i < threads; i++) workers_.emplace_back(&FanoutPool::Work, this, i);
+}
+
+FanoutPool::~FanoutPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto& t : workers_) t.join();
+}
+
+void FanoutPool::Run(size_t n, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+  grain = std::max<size_t>(grain, 1);
+  size_t ranges = (n + grain - 1) / grain;
+  if (ranges < 2 || queues_.empty()) {
+    inline_runs_++;
+    if (n) fn(0, n);
+    return;
+  }
+  parallel_runs_++;
+  ranges_ += ranges;
+
+  Job job;
+  job.fn = &fn;
+  job.left = ranges;
+  // Each worker is dealt a contiguous run of ranges, so followers next to
+  // each other in the list, often next to each other in memory, stay on one
+  // thread unless they are stolen
+  size_t workers = queues_.size();
+  for (size_t w = 0; w < workers; w++) {
+    size_t first = ranges * w / workers, last = ranges * (w + 1) / workers;
+    if (first == last) continue;
+    std::lock_guard<std::mutex> lock(queues_[w]->mu);
+    for (size_t r = first; r < last; r++) {
+      queues_[w]->tasks.push_back({&job, r * grain, std::min(n, (r + 1) * grain)});
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    queued_ += ranges;
+  }
+  wake_.notify_all();
+
+  Task task;
+  while (Take(workers, &task)) Execute(task);
+  std::unique_lock<std::mutex> lock(job.mu);
+  job.done.wait(lock, [&] { return job.finished; });
+}
+
+bool FanoutPool::Take(size_t self, Task* task) {
+  size_t workers = queues_.size();
+  if (self < workers) {
+    Queue& own = *queues_[self];
+    std::lock_guard<std::mutex> lock(own.mu);
+    if (!own.tasks.empty()) {
+      *task = own.tasks.back();
+      own.tasks.pop_back();
+      queued_--;
+      return true;
+    }
+  }
+  for (size_t i = 1; i <= workers; i++) {
+    size_t victim = (self + i) % (workers + 1);
+    if (victim == workers) continue;
+    Queue& q = *queues_[victim];
+    std::lock_guard<std::mutex> lock(q.mu);
+    if (q.tasks.empty()) continue;
+    *task = q.tasks.front();
+    q.tasks.pop_front();
+    queued_--;
+    // The calling thread owns no queue; only a worker's take is a steal
+    if (self < workers) stolen_++;
+    return true;
+  }
+  return false;
+}
+
+void FanoutPool::Execute(const Task& task) {
+  Job* job = task.job;
+  (*job->fn)(task.begin, task.end);
+  if (job->left.fetch_sub(1) == 1) {
+    // Run returns, and frees job, only once it sees finished, so job is not
+    // touched after the lock is released
+    std::lock_guard<std::mutex> lock(job->mu);
+    job->finished = true;
+    job->done.notify_one();
+  }
+}
+
+void FanoutPool::Work(size_t self) {
+  Task task;
+  while (true) {
+    if (Take(self, &task)) {
+      Execute(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mu_);
+    wake_.wait(lock, [&] { return stopping_ || queued_ > 0; });
+    if (stopping_) return;
+  }
+}
+
+FanoutStats FanoutPool::Stats() const {
+  FanoutStats stats;
+  stats.inline_runs = inline_runs_;
+  stats.parallel_runs = parallel_runs_;
+  stats.ranges = ranges_;
+  stats.stolen = stolen_;
+  return stats;
+}
@@ -0,0 +1,87 @@
+#ifndef FANOUT_POOL_H
+#define FANOUT_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Worker threads that fan a post out to a large follower list in parallel.
+ *
+ * Run() splits the list into ranges and deals them out, in contiguous runs,
+ * to the workers' queues. A worker takes ranges from the back of its own
+ * queue and, once that is empty, steals from the front of another's, so
+ * workers that drew cheap followers (offline ones only get an inbox
+ * reference) help those that drew expensive ones. The calling thread steals
+ * ranges too, and Run() returns only once every range is done: a post is
+ * fanned out completely before its author's next one, so followers still
+ * see an author's posts in order. Several threads may call Run() at once;
+ * each waits for its own ranges only.
+ *
+ * A list of fewer than two ranges, or any list on a pool without workers,
+ * is fanned out on the calling thread; waking workers would cost more than
+ * they save.
+ */
+
+struct FanoutStats {
+  uint64_t inline_runs = 0;     // fanned out on the calling thread alone
+  uint64_t parallel_runs = 0;
+  uint64_t ranges = 0;          // of the parallel runs
+  uint64_t stolen = 0;          // ranges a worker took from another worker's queue
+};
+
+class FanoutPool {
+public:
+  // threads workers besides the calling thread; 0 fans everything out inline
+  explicit FanoutPool(unsigned threads);
+  ~FanoutPool();
+
+  FanoutPool(const FanoutPool&) = delete;
+  FanoutPool& operator=(const FanoutPool&) = delete;
+
+  // Calls fn(begin, end) on ranges of grain items that cover [0, n), and
+  // returns once all calls have. Ranges start at multiples of grain. fn must
+  // be safe to call from several threads at once for different ranges.
+  void Run(size_t n, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+  unsigned threads() const { return static_cast<unsigned>(queues_.size()); }
+
+  FanoutStats Stats() const;
+
+private:
+  struct Job;
+  struct Task {
+    Job* job;
+    size_t begin, end;
+  };
+  struct Queue {
+    std::mutex mu;
+    std::deque<Task> tasks;
+  };
+
+  void Work(size_t self);
+  // Takes a task from the back of queue self, or steals one from the front
+  // of another queue (self == threads() for the calling thread).
+  bool Take(size_t self, Task* task);
+  void Execute(const Task& task);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  // Workers sleep on wake_ while no task is queued
+  std::mutex sleep_mu_;
+  std::condition_variable wake_;
+  std::atomic<int64_t> queued_{0};
+  bool stopping_ = false;
+
+  std::atomic<uint64_t> inline_runs_{0}, parallel_runs_{0}, ranges_{0}, stolen_{0};
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "forwarder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+using csce438::Forwarded;
+using csce438::ForwardRequest;
+using csce438::Reply;
+
+namespace {
+
+const std::chrono::milliseconds kRetry(500);
+const std::chrono::seconds kCallDeadline(5);
+
+}  // namespace
+
+struct Forwarder::Peer {
+  std::string address;
+  std::shared_ptr<grpc::Channel> channel;
+  std::unique_ptr<csce438::SNSService::Stub> stub;
+  std::deque<Forwarded> queue;
+  size_t sending = 0;      // items at the front of queue in the call in flight
+  std::map<std::string, Forwarded> missed;   // notes of dropped posts, by author
+  int held = 0;
+  grpc::ClientContext* call = nullptr;   // the Forward call in flight
+  std::thread thread;
+};
+
+Forwarder::Forwarder() = default;
+
+Forwarder::~Forwarder() { Stop(); }
+
+void Forwarder::Configure(std::string self, ChannelFactory channels) {
+  self_ = std::move(self);
+  channels_ = std::move(channels);
+}
+
+Forwarder::Peer* Forwarder::Find(const std::string& address) {
+  auto& peer = peers_[address];
+  if (!peer) {
+    peer = std::make_unique<Peer>();
+    peer->address = address;
+    peer->channel = channels_ ? channels_(address) : grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    peer->stub = csce438::SNSService::NewStub(peer->channel);
+    Peer* p = peer.get();
+    if (!stop_) p->thread = std::thread(&Forwarder::Run, this, p);
+  }
+  return peer.get();
+}
+
+void Forwarder::Send(const std::string& address, Forwarded item) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (stop_) return;
+  Peer* peer = Find(address);
+  if (peer->queue.size() >= kMaxQueued) DropOldestPost(peer);
+  peer->queue.push_back(std::move(item));
+  cv_.notify_all();
+}
+
+//Drops the oldest post not in flight into its author's note. A queue of only
+//follow changes and notes is left to grow; mu_ must be held
+void Forwarder::DropOldestPost(Peer* peer) {
+  auto it = std::find_if(peer->queue.begin() + peer->sending, peer->queue.end(),
+                         [](const Forwarded& f) { return !f.post().empty(); });
+  if (it == peer->queue.end()) return;
+  std::string author = it->author();
+  // Queued by a tsd from before author was sent along
+  if (author.empty()) {
+    csce438::Message post;
+    if (post.ParseFromString(it->post())) author = post.username();
+  }
+  auto found = peer->missed.find(author);
+  if (found == peer->missed.end()) {
+    Forwarded& note = peer->missed[author];
+    note.set_author(author);
+    note.set_home(it->home());
+    note.set_hops(it->hops());
+    note.set_missed_from(it->ordinal());
+    note.set_ordinal(it->ordinal());
+    *note.mutable_followers() = it->followers();
+  } else {
+    // A queue holds an author's posts in order, so this one is the latest
+    Forwarded& note = found->second;
+    note.set_ordinal(std::max(note.ordinal(), it->ordinal()));
+    for (const auto& f : it->followers()) {
+      if (std::find(note.followers().begin(), note.followers().end(), f) == note.followers().end()) {
+        note.add_followers(f);
+      }
+    }
+  }
+  peer->queue.erase(it);
+  stats_.dropped++;
+}
+
+void Forwarder::Hold(const std::string& address) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Find(address)->held++;
+}
+
+void Forwarder::Release(const std::string& address) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Peer* peer = Find(address);
+  if (peer->held > 0) peer->held--;
+  cv_.notify_all();
+}
+
+std::shared_ptr<grpc::Channel> Forwarder::Channel(const std::string& address) {
+  std::lock_guard<std::mutex> lock(mu_);
+  return Find(address)->channel;
+}
+
+void Forwarder::Stop() {
+  std::vector<Peer*> peers;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stop_) return;
+    stop_ = true;
+    cv_.notify_all();
+    // Peers are never removed, and none started after this has a thread.
+    // A call in flight is cancelled; its items stay queued
+    for (auto& p : peers_) {
+      peers.push_back(p.second.get());
+      if (p.second->call) p.second->call->TryCancel();
+    }
+  }
+  for (Peer* p : peers) {
+    if (p->thread.joinable()) p->thread.join();
+  }
+}
+
+void Forwarder::Restart() {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!stop_) return;
+  stop_ = false;
+  // A call Stop() cancelled may have been delivered; the receiver's cursors
+  // skip what it sees again
+  for (auto& p : peers_) p.second->thread = std::thread(&Forwarder::Run, this, p.second.get());
+}
+
+std::vector<csce438::QueuedForwards> Forwarder::Queued() {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<csce438::QueuedForwards> queued;
+  for (auto& p : peers_) {
+    if (p.second->queue.empty() && p.second->missed.empty()) continue;
+    queued.emplace_back();
+    queued.back().set_to(p.first);
+    for (const auto& item : p.second->queue) *queued.back().add_items() = item;
+    for (const auto& note : p.second->missed) *queued.back().add_items() = note.second;
+  }
+  return queued;
+}
+
+ForwarderStats Forwarder::Stats() {
+  std::lock_guard<std::mutex> lock(mu_);
+  ForwarderStats stats = stats_;
+  for (auto& p : peers_) stats.queued += p.second->queue.size();
+  return stats;
+}
+
+void Forwarder::Run(Peer* peer) {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    cv_.wait(lock, [&]() { return stop_ || (!peer->held && (!peer->queue.empty() || !peer->missed.empty())); });
+    if (stop_) return;
+    // Notes of dropped posts go out once there is room for them
+    if (!peer->missed.empty() && peer->queue.size() < kMaxQueued) {
+      for (auto& note : peer->missed) peer->queue.push_back(std::move(note.second));
+      peer->missed.clear();
+    }
+
+    ForwardRequest request;
+    request.set_from(self_);
+    size_t n = std::min(peer->queue.size(), size_t{kBatch});
+    for (size_t i = 0; i < n; i++) *request.add_items() = peer->queue[i];
+    peer->sending = n;
+    grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + kCallDeadline);
+    peer->call = &ctx;
+    lock.unlock();
+
+    Reply reply;
+    grpc::Status status = peer->stub->Forward(&ctx, request, &reply);
+
+    lock.lock();
+    peer->call = nullptr;
+    peer->sending = 0;
+    if (status.ok()) {
+      stats_.sent += n;
+      peer->queue.erase(peer->queue.begin(), peer->queue.begin() + n);
+    } else {
+      stats_.retries++;
+      cv_.wait_for(lock, kRetry, [&]() { return stop_; });
+    }
+  }
+}
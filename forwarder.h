@@ -0,0 +1,105 @@
+#ifndef FORWARDER_H
+#define FORWARDER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+/*
+ * Calls from one tsd to the others that hold users it knows of
+ * (Client::home): posts for followers that live there and follow changes
+ * made here, sent as Forward calls.
+ *
+ * Items are queued per destination and sent in order, up to kBatch per call,
+ * by one thread per destination, so fan-out never waits on another server.
+ * A failed call is retried after kRetry with everything queued behind it.
+ * The receiver remembers the last ordinal it delivered per author and
+ * sender, so a retry delivers nothing twice.
+ *
+ * At most kMaxQueued items wait per destination. A full queue makes room by
+ * dropping its oldest post, never a follow change, whose loss would leave
+ * the two servers' graphs apart for good. What was dropped is kept as one
+ * note per author: the range of ordinals and the followers they were for.
+ * The notes go out once the queue has room again, and the receiver delivers
+ * those posts from its copy of the author's log.
+ *
+ * Hold() parks a destination's queue while users are being handed over to
+ * it, so posts for them arrive after the users themselves.
+ */
+
+struct ForwarderStats {
+  uint64_t sent = 0;       // items the receivers accepted
+  uint64_t retries = 0;    // failed calls
+  uint64_t dropped = 0;    // posts dropped from a full queue, to be sent as notes
+  size_t queued = 0;       // items waiting over all destinations
+};
+
+class Forwarder {
+public:
+  using ChannelFactory = std::function<std::shared_ptr<grpc::Channel>(const std::string& address)>;
+
+  static const size_t kBatch = 256;
+  static const size_t kMaxQueued = 1 << 16;
+
+  Forwarder();
+  ~Forwarder();
+
+  Forwarder(const Forwarder&) = delete;
+  Forwarder& operator=(const Forwarder&) = delete;
+
+  // self is the address other servers reach this one at, sent along so they
+  // can record where the users named in an item live. channels opens a
+  // channel to an address (insecure TCP if unset). Call before any Send.
+  void Configure(std::string self, ChannelFactory channels = nullptr);
+  const std::string& self() const { return self_; }
+
+  // Queues item for the server at address.
+  void Send(const std::string& address, csce438::Forwarded item);
+
+  void Hold(const std::string& address);
+  void Release(const std::string& address);
+
+  // Channel to address, shared with the forwarding thread.
+  std::shared_ptr<grpc::Channel> Channel(const std::string& address);
+
+  // Stops every forwarding thread, cancelling the calls in flight; whatever
+  // is still queued is dropped.
+  void Stop();
+  // After Stop: starts forwarding again, beginning with what is still queued.
+  void Restart();
+
+  // After Stop: what is still queued, by destination, so another process
+  // can send it (handover.h).
+  std::vector<csce438::QueuedForwards> Queued();
+
+  ForwarderStats Stats();
+
+private:
+  struct Peer;
+
+  Peer* Find(const std::string& address);
+  void DropOldestPost(Peer* peer);
+  void Run(Peer* peer);
+
+  std::string self_;
+  ChannelFactory channels_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::map<std::string, std::unique_ptr<Peer>> peers_;
+  ForwarderStats stats_;
+};
+
+#endif
@@ -0,0 +1,357 @@
+#include "handover.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <grpc++/server_posix.h>
+
+#include "snapshot.h"
+#include "sns_service.h"
+
+#include <glog/logging.h>
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity);
+
+namespace {
+
+enum Type : uint32_t { kHello = 1, kSnapshot = 2, kReady = 3, kState = 4 };
+
+const size_t kHeader = 12;
+
+// How long the calls in flight get to finish at the cutover
+const std::chrono::seconds kDrainDeadline(1);
+
+// Lives as long as the call it was created for
+class CountingInterceptor : public grpc::experimental::Interceptor {
+public:
+  explicit CountingInterceptor(std::atomic<int64_t>* calls) : calls_(calls) { ++*calls_; }
+  ~CountingInterceptor() override { --*calls_; }
+  void Intercept(grpc::experimental::InterceptorBatchMethods* methods) override { methods->Proceed(); }
+
+private:
+  std::atomic<int64_t>* calls_;
+};
+
+class CountingFactory : public grpc::experimental::ServerInterceptorFactoryInterface {
+public:
+  explicit CountingFactory(std::atomic<int64_t>* calls) : calls_(calls) {}
+  grpc::experimental::Interceptor* CreateServerInterceptor(grpc::experimental::ServerRpcInfo*) override {
+    return new CountingInterceptor(calls_);
+  }
+
+private:
+  std::atomic<int64_t>* calls_;
+};
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Sends a message whose bytes are a followed by b, with pass_fd attached if
+// it is not -1
+bool WriteMessage(int fd, Type type, const std::string& a, const std::string& b = std::string(),
+                  int pass_fd = -1) {
+  char header[kHeader];
+  uint32_t t = type;
+  uint64_t length = a.size() + b.size();
+  memcpy(header, &t, 4);
+  memcpy(header + 4, &length, 8);
+
+  iovec iov = {header, kHeader};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  if (pass_fd >= 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+  }
+  ssize_t n;
+  while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+  if (n <= 0) return false;
+  return WriteAll(fd, header + n, kHeader - n) && WriteAll(fd, a.data(), a.size()) &&
+         WriteAll(fd, b.data(), b.size());
+}
+
+// Reads the next message into *body; a socket passed along with it goes to
+// *passed_fd, if given
+bool ReadMessage(int fd, Type* type, std::string* body, int* passed_fd = nullptr) {
+  char header[kHeader];
+  iovec iov = {header, kHeader};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+  if (n <= 0) return false;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    int passed;
+    memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+    if (passed_fd) *passed_fd = passed;
+    else close(passed);
+  }
+  if (!ReadAll(fd, header + n, kHeader - n)) return false;
+  uint32_t t;
+  uint64_t length;
+  memcpy(&t, header, 4);
+  memcpy(&length, header + 4, 8);
+  *type = static_cast<Type>(t);
+  body->resize(length);
+  return ReadAll(fd, &(*body)[0], length);
+}
+
+}  // namespace
+
+int ListenTcp(const std::string& host, const std::string& port) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addrs = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* a = addrs; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd < 0) continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+Acceptor::Acceptor(int fd, grpc::Server* server) : fd_(fd), server_(server) {
+  if (pipe2(wake_, O_CLOEXEC) != 0) wake_[0] = wake_[1] = -1;
+}
+
+Acceptor::~Acceptor() {
+  Stop();
+  if (wake_[0] >= 0) close(wake_[0]);
+  if (wake_[1] >= 0) close(wake_[1]);
+}
+
+void Acceptor::Start() {
+  thread_ = std::thread(&Acceptor::Run, this);
+}
+
+void Acceptor::Stop() {
+  if (!thread_.joinable()) return;
+  char b = 0;
+  if (write(wake_[1], &b, 1) != 1) {}
+  thread_.join();
+  if (read(wake_[0], &b, 1) != 1) {}
+}
+
+void Acceptor::Run() {
+  pollfd fds[2] = {{fd_, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    if (fds[1].revents) return;
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+      // Out of descriptors: let some close rather than spin
+      if (errno == EMFILE || errno == ENFILE) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    int one = 1;
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    grpc::AddInsecureChannelFromFd(server_, conn);
+  }
+}
+
+std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface> CallCounter::Factory() {
+  return std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>(new CountingFactory(&calls_));
+}
+
+bool CallCounter::WaitIdle(std::chrono::steady_clock::time_point deadline) const {
+  while (calls_ > 0) {
+    if (std::chrono::steady_clock::now() >= deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  return true;
+}
+
+std::string HandoverPath(const std::string& dir) { return dir + "/tsd.handover"; }
+
+HandoverServer::~HandoverServer() {
+  for (auto& t : shutdowns_) t.join();
+  if (fd_ >= 0) close(fd_);
+}
+
+bool HandoverServer::Open() {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) return false;
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) return false;
+  // Left by whichever tsd served here before; a successor that took over
+  // from one replaces its socket the same way
+  unlink(path_.c_str());
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd_, 1) != 0) {
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void HandoverServer::Close() {
+  if (fd_ >= 0) shutdown(fd_, SHUT_RDWR);
+}
+
+HandoverServer::Result HandoverServer::Serve(SNSServiceImpl* service, grpc::Server* server, Acceptor* acceptor,
+                                             const CallCounter* calls) {
+  while (fd_ >= 0) {
+    int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return kClosed;
+    }
+    Result result = HandOver(conn, service, server, acceptor, calls);
+    close(conn);
+    if (result != kServing) return result;
+  }
+  return kClosed;
+}
+
+HandoverServer::Result HandoverServer::HandOver(int conn, SNSServiceImpl* service, grpc::Server* server,
+                                                Acceptor* acceptor, const CallCounter* calls) {
+  Type type;
+  std::string body;
+  if (!ReadMessage(conn, &type, &body) || type != kHello) return kServing;
+
+  // 1. A checkpoint to recover from, taken and sent while still serving
+  log(INFO, "Handover: a successor connected; sending it a checkpoint");
+  Snapshot snap;
+  if (!service->BeginHandover(&snap)) {
+    log(WARNING, "Handover: cannot take a checkpoint; still serving");
+    return kServing;
+  }
+  bool ok = WriteMessage(conn, kSnapshot, EncodeSnapshotHead(snap), snap.graph);
+  snap = Snapshot();
+  if (!ok || !ReadMessage(conn, &type, &body) || type != kReady) {
+    service->EndHandover();
+    log(WARNING, "Handover: the successor went away before the cutover; still serving");
+    return kServing;
+  }
+
+  // 2. Nothing runs here any more once this is done
+  int64_t stopped = NowNs();
+  acceptor->Stop();
+  service->Drain();
+  // New calls are refused from here on, and those left at the deadline are
+  // cancelled
+  shutdowns_.emplace_back([server]() { server->Shutdown(std::chrono::system_clock::now() + kDrainDeadline); });
+  if (!calls->WaitIdle(std::chrono::steady_clock::now() + kDrainDeadline + std::chrono::milliseconds(100))) {
+    log(WARNING, "Handover: " + std::to_string(calls->calls()) + " calls still running at the cutover");
+  }
+  service->Stop();
+
+  // 3. The rest goes along with the socket
+  csce438::HandoverState state;
+  service->SaveHandoverState(&state);
+  state.set_stopped_ns(stopped);
+  std::string wire;
+  state.SerializeToString(&wire);
+  double ms = (NowNs() - stopped) / 1e6;
+  if (!WriteMessage(conn, kState, wire, std::string(), acceptor->fd())) {
+    // The listening socket is still ours, so nothing is lost by serving on
+    service->Resume();
+    log(ERROR, "Handover: the successor went away during the cutover; serving again");
+    return kResumed;
+  }
+  log(INFO, "Handover: stopped in " + std::to_string(ms) + " ms and handed over " +
+      std::to_string(state.sessions_size()) + " sessions");
+  return kHandedOver;
+}
+
+HandoverClient::~HandoverClient() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool HandoverClient::Prepare(SNSServiceImpl* service) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) return false;
+  strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0 || connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+
+  Type type;
+  std::string snapshot;
+  auto start = std::chrono::steady_clock::now();
+  if (!WriteMessage(fd_, kHello, std::string()) || !ReadMessage(fd_, &type, &snapshot) || type != kSnapshot) {
+    return false;
+  }
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  log(INFO, "Handover: received a " + std::to_string(snapshot.size() >> 20) + " MB checkpoint in " +
+      std::to_string(static_cast<int>(ms)) + " ms");
+  service->Recover(&snapshot);
+  return true;
+}
+
+int HandoverClient::Cutover(SNSServiceImpl* service) {
+  Type type;
+  std::string body;
+  int fd = -1;
+  if (!WriteMessage(fd_, kReady, std::string()) || !ReadMessage(fd_, &type, &body, &fd) || type != kState ||
+      fd < 0) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  csce438::HandoverState state;
+  if (!state.ParseFromString(body)) {
+    log(ERROR, "Handover: the state handed over is unreadable");
+  }
+  stopped_ns_ = state.stopped_ns();
+  service->TakeOver(state);
+  return fd;
+}
@@ -0,0 +1,162 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+#include <grpcpp/support/server_interceptor.h>
+
+class SNSServiceImpl;
+
+/*
+ * Replaces a running tsd with a new process, e.g. to upgrade it, without
+ * closing its port or dropping its users.
+ *
+ * tsd accepts connections itself (Acceptor) and passes each to gRPC, so its
+ * listening socket can outlive the process. The running tsd waits for a
+ * successor on a Unix socket in its data directory (HandoverPath). A
+ * successor started there with -u connects, and:
+ *
+ *   1. gets a fresh checkpoint (SNSServiceImpl::BeginHandover) and recovers
+ *      from it while the old process keeps serving;
+ *   2. says it is ready. The old process stops accepting, so connections
+ *      wait in the socket's backlog. It ends its Timeline streams with a
+ *      reconnect hint, lets the calls in flight finish (CallCounter) and
+ *      stops. Its clients' connections close once it exits;
+ *   3. gets the listening socket and what was only in memory
+ *      (HandoverState), catches up on what the old process logged after the
+ *      checkpoint, and starts accepting.
+ *
+ * The gap, from the old process's last accept to the new one's first, is
+ * the drain in 2 plus step 3. If the successor goes away before 2, the old
+ * process carries on as before. If it goes away during 3, before it has the
+ * socket, the old process starts its service again and serves on a new
+ * gRPC server from the same socket; clients reconnect as after a drain.
+ *
+ * Messages on the Unix socket are [u32 type][u64 length][bytes]; the
+ * listening socket goes along with the last one (SCM_RIGHTS).
+ */
+
+// Listens on host:port, with a backlog deep enough for the connections that
+// arrive during a handover. Returns the socket, or -1.
+int ListenTcp(const std::string& host, const std::string& port);
+
+// Passes every connection accepted on a listening socket to server.
+class Acceptor {
+public:
+  // fd stays the caller's; server must be started.
+  Acceptor(int fd, grpc::Server* server);
+  ~Acceptor();
+
+  Acceptor(const Acceptor&) = delete;
+  Acceptor& operator=(const Acceptor&) = delete;
+
+  void Start();
+  // Stops accepting. The socket stays open, and the kernel keeps queuing
+  // connections on it.
+  void Stop();
+
+  int fd() const { return fd_; }
+
+private:
+  void Run();
+
+  int fd_;
+  grpc::Server* server_;
+  int wake_[2] = {-1, -1};
+  std::thread thread_;
+};
+
+// Counts the calls a server is running. gRPC's Shutdown() also waits for
+// every client to close its connection, which an idle one only does on its
+// next call; a handover waits for the calls alone.
+class CallCounter {
+public:
+  // For ServerBuilder::experimental().SetInterceptorCreators
+  std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface> Factory();
+
+  // Waits until no call is running, or until deadline. Returns whether none is.
+  bool WaitIdle(std::chrono::steady_clock::time_point deadline) const;
+
+  int64_t calls() const { return calls_; }
+
+private:
+  std::atomic<int64_t> calls_{0};
+};
+
+// The Unix socket a tsd serving dir waits for its successor on
+std::string HandoverPath(const std::string& dir);
+
+// The running tsd's side.
+class HandoverServer {
+public:
+  explicit HandoverServer(std::string path) : path_(std::move(path)) {}
+  ~HandoverServer();
+
+  HandoverServer(const HandoverServer&) = delete;
+  HandoverServer& operator=(const HandoverServer&) = delete;
+
+  // Starts listening for a successor. Returns false if it cannot.
+  bool Open();
+
+  enum Result {
+    kClosed,       // Close() was called
+    kServing,      // the successor went away before the cutover; nothing changed
+    kHandedOver,   // service is stopped and server shutting down
+    kResumed,      // the successor went away during the cutover: server is
+                   // shutting down, but service runs again
+  };
+
+  // Waits for a successor and hands service, which server runs with
+  // connections from acceptor and calls counted by calls, over to it.
+  // Returns kHandedOver once it has. kResumed leaves acceptor stopped with
+  // its socket open; the caller serves service on a new server from it and
+  // calls Serve again. Never returns kServing.
+  Result Serve(SNSServiceImpl* service, grpc::Server* server, Acceptor* acceptor, const CallCounter* calls);
+
+  void Close();
+
+private:
+  Result HandOver(int conn, SNSServiceImpl* service, grpc::Server* server, Acceptor* acceptor,
+                  const CallCounter* calls);
+
+  std::string path_;
+  int fd_ = -1;
+  // One per cutover: runs server->Shutdown(), which returns once the
+  // clients are gone
+  std::vector<std::thread> shutdowns_;
+};
+
+// The successor's side.
+class HandoverClient {
+public:
+  explicit HandoverClient(std::string path) : path_(std::move(path)) {}
+  ~HandoverClient();
+
+  HandoverClient(const HandoverClient&) = delete;
+  HandoverClient& operator=(const HandoverClient&) = delete;
+
+  // Connects to the running tsd and recovers service from the checkpoint it
+  // sends. Returns false if there is no tsd to take over from.
+  bool Prepare(SNSServiceImpl* service);
+
+  // Has the running tsd stop, and takes over its state into service. Returns
+  // the listening socket, or -1 if the old tsd went away first.
+  int Cutover(SNSServiceImpl* service);
+
+  // When the old tsd stopped accepting, in steady clock nanoseconds
+  int64_t stopped_ns() const { return stopped_ns_; }
+
+private:
+  std::string path_;
+  int fd_ = -1;
+  int64_t stopped_ns_ = 0;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "home_timeline.h"
+
+#include <algorithm>
+
+namespace {
+
+// Most records read from one followee's log at a time
+const size_t kBatch = 64;
+
+struct Cursor {
+  size_t source;
+  size_t rank;                        // position of the username in sorted order
+  TimelineRange range;
+  bool done = false;                  // the log has nothing more in range
+  std::vector<TimelineRecord> buf;    // newest first
+  size_t pos = 0;
+
+  const TimelineRecord& head() const { return buf[pos]; }
+};
+
+// Heap order: the newest head on top
+bool Older(const Cursor* a, const Cursor* b) {
+  const TimelineRecord& x = a->head();
+  const TimelineRecord& y = b->head();
+  if (x.time != y.time) return x.time < y.time;
+  if (a->rank != b->rank) return a->rank < b->rank;
+  return x.ordinal < y.ordinal;
+}
+
+void Fetch(TimelineStore& store, const std::string& username, Cursor* c, size_t n) {
+  c->buf.clear();
+  c->pos = 0;
+  if (c->done) return;
+  c->range.limit = n;
+  c->range.cursor = store.ScanBack(username, c->range, &c->buf);
+  c->done = c->range.cursor == 0;
+}
+
+}  // namespace
+
+bool BuildHomePage(TimelineStore& store, const std::vector<HomeSource>& sources,
+                   const HomePosition* from, size_t limit, std::vector<HomeEntry>* out,
+                   HomePosition* next) {
+  if (limit == 0 || sources.empty()) return false;
+
+  std::vector<size_t> by_name(sources.size());
+  for (size_t i = 0; i < by_name.size(); i++) by_name[i] = i;
+  std::sort(by_name.begin(), by_name.end(),
+            [&](size_t a, size_t b) { return sources[a].username < sources[b].username; });
+
+  // Enough of each log up front that a page over few followees rarely needs
+  // a second read, and one record each when there are many.
+  size_t first = std::min(kBatch, std::max<size_t>(1, limit / sources.size() + 1));
+
+  std::vector<Cursor> cursors(sources.size());
+  std::vector<Cursor*> heap;
+  heap.reserve(sources.size());
+  for (size_t r = 0; r < by_name.size(); r++) {
+    size_t i = by_name[r];
+    Cursor& c = cursors[r];
+    c.source = i;
+    c.rank = r;
+    c.range.since = sources[i].since;
+    if (from && !from->username.empty()) {
+      // Resume strictly after *from in (time, username, ordinal) order
+      int cmp = sources[i].username.compare(from->username);
+      c.range.until = cmp > 0 ? from->time - 1 : from->time;
+      if (cmp == 0) c.range.cursor = from->ordinal;
+      if (c.range.until <= 0 || (cmp == 0 && from->ordinal == 0)) continue;
+    }
+    Fetch(store, sources[i].username, &c, first);
+    if (!c.buf.empty()) heap.push_back(&c);
+  }
+  std::make_heap(heap.begin(), heap.end(), Older);
+
+  size_t taken = 0;
+  while (taken < limit && !heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), Older);
+    Cursor* c = heap.back();
+    heap.pop_back();
+    out->push_back({c->source, std::move(c->buf[c->pos++])});
+    taken++;
+    if (c->pos == c->buf.size()) {
+      // One more than the rest of the page, so there is still a head to say
+      // whether anything follows it
+      Fetch(store, sources[c->source].username, c, std::min(kBatch, limit - taken + 1));
+    }
+    if (c->pos < c->buf.size()) {
+      heap.push_back(c);
+      std::push_heap(heap.begin(), heap.end(), Older);
+    }
+  }
+
+  if (heap.empty() || taken == 0) return false;
+  const HomeEntry& last = out->back();
+  next->time = last.record.time;
+  next->username = sources[last.source].username;
+  next->ordinal = last.record.ordinal;
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef HOME_TIMELINE_H
+#define HOME_TIMELINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "timeline_store.h"
+
+/*
+ * Fan-out-on-read home timeline: a page of the posts of everyone a user
+ * follows, newest first, assembled at read time from the followees' own
+ * TimelineStore logs instead of from a per-user feed written at post time.
+ *
+ * Each followee's log is read backwards in small batches and the heads meet
+ * in a max-heap, so a page touches about limit + (followees) records however
+ * long the logs are, and stops as soon as limit posts are out. A followee
+ * contributes only posts made at or after the time they were followed.
+ *
+ * Posts are ordered by (time, author username, ordinal), descending; that
+ * triple of the last post on a page is the cursor for the next one.
+ */
+
+struct HomeSource {
+  std::string username;
+  int64_t since = 0;       // follow time, seconds; 0 = unbounded
+};
+
+struct HomePosition {
+  int64_t time = 0;
+  std::string username;    // empty = start from the newest post
+  uint64_t ordinal = 0;
+};
+
+struct HomeEntry {
+  size_t source;           // index into the sources passed in
+  TimelineRecord record;
+};
+
+// Collects up to limit posts of sources that come after *from (or from the
+// newest, if from is null) into out. Sets *next and returns true if more
+// posts remain after the page.
+bool BuildHomePage(TimelineStore& store, const std::vector<HomeSource>& sources,
+                   const HomePosition* from, size_t limit, std::vector<HomeEntry>* out,
+                   HomePosition* next);
+
+#endif
@@ -0,0 +1,264 @@
+#include "inbox_store.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct InboxStore::Inbox {
+  std::string path;
+  uint64_t base = 0;      // position of the first reference in the file
+  uint64_t cursor = 0;    // first undelivered position
+  uint64_t written = 0;   // end of the references on disk
+  uint64_t end = 0;       // end including the buffered references
+  std::string buffer;     // references appended since the last flush
+  bool header_dirty = false;
+  bool listed = false;    // already in its shard's dirty list
+  bool exists = false;    // file is on disk
+};
+
+namespace {
+
+bool WriteHeader(int fd, uint64_t base, uint64_t cursor) {
+  uint64_t header[2] = {base, cursor};
+  return pwrite(fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+}
+
+}  // namespace
+
+InboxStore::InboxStore(std::string root) : root_(std::move(root)) {}
+
+InboxStore::~InboxStore() { Flush(); }
+
+InboxStore::Inbox* InboxStore::Open(Shard& shard, const std::string& username) {
+  auto it = shard.inboxes.find(username);
+  if (it != shard.inboxes.end()) return it->second.get();
+
+  auto in = std::make_unique<Inbox>();
+  in->path = root_ + "/" + username + ".inbox";
+
+  int fd = open(in->path.c_str(), O_RDWR);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) >= kHeader) {
+    uint64_t header[2];
+    if (pread(fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))) {
+      uint64_t refs = (st.st_size - kHeader) / kRefBytes;
+      // Drop a reference that was only partially written before a crash.
+      if (kHeader + refs * kRefBytes != static_cast<uint64_t>(st.st_size)) {
+        if (ftruncate(fd, kHeader + refs * kRefBytes) != 0) refs = 0;
+      }
+      in->base = header[0];
+      in->written = in->end = in->base + refs;
+      in->cursor = std::min(std::max(header[1], in->base), in->end);
+      in->exists = true;
+    }
+  }
+  if (fd >= 0) close(fd);
+
+  Inbox* raw = in.get();
+  shard.inboxes[username] = std::move(in);
+  return raw;
+}
+
+void InboxStore::Dirty(Shard& shard, Inbox* in) {
+  if (in->listed) return;
+  in->listed = true;
+  shard.dirty.push_back(in);
+}
+
+void InboxStore::Compact(Inbox* in) {
+  // Rewrite only the undelivered references, then swap the file in. Once
+  // the cursor is past what was written, the oldest buffered references
+  // were dropped for a full inbox too, and nothing on disk is kept.
+  std::string live;
+  if (in->cursor < in->written) {
+    int fd = open(in->path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    live.resize((in->written - in->cursor) * kRefBytes);
+    off_t at = kHeader + (in->cursor - in->base) * kRefBytes;
+    bool ok = pread(fd, &live[0], live.size(), at) == static_cast<ssize_t>(live.size());
+    close(fd);
+    if (!ok) return;
+    live += in->buffer;
+  } else {
+    live.assign(in->buffer, (in->cursor - in->written) * kRefBytes, std::string::npos);
+  }
+
+  std::string tmp = in->path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  bool ok = WriteHeader(fd, in->cursor, in->cursor) &&
+            pwrite(fd, live.data(), live.size(), kHeader) == static_cast<ssize_t>(live.size());
+  close(fd);
+  if (!ok || rename(tmp.c_str(), in->path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+  in->base = in->cursor;
+  in->written = in->base + live.size() / kRefBytes;
+  in->buffer.clear();
+  in->header_dirty = false;
+  in->exists = true;
+}
+
+void InboxStore::FlushInbox(Inbox* in) {
+  if (in->buffer.empty() && !in->header_dirty) return;
+
+  if (in->cursor - in->base > kMaxPending && in->cursor < in->end) {
+    Compact(in);
+    return;
+  }
+
+  int fd = open(in->path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return;
+  if (in->cursor == in->end) {
+    // Fully delivered: shrink back to a bare header.
+    in->base = in->written = in->end;
+    in->buffer.clear();
+    if (ftruncate(fd, kHeader) == 0 && WriteHeader(fd, in->base, in->cursor)) {
+      in->header_dirty = false;
+      in->exists = true;
+    } else {
+      in->header_dirty = true;
+    }
+  } else {
+    off_t at = kHeader + (in->written - in->base) * kRefBytes;
+    if (!in->exists || in->header_dirty) {
+      in->header_dirty = !WriteHeader(fd, in->base, in->cursor);
+      if (!in->header_dirty) in->exists = true;
+    }
+    // References go only into a file whose header is on disk
+    if (in->exists && !in->buffer.empty() &&
+        pwrite(fd, in->buffer.data(), in->buffer.size(), at) == static_cast<ssize_t>(in->buffer.size())) {
+      in->written = in->end;
+      in->buffer.clear();
+    }
+  }
+  close(fd);
+}
+
+void InboxStore::Append(const std::string& username, const InboxRef& ref) {
+  Shard& shard = ShardOf(username);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  AppendLocked(shard, username, ref);
+}
+
+void InboxStore::Append(const std::vector<std::string>& usernames, const InboxRef& ref) {
+  static_assert(kShards <= 32, "shards are tracked in a 32-bit mask");
+  std::vector<uint8_t> shard_of(usernames.size());
+  uint32_t used = 0;
+  for (size_t i = 0; i < usernames.size(); i++) {
+    shard_of[i] = static_cast<uint8_t>(ShardIndex(usernames[i]));
+    used |= 1u << shard_of[i];
+  }
+  for (size_t s = 0; s < kShards; s++) {
+    if (!(used >> s & 1)) continue;
+    std::lock_guard<std::mutex> lock(shards_[s].mu);
+    for (size_t i = 0; i < usernames.size(); i++) {
+      if (shard_of[i] == s) AppendLocked(shards_[s], usernames[i], ref);
+    }
+  }
+}
+
+void InboxStore::AppendLocked(Shard& shard, const std::string& username, const InboxRef& ref) {
+  Inbox* in = Open(shard, username);
+  in->buffer.append(reinterpret_cast<const char*>(&ref), kRefBytes);
+  in->end++;
+  if (in->end - in->cursor > kMaxPending) {
+    // Full: the oldest reference gives way. The post itself is still in the
+    // author's log and reachable through GetTimeline.
+    in->cursor++;
+    in->header_dirty = true;
+    dropped_++;
+  }
+  Dirty(shard, in);
+}
+
+void InboxStore::Flush() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    for (auto in : shard.dirty) {
+      FlushInbox(in);
+      in->listed = false;
+    }
+    shard.dirty.clear();
+    // Kept while anything failed to reach disk
+    for (const auto& username : shard.evicted) {
+      auto it = shard.inboxes.find(username);
+      if (it != shard.inboxes.end() && it->second->buffer.empty() && !it->second->header_dirty) {
+        shard.inboxes.erase(it);
+      }
+    }
+    shard.evicted.clear();
+  }
+}
+
+uint64_t InboxStore::Read(const std::string& username, uint64_t from, size_t max,
+                          std::vector<InboxRef>* out) {
+  Shard& shard = ShardOf(username);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  Inbox* in = Open(shard, username);
+  FlushInbox(in);
+
+  from = std::max(from, in->cursor);
+  if (from >= in->written) return from;
+  uint64_t n = std::min<uint64_t>(max, in->written - from);
+
+  int fd = open(in->path.c_str(), O_RDONLY);
+  if (fd < 0) return from;
+  size_t old = out->size();
+  out->resize(old + n);
+  off_t at = kHeader + (from - in->base) * kRefBytes;
+  ssize_t got = pread(fd, &(*out)[old], n * kRefBytes, at);
+  close(fd);
+  n = got > 0 ? got / kRefBytes : 0;
+  out->resize(old + n);
+  return from + n;
+}
+
+uint64_t InboxStore::Cursor(const std::string& username) {
+  Shard& shard = ShardOf(username);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  return Open(shard, username)->cursor;
+}
+
+void InboxStore::Commit(const std::string& username, uint64_t pos) {
+  Shard& shard = ShardOf(username);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  Inbox* in = Open(shard, username);
+  pos = std::min(pos, in->end);
+  if (pos <= in->cursor) return;
+  in->cursor = pos;
+  in->header_dirty = true;
+  Dirty(shard, in);
+}
+
+void InboxStore::Evict(const std::string& username) {
+  Shard& shard = ShardOf(username);
+  std::lock_guard<std::mutex> lock(shard.mu);
+  auto it = shard.inboxes.find(username);
+  if (it == shard.inboxes.end()) return;
+  Inbox* in = it->second.get();
+  FlushInbox(in);
+  // One still listed as dirty goes with the next Flush()
+  if (in->listed) shard.evicted.push_back(username);
+  else if (in->buffer.empty() && !in->header_dirty) shard.inboxes.erase(it);
+}
+
+InboxStats InboxStore::Stats() {
+  InboxStats stats;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    for (const auto& entry : shard.inboxes) {
+      const Inbox* in = entry.second.get();
+      uint64_t pending = in->end - in->cursor;
+      if (pending) stats.inboxes++;
+      stats.pending += pending;
+      if (in->exists) stats.disk_bytes += kHeader + (in->written - in->base) * kRefBytes;
+    }
+  }
+  stats.dropped = dropped_;
+  return stats;
+}
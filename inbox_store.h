@@ -0,0 +1,115 @@
+#ifndef INBOX_STORE_H
+#define INBOX_STORE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * InboxStore keeps, for every follower that was offline when a post was made,
+ * an append-only list of references to the posts it missed plus a read cursor.
+ *
+ * Layout: <root>/<username>.inbox
+ *   [u64 base][u64 cursor]            header
+ *   [u32 author][u32 reserved][u64 ordinal] ...   16 bytes per reference
+ *
+ * Positions are logical and never reused: the first reference in the file is
+ * at position base, and everything before cursor has been delivered. A caught
+ * up inbox shrinks back to its header, and at most kMaxPending references are
+ * kept per user, so an inbox never costs more than 16 bytes * kMaxPending
+ * (plus an equal dead prefix awaiting compaction) on disk.
+ *
+ * Appends are buffered in memory and written by Flush(), which tsd calls a
+ * few times a second; Read() flushes the user's buffer first.
+ *
+ * Inboxes are spread over kShards shards by username, each with its own
+ * lock, so a post's fan-out can append to many inboxes from several threads
+ * at once (fanout_pool.h).
+ */
+
+struct InboxRef {
+  uint32_t author = 0;     // Client::id of the poster
+  uint32_t reserved = 0;
+  uint64_t ordinal = 0;    // position of the post in the author's TimelineStore log
+};
+
+struct InboxStats {
+  size_t inboxes = 0;      // inboxes with undelivered references
+  uint64_t pending = 0;    // undelivered references across all inboxes
+  uint64_t disk_bytes = 0; // size of all inbox files, headers included
+  uint64_t dropped = 0;    // references discarded because an inbox was full
+};
+
+class InboxStore {
+public:
+  static const size_t kHeader = 16;
+  static const size_t kRefBytes = sizeof(InboxRef);
+  static const uint64_t kMaxPending = 1 << 20;
+  static const size_t kShards = 16;
+
+  explicit InboxStore(std::string root = ".");
+  ~InboxStore();
+
+  InboxStore(const InboxStore&) = delete;
+  InboxStore& operator=(const InboxStore&) = delete;
+
+  // Adds ref to username's inbox. Cheap: only buffers it in memory.
+  void Append(const std::string& username, const InboxRef& ref);
+  // Adds ref to the inbox of each of usernames, taking each shard's lock
+  // once for all of its names rather than once per name.
+  void Append(const std::vector<std::string>& usernames, const InboxRef& ref);
+
+  // Writes every buffered reference, and any moved cursor, to disk.
+  void Flush();
+
+  // Collects up to max references of username's inbox starting at position
+  // from (or at the cursor, if that is further). Returns the position after
+  // the last reference collected.
+  uint64_t Read(const std::string& username, uint64_t from, size_t max,
+                std::vector<InboxRef>* out);
+
+  // Position of the first undelivered reference.
+  uint64_t Cursor(const std::string& username);
+
+  // Marks everything before pos as delivered.
+  void Commit(const std::string& username, uint64_t pos);
+
+  // Writes username's inbox out and forgets it until it is used again.
+  void Evict(const std::string& username);
+
+  InboxStats Stats();
+
+  const std::string& root() const { return root_; }
+
+private:
+  struct Inbox;
+
+  struct Shard {
+    std::mutex mu;
+    std::unordered_map<std::string, std::unique_ptr<Inbox>> inboxes;
+    std::vector<Inbox*> dirty;
+    std::vector<std::string> evicted;   // to forget once flushed
+  };
+
+  static size_t ShardIndex(const std::string& username) {
+    return std::hash<std::string>()(username) % kShards;
+  }
+  Shard& ShardOf(const std::string& username) { return shards_[ShardIndex(username)]; }
+  // The shard's lock must be held
+  Inbox* Open(Shard& shard, const std::string& username);
+  void AppendLocked(Shard& shard, const std::string& username, const InboxRef& ref);
+  void FlushInbox(Inbox* in);
+  void Compact(Inbox* in);
+  void Dirty(Shard& shard, Inbox* in);
+
+  std::string root_;
+  Shard shards_[kShards];
+  std::atomic<uint64_t> dropped_{0};
+};
+
+#endif
@@ -0,0 +1,83 @@
+// Operator tool: moves users to another cluster while they stay online.
+//
+//   ./migrate -h <coordinator host> -k <coordinator port> -c <cluster> [-b <batch>] <user id> ...
+//
+// -h may list several coordinators like tsc's; the first that answers takes
+// the request (a replica passes it on to the leader). Ids may also be given
+// as ranges, e.g. 1-3000.
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "coord_service.h"
+#include "coordinator.grpc.pb.h"
+
+using csce438::CoordService;
+using csce438::MoveUsersReply;
+using csce438::MoveUsersRequest;
+
+// Adds the ids in arg ("7" or "1-3000") to request
+bool addUsers(const std::string& arg, MoveUsersRequest* request) {
+    size_t dash = arg.find('-', 1);
+    int first = atoi(arg.c_str());
+    int last = dash == std::string::npos ? first : atoi(arg.c_str() + dash + 1);
+    if (first <= 0 || last < first) return false;
+    for (int id = first; id <= last; id++) request->add_users(id);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string hostname = "localhost";
+    std::string port = "9090";
+    MoveUsersRequest request;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:k:c:b:")) != -1) {
+        switch (opt) {
+            case 'h': hostname = optarg; break;
+            case 'k': port = optarg; break;
+            case 'c': request.set_cluster(atoi(optarg)); break;
+            case 'b': request.set_batch(atoi(optarg)); break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+                return 2;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!addUsers(argv[i], &request)) {
+            std::cerr << "Not a user id or range: " << argv[i] << std::endl;
+            return 2;
+        }
+    }
+    if (request.cluster() < 1 || request.cluster() > 3 || request.users_size() == 0) {
+        std::cerr << "usage: " << argv[0] << " -h host -k port -c cluster [-b batch] id|first-last ..." << std::endl;
+        return 2;
+    }
+
+    grpc::Status status;
+    MoveUsersReply reply;
+    for (const auto& addr : coordinatorAddresses(hostname, port)) {
+        auto stub = CoordService::NewStub(grpc::CreateChannel(addr, grpc::InsecureChannelCredentials()));
+        grpc::ClientContext ctx;
+        reply.Clear();
+        status = stub->Migrate(&ctx, request, &reply);
+        if (status.ok() || status.error_code() != grpc::StatusCode::UNAVAILABLE) break;
+        std::cerr << "Coordinator " << addr << " unreachable: " << status.error_message() << std::endl;
+    }
+    if (!status.ok()) {
+        std::cerr << "Migration failed: " << status.error_message() << std::endl;
+        return 1;
+    }
+    std::cout << "Moved " << reply.moved() << " users to cluster " << request.cluster() << " ("
+              << reply.posts() << " posts, " << reply.inbox() << " undelivered)" << std::endl;
+    if (reply.failed()) {
+        std::cout << reply.failed() << " users stayed where they were: " << reply.error() << std::endl;
+        return 1;
+    }
+    return 0;
+}
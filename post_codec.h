@@ -0,0 +1,43 @@
+#ifndef POST_CODEC_H
+#define POST_CODEC_H
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Compact encoding of Timeline traffic, for readers that ask for it with
+ * "post-encoding" metadata naming kPostEncoding.
+ *
+ * A frame holds one or more serialized Messages, each behind a varint length,
+ * compressed with raw deflate against a hand-picked preset dictionary of
+ * words and phrases common in posts. A single short post has too little text to
+ * compress on its own; with the dictionary its words become back-references.
+ * A replay of many posts packs them into frames of up to kFrameBytes, where
+ * they also compress against each other.
+ *
+ * The dictionary is compiled into both tsc and tsd. Changing it means a new
+ * encoding name, so that readers and servers built with different ones fall
+ * back to plain Messages instead of misreading each other.
+ */
+
+// The encoding name readers send and servers look for
+extern const char kPostEncoding[];
+
+// Messages per frame stop being added once it holds this many bytes
+const size_t kFrameBytes = 64 << 10;
+
+// Appends one serialized message to the contents of a frame.
+void AppendToFrame(std::string* raw, const char* data, size_t size);
+
+// Compresses frame contents into *frame. Returns false if zlib fails.
+bool PackFrame(const std::string& raw, std::string* frame);
+
+// Restores the contents of a frame. Returns false if it is corrupt.
+bool UnpackFrame(const std::string& frame, std::string* raw);
+
+// Steps through frame contents from *pos: points *data and *size at the next
+// message and moves *pos past it. Returns false at the end, or at an entry
+// that runs past it.
+bool NextInFrame(const std::string& raw, size_t* pos, const char** data, size_t* size);
+
+#endif
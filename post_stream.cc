@@ -0,0 +1,145 @@
+#include "post_stream.h"
+
+#include <utility>
+
+#include <grpcpp/support/slice.h>
+
+#include "post_codec.h"
+#include "sns.pb.h"
+#include "trace.h"
+
+OutgoingPost::OutgoingPost(const std::string& wire, uint32_t author)
+    : wire_(wire), author_(author), plain_(SharedBuffer(wire)) {}
+
+const std::shared_ptr<const grpc::ByteBuffer>& OutgoingPost::packed() {
+  std::call_once(packed_once_, [this] {
+    csce438::Message post;
+    if (!post.ParseFromString(wire_)) return;
+    csce438::Message name;
+    name.set_author(author_);
+    name.set_username(post.username());
+    post.clear_username();
+    post.set_author(author_);
+    std::string raw, frame;
+    std::string bytes = post.SerializeAsString();
+    AppendToFrame(&raw, bytes.data(), bytes.size());
+    if (!PackFrame(raw, &frame)) return;
+    csce438::Message packed;
+    packed.set_packed(frame);
+    packed_ = SerializeShared(packed);
+    name_ = SerializeShared(name);
+  });
+  return packed_;
+}
+
+bool PostStream::Queue(std::shared_ptr<const grpc::ByteBuffer> buf, uint64_t trace_id, bool live) {
+  Pending p{std::move(buf), trace_id, trace_id ? Tracer::Now() : 0};
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_) return false;
+    // Drained as Drain does: what is queued is still in order ahead of
+    // whatever the client catches up on
+    if (live && writing_ && queue_.size() >= kMaxQueued) {
+      closed_ = true;
+      overflowed_ = true;
+      status_ = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Stream fell behind; reconnect to catch up");
+      return false;
+    }
+    accepted_++;
+    if (backlog_) backlog_->fetch_add(1, std::memory_order_relaxed);
+    if (writing_) {
+      queue_.push_back(std::move(p));
+      return true;
+    }
+    writing_ = true;
+    current_ = std::move(p);
+  }
+  StartSend(current_.buf.get());
+  return true;
+}
+
+void PostStream::SendDone(bool ok) {
+  std::unique_lock<std::mutex> lock(mu_);
+  if (current_.trace_id) Tracer::Record("tsd.deliver", current_.trace_id, current_.queued_ns, Tracer::Now());
+  current_ = Pending();
+  Release(1);
+  if (ok) written_++;
+  // A drained stream ends once its queue is out
+  if (closed_ && (!ok || queue_.empty())) {
+    Release(queue_.size());
+    queue_.clear();
+    writing_ = false;
+    grpc::Status status = status_;
+    lock.unlock();
+    EndStream(status);
+    return;
+  }
+  // A failed write means the peer is gone; the read side will Close us.
+  if (!ok) {
+    Release(queue_.size());
+    queue_.clear();
+  }
+  if (queue_.empty()) {
+    writing_ = false;
+    return;
+  }
+  current_ = std::move(queue_.front());
+  queue_.pop_front();
+  lock.unlock();
+  StartSend(current_.buf.get());
+}
+
+void PostStream::Close(grpc::Status status) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_) return;
+    closed_ = true;
+    Release(queue_.size());
+    queue_.clear();
+    status_ = status;
+    // The write in flight finishes the stream from SendDone.
+    if (writing_) return;
+  }
+  EndStream(status);
+}
+
+void PostStream::Drain(grpc::Status status) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_) return;
+    closed_ = true;
+    status_ = status;
+    // Anything queued sits behind a write in flight, which goes on from SendDone
+    if (writing_) return;
+  }
+  EndStream(status);
+}
+
+size_t PostStream::queued() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return queue_.size();
+}
+
+bool PostStream::overflowed() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return overflowed_;
+}
+
+uint64_t PostStream::accepted() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return accepted_;
+}
+
+uint64_t PostStream::written() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return written_;
+}
+
+std::shared_ptr<const grpc::ByteBuffer> SharedBuffer(const std::string& wire) {
+  grpc::Slice slice(wire);
+  return std::make_shared<const grpc::ByteBuffer>(&slice, 1);
+}
+
+std::shared_ptr<const grpc::ByteBuffer> SerializeShared(const google::protobuf::MessageLite& msg) {
+  return SharedBuffer(msg.SerializeAsString());
+}
@@ -0,0 +1,146 @@
+#ifndef POST_STREAM_H
+#define POST_STREAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <google/protobuf/message_lite.h>
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/status.h>
+
+/*
+ * A post on its way to its followers' streams. Each encoding of it is built at
+ * most once, by whichever stream needs it first, and shared by all of them.
+ */
+class OutgoingPost {
+public:
+  // wire is the serialized Message and must outlive this. author is a nonzero
+  // token for the poster, the same for all its posts on this server.
+  OutgoingPost(const std::string& wire, uint32_t author);
+
+  const std::shared_ptr<const grpc::ByteBuffer>& plain() const { return plain_; }
+
+  // The post as a packed frame (post_codec.h), with its username replaced by
+  // author; null if it could not be packed. Safe to call from any thread.
+  const std::shared_ptr<const grpc::ByteBuffer>& packed();
+  // The frame that names author, for streams that have not seen it yet;
+  // built by packed()
+  const std::shared_ptr<const grpc::ByteBuffer>& name() const { return name_; }
+
+  uint32_t author() const { return author_; }
+
+private:
+  const std::string& wire_;
+  uint32_t author_;
+  std::shared_ptr<const grpc::ByteBuffer> plain_;
+  std::once_flag packed_once_;
+  std::shared_ptr<const grpc::ByteBuffer> packed_, name_;
+};
+
+/*
+ * Outbound half of a Timeline stream.
+ *
+ * Posts are serialized once into a shared, ref-counted ByteBuffer and that
+ * same buffer is queued on every follower's PostStream. Each stream keeps at
+ * most one write in flight; Send() only queues, so fan-out never blocks on a
+ * slow follower.
+ *
+ * A live post is queued only while fewer than kMaxQueued buffers wait. A
+ * follower that falls that far behind has its stream drained and ended with
+ * RESOURCE_EXHAUSTED, and the posts refused are left in its inbox for the
+ * client to catch up from when it reconnects.
+ */
+class PostStream {
+public:
+  static const size_t kMaxQueued = 4096;
+
+  virtual ~PostStream() = default;
+
+  // Queues buf behind any write in flight. Safe to call from any thread.
+  // A nonzero trace_id records the time from here until the write completes
+  // as a "tsd.deliver" span (trace.h). Returns false if the stream is closed.
+  bool Send(std::shared_ptr<const grpc::ByteBuffer> buf, uint64_t trace_id = 0) {
+    return Queue(std::move(buf), trace_id, false);
+  }
+
+  // Like Send, for a live post: if kMaxQueued buffers already wait, closes
+  // the stream instead and returns false. Replayed posts, acks and resume
+  // tokens, which have nowhere else to go, use Send.
+  bool SendLive(std::shared_ptr<const grpc::ByteBuffer> buf, uint64_t trace_id = 0) {
+    return Queue(std::move(buf), trace_id, true);
+  }
+
+  // Queues post in the encoding this stream uses: plain, unless a subclass
+  // negotiated another with its reader. Returns false as SendLive does.
+  virtual bool SendPost(OutgoingPost* post, uint64_t trace_id = 0) { return SendLive(post->plain(), trace_id); }
+
+  // Drops whatever is still queued and ends the stream with status once no
+  // write is in flight. Later Sends are ignored.
+  void Close(grpc::Status status);
+
+  // Like Close, but whatever is already queued is still written first.
+  void Drain(grpc::Status status);
+
+  // Buffers waiting behind the write in flight.
+  size_t queued() const;
+
+  // Whether the stream was closed for going over kMaxQueued.
+  bool overflowed() const;
+
+  // Buffers accepted by Send, and buffers written successfully, so far. Once
+  // written() reaches an earlier accepted(), everything sent up to then is out.
+  uint64_t accepted() const;
+  uint64_t written() const;
+
+  // Keeps *counter up by the buffers this stream holds (queued or in flight),
+  // so one counter can track the backlog of many streams. Set before the
+  // first Send.
+  void set_backlog_counter(std::atomic<int64_t>* counter) { backlog_ = counter; }
+
+protected:
+  // Starts writing buf; the transport calls SendDone when it completes.
+  virtual void StartSend(const grpc::ByteBuffer* buf) = 0;
+  // Ends the underlying stream; called exactly once, after Close.
+  virtual void EndStream(grpc::Status status) = 0;
+
+  void SendDone(bool ok);
+
+private:
+  bool Queue(std::shared_ptr<const grpc::ByteBuffer> buf, uint64_t trace_id, bool live);
+
+  void Release(int64_t n) {
+    if (backlog_ && n) backlog_->fetch_sub(n, std::memory_order_relaxed);
+  }
+
+  struct Pending {
+    std::shared_ptr<const grpc::ByteBuffer> buf;
+    uint64_t trace_id = 0;
+    int64_t queued_ns = 0;   // only for traced buffers
+  };
+
+  std::atomic<int64_t>* backlog_ = nullptr;
+  mutable std::mutex mu_;
+  std::deque<Pending> queue_;
+  Pending current_;
+  uint64_t accepted_ = 0;
+  uint64_t written_ = 0;
+  bool writing_ = false;
+  bool closed_ = false;
+  bool overflowed_ = false;
+  grpc::Status status_;
+};
+
+// Wraps already-serialized bytes in a buffer that can be queued on any number
+// of streams.
+std::shared_ptr<const grpc::ByteBuffer> SharedBuffer(const std::string& wire);
+
+// Serializes msg into a buffer that can be queued on any number of streams.
+std::shared_ptr<const grpc::ByteBuffer> SerializeShared(const google::protobuf::MessageLite& msg);
+
+#endif
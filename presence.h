@@ -0,0 +1,40 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Bitmap of online users indexed by user id: one bit per registered user,
+ * so a server with a million users spends 128 KB on presence. Not thread
+ * safe; tsd guards it with the same mutex as the rest of the user directory.
+ */
+class OnlineSet {
+public:
+  void Set(uint32_t id) {
+    if (id / 64 >= words_.size()) words_.resize(id / 64 + 1, 0);
+    uint64_t bit = 1ull << (id % 64);
+    if (!(words_[id / 64] & bit)) count_++;
+    words_[id / 64] |= bit;
+  }
+
+  void Clear(uint32_t id) {
+    if (id / 64 >= words_.size()) return;
+    uint64_t bit = 1ull << (id % 64);
+    if (words_[id / 64] & bit) count_--;
+    words_[id / 64] &= ~bit;
+  }
+
+  bool Test(uint32_t id) const {
+    return id / 64 < words_.size() && (words_[id / 64] >> (id % 64)) & 1;
+  }
+
+  size_t Count() const { return count_; }
+
+private:
+  std::vector<uint64_t> words_;
+  size_t count_ = 0;
+};
+
+#endif
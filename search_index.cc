@@ -0,0 +1,598 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[4] = {'T', 'S', 'I', 'X'};
+const uint32_t kVersion = 1;
+const size_t kDocBytes = 16;
+const size_t kMaxTermBytes = 64;
+
+struct Skip {
+  uint64_t first;    // first doc id of the block
+  uint64_t offset;   // where the block's deltas start in the data bytes
+};
+
+// Segment file:
+//   header  [magic][u32 version][u64 first doc][u64 end doc][u64 terms][u64 dict offset]
+//   blobs   [u32 count][u32 skips][Skip x skips][deltas], each 8-byte aligned
+//   dict    DictEntry x terms, sorted by term, then the term bytes
+struct SegmentHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t first;
+  uint64_t end;
+  uint64_t terms;
+  uint64_t dict;
+};
+
+struct DictEntry {
+  uint64_t blob;        // file offset of the term's blob
+  uint64_t term;        // offset of the term in the term bytes
+  uint32_t term_len;
+  uint32_t data_len;    // bytes of deltas in the blob
+};
+
+void PutVarint(std::string* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+const uint8_t* GetVarint(const uint8_t* p, const uint8_t* end, uint64_t* v) {
+  uint64_t r = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    r |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+  }
+  *v = r;
+  return p;
+}
+
+// A posting list wherever it lives: in a MemTable or in a mapped segment.
+struct PostingsView {
+  const Skip* skips = nullptr;
+  size_t nskips = 0;
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  uint64_t count = 0;
+};
+
+// Walks one posting list block by block, remembering the last block decoded.
+class ListCursor {
+public:
+  explicit ListCursor(const PostingsView& v) : v_(v) {}
+
+  // Index of the last block whose first doc is below `below`, or -1.
+  long BlockBelow(uint64_t below) const {
+    const Skip* it = std::lower_bound(v_.skips, v_.skips + v_.nskips, below,
+                                      [](const Skip& s, uint64_t d) { return s.first < d; });
+    return static_cast<long>(it - v_.skips) - 1;
+  }
+
+  const std::vector<uint64_t>& Block(long b) {
+    if (b == block_) return ids_;
+    block_ = b;
+    ids_.clear();
+    uint64_t left = v_.count - b * SearchIndex::kBlock;
+    uint64_t n = left < SearchIndex::kBlock ? left : SearchIndex::kBlock;
+    const uint8_t* p = v_.data + v_.skips[b].offset;
+    const uint8_t* end = b + 1 < static_cast<long>(v_.nskips) ? v_.data + v_.skips[b + 1].offset
+                                                              : v_.data + v_.size;
+    uint64_t doc = v_.skips[b].first;
+    ids_.push_back(doc);
+    for (uint64_t i = 1; i < n && p < end; i++) {
+      uint64_t delta;
+      p = GetVarint(p, end, &delta);
+      doc += delta;
+      ids_.push_back(doc);
+    }
+    return ids_;
+  }
+
+  bool Contains(uint64_t doc) {
+    long b = BlockBelow(doc + 1);
+    if (b < 0) return false;
+    const auto& ids = Block(b);
+    return std::binary_search(ids.begin(), ids.end(), doc);
+  }
+
+private:
+  PostingsView v_;
+  long block_ = -1;
+  std::vector<uint64_t> ids_;
+};
+
+// Appends to out, newest first, up to limit docs below `below` that are in
+// every list. The shortest list leads; the others are probed per candidate.
+void Collect(std::vector<PostingsView>& views, uint64_t below, size_t limit,
+             std::vector<uint64_t>* out) {
+  std::sort(views.begin(), views.end(),
+            [](const PostingsView& a, const PostingsView& b) { return a.count < b.count; });
+  std::vector<ListCursor> lists(views.begin(), views.end());
+  ListCursor& lead = lists[0];
+  for (long b = lead.BlockBelow(below); b >= 0 && out->size() < limit; b--) {
+    const std::vector<uint64_t>& ids = lead.Block(b);
+    for (auto it = ids.rbegin(); it != ids.rend() && out->size() < limit; ++it) {
+      if (*it >= below) continue;
+      bool all = true;
+      for (size_t i = 1; i < lists.size() && all; i++) all = lists[i].Contains(*it);
+      if (all) out->push_back(*it);
+    }
+  }
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+void Pad8(std::string* out) {
+  out->append((8 - out->size() % 8) % 8, '\0');
+}
+
+bool IsWordByte(unsigned char c) {
+  // Bytes of multi-byte UTF-8 characters count as word bytes, so non-ASCII
+  // words are indexed whole (though only ASCII is case folded).
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' ||
+         c >= 0x80;
+}
+
+}  // namespace
+
+// Postings of the newest docs, in memory. Terms are found through an open
+// addressing table of {hash, index} slots, so a lookup touches one slot and
+// the matching list instead of walking a chain of nodes.
+struct SearchIndex::MemTable {
+  struct Postings {
+    std::string term;
+    std::string data;              // varint deltas
+    std::vector<Skip> skips;       // one per kBlock docs
+    uint64_t last = 0;
+    uint64_t count = 0;
+  };
+
+  explicit MemTable(uint64_t first) : first(first), end(first), slots(1024) {}
+
+  void Add(uint64_t doc, const std::string& term) {
+    size_t h = std::hash<std::string>()(term);
+    size_t i = Probe(h, term);
+    if (!slots[i]) {
+      lists.emplace_back();
+      lists.back().term = term;
+      slots[i] = (h & ~uint64_t(0xffffffff)) | lists.size();
+      bytes += term.size() + sizeof(Postings) + 16;
+      if (lists.size() * 2 > slots.size()) Grow();
+      i = Probe(h, term);
+    }
+    Postings& p = lists[(slots[i] & 0xffffffff) - 1];
+    size_t before = p.data.size();
+    if (p.count % kBlock == 0) {
+      p.skips.push_back(Skip{doc, p.data.size()});
+      bytes += sizeof(Skip);
+    } else {
+      PutVarint(&p.data, doc - p.last);
+    }
+    bytes += p.data.size() - before;
+    p.last = doc;
+    p.count++;
+  }
+
+  bool Find(const std::string& term, PostingsView* v) const {
+    size_t i = Probe(std::hash<std::string>()(term), term);
+    if (!slots[i]) return false;
+    const Postings& p = lists[(slots[i] & 0xffffffff) - 1];
+    v->skips = p.skips.data();
+    v->nskips = p.skips.size();
+    v->data = reinterpret_cast<const uint8_t*>(p.data.data());
+    v->size = p.data.size();
+    v->count = p.count;
+    return true;
+  }
+
+  // Slot holding term, or the empty slot where it would go
+  size_t Probe(size_t h, const std::string& term) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      uint64_t s = slots[i];
+      if (!s) return i;
+      if ((s >> 32) == (h >> 32) && lists[(s & 0xffffffff) - 1].term == term) return i;
+    }
+  }
+
+  void Grow() {
+    std::vector<uint64_t> old(slots.size() * 2);
+    old.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (uint64_t s : old) {
+      if (!s) continue;
+      size_t i = std::hash<std::string>()(lists[(s & 0xffffffff) - 1].term) & mask;
+      while (slots[i]) i = (i + 1) & mask;
+      slots[i] = s;
+    }
+  }
+
+  uint64_t first;    // docs [first, end)
+  uint64_t end;
+  size_t bytes = 0;
+  std::vector<Postings> lists;
+  std::vector<uint64_t> slots;   // [u32 hash bits][u32 index in lists + 1]; 0 = empty
+};
+
+class SearchIndex::Segment {
+public:
+  ~Segment() {
+    if (base_) munmap(const_cast<char*>(base_), size_);
+  }
+
+  // Maps path; nullptr if it is missing or malformed.
+  static std::shared_ptr<Segment> Load(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SegmentHeader)) {
+      base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+
+    auto seg = std::make_shared<Segment>();
+    seg->base_ = static_cast<const char*>(base);
+    seg->size_ = st.st_size;
+    memcpy(&seg->header_, base, sizeof(SegmentHeader));
+    const SegmentHeader& h = seg->header_;
+    if (memcmp(h.magic, kMagic, 4) != 0 || h.version != kVersion || h.end < h.first ||
+        h.dict % 8 || h.dict > seg->size_ || h.terms > (seg->size_ - h.dict) / sizeof(DictEntry)) {
+      return nullptr;
+    }
+    seg->dict_ = reinterpret_cast<const DictEntry*>(seg->base_ + h.dict);
+    seg->term_bytes_ = seg->base_ + h.dict + h.terms * sizeof(DictEntry);
+    return seg;
+  }
+
+  bool Find(const std::string& term, PostingsView* v) const {
+    const DictEntry* end = dict_ + header_.terms;
+    const DictEntry* it = std::lower_bound(dict_, end, term, [this](const DictEntry& e, const std::string& t) {
+      return Compare(e, t) < 0;
+    });
+    if (it == end || Compare(*it, term) != 0) return false;
+    uint32_t header[2];
+    if (it->blob + sizeof(header) > size_) return false;
+    memcpy(header, base_ + it->blob, sizeof(header));
+    uint64_t skips_at = it->blob + sizeof(header);
+    if (skips_at + header[1] * sizeof(Skip) + it->data_len > size_) return false;
+    v->count = header[0];
+    v->nskips = header[1];
+    v->skips = reinterpret_cast<const Skip*>(base_ + skips_at);
+    v->data = reinterpret_cast<const uint8_t*>(base_ + skips_at + header[1] * sizeof(Skip));
+    v->size = it->data_len;
+    return true;
+  }
+
+  uint64_t first() const { return header_.first; }
+  uint64_t end() const { return header_.end; }
+  size_t size() const { return size_; }
+
+private:
+  // Orders e's term against t like std::string::compare
+  int Compare(const DictEntry& e, const std::string& t) const {
+    size_t len = e.term_len;
+    if (term_bytes_ + e.term + len > base_ + size_) len = 0;
+    int c = memcmp(term_bytes_ + e.term, t.data(), std::min(len, t.size()));
+    if (c != 0) return c;
+    return len < t.size() ? -1 : len > t.size() ? 1 : 0;
+  }
+
+  const char* base_ = nullptr;
+  size_t size_ = 0;
+  SegmentHeader header_;
+  const DictEntry* dict_ = nullptr;
+  const char* term_bytes_ = nullptr;
+};
+
+SearchIndex::SearchIndex(std::string root)
+    : dir_(std::move(root) + "/search"), memtable_(std::make_shared<MemTable>(1)) {}
+
+SearchIndex::~SearchIndex() {
+  if (docs_fd_ >= 0) {
+    FlushDocs();
+    close(docs_fd_);
+  }
+}
+
+void SearchIndex::Open() {
+  mkdir(dir_.c_str(), 0755);
+
+  std::vector<std::shared_ptr<Segment>> segments;
+  if (DIR* d = opendir(dir_.c_str())) {
+    while (struct dirent* e = readdir(d)) {
+      std::string name = e->d_name;
+      std::string path = dir_ + "/" + name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+        unlink(path.c_str());   // a segment write that never finished
+      } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+        if (auto seg = Segment::Load(path)) segments.push_back(seg);
+      }
+    }
+    closedir(d);
+  }
+  std::sort(segments.begin(), segments.end(),
+            [](const std::shared_ptr<Segment>& a, const std::shared_ptr<Segment>& b) { return a->first() < b->first(); });
+
+  std::lock_guard<std::mutex> lock(mu_);
+  segments_.clear();
+  flushed_end_ = 1;
+  for (auto& seg : segments) {
+    // Segments tile the doc ids; one that does not follow on is left out
+    if (seg->first() != flushed_end_) continue;
+    segments_.push_back(seg);
+    flushed_end_ = seg->end();
+  }
+
+  docs_fd_ = open((dir_ + "/docs").c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  docs_written_ = 0;
+  if (docs_fd_ >= 0 && fstat(docs_fd_, &st) == 0) {
+    docs_written_ = st.st_size / kDocBytes;
+    // Drop a record that was only partially written before a crash
+    if (docs_written_ * kDocBytes != static_cast<uint64_t>(st.st_size) &&
+        ftruncate(docs_fd_, docs_written_ * kDocBytes) != 0) {
+      docs_written_ = 0;
+    }
+  }
+  next_doc_ = std::max(docs_written_ + 1, flushed_end_);
+  memtable_ = std::make_shared<MemTable>(flushed_end_);
+}
+
+void SearchIndex::Unflushed(uint64_t* first, uint64_t* last) const {
+  *first = flushed_end_;
+  *last = next_doc_ - 1;
+}
+
+void SearchIndex::Reindex(uint64_t doc, const std::string& text) {
+  std::vector<std::string> terms;
+  Tokenize(text, &terms);
+  std::lock_guard<std::mutex> lock(mu_);
+  if (doc < memtable_->end) return;
+  AddTerms(doc, terms);
+}
+
+void SearchIndex::Tokenize(const std::string& text, std::vector<std::string>* terms) {
+  terms->clear();
+  size_t i = 0, n = text.size();
+  auto add = [terms](const std::string& t) {
+    if (terms->size() < kMaxTermsPerPost && std::find(terms->begin(), terms->end(), t) == terms->end()) {
+      terms->push_back(t);
+    }
+  };
+  while (i < n) {
+    unsigned char c = text[i];
+    if (!IsWordByte(c)) {
+      i++;
+      continue;
+    }
+    char sigil = i > 0 && (text[i - 1] == '#' || text[i - 1] == '@') ? text[i - 1] : 0;
+    size_t start = i;
+    while (i < n && IsWordByte(text[i])) i++;
+    if (i - start > kMaxTermBytes) continue;   // not a word anyone searches for
+    std::string word = text.substr(start, i - start);
+    for (auto& ch : word) {
+      if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+    }
+    if (sigil) add(sigil + word);
+    add(word);
+  }
+}
+
+void SearchIndex::AddTerms(uint64_t doc, const std::vector<std::string>& terms) {
+  for (const auto& t : terms) memtable_->Add(doc, t);
+  memtable_->end = doc + 1;
+}
+
+uint64_t SearchIndex::Add(uint32_t author, uint64_t ordinal, const std::string& text) {
+  std::vector<std::string> terms;
+  Tokenize(text, &terms);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  uint64_t doc = next_doc_++;
+  char buf[kDocBytes] = {};
+  memcpy(buf, &author, 4);
+  memcpy(buf + 8, &ordinal, 8);
+  docs_pending_.append(buf, kDocBytes);
+  AddTerms(doc, terms);
+  return doc;
+}
+
+// Writes docs_pending_ to the doc table; mu_ must be held
+void SearchIndex::FlushDocs() {
+  if (docs_pending_.empty() || docs_fd_ < 0) return;
+  off_t at = docs_written_ * kDocBytes;
+  if (pwrite(docs_fd_, docs_pending_.data(), docs_pending_.size(), at) ==
+      static_cast<ssize_t>(docs_pending_.size())) {
+    docs_written_ += docs_pending_.size() / kDocBytes;
+    docs_pending_.clear();
+  }
+}
+
+void SearchIndex::Flush(bool force) {
+  std::lock_guard<std::mutex> flush_lock(flush_mu_);
+  std::shared_ptr<MemTable> table;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    FlushDocs();
+    // A segment's docs must all be in the doc table before it exists
+    bool full = memtable_->bytes >= kFlushBytes || (force && !memtable_->lists.empty());
+    if (!frozen_ && full && docs_pending_.empty()) {
+      frozen_ = memtable_;
+      memtable_ = std::make_shared<MemTable>(frozen_->end);
+    }
+    // A table whose write failed stays frozen, and searchable, until a later
+    // flush writes it out.
+    table = frozen_;
+  }
+  if (!table) return;
+
+  fdatasync(docs_fd_);
+  std::string path = dir_ + "/" + std::to_string(table->first) + ".seg";
+  std::shared_ptr<Segment> seg;
+  if (WriteSegment(*table, path)) seg = Segment::Load(path);
+  if (!seg) return;
+
+  std::lock_guard<std::mutex> lock(mu_);
+  segments_.push_back(seg);
+  flushed_end_ = seg->end();
+  frozen_.reset();
+}
+
+bool SearchIndex::WriteSegment(const MemTable& table, const std::string& path) {
+  std::vector<const MemTable::Postings*> sorted;
+  sorted.reserve(table.lists.size());
+  for (const auto& p : table.lists) sorted.push_back(&p);
+  std::sort(sorted.begin(), sorted.end(),
+            [](const MemTable::Postings* a, const MemTable::Postings* b) { return a->term < b->term; });
+
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+
+  SegmentHeader h;
+  memcpy(h.magic, kMagic, 4);
+  h.version = kVersion;
+  h.first = table.first;
+  h.end = table.end;
+  h.terms = sorted.size();
+
+  std::vector<DictEntry> dict;
+  dict.reserve(sorted.size());
+  std::string term_bytes;
+  std::string buf(reinterpret_cast<const char*>(&h), sizeof(h));
+  uint64_t offset = 0;    // file offset of buf[0]
+  bool ok = true;
+  for (const auto* list : sorted) {
+    const auto& p = *list;
+    DictEntry e;
+    e.blob = offset + buf.size();
+    e.term = term_bytes.size();
+    e.term_len = static_cast<uint32_t>(p.term.size());
+    e.data_len = static_cast<uint32_t>(p.data.size());
+    dict.push_back(e);
+    term_bytes += p.term;
+
+    uint32_t header[2] = {static_cast<uint32_t>(p.count), static_cast<uint32_t>(p.skips.size())};
+    buf.append(reinterpret_cast<const char*>(header), sizeof(header));
+    buf.append(reinterpret_cast<const char*>(p.skips.data()), p.skips.size() * sizeof(Skip));
+    buf += p.data;
+    Pad8(&buf);
+    if (buf.size() >= (1 << 20)) {
+      ok = ok && WriteAll(fd, buf);
+      offset += buf.size();
+      buf.clear();
+    }
+  }
+  h.dict = offset + buf.size();
+  buf.append(reinterpret_cast<const char*>(dict.data()), dict.size() * sizeof(DictEntry));
+  buf += term_bytes;
+  ok = ok && WriteAll(fd, buf) &&
+       pwrite(fd, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h)) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Fills hit from the doc table; mu_ must be held
+bool SearchIndex::ReadDoc(uint64_t doc, SearchHit* hit) {
+  char buf[kDocBytes];
+  if (doc == 0 || doc >= next_doc_) return false;
+  if (doc <= docs_written_) {
+    if (pread(docs_fd_, buf, kDocBytes, (doc - 1) * kDocBytes) != static_cast<ssize_t>(kDocBytes)) return false;
+  } else {
+    memcpy(buf, docs_pending_.data() + (doc - docs_written_ - 1) * kDocBytes, kDocBytes);
+  }
+  hit->doc = doc;
+  memcpy(&hit->author, buf, 4);
+  memcpy(&hit->ordinal, buf + 8, 8);
+  return true;
+}
+
+bool SearchIndex::Lookup(uint64_t doc, SearchHit* hit) {
+  std::lock_guard<std::mutex> lock(mu_);
+  return ReadDoc(doc, hit);
+}
+
+uint64_t SearchIndex::Search(const std::string& query, size_t limit, uint64_t cursor,
+                             std::vector<SearchHit>* out) {
+  std::vector<std::string> terms;
+  Tokenize(query, &terms);
+  if (terms.empty() || limit == 0) return 0;
+  uint64_t below = cursor ? cursor : UINT64_MAX;
+  // One extra match tells whether there is another page
+  size_t want = limit + 1;
+  std::vector<uint64_t> docs;
+
+  // Newest docs first: the open table, then the one being written out, then
+  // segments from the newest down. Only the open table changes under us.
+  auto search = [&](auto& source) {
+    std::vector<PostingsView> views(terms.size());
+    for (size_t i = 0; i < terms.size(); i++) {
+      if (!source.Find(terms[i], &views[i])) return;
+    }
+    Collect(views, below, want, &docs);
+  };
+  std::shared_ptr<MemTable> frozen;
+  std::vector<std::shared_ptr<Segment>> segments;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    search(*memtable_);
+    frozen = frozen_;
+    segments = segments_;
+  }
+  if (frozen && docs.size() < want) search(*frozen);
+  for (auto it = segments.rbegin(); it != segments.rend() && docs.size() < want; ++it) {
+    if ((*it)->first() < below) search(**it);
+  }
+
+  uint64_t next = 0;
+  if (docs.size() > limit) {
+    docs.resize(limit);
+    next = docs.back();
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  for (uint64_t doc : docs) {
+    SearchHit hit;
+    if (ReadDoc(doc, &hit)) out->push_back(hit);
+  }
+  return next;
+}
+
+SearchStats SearchIndex::Stats() {
+  std::lock_guard<std::mutex> lock(mu_);
+  SearchStats stats;
+  stats.docs = next_doc_ - 1;
+  stats.segments = segments_.size();
+  stats.memory_terms = memtable_->lists.size();
+  stats.memory_bytes = memtable_->bytes + (frozen_ ? frozen_->bytes : 0);
+  stats.disk_bytes = docs_written_ * kDocBytes;
+  for (const auto& seg : segments_) stats.disk_bytes += seg->size();
+  return stats;
+}
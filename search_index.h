@@ -0,0 +1,110 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Inverted index over post text, maintained as posts are stored.
+ *
+ * Every indexed post gets a doc id (1, 2, ... in posting order) and a 16-byte
+ * record in the doc table pointing at the post in its author's TimelineStore
+ * log. Each term maps to the sorted list of doc ids containing it, kept as
+ * varint deltas in blocks of kBlock ids; a skip entry per block holds its
+ * first id and offset, so a lookup or an intersection decodes one block
+ * instead of the whole list.
+ *
+ * New postings go to an in-memory table. Once that holds kFlushBytes it is
+ * written out as an immutable segment and searched from the mmap'ed file.
+ *
+ * Layout: <root>/search/docs          [u32 author][u32 reserved][u64 ordinal] per doc
+ *         <root>/search/<first doc>.seg
+ *
+ * Doc table appends are buffered like inbox references and written by
+ * Flush(). Postings not yet in a segment are rebuilt after a restart from
+ * the doc table and the posts it points at (see Unflushed() and Reindex()).
+ */
+
+struct SearchHit {
+  uint64_t doc = 0;
+  uint32_t author = 0;     // Client::id of the poster
+  uint64_t ordinal = 0;    // position of the post in the author's TimelineStore log
+};
+
+struct SearchStats {
+  uint64_t docs = 0;
+  size_t segments = 0;
+  size_t memory_terms = 0;     // terms in the in-memory table
+  size_t memory_bytes = 0;     // postings held in memory, approximately
+  uint64_t disk_bytes = 0;     // segments and doc table
+};
+
+class SearchIndex {
+public:
+  static const size_t kBlock = 128;
+  static const size_t kFlushBytes = 64 << 20;
+  static const size_t kMaxTermsPerPost = 64;
+
+  explicit SearchIndex(std::string root = ".");
+  ~SearchIndex();
+
+  SearchIndex(const SearchIndex&) = delete;
+  SearchIndex& operator=(const SearchIndex&) = delete;
+
+  // Loads the segments and doc table. Call once, before anything else.
+  void Open();
+
+  // Docs [first, last] are in the doc table but in no segment; the caller
+  // feeds each one back through Reindex(). Empty if first > last.
+  void Unflushed(uint64_t* first, uint64_t* last) const;
+  void Reindex(uint64_t doc, const std::string& text);
+
+  // Indexes text as the post of author stored at ordinal. Returns its doc id.
+  uint64_t Add(uint32_t author, uint64_t ordinal, const std::string& text);
+
+  // Writes buffered doc table records, and the in-memory postings as a new
+  // segment once they reach kFlushBytes (or whenever there are some, if force).
+  void Flush(bool force = false);
+
+  // Up to limit docs containing every term of query, newest first, starting
+  // below doc id cursor (0 = from the newest). Returns the cursor to resume
+  // from, or 0 once there are no more matches.
+  uint64_t Search(const std::string& query, size_t limit, uint64_t cursor,
+                  std::vector<SearchHit>* out);
+
+  // Where doc points; false if there is no such doc.
+  bool Lookup(uint64_t doc, SearchHit* hit);
+
+  SearchStats Stats();
+
+  // Lowercased words of text, deduplicated. A #hashtag or @mention yields
+  // both "#tag" and "tag".
+  static void Tokenize(const std::string& text, std::vector<std::string>* terms);
+
+private:
+  struct MemTable;
+  class Segment;
+
+  bool WriteSegment(const MemTable& table, const std::string& path);
+  void FlushDocs();
+  void AddTerms(uint64_t doc, const std::vector<std::string>& terms);
+  bool ReadDoc(uint64_t doc, SearchHit* hit);
+
+  std::string dir_;
+  std::mutex mu_;                              // guards everything below
+  std::mutex flush_mu_;                        // one Flush at a time
+  uint64_t next_doc_ = 1;
+  int docs_fd_ = -1;
+  uint64_t docs_written_ = 0;                  // doc table records on disk
+  std::string docs_pending_;                   // records not yet written
+  std::shared_ptr<MemTable> memtable_;         // docs after every segment and frozen_
+  std::shared_ptr<MemTable> frozen_;           // being written out as a segment
+  std::vector<std::shared_ptr<Segment>> segments_;   // oldest first
+  uint64_t flushed_end_ = 1;                   // docs below this are in segments
+};
+
+#endif
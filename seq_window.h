@@ -0,0 +1,50 @@
+#ifndef SEQ_WINDOW_H
+#define SEQ_WINDOW_H
+
+#include <cstdint>
+
+/*
+ * Sliding dedup window over one client's post sequence numbers.
+ *
+ * Remembers the highest sequence number accepted and which of the kSpan
+ * numbers below it were accepted too, so a retried post is recognized in O(1)
+ * with 16 bytes of state per user. A client sends its posts in sequence order
+ * and re-sends unacknowledged ones before any new post, so anything older
+ * than the window has necessarily been stored already.
+ */
+class SeqWindow {
+public:
+  static const uint64_t kSpan = 64;
+
+  // Returns true the first time seq is seen, false for a duplicate.
+  bool Accept(uint64_t seq) {
+    if (seq > high_) {
+      uint64_t shift = seq - high_;
+      bits_ = shift >= kSpan ? 0 : bits_ << shift;
+      bits_ |= 1;
+      high_ = seq;
+      return true;
+    }
+    uint64_t back = high_ - seq;
+    if (back >= kSpan) return false;
+    uint64_t bit = 1ull << back;
+    if (bits_ & bit) return false;
+    bits_ |= bit;
+    return true;
+  }
+
+  // Whether seq was accepted already, without accepting it.
+  bool Seen(uint64_t seq) const {
+    if (seq > high_) return false;
+    uint64_t back = high_ - seq;
+    return back >= kSpan || (bits_ >> back) & 1;
+  }
+
+  uint64_t high() const { return high_; }
+
+private:
+  uint64_t high_ = 0;
+  uint64_t bits_ = 0;   // bit i set: high_ - i was accepted
+};
+
+#endif
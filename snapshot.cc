@@ -0,0 +1,221 @@
+#include "snapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[4] = {'T', 'S', 'N', 'S'};
+
+enum Tag : uint32_t { kNames = 1, kSessions = 2, kGraph = 3, kUsersLog = 4 };
+
+void PutSection(std::string* out, uint32_t tag, const char* data, uint64_t size) {
+  out->append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+  out->append(reinterpret_cast<const char*>(&size), sizeof(size));
+  out->append(data, size);
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+struct Record {
+  uint32_t op;
+  uint32_t follower;
+  uint32_t followee;
+};
+
+// Replays path from record first on
+uint64_t ReplayFile(const std::string& path, uint64_t first,
+                    const std::function<void(GraphLog::Op, uint32_t, uint32_t)>& apply) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return 0;
+  if (first && fseeko(f, static_cast<off_t>(first * sizeof(Record)), SEEK_SET) != 0) {
+    fclose(f);
+    return 0;
+  }
+  uint64_t count = 0;
+  Record batch[4096];
+  size_t n;
+  // A torn last record is shorter than sizeof(Record) and simply not read.
+  while ((n = fread(batch, sizeof(Record), 4096, f)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      apply(static_cast<GraphLog::Op>(batch[i].op), batch[i].follower, batch[i].followee);
+    }
+    count += n;
+  }
+  fclose(f);
+  return count;
+}
+
+}  // namespace
+
+std::string EncodeSnapshotHead(const Snapshot& snap) {
+  std::string names;
+  for (const auto& name : snap.names) {
+    uint32_t len = static_cast<uint32_t>(name.size());
+    names.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    names.append(name);
+  }
+
+  std::string head(kMagic, sizeof(kMagic));
+  uint32_t version = Snapshot::kVersion;
+  head.append(reinterpret_cast<const char*>(&version), sizeof(version));
+  PutSection(&head, kUsersLog, reinterpret_cast<const char*>(&snap.users_log_offset),
+             sizeof(snap.users_log_offset));
+  PutSection(&head, kNames, names.data(), names.size());
+  PutSection(&head, kSessions, reinterpret_cast<const char*>(snap.sessions.data()),
+             snap.sessions.size() * sizeof(uint64_t));
+
+  // The graph section is written straight from snap.graph, which can be
+  // hundreds of megabytes, rather than copied into head.
+  uint32_t tag = kGraph;
+  uint64_t size = snap.graph.size();
+  head.append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+  head.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  return head;
+}
+
+bool SaveSnapshot(const std::string& path, const Snapshot& snap) {
+  std::string head = EncodeSnapshotHead(snap);
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool ok = WriteAll(fd, head.data(), head.size()) &&
+            WriteAll(fd, snap.graph.data(), snap.graph.size()) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadSnapshot(const std::string& path, Snapshot* snap, SocialGraph* graph, unsigned threads) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 8) {
+    close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return false;
+  bool ok = DecodeSnapshot(static_cast<const char*>(addr), size, snap, graph, threads);
+  munmap(addr, size);
+  return ok;
+}
+
+bool DecodeSnapshot(const char* data, size_t size, Snapshot* snap, SocialGraph* graph, unsigned threads) {
+  if (size < 8) return false;
+  uint32_t version;
+  memcpy(&version, data + 4, sizeof(version));
+  bool ok = memcmp(data, kMagic, sizeof(kMagic)) == 0 && version == Snapshot::kVersion;
+
+  const char* sections[5] = {nullptr};
+  uint64_t lengths[5] = {0};
+  for (size_t off = 8; ok && off < size;) {
+    uint32_t tag;
+    uint64_t len;
+    if (off + 12 > size) { ok = false; break; }
+    memcpy(&tag, data + off, 4);
+    memcpy(&len, data + off + 4, 8);
+    off += 12;
+    if (len > size - off) { ok = false; break; }
+    if (tag < 5) {
+      sections[tag] = data + off;
+      lengths[tag] = len;
+    }
+    off += len;
+  }
+  ok = ok && sections[kNames] && sections[kSessions] && sections[kGraph] &&
+       lengths[kUsersLog] == sizeof(uint64_t);
+
+  // The graph is the bulk of the file; fill it in the background while this
+  // thread decodes the users.
+  bool graph_ok = false;
+  std::thread graph_loader;
+  if (ok) {
+    graph_loader = std::thread([&]() {
+      graph_ok = graph->Deserialize(sections[kGraph], lengths[kGraph], threads);
+    });
+
+    memcpy(&snap->users_log_offset, sections[kUsersLog], sizeof(uint64_t));
+    snap->names.clear();
+    const char* p = sections[kNames];
+    const char* end = p + lengths[kNames];
+    while (ok && p + 4 <= end) {
+      uint32_t len;
+      memcpy(&len, p, 4);
+      p += 4;
+      if (len > static_cast<size_t>(end - p)) { ok = false; break; }
+      snap->names.emplace_back(p, len);
+      p += len;
+    }
+    size_t users = lengths[kSessions] / sizeof(uint64_t);
+    snap->sessions.resize(users);
+    memcpy(snap->sessions.data(), sections[kSessions], users * sizeof(uint64_t));
+    ok = ok && users == snap->names.size();
+
+    graph_loader.join();
+    ok = ok && graph_ok && graph->users() <= users;
+  }
+  return ok;
+}
+
+GraphLog::~GraphLog() {
+  if (fd_ >= 0) close(fd_);
+}
+
+void GraphLog::OpenForAppend() {
+  if (fd_ < 0) fd_ = open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
+
+void GraphLog::Append(Op op, uint32_t follower, uint32_t followee) {
+  OpenForAppend();
+  Record r = {op, follower, followee};
+  if (fd_ >= 0 && write(fd_, &r, sizeof(r)) == static_cast<ssize_t>(sizeof(r))) pending_++;
+}
+
+void GraphLog::Rotate() {
+  std::string old = path_ + ".1";
+  if (access(old.c_str(), F_OK) == 0) return;
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  rename(path_.c_str(), old.c_str());
+  pending_ = 0;
+}
+
+void GraphLog::Retire() {
+  unlink((path_ + ".1").c_str());
+}
+
+uint64_t GraphLog::Replay(const std::function<void(Op, uint32_t, uint32_t)>& apply) {
+  uint64_t older = ReplayFile(path_ + ".1", 0, apply);
+  replayed_ = ReplayFile(path_, 0, apply);
+  pending_ = older + replayed_;
+  return pending_;
+}
+
+uint64_t GraphLog::CatchUp(const std::function<void(Op, uint32_t, uint32_t)>& apply) {
+  uint64_t count = ReplayFile(path_, replayed_, apply);
+  replayed_ += count;
+  pending_ += count;
+  return count;
+}
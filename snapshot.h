@@ -0,0 +1,94 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "social_graph.h"
+
+/*
+ * Checkpoint of tsd's in-memory directory: users (by id), their session ids,
+ * and the follow graph. Posts need no checkpoint; they are already durable in
+ * the segment logs and inboxes.
+ *
+ * File: "TSNS" [u32 version] then sections, each [u32 tag][u64 length][bytes].
+ * It is written to a temporary file, fsync'ed and renamed into place, so a
+ * crash leaves either the old or the new snapshot.
+ *
+ * Changes made after a checkpoint are recovered from two logs: users.list
+ * (one username per line, from users_log_offset on) and the GraphLog.
+ */
+
+struct Snapshot {
+  static const uint32_t kVersion = 1;
+
+  std::vector<std::string> names;     // by user id
+  std::vector<uint64_t> sessions;     // by user id
+  std::string graph;                  // SocialGraph::Serialize output
+  uint64_t users_log_offset = 0;      // bytes of users.list the snapshot covers
+};
+
+// Writes snap to path atomically. Returns false and leaves any previous
+// snapshot in place on failure.
+bool SaveSnapshot(const std::string& path, const Snapshot& snap);
+
+// Reads path into snap (leaving snap->graph empty) and rebuilds graph from it.
+// The graph is filled on up to threads threads while the calling thread
+// decodes the user sections. Returns false if there is no usable snapshot.
+bool LoadSnapshot(const std::string& path, Snapshot* snap, SocialGraph* graph, unsigned threads);
+
+// The file's bytes up to where snap.graph follows, for sending a snapshot
+// elsewhere than a file (handover.h); DecodeSnapshot reads head + graph back
+// like LoadSnapshot reads the file.
+std::string EncodeSnapshotHead(const Snapshot& snap);
+bool DecodeSnapshot(const char* data, size_t size, Snapshot* snap, SocialGraph* graph, unsigned threads);
+
+/*
+ * Append-only log of follow graph changes since the last checkpoint, as
+ * 12-byte records [u32 op][u32 follower][u32 followee]. Replaying a record
+ * sets the edge to the state it names, so replaying records that a snapshot
+ * already covers is harmless.
+ */
+class GraphLog {
+public:
+  enum Op : uint32_t { kFollow = 1, kUnFollow = 2 };
+
+  explicit GraphLog(std::string path) : path_(std::move(path)) {}
+  ~GraphLog();
+
+  GraphLog(const GraphLog&) = delete;
+  GraphLog& operator=(const GraphLog&) = delete;
+
+  void Append(Op op, uint32_t follower, uint32_t followee);
+
+  // Moves the current log aside as <path>.1 and starts a new one. Called
+  // when a checkpoint starts; Retire() drops <path>.1 once it has
+  // committed. If a <path>.1 from a failed checkpoint is still there, the
+  // current log stays where it is: the checkpoint covers it too, and
+  // replaying it after the checkpoint is harmless.
+  void Rotate();
+  void Retire();
+
+  // Replays <path>.1 and then <path>, in order. Returns the records seen.
+  uint64_t Replay(const std::function<void(Op, uint32_t, uint32_t)>& apply);
+
+  // Replays what another process appended to <path> since Replay or the
+  // last CatchUp; it must not have rotated the log meanwhile.
+  uint64_t CatchUp(const std::function<void(Op, uint32_t, uint32_t)>& apply);
+
+  // Records not yet covered by a checkpoint.
+  uint64_t pending() const { return pending_; }
+
+private:
+  void OpenForAppend();
+
+  std::string path_;
+  int fd_ = -1;
+  uint64_t pending_ = 0;
+  uint64_t replayed_ = 0;   // records of <path> replayed
+};
+
+#endif
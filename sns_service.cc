@@ -0,0 +1,2227 @@
+/*
+ *
+ * Copyright 2015, Google Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "sns_service.h"
+#include "post_codec.h"
+#include "trace.h"
+
+#include <ctime>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <unordered_set>
+
+#include <malloc.h>
+#include <google/protobuf/timestamp.pb.h>
+#include <unistd.h>
+#include <glog/logging.h>
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
+
+using grpc::ServerContext;
+using grpc::Status;
+using csce438::Message;
+using csce438::ListReply;
+using csce438::Request;
+using csce438::Reply;
+using csce438::TimelineQuery;
+using csce438::HomeTimelineQuery;
+using csce438::HomeTimelinePage;
+using csce438::SearchQuery;
+using csce438::SearchReply;
+using csce438::Forwarded;
+using csce438::ForwardRequest;
+using csce438::MigrateRequest;
+using csce438::MigrateReply;
+using csce438::UserTransfer;
+using csce438::HandoverState;
+using csce438::UserSession;
+using csce438::ForwardCursor;
+
+namespace {
+
+const std::chrono::seconds kLeaseTtl(15);
+
+const std::chrono::seconds kCheckpointInterval(60);
+
+// GetTimeline page bounds: records and payload bytes per streamed page
+const size_t kPageRecords = 512;
+const size_t kPageBytes = 1 << 20;
+
+// Inbox references read per batch during catch-up
+const size_t kReplayBatch = 4096;
+
+// Buffered inbox references reach disk this often; a crash loses at most this much
+const std::chrono::milliseconds kInboxFlushInterval(100);
+
+// Home timeline page size when the query sets none, and the most a query may ask for
+const size_t kHomeLimit = 20;
+const size_t kMaxHomeLimit = 512;
+
+// Search page size when the query sets none, and the most a query may ask for
+const size_t kSearchLimit = 20;
+const size_t kMaxSearchLimit = 100;
+
+// A forwarded item goes on to the server a user lives on at most this many
+// times, so servers that disagree about it cannot pass it around forever
+const uint32_t kMaxHops = 3;
+
+// Post bytes per UserTransfer during a migration
+const size_t kTransferBytes = 1 << 20;
+
+// How long copying a remote user's posts (SyncMirror) may take
+const std::chrono::seconds kMirrorDeadline(10);
+
+// A paged-out user's record in user_pages starts [u64 session][u64 version of
+// its follower_changes], followed by its SocialGraph::PageOut record if it
+// has follows
+const size_t kPageHeader = 16;
+
+// Users EvictCold looks at per pass, so one pass holds db_mutex only briefly
+const size_t kEvictBatch = 2048;
+
+// Heap bytes of an lru entry and of a follow_since entry, for Footprint
+const size_t kLruEntryBytes = 24;
+const size_t kFollowTimeBytes = 32;
+
+// Streams ended for a handover are told to reconnect within this long, so
+// their clients do not all come back at once
+const int kReconnectSpreadMs = 250;
+
+// Threads that run the steps of Timeline streams that may block (executor.h).
+// They mostly wait on disk or on fan-outs, so there are more than cores.
+const unsigned kSessionThreads = 8;
+
+// Followers per range of a parallel fan-out; a post to fewer than two ranges'
+// worth is fanned out on the posting thread
+const size_t kFanoutGrain = 1024;
+
+// Whether the comma-separated list in the caller's key metadata names
+// encoding, as "post-encoding" and "page-encoding" do
+bool AsksFor(const grpc::ServerContextBase* context, const char* key, const std::string& encoding) {
+  const auto& md = context->client_metadata();
+  auto it = md.find(key);
+  if (it == md.end()) return false;
+  std::stringstream encodings(std::string(it->second.data(), it->second.length()));
+  std::string e;
+  while (std::getline(encodings, e, ',')) {
+    e.erase(0, e.find_first_not_of(' '));
+    if (e == encoding) return true;
+  }
+  return false;
+}
+
+// Tells a poster that its post with sequence number seq is stored
+void SendAck(Client* c, uint64_t seq) {
+  Message ack;
+  ack.set_ack(seq);
+  std::lock_guard<std::mutex> lock(c->stream_mu);
+  if (c->stream) c->stream->Send(SerializeShared(ack));
+}
+
+}  // namespace
+
+SNSServiceImpl::SNSServiceImpl(std::string dir, const AdmissionLimits& limits)
+    : dir_(std::move(dir)),
+      user_pages(Path("users.pages")),
+      users_file(Path("users.list")),
+      snapshot_file(Path("tsd.snapshot")),
+      graph_log(Path("graph.log")),
+      session_rng(std::random_device{}()),
+      timeline_store(dir_),
+      inbox_store(dir_),
+      search_index(dir_),
+      homes_file(Path("homes.log")),
+      admission(limits),
+      fanout(new FanoutPool(0)),
+      sessions(new Executor(kSessionThreads)) {
+  list_epoch = NewSessionId();
+}
+
+SNSServiceImpl::~SNSServiceImpl() {
+  // Runs what the streams' OnDone left behind; the server is shut down by now
+  sessions.reset();
+  Stop();
+  for (auto c : client_db) delete c;
+}
+
+SNSServiceImpl::Pins::~Pins() {
+  if (clients_.empty()) return;
+  std::lock_guard<std::mutex> lock(service_->db_mutex);
+  for (Client* c : clients_) c->pins--;
+}
+
+Client* SNSServiceImpl::Pins::Add(Client* c) {
+  if (c) {
+    c->pins++;
+    clients_.push_back(c);
+  }
+  return c;
+}
+
+//Looks a user up by name, bringing it into memory; db_mutex must be held
+Client* SNSServiceImpl::FindClient(const std::string& username) {
+  uint32_t id;
+  return directory.Find(username, &id) ? ClientAt(id) : nullptr;
+}
+
+//The user with Client::id id, brought back into memory if it is paged out;
+//db_mutex must be held
+Client* SNSServiceImpl::ClientAt(uint32_t id) {
+  Client* c = client_db[id];
+  if (!c) {
+    faults++;
+    return MakeResident(id);
+  }
+  lru.splice(lru.begin(), lru, c->lru);
+  return c;
+}
+
+//Adds a user under the next free id; db_mutex must be held
+Client* SNSServiceImpl::AddClient(const std::string& username) {
+  uint32_t id;
+  {
+    std::lock_guard<std::shared_mutex> names(directory_mu);
+    id = directory.Add(username);
+  }
+  client_db.push_back(nullptr);
+  social_graph.Resize(client_db.size());
+  return MakeResident(id);
+}
+
+//Creates the Client of a user that has none, from what was paged out of it
+//if anything; db_mutex must be held
+Client* SNSServiceImpl::MakeResident(uint32_t id) {
+  Client* c = new Client();
+  c->id = id;
+  c->username = directory.Name(id);
+  c->post_bucket.Configure(admission.limits().user_posts, admission.limits().user_post_burst);
+  c->rpc_bucket.Configure(admission.limits().user_rpcs, admission.limits().user_rpc_burst);
+  const char* data;
+  size_t size;
+  if (user_pages.Get(id, &data, &size) && size >= kPageHeader) {
+    uint64_t header[2];
+    memcpy(header, data, sizeof(header));
+    c->session = header[0];
+    c->follower_changes = ChangeLog(header[1]);
+    if (size > kPageHeader && !social_graph.PageIn(id, data + kPageHeader, size - kPageHeader)) {
+      log(ERROR, "Paged-out follows of " + c->username + " are unreadable");
+    }
+    user_pages.Drop(id);
+  }
+  // Streams that opened while the user was out were not added to its list.
+  // Followers come in id order, which keeps the list sorted
+  if (online_users.Count()) {
+    for (auto f : social_graph.Followers(id)) {
+      if (online_users.Test(f)) c->online_followers.push_back({f, client_db[f]->online_epoch});
+    }
+  }
+  client_db[id] = c;
+  lru.push_front(id);
+  c->lru = lru.begin();
+  c->charged = Footprint(c);
+  resident_bytes += c->charged;
+  return c;
+}
+
+//Where a user lives, empty if here; db_mutex must be held. Users that live
+//elsewhere are never paged out
+const std::string& SNSServiceImpl::HomeOf(uint32_t id) const {
+  static const std::string here;
+  return remote_users.Test(id) ? client_db[id]->home : here;
+}
+
+//Rough bytes c holds: the Client with its strings and lists, and its follows
+size_t SNSServiceImpl::Footprint(const Client* c) const {
+  return sizeof(Client) + kLruEntryBytes + c->username.capacity() + c->home.capacity() +
+         c->online_followers.capacity() * sizeof(OnlineRef) + c->follow_since.size() * kFollowTimeBytes +
+         social_graph.NodeBytes(c->id);
+}
+
+//Writes what a user without a Client needs back, and its follows, to
+//user_pages. Returns false, leaving its follows in memory, if that fails;
+//db_mutex must be held
+bool SNSServiceImpl::PageOut(uint32_t id, uint64_t session, uint64_t changes) {
+  uint64_t header[2] = {session, changes};
+  std::string record(reinterpret_cast<const char*>(header), sizeof(header));
+  bool follows = social_graph.PageOut(id, &record);
+  if (!follows && !session && !changes) return true;
+  if (user_pages.Put(id, record)) return true;
+  if (follows) social_graph.PageIn(id, record.data() + kPageHeader, record.size() - kPageHeader);
+  return false;
+}
+
+//Whether c may be paged out: nothing is using it and its lease has run out.
+//Its online-follower list is rebuilt when it is paged back in; db_mutex must
+//be held
+bool SNSServiceImpl::Evictable(Client* c) {
+  return !c->pins && !c->HasLease() && c->home.empty() && !c->migrated_posts && !online_users.Test(c->id);
+}
+
+//Records follower's current stream in c's online-follower list, replacing
+//the entry of an earlier stream. The list is sorted by user; db_mutex must
+//be held
+void SNSServiceImpl::AddOnlineFollower(Client* c, const Client* follower) {
+  auto& online = c->online_followers;
+  auto it = std::lower_bound(online.begin(), online.end(), follower->id,
+                             [](const OnlineRef& r, uint32_t user) { return r.user < user; });
+  if (it != online.end() && it->user == follower->id) {
+    it->epoch = follower->online_epoch;
+  } else {
+    online.insert(it, {follower->id, follower->online_epoch});
+  }
+}
+
+//Pages c out and deletes it. Its rate limits, post dedup window and follow
+//times are rebuilt when it is next needed. Returns false, keeping c, if it
+//cannot be written out; db_mutex must be held
+bool SNSServiceImpl::Evict(Client* c) {
+  if (!PageOut(c->id, c->session, c->follower_changes.version())) return false;
+  inbox_store.Evict(c->username);
+  timeline_store.Evict(c->username);
+  lru.erase(c->lru);
+  resident_bytes -= c->charged;
+  client_db[c->id] = nullptr;
+  delete c;
+  evictions++;
+  return true;
+}
+
+ResidencyStats SNSServiceImpl::Residency() {
+  std::lock_guard<std::mutex> lock(db_mutex);
+  UserPagesStats pages = user_pages.Stats();
+  ResidencyStats rs;
+  rs.users = client_db.size();
+  rs.resident = lru.size();
+  rs.resident_bytes = resident_bytes;
+  rs.budget = memory_budget;
+  rs.directory_bytes = directory.MemoryBytes() + client_db.capacity() * sizeof(Client*);
+  rs.paged = pages.records;
+  rs.page_file_bytes = pages.file_bytes;
+  rs.faults = faults;
+  rs.evictions = evictions;
+  return rs;
+}
+
+//Pages out the least recently used users until the rest fit the memory
+//budget. Those that cannot go yet move to the front
+void SNSServiceImpl::EvictCold() {
+  // In batches, letting RPCs have the lock in between, until under budget or
+  // a batch finds nothing to evict
+  for (bool evicted = true; evicted;) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    if (!memory_budget) return;
+    evicted = false;
+    for (size_t n = std::min(lru.size(), kEvictBatch); n > 0 && resident_bytes > memory_budget; n--) {
+      Client* c = client_db[lru.back()];
+      // Follows made since it was last counted
+      resident_bytes -= c->charged;
+      c->charged = Footprint(c);
+      resident_bytes += c->charged;
+      if (Evictable(c) && Evict(c)) {
+        evicted = true;
+      } else {
+        lru.splice(lru.begin(), lru, c->lru);
+      }
+    }
+  }
+}
+
+//Extends c's lease if session is the one it was granted to; db_mutex must be held
+void SNSServiceImpl::RenewLease(Client* c, uint64_t session) {
+  if (c && session && session == c->session) {
+    c->lease_deadline = std::chrono::steady_clock::now() + kLeaseTtl;
+  }
+}
+
+//Registers a fan-out about to copy the follower lists, once no change of
+//online_users waits; lock holds db_mutex
+void SNSServiceImpl::BeginFanout(std::unique_lock<std::mutex>& lock) {
+  fanout_cv.wait(lock, [&] { return presence_waiting == 0; });
+  fanouts_running++;
+}
+
+//Waits until no fan-out runs, holding new ones off; lock holds db_mutex.
+//Call it before setting or clearing a bit of online_users, without any
+//stream_mu held, and keep db_mutex until the change is made
+void SNSServiceImpl::AwaitFanouts(std::unique_lock<std::mutex>& lock) {
+  presence_waiting++;
+  fanout_cv.wait(lock, [&] { return fanouts_running == 0; });
+  if (--presence_waiting == 0) fanout_cv.notify_all();
+}
+
+//db_mutex must be held
+void SNSServiceImpl::EndFanout() {
+  if (--fanouts_running == 0) fanout_cv.notify_all();
+}
+
+//Delivers author's stored post ref, serialized as wire. Followers with an
+//open stream get the post itself from the online list; the others get a
+//16-byte reference in their inbox, and those that live on other servers get
+//it forwarded there. db_mutex is held only to copy what that takes: the
+//online followers' Clients, a snapshot of the follower set's chunks (a
+//pointer per IdSet::kChunk followers) and which users are remote. These are
+//then split into ranges of about kFanoutGrain followers that the fan-out
+//pool works through in parallel. Until EndFanout
+//no follower comes online or goes offline, so each gets the post exactly one
+//way, and the online ones stay resident. Call it without db_mutex
+void SNSServiceImpl::FanOut(Client* author, const InboxRef& ref, const std::string& wire, uint64_t trace) {
+  OutgoingPost post(wire, author->id + 1);
+  std::vector<Client*> online;
+  IdSet::Snapshot chunks;
+  OnlineSet remote;
+  {
+    std::unique_lock<std::mutex> lock(db_mutex);
+    BeginFanout(lock);
+    // Entries of followers whose stream has ended are dropped on the way
+    auto& refs = author->online_followers;
+    size_t live = 0;
+    for (size_t i = 0; i < refs.size(); i++) {
+      // Only users with a stream are sure to be in memory
+      if (!online_users.Test(refs[i].user)) continue;
+      Client* f = client_db[refs[i].user];
+      if (f->online_epoch != refs[i].epoch) continue;
+      refs[live++] = refs[i];
+      online.push_back(f);
+    }
+    refs.resize(live);
+    chunks = social_graph.Followers(author->id).Share();
+    if (remote_users.Count()) remote = remote_users;
+  }
+
+  fanout->Run(online.size(), kFanoutGrain, [&](size_t begin, size_t end) {
+    // A stream that is closed, or closes now for falling behind, leaves the
+    // post to the inbox, which the client replays on reconnecting
+    std::vector<std::string> missed;
+    for (size_t i = begin; i < end; i++) {
+      std::lock_guard<std::mutex> stream_lock(online[i]->stream_mu);
+      if (!online[i]->stream || !online[i]->stream->SendPost(&post, trace)) {
+        missed.push_back(online[i]->username);
+      }
+    }
+    if (!missed.empty()) inbox_store.Append(missed, ref);
+  });
+
+  // Position of each chunk's first follower in the whole list
+  std::vector<size_t> starts(chunks.size() + 1);
+  for (size_t c = 0; c < chunks.size(); c++) starts[c + 1] = starts[c] + chunks[c]->size();
+  size_t followers = starts.back();
+
+  // online_users stays as copied, so it is read in place
+  std::vector<std::vector<uint32_t>> remote_ids((followers + kFanoutGrain - 1) / kFanoutGrain);
+  fanout->Run(followers, kFanoutGrain, [&](size_t begin, size_t end) {
+    std::vector<std::string> names;
+    size_t c = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+    {
+      std::shared_lock<std::shared_mutex> lock(directory_mu);
+      for (size_t i = begin; i < end; i++) {
+        if (i == starts[c + 1]) c++;
+        uint32_t f = (*chunks[c])[i - starts[c]];
+        if (remote.Test(f)) {
+          remote_ids[begin / kFanoutGrain].push_back(f);
+        } else if (!online_users.Test(f)) {
+          names.push_back(directory.Name(f));
+        }
+      }
+    }
+    inbox_store.Append(names, ref);
+  });
+
+  std::vector<uint32_t> all;
+  for (auto& r : remote_ids) all.insert(all.end(), r.begin(), r.end());
+  std::lock_guard<std::mutex> lock(db_mutex);
+  EndFanout();
+  if (!all.empty()) ForwardPost(author, ref.ordinal, wire, all, 0);
+}
+
+Client* SNSServiceImpl::AddFollowerForTest(const std::string& author, const std::string& follower,
+                                           PostStream* stream) {
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* a = FindClient(author);
+  if (!a) a = AddClient(author);
+  Client* f = FindClient(follower);
+  if (!f) f = AddClient(follower);
+  social_graph.Follow(f->id, a->id);
+  if (stream) {
+    std::lock_guard<std::mutex> stream_lock(f->stream_mu);
+    f->stream = stream;
+    f->online_epoch = ++online_epochs;
+    online_users.Set(f->id);
+    AddOnlineFollower(a, f);
+  }
+  return a;
+}
+
+void SNSServiceImpl::FanOutForTest(Client* author, uint64_t ordinal, const std::string& wire) {
+  InboxRef ref;
+  ref.author = author->id;
+  ref.ordinal = ordinal;
+  FanOut(author, ref, wire, 0);
+}
+
+Status SNSServiceImpl::Admit(grpc::ServerContextBase* context, Admission::Kind kind, Client* c) {
+  int64_t retry_ms;
+  TokenBucket* bucket = c ? (kind == Admission::kPost ? &c->post_bucket : &c->rpc_bucket) : nullptr;
+  if (admission.Admit(kind, bucket, &retry_ms)) return Status::OK;
+  context->AddTrailingMetadata("retry-after-ms", std::to_string(retry_ms));
+  return Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                kind == Admission::kPost ? "Too many posts, retry later" : "Too many requests, retry later");
+}
+
+//Rebuilds users (with the ids inbox entries refer to), sessions and the follow
+//graph from the last checkpoint plus the users.list and graph.log tails after it
+void SNSServiceImpl::Recover(const std::string* snapshot) {
+  auto start = std::chrono::steady_clock::now();
+  if (memory_budget && !user_pages.Open()) {
+    log(ERROR, "Cannot open " + Path("users.pages") + "; every user stays in memory");
+  }
+  Snapshot snap;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  bool from_snapshot = snapshot ? DecodeSnapshot(snapshot->data(), snapshot->size(), &snap, &social_graph, threads)
+                                : LoadSnapshot(snapshot_file, &snap, &social_graph, threads);
+  if (!from_snapshot) {
+    if (snapshot) {
+      log(ERROR, "The snapshot handed over is unreadable, ignoring it");
+    } else if (access(snapshot_file.c_str(), F_OK) == 0) {
+      log(ERROR, "Snapshot " + snapshot_file + " is unreadable, ignoring it");
+    }
+    snap = Snapshot();
+    social_graph = SocialGraph();
+  }
+
+  // Users get a Client once they are used, except that clients of the
+  // previous run get one, with a lease's worth of time to come back. The
+  // directory is sized for the snapshot's users and an eighth more
+  size_t name_bytes = 0;
+  for (const auto& name : snap.names) name_bytes += name.size();
+  size_t room = snap.names.size() + snap.names.size() / 8;
+  directory.Reserve(room, name_bytes + name_bytes / 8);
+  client_db.reserve(room);
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < snap.names.size(); i++) {
+    uint32_t id = directory.Add(snap.names[i]);
+    client_db.push_back(nullptr);
+    if (!snap.sessions[i]) continue;
+    Client* c = MakeResident(id);
+    c->session = snap.sessions[i];
+    c->lease_deadline = now + kLeaseTtl;
+  }
+
+  users_log_bytes = snap.users_log_offset;
+  ReadUsersLog();
+
+  uint64_t replayed = graph_log.Replay([this](GraphLog::Op op, uint32_t follower, uint32_t followee) {
+    ApplyGraphChange(op, follower, followee);
+  });
+  checkpointed_users = from_snapshot ? snap.names.size() : 0;
+  LoadHomes();
+
+  // The follows of users without a Client wait on disk
+  size_t paged = 0;
+  for (uint32_t id = 0; memory_budget && id < client_db.size(); id++) {
+    if (!client_db[id] && PageOut(id, 0, 0) && social_graph.paged(id)) paged++;
+  }
+#ifdef __GLIBC__
+  // The snapshot was loaded whole; give back what just went to disk
+  if (paged) malloc_trim(0);
+#endif
+
+  // The old tsd still adds to the index until TakeOver
+  if (!snapshot) {
+    search_index.Open();
+    ReindexPosts();
+  }
+
+  std::ifstream id_in(Path("inbox.id"));
+  if (!(id_in >> inbox_id)) {
+    inbox_id = std::to_string(NewSessionId());
+    std::ofstream(Path("inbox.id")) << inbox_id << "\n";
+  }
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  log(INFO, "Recovered " + std::to_string(client_db.size()) + " users and " +
+      std::to_string(social_graph.edges()) + " follows in " + std::to_string(static_cast<int>(ms)) +
+      " ms (" + (from_snapshot ? "snapshot + " : "no snapshot, ") + std::to_string(replayed) +
+      " graph log records); " + std::to_string(lru.size()) + " users in memory, the follows of " +
+      std::to_string(paged) + " paged out");
+}
+
+//Adds the users.list lines past users_log_bytes; db_mutex must be held, or
+//the server not serving yet. A line still being written is left for later
+void SNSServiceImpl::ReadUsersLog() {
+  std::ifstream in(users_file);
+  in.seekg(users_log_bytes);
+  std::string name;
+  while (std::getline(in, name) && !in.eof()) {
+    {
+      std::lock_guard<std::shared_mutex> names(directory_mu);
+      directory.Add(name);
+    }
+    client_db.push_back(nullptr);
+    users_log_bytes += name.size() + 1;
+  }
+  social_graph.Resize(client_db.size());
+}
+
+void SNSServiceImpl::ApplyGraphChange(GraphLog::Op op, uint32_t follower, uint32_t followee) {
+  if (std::max(follower, followee) >= client_db.size()) return;
+  if (op == GraphLog::kFollow) social_graph.Follow(follower, followee);
+  if (op == GraphLog::kUnFollow) social_graph.UnFollow(follower, followee);
+}
+
+//Reads where the users that live on other servers are; a later line
+//overrides an earlier one. db_mutex must be held, or the server not serving yet
+void SNSServiceImpl::LoadHomes() {
+  std::ifstream homes(homes_file);
+  std::string line;
+  while (std::getline(homes, line)) {
+    size_t tab = line.find('\t');
+    Client* c = tab == std::string::npos ? nullptr : FindClient(line.substr(0, tab));
+    if (!c) continue;
+    c->home = line.substr(tab + 1);
+    if (c->home.empty()) remote_users.Clear(c->id);
+    else remote_users.Set(c->id);
+  }
+}
+
+//Reads the post author stored at ordinal back from the post log
+bool SNSServiceImpl::ReadPost(uint32_t author, uint64_t ordinal, Message* msg) {
+  std::string username;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    if (author >= client_db.size()) return false;
+    username = directory.Name(author);
+  }
+  TimelineRange range;
+  range.cursor = ordinal;
+  range.limit = 1;
+  std::vector<TimelineRecord> records;
+  timeline_store.Scan(username, range, &records);
+  return !records.empty() && records[0].ordinal == ordinal &&
+         msg->ParseFromArray(records[0].payload.begin(), records[0].payload.size());
+}
+
+//Puts the posts indexed since the last index segment back into the index
+void SNSServiceImpl::ReindexPosts() {
+  uint64_t first, last;
+  search_index.Unflushed(&first, &last);
+  for (uint64_t doc = first; doc <= last; doc++) {
+    SearchHit hit;
+    Message msg;
+    if (search_index.Lookup(doc, &hit) && ReadPost(hit.author, hit.ordinal, &msg)) {
+      search_index.Reindex(doc, msg.msg());
+    }
+  }
+  SearchStats st = search_index.Stats();
+  log(INFO, "Search index: " + std::to_string(st.docs) + " posts in " + std::to_string(st.segments) +
+      " segments, " + std::to_string(first <= last ? last - first + 1 : 0) + " reindexed");
+}
+
+//Snapshots client_db and social_graph. The copy is taken under db_mutex and
+//written to disk after releasing it
+void SNSServiceImpl::Checkpoint() {
+  std::lock_guard<std::mutex> lock(checkpoint_mu);
+  if (handing_over) return;
+  Snapshot snap;
+  WriteCheckpoint(false, &snap);
+}
+
+//Takes a checkpoint into *snap, if anything changed since the last one or
+//force is set. Returns false if it could not be taken or written;
+//checkpoint_mu must be held
+bool SNSServiceImpl::WriteCheckpoint(bool force, Snapshot* out) {
+  Snapshot& snap = *out;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    if (!force && !graph_log.pending() && client_db.size() == checkpointed_users) return true;
+    snap.names.reserve(client_db.size());
+    snap.sessions.reserve(client_db.size());
+    for (uint32_t id = 0; id < client_db.size(); id++) {
+      snap.names.push_back(directory.Name(id));
+      // A paged-out user's lease ran out long ago, so a restart gives it no
+      // time to come back; it logs in again
+      snap.sessions.push_back(client_db[id] ? client_db[id]->session : 0);
+    }
+    bool read = social_graph.Serialize(&snap.graph, [this](uint32_t id, size_t* size) -> const char* {
+      const char* data = nullptr;
+      if (!user_pages.Get(id, &data, size) || *size < kPageHeader) return nullptr;
+      *size -= kPageHeader;
+      return data + kPageHeader;
+    });
+    if (!read) {
+      log(ERROR, "Checkpoint failed: cannot read a paged-out user's follows; graph.log is kept for recovery");
+      return false;
+    }
+    snap.users_log_offset = users_log_bytes;
+    graph_log.Rotate();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (!SaveSnapshot(snapshot_file, snap)) {
+    log(ERROR, "Checkpoint failed; graph.log is kept for recovery");
+    return false;
+  }
+  graph_log.Retire();
+  checkpointed_users = snap.names.size();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  log(INFO, "Checkpointed " + std::to_string(snap.names.size()) + " users, " +
+      std::to_string(snap.graph.size()) + " graph bytes in " + std::to_string(static_cast<int>(ms)) + " ms");
+  return true;
+}
+
+void SNSServiceImpl::CheckpointLoop() {
+  while (Sleep(kCheckpointInterval)) Checkpoint();
+}
+
+//The successor replays graph.log from where this checkpoint leaves it, so
+//the log must not be rotated again until the handover is over
+bool SNSServiceImpl::BeginHandover(Snapshot* snap) {
+  std::lock_guard<std::mutex> lock(checkpoint_mu);
+  handing_over = WriteCheckpoint(true, snap);
+  return handing_over;
+}
+
+void SNSServiceImpl::EndHandover() {
+  std::lock_guard<std::mutex> lock(checkpoint_mu);
+  handing_over = false;
+}
+
+//Ends every Timeline stream once what is queued on it is written. Streams
+//opened later are ended right away; either way the client is told to come
+//back to this address shortly (TimelineSession::EndStream)
+void SNSServiceImpl::Drain() {
+  std::unique_lock<std::mutex> lock(db_mutex);
+  AwaitFanouts(lock);
+  draining = true;
+  auto now = std::chrono::steady_clock::now();
+  for (uint32_t id : lru) {
+    Client* c = client_db[id];
+    std::lock_guard<std::mutex> stream_lock(c->stream_mu);
+    if (!c->stream) continue;
+    c->stream->Drain(Status(grpc::StatusCode::UNAVAILABLE, "Server restarting"));
+    c->stream = nullptr;
+    online_users.Clear(c->id);
+    c->lease_deadline = now + kLeaseTtl;
+  }
+}
+
+void SNSServiceImpl::Resume() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mu);
+    stopping = false;
+  }
+  forwarder.Restart();
+  Start();
+  draining = false;
+  EndHandover();
+}
+
+//What the successor cannot read from disk: sessions, and the forwarding
+//state. Call once nothing runs any more
+void SNSServiceImpl::SaveHandoverState(HandoverState* state) {
+  std::lock_guard<std::mutex> lock(db_mutex);
+  for (uint32_t id : lru) {
+    Client* c = client_db[id];
+    if (!c->session || !c->home.empty()) continue;
+    UserSession* s = state->add_sessions();
+    s->set_user(id);
+    s->set_session(c->session);
+  }
+  for (auto& queued : forwarder.Queued()) *state->add_forwards() = std::move(queued);
+  std::lock_guard<std::mutex> mirror_lock(mirror_mu);
+  for (const auto& f : forwarded) {
+    ForwardCursor* cursor = state->add_delivered();
+    cursor->set_author(f.first.first);
+    cursor->set_from(f.first.second);
+    cursor->set_next(f.second);
+  }
+  for (const auto& f : missed_next) {
+    ForwardCursor* cursor = state->add_delivered();
+    cursor->set_author(f.first.first);
+    cursor->set_from(f.first.second);
+    cursor->set_missed_next(f.second);
+  }
+}
+
+//Picks up where the tsd this one replaces left off: users and follows it
+//logged after the checkpoint it sent, the homes it recorded, its posts in
+//the search index, and what it handed over in state. Call before serving
+void SNSServiceImpl::TakeOver(const HandoverState& state) {
+  auto start = std::chrono::steady_clock::now();
+  size_t users, replayed;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    users = client_db.size();
+    ReadUsersLog();
+    users = client_db.size() - users;
+    replayed = graph_log.CatchUp([this](GraphLog::Op op, uint32_t follower, uint32_t followee) {
+      ApplyGraphChange(op, follower, followee);
+    });
+    LoadHomes();
+    // Their clients reconnect within kReconnectSpreadMs
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& s : state.sessions()) {
+      if (s.user() >= client_db.size()) continue;
+      Client* c = ClientAt(s.user());
+      c->session = s.session();
+      c->lease_deadline = now + kLeaseTtl;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mirror_mu);
+    for (const auto& cursor : state.delivered()) {
+      if (cursor.next()) forwarded[{cursor.author(), cursor.from()}] = cursor.next();
+      if (cursor.missed_next()) missed_next[{cursor.author(), cursor.from()}] = cursor.missed_next();
+    }
+  }
+  size_t queued = 0;
+  for (const auto& q : state.forwards()) {
+    for (const auto& item : q.items()) forwarder.Send(q.to(), item);
+    queued += q.items_size();
+  }
+  search_index.Open();
+  ReindexPosts();
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  log(INFO, "Took over " + std::to_string(users) + " new users, " + std::to_string(replayed) +
+      " graph log records, " + std::to_string(state.sessions_size()) + " sessions and " +
+      std::to_string(queued) + " queued forwards in " + std::to_string(static_cast<int>(ms)) + " ms");
+}
+
+uint64_t SNSServiceImpl::NewSessionId() {
+  uint64_t id;
+  do { id = session_rng(); } while (id == 0);
+  return id;
+}
+
+// Rebuilds a user's dedup window from the newest stored posts, so a server
+// that took over the user's data directory still recognizes retries. Done
+// once per resident Client, under stream_mu like every other use of the
+// window; db_mutex must not be held.
+void SNSServiceImpl::SeedPostWindow(Client* c) {
+  std::lock_guard<std::mutex> lock(c->stream_mu);
+  if (c->posted_seeded) return;
+  uint64_t size = timeline_store.Size(c->username);
+  TimelineRange range;
+  range.cursor = size > SeqWindow::kSpan ? size - SeqWindow::kSpan : 0;
+  std::vector<TimelineRecord> records;
+  timeline_store.Scan(c->username, range, &records);
+  Message m;
+  for (const auto& r : records) {
+    if (m.ParseFromArray(r.payload.begin(), static_cast<int>(r.payload.size())) && m.seq()) {
+      c->posted.Accept(m.seq());
+    }
+  }
+  c->posted_seeded = true;
+}
+
+//Reads c's follow times back from its _follow_time.txt; the last line for a
+//followee wins. db_mutex must be held
+void SNSServiceImpl::LoadFollowTimes(Client* c) {
+  std::ifstream in(Path(c->username + "_follow_time.txt"));
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t bar = line.rfind('|');
+    if (bar == std::string::npos) continue;
+    uint32_t id;
+    if (directory.Find(line.substr(0, bar), &id)) c->follow_since[id] = atoll(line.c_str() + bar + 1);
+  }
+  c->follow_since_loaded = true;
+}
+
+// Flushes inbox and search index buffers and logs the inbox footprint once a minute
+void SNSServiceImpl::FlushInboxes() {
+  for (int ticks = 1; Sleep(kInboxFlushInterval); ticks++) {
+    inbox_store.Flush();
+    search_index.Flush();
+    EvictCold();
+    if (ticks % 600 == 0) {
+      {
+        // Recounted in full, since follows change what every user holds
+        std::lock_guard<std::mutex> lock(db_mutex);
+        resident_bytes = 0;
+        for (uint32_t id : lru) {
+          client_db[id]->charged = Footprint(client_db[id]);
+          resident_bytes += client_db[id]->charged;
+        }
+      }
+      ResidencyStats rs = Residency();
+      log(INFO, "Users: " + std::to_string(rs.users) + " known, " + std::to_string(rs.resident) +
+          " in memory (" + std::to_string(rs.resident_bytes >> 20) + " MB" +
+          (rs.budget ? " of " + std::to_string(rs.budget >> 20) + " MB" : std::string()) + "), " +
+          std::to_string(rs.paged) + " paged out (" + std::to_string(rs.page_file_bytes >> 20) +
+          " MB on disk), " + std::to_string(rs.faults) + " faults, " + std::to_string(rs.evictions) + " evictions");
+      InboxStats st = inbox_store.Stats();
+      log(INFO, "Inboxes: " + std::to_string(st.inboxes) + " pending, " +
+          std::to_string(st.pending) + " refs, " + std::to_string(st.disk_bytes) +
+          " bytes on disk, " + std::to_string(st.dropped) + " dropped");
+      AdmissionStats ad = admission.Stats();
+      log(INFO, "Admission: " + std::to_string(ad.user_limited) + " over user limits, " +
+          std::to_string(ad.server_limited) + " over server limits, " + std::to_string(ad.shed) +
+          " shed; backlog " + std::to_string(ad.backlog) + ", post latency " +
+          std::to_string(ad.latency_us) + " us");
+      ForwarderStats fw = forwarder.Stats();
+      if (fw.sent || fw.queued) {
+        log(INFO, "Forwarding: " + std::to_string(fw.sent) + " sent, " + std::to_string(fw.queued) +
+            " queued, " + std::to_string(fw.retries) + " retried calls, " + std::to_string(fw.dropped) +
+            " dropped");
+      }
+    }
+  }
+}
+
+bool SNSServiceImpl::Sleep(std::chrono::milliseconds d) {
+  std::unique_lock<std::mutex> lock(stop_mu);
+  return !stop_cv.wait_for(lock, d, [this] { return stopping; });
+}
+
+void SNSServiceImpl::Start() {
+  workers.emplace_back(&SNSServiceImpl::FlushInboxes, this);
+  workers.emplace_back(&SNSServiceImpl::CheckpointLoop, this);
+}
+
+void SNSServiceImpl::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mu);
+    // Already stopped by a handover; a successor owns the files now
+    if (stopping) return;
+    stopping = true;
+  }
+  stop_cv.notify_all();
+  for (auto& t : workers) t.join();
+  workers.clear();
+  forwarder.Stop();
+  inbox_store.Flush();
+  // A clean stop writes out the in-memory postings so the next start need not rebuild them
+  search_index.Flush(true);
+}
+
+// Streams the TimelinePages of one GetTimeline call. Pages are assembled from
+// slices of the mmap'ed segments, so stored records are never re-serialized.
+class TimelinePageWriter : public grpc::ServerWriteReactor<grpc::ByteBuffer> {
+public:
+  TimelinePageWriter(SNSServiceImpl* service, const grpc::ByteBuffer* request) : service_(service) {
+    TimelineQuery query;
+    grpc::ByteBuffer raw(*request);
+    if (!grpc::SerializationTraits<TimelineQuery>::Deserialize(&raw, &query).ok()) {
+      Finish(Status(grpc::StatusCode::INVALID_ARGUMENT, "Malformed TimelineQuery"));
+      return;
+    }
+    username_ = query.username();
+    {
+      // Asked of the directory, so that queries about made-up names leave
+      // nothing behind in timeline_store
+      uint32_t id;
+      std::lock_guard<std::mutex> lock(service_->db_mutex);
+      if (!service_->directory.Find(username_, &id)) {
+        Finish(Status(grpc::StatusCode::NOT_FOUND, "User not found"));
+        return;
+      }
+    }
+    range_.since = query.has_since() ? query.since().seconds() : 0;
+    range_.until = query.has_until() ? query.until().seconds() : 0;
+    range_.cursor = query.cursor();
+    range_.max_bytes = kPageBytes;
+    remaining_ = query.limit() ? query.limit() : SIZE_MAX;
+    NextPage();
+  }
+
+  void OnWriteDone(bool ok) override {
+    if (!ok) { Finish(Status(grpc::StatusCode::CANCELLED, "Stream closed")); return; }
+    NextPage();
+  }
+
+  void OnDone() override { delete this; }
+
+private:
+  void NextPage() {
+    if (remaining_ == 0) { Finish(Status::OK); return; }
+    std::vector<TimelineRecord> records;
+    range_.limit = std::min(remaining_, kPageRecords);
+    uint64_t next = service_->timeline_store.Scan(username_, range_, &records);
+    if (records.empty()) { Finish(Status::OK); return; }
+
+    remaining_ = next ? remaining_ - records.size() : 0;
+    range_.cursor = next;
+    page_ = BuildTimelinePage(records, next);
+    StartWrite(&page_);
+  }
+
+  SNSServiceImpl* service_;
+  std::string username_;
+  TimelineRange range_;
+  size_t remaining_ = 0;
+  grpc::ByteBuffer page_;
+};
+
+// One Timeline stream. Incoming posts are parsed and serialized once, and the
+// resulting buffer is shared by every follower's stream instead of being
+// re-serialized per follower.
+class TimelineSession : public grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>,
+                        public PostStream {
+public:
+  TimelineSession(SNSServiceImpl* service, grpc::CallbackServerContext* context)
+      : service_(service), context_(context) {
+    set_backlog_counter(service_->admission.backlog());
+    if (service_->draining) {
+      Close(Status(grpc::StatusCode::UNAVAILABLE, "Server restarting"));
+      return;
+    }
+    const auto& md = context->client_metadata();
+    auto it = md.find("username");
+    if (it == md.end()) {
+      Close(Status(grpc::StatusCode::UNAUTHENTICATED, "No username in metadata"));
+      return;
+    }
+    std::string username(it->second.data(), it->second.length());
+    // The session Login handed out, in decimal
+    uint64_t session = 0;
+    it = md.find("session");
+    if (it != md.end()) session = strtoull(std::string(it->second.data(), it->second.length()).c_str(), nullptr, 10);
+
+    bool moved = false;
+    bool current = false;
+    {
+      std::lock_guard<std::mutex> lock(service_->db_mutex);
+      client_ = service_->FindClient(username);
+      moved = client_ && !client_->home.empty();
+      current = client_ && session && client_->session == session;
+      // Resident until OnDone
+      if (client_ && !moved && current) client_->pins++;
+    }
+    if (!client_) {
+      Close(Status(grpc::StatusCode::NOT_FOUND, "User not found"));
+      return;
+    }
+    if (moved) {
+      client_ = nullptr;
+      Close(Status(grpc::StatusCode::UNAVAILABLE, "User moved to another server"));
+      return;
+    }
+    if (!current) {
+      client_ = nullptr;
+      Close(Status(grpc::StatusCode::UNAUTHENTICATED, "Not the user's session; log in first"));
+      return;
+    }
+
+    // "post-encoding" lists the encodings the reader can unpack
+    packed_ = service_->compression && AsksFor(context, "post-encoding", kPostEncoding);
+    it = md.find("inbox-resume");
+    if (it != md.end()) resume_ = ParseResume(std::string(it->second.data(), it->second.length()));
+    Step([this] {
+      service_->SeedPostWindow(client_);
+      CatchUp();
+      StartRead(&in_);
+    });
+  }
+
+  void OnReadDone(bool ok) override {
+    Step([this, ok] {
+      if (!ok) {
+        Detach();
+        Close(Status::OK);
+        return;
+      }
+      if (HandleMessage()) StartRead(&in_);
+    });
+  }
+
+  void OnWriteDone(bool ok) override {
+    SendDone(ok);
+    if (ok) CommitReplay();
+  }
+
+  // gRPC is done with the stream; the session goes once its tasks are too
+  void OnDone() override {
+    Post([this] { Release(); });
+  }
+
+  // Called with the reader's stream_mu held, which also guards interned_
+  bool SendPost(OutgoingPost* post, uint64_t trace_id) override {
+    std::shared_ptr<const grpc::ByteBuffer> packed;
+    if (packed_) packed = post->packed();
+    if (!packed) return SendLive(post->plain(), trace_id);
+    if (interned_.count(post->author()) == 0) {
+      if (!SendLive(post->name())) return false;
+      interned_.insert(post->author());
+    }
+    return SendLive(packed, trace_id);
+  }
+
+protected:
+  void StartSend(const grpc::ByteBuffer* buf) override { StartWrite(buf); }
+  void EndStream(Status status) override {
+    // Ended for a handover: the same address serves again within moments,
+    // so the client comes straight back instead of asking the coordinator
+    if (service_->draining) {
+      thread_local std::minstd_rand rng(std::random_device{}());
+      context_->AddTrailingMetadata("reconnect-after-ms", std::to_string(rng() % kReconnectSpreadMs));
+    }
+    // What it missed is in its inbox already, so it may come straight back
+    if (overflowed()) {
+      log(WARNING, "Timeline stream of " + client_->username + " fell behind; closed");
+      context_->AddTrailingMetadata("retry-after-ms", "0");
+    }
+    std::lock_guard<std::mutex> lock(call_mu_);
+    if (steps_) {
+      end_pending_ = true;
+      end_status_ = status;
+      return;
+    }
+    ended_ = true;
+    Finish(status);
+  }
+
+private:
+  // Runs task on the service's session threads. Whatever may block, on disk
+  // or on running fan-outs, goes there instead of holding up the gRPC
+  // callback thread; the reactor's next step starts when task is done.
+  void Post(std::function<void()> task) {
+    refs_++;
+    service_->sessions->Post([this, task] {
+      task();
+      Release();
+    });
+  }
+
+  // Posts a step of the call, which may start its next read. A call that
+  // ended meanwhile is left alone, and one ending while a step runs is
+  // finished once no step does: until then OnDone, after which gRPC may free
+  // the call and context_, cannot come.
+  void Step(std::function<void()> step) {
+    Post([this, step] {
+      {
+        std::lock_guard<std::mutex> lock(call_mu_);
+        if (ended_) return;
+        steps_++;
+      }
+      step();
+      std::lock_guard<std::mutex> lock(call_mu_);
+      if (--steps_ == 0 && end_pending_) {
+        end_pending_ = false;
+        ended_ = true;
+        Finish(end_status_);
+      }
+    });
+  }
+
+  // Drops a reference: gRPC's, at OnDone, or a task's. The last one takes
+  // the user offline and deletes the session.
+  void Release() {
+    if (--refs_ > 0) return;
+    Detach();
+    if (client_) {
+      std::lock_guard<std::mutex> lock(service_->db_mutex);
+      client_->pins--;
+    }
+    delete this;
+  }
+
+  // Returns false if the stream was closed instead.
+  bool HandleMessage() {
+    Message incoming;
+    if (!grpc::SerializationTraits<Message>::Deserialize(&in_, &incoming).ok()) return true;
+
+    // A retried post that is already stored is only acknowledged again
+    if (incoming.seq() && Stored(incoming.seq())) {
+      SendAck(client_, incoming.seq());
+      return true;
+    }
+
+    // Posts their client did not sample may still be sampled here; either
+    // way the id goes out to followers with the post
+    uint64_t trace = incoming.trace_id();
+    if (!trace && !handshake_ && (trace = Tracer::Sample())) incoming.set_trace_id(trace);
+    int64_t received_at = trace ? Tracer::Now() : 0;
+    if (incoming.trace_sent_ns()) Tracer::Record("tsd.receive", trace, incoming.trace_sent_ns(), received_at);
+
+    // A post over the limits ends the stream. The client backs off, reconnects
+    // and re-sends its unacknowledged posts in order, so none is lost or
+    // overtaken by a later one.
+    int64_t start = Admission::Now();
+    if (!handshake_) {
+      TraceSpan span("tsd.admit", trace);
+      Status admitted = service_->Admit(context_, Admission::kPost, client_);
+      if (!admitted.ok()) {
+        Detach();
+        Close(admitted);
+        return false;
+      }
+    }
+    int64_t store_start = trace ? Tracer::Now() : 0;
+
+    // Serialized exactly once: the same bytes go to the segment log and,
+    // as one shared buffer, to every follower's stream.
+    std::string wire;
+    incoming.SerializeToString(&wire);
+
+    // The first message only opens the stream; everything after it is a post
+    bool stored = !handshake_;
+    bool duplicate = false;
+    InboxRef ref;
+    ref.author = client_->id;
+    if (stored) {
+      // MigrateOut moves the user under stream_mu. A post stored before that
+      // goes along with the user; a later one is left unacknowledged, and the
+      // client sends it again to its new server.
+      std::lock_guard<std::mutex> moving(client_->stream_mu);
+      if (!client_->home.empty()) return true;
+      // Checked again under the lock that Accept takes: another stream of
+      // the user, such as the one this reconnect replaces, may have stored
+      // the same retry since the check above
+      duplicate = incoming.seq() && client_->posted.Seen(incoming.seq());
+      if (!duplicate) {
+        ref.ordinal = service_->timeline_store.Append(client_->username, wire, incoming.timestamp().seconds());
+        if (ref.ordinal != TimelineStore::kAppendFailed) {
+          // Only a stored post counts as seen: one turned away here or above
+          // is retried, here or on the user's new server
+          if (incoming.seq()) client_->posted.Accept(incoming.seq());
+          service_->search_index.Add(client_->id, ref.ordinal, incoming.msg());
+          WriteLegacyTimeline(incoming);
+        }
+      }
+    }
+    if (duplicate) {
+      SendAck(client_, incoming.seq());
+      return true;
+    }
+    // Left unacknowledged; the client reconnects and sends it again
+    if (stored && ref.ordinal == TimelineStore::kAppendFailed) {
+      log(ERROR, "Cannot store a post of " + client_->username);
+      Detach();
+      Close(Status(grpc::StatusCode::INTERNAL, "Cannot store post"));
+      return false;
+    }
+    handshake_ = false;
+    int64_t stored_at = trace ? Tracer::Now() : 0;
+    Tracer::Record("tsd.store", trace, store_start, stored_at);
+
+    // Followers never see a handshake, such as a reconnecting stream's
+    if (stored) service_->FanOut(client_, ref, wire, trace);
+
+    if (trace) Tracer::Record("tsd.fanout", trace, stored_at, Tracer::Now());
+
+    if (incoming.seq()) SendAck(client_, incoming.seq());
+    if (stored) service_->admission.RecordPost(Admission::Now() - start);
+    return true;
+  }
+
+  // Whether a post with this seq is stored already
+  bool Stored(uint64_t seq) {
+    std::lock_guard<std::mutex> lock(client_->stream_mu);
+    return client_->posted.Seen(seq);
+  }
+
+  // Appends the post to the human readable <username>.timeline
+  void WriteLegacyTimeline(const Message& post) {
+    std::ofstream fout(service_->Path(client_->username + ".timeline"), std::ios::app);
+    if (!fout) return;
+    char buf[32];
+    time_t sec = static_cast<time_t>(post.timestamp().seconds());
+    std::tm* tm_ptr = localtime(&sec);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tm_ptr);
+    fout << "T " << buf << "\n"
+        << "U " << post.username() << "\n"
+        << "W " << post.msg() << "\n\n";
+  }
+
+  // Queues everything that reached the inbox while the user was offline,
+  // oldest first, then goes live. The bulk is replayed without db_mutex; only
+  // what arrived meanwhile is replayed under it, right before the stream is
+  // registered, so no post is missed or overtaken by a live one.
+  //
+  // Replay skips what the client's resume token says it already has, and
+  // ends with a fresh token. The cursor alone lags: it moves only once posts
+  // are written to the transport and reaches disk on the next Flush().
+  void CatchUp() {
+    uint64_t start = service_->inbox_store.Cursor(client_->username);
+    uint64_t pos = Replay(std::max(start, resume_), false);
+    {
+      // Fan-outs that still count the user offline append to its inbox; the
+      // last replay waits for them
+      std::unique_lock<std::mutex> lock(service_->db_mutex);
+      service_->AwaitFanouts(lock);
+      pos = Replay(pos, true);
+      Attach();
+    }
+    if (!service_->inbox_id.empty()) {
+      Message token;
+      token.set_inbox_resume(service_->inbox_id + ":" + std::to_string(pos));
+      Send(SerializeShared(token));
+    }
+    if (pos == start) return;
+    {
+      std::lock_guard<std::mutex> lock(replay_mu_);
+      replay_end_ = pos;
+      replay_mark_ = accepted();
+    }
+    CommitReplay();
+  }
+
+  // Position in a resume token issued for this data directory, else 0
+  uint64_t ParseResume(const std::string& token) {
+    const std::string& id = service_->inbox_id;
+    if (id.empty() || token.size() <= id.size() + 1 || token.compare(0, id.size(), id) != 0 ||
+        token[id.size()] != ':') {
+      return 0;
+    }
+    return strtoull(token.c_str() + id.size() + 1, nullptr, 10);
+  }
+
+  // Sends the posts referenced by the inbox from pos on. Consecutive posts of
+  // one author are read with a single Scan and sent as slices of the
+  // author's segments. Returns the position after the last reference sent.
+  uint64_t Replay(uint64_t pos, bool db_locked) {
+    std::vector<InboxRef> refs;
+    std::vector<std::string> authors;
+    std::vector<TimelineRecord> records;
+    while (true) {
+      refs.clear();
+      uint64_t next = service_->inbox_store.Read(client_->username, pos, kReplayBatch, &refs);
+      if (refs.empty()) return next;
+
+      authors.assign(refs.size(), std::string());
+      {
+        std::unique_lock<std::mutex> lock(service_->db_mutex, std::defer_lock);
+        if (!db_locked) lock.lock();
+        for (size_t i = 0; i < refs.size(); i++) {
+          if (refs[i].author < service_->client_db.size()) authors[i] = service_->directory.Name(refs[i].author);
+        }
+      }
+
+      for (size_t i = 0, j; i < refs.size(); i = j) {
+        for (j = i + 1; j < refs.size() && refs[j].author == refs[i].author &&
+                        refs[j].ordinal == refs[j - 1].ordinal + 1; j++) {}
+        if (authors[i].empty()) continue;
+        TimelineRange range;
+        range.cursor = refs[i].ordinal;
+        range.limit = j - i;
+        records.clear();
+        service_->timeline_store.Scan(authors[i], range, &records);
+        if (!packed_ || !SendPacked(records)) {
+          for (auto& r : records) Send(std::make_shared<const grpc::ByteBuffer>(&r.payload, 1));
+        }
+      }
+      pos = next;
+    }
+  }
+
+  // Sends replayed posts packed into as few frames as fit kFrameBytes, with
+  // their usernames left in: repeats of one compress away within a frame.
+  // Returns false, having sent nothing, if they cannot be packed.
+  bool SendPacked(const std::vector<TimelineRecord>& records) {
+    std::vector<std::shared_ptr<const grpc::ByteBuffer>> frames;
+    std::string raw, frame;
+    for (size_t i = 0; i < records.size(); i++) {
+      const auto& payload = records[i].payload;
+      AppendToFrame(&raw, reinterpret_cast<const char*>(payload.begin()), payload.size());
+      if (raw.size() < kFrameBytes && i + 1 < records.size()) continue;
+      if (!PackFrame(raw, &frame)) return false;
+      Message packed;
+      packed.set_packed(frame);
+      frames.push_back(SerializeShared(packed));
+      raw.clear();
+    }
+    for (auto& f : frames) Send(std::move(f));
+    return true;
+  }
+
+  // Advances the inbox cursor once every replayed post has been written.
+  void CommitReplay() {
+    uint64_t pos;
+    {
+      std::lock_guard<std::mutex> lock(replay_mu_);
+      if (!replay_end_ || written() < replay_mark_) return;
+      pos = replay_end_;
+      replay_end_ = 0;
+    }
+    service_->inbox_store.Commit(client_->username, pos);
+  }
+
+  // Marks the user online and announces the stream to everyone they follow.
+  // db_mutex must be held.
+  void Attach() {
+    {
+      std::lock_guard<std::mutex> stream_lock(client_->stream_mu);
+      client_->stream = this;
+    }
+    client_->online_epoch = ++service_->online_epochs;
+    service_->online_users.Set(client_->id);
+    // Followees that are paged out pick the stream up when paged back in
+    for (auto followee : service_->social_graph.Following(client_->id)) {
+      Client* c = service_->client_db[followee];
+      if (c) service_->AddOnlineFollower(c, client_);
+    }
+  }
+
+  // Marks the user offline. Followees' online lists are cleaned up lazily;
+  // the session lease runs on for kLeaseTtl so the client can reconnect.
+  void Detach() {
+    if (!client_) return;
+    std::unique_lock<std::mutex> lock(service_->db_mutex);
+    service_->AwaitFanouts(lock);
+    std::lock_guard<std::mutex> stream_lock(client_->stream_mu);
+    if (client_->stream != this) return;
+    client_->stream = nullptr;
+    service_->online_users.Clear(client_->id);
+    client_->lease_deadline = std::chrono::steady_clock::now() + kLeaseTtl;
+  }
+
+  SNSServiceImpl* service_;
+  grpc::CallbackServerContext* context_;
+  Client* client_ = nullptr;
+  grpc::ByteBuffer in_;
+  bool handshake_ = true;
+  std::mutex replay_mu_;
+  uint64_t replay_end_ = 0;    // inbox position to commit once replay_mark_ buffers are written
+  uint64_t replay_mark_ = 0;
+  uint64_t resume_ = 0;        // inbox position the client's resume token says it has reached
+  bool packed_ = false;        // the reader takes kPostEncoding
+  std::unordered_set<uint32_t> interned_;   // author tokens named on this stream
+  std::atomic<int> refs_{1};   // gRPC's until OnDone, plus one per task posted
+  std::mutex call_mu_;
+  int steps_ = 0;              // steps running; call_mu_
+  bool ended_ = false;         // Finish was called; call_mu_
+  bool end_pending_ = false;   // EndStream waits for the steps running; call_mu_
+  Status end_status_;
+};
+
+Status SNSServiceImpl::List(ServerContext* context, const Request* request, ListReply* list_reply) {
+  // Get the username from the request
+  std::string user = request->username();
+
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* user_client = FindClient(user);
+  Status admitted = Admit(context, Admission::kRpc, user_client);
+  if (!admitted.ok()) return admitted;
+  RenewLease(user_client, request->session());
+
+  // Versions the caller already holds, if they came from this instance
+  bool known = request->list_epoch() == list_epoch;
+  list_reply->set_list_epoch(list_epoch);
+
+  // Users are only ever added, so the directory's version is its size and
+  // the users added since are the tail of client_db
+  size_t from = 0;
+  if (known && request->users_version() <= client_db.size()) {
+    from = request->users_version();
+    list_reply->set_users_delta(true);
+  }
+  for (size_t i = from; i < client_db.size(); i++) {
+    list_reply->add_all_users(directory.Name(i));
+  }
+  list_reply->set_users_version(client_db.size());
+
+  if (user_client) {
+    std::vector<uint32_t> added, removed;
+    const ChangeLog& changes = user_client->follower_changes;
+    list_reply->set_followers_version(changes.version());
+    if (known && changes.Since(request->followers_version(), &added, &removed)) {
+      list_reply->set_followers_delta(true);
+      for (auto f : added) list_reply->add_followers(directory.Name(f));
+      for (auto f : removed) list_reply->add_removed_followers(directory.Name(f));
+    } else {
+      for (auto f : social_graph.Followers(user_client->id)) {
+        list_reply->add_followers(directory.Name(f));
+      }
+    }
+  }
+  return Status::OK;
+}
+
+Status SNSServiceImpl::Follow(ServerContext* context, const Request* request, Reply* reply) {
+  // Get the username of the requester
+  std::string user = request->username();
+
+  // Check if an argument (user to follow) is provided
+  if (request->arguments_size() == 0) { reply->set_msg("INVALID"); return Status::OK; }
+  std::string user_to_follow = request->arguments(0);
+
+  // Prevent self-following
+  if (user == user_to_follow) { reply->set_msg("INVALID_USERNAME"); return Status::OK; }
+
+  // Find the client objects for both users
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* user_client = FindClient(user);
+  Client* follow_client = FindClient(user_to_follow);
+  Status admitted = Admit(context, Admission::kRpc, user_client);
+  if (!admitted.ok()) return admitted;
+
+  // Check if both users exist
+  if (!user_client || !follow_client) { reply->set_msg("User does not exist"); return Status::OK; }
+  RenewLease(user_client, request->session());
+
+  // Establish the follow relationship unless it already exists
+  if (!social_graph.Follow(user_client->id, follow_client->id)) {
+    reply->set_msg("Already following user");
+    return Status::OK;
+  }
+  graph_log.Append(GraphLog::kFollow, user_client->id, follow_client->id);
+  follow_client->follower_changes.Record(user_client->id, true);
+  if (!follow_client->home.empty()) ForwardFollow(user_client, follow_client, false, 0);
+  if (online_users.Test(user_client->id)) AddOnlineFollower(follow_client, user_client);
+
+  // Record the follow time for timeline filtering
+  {
+    long long now = time(nullptr);
+    std::ofstream ofs(Path(user + "_follow_time.txt"), std::ios::app);
+    ofs << user_to_follow << "|" << now << "\n";
+    if (user_client->follow_since_loaded) user_client->follow_since[follow_client->id] = now;
+  }
+
+  reply->set_msg("OK");
+  return Status::OK;
+}
+
+Status SNSServiceImpl::UnFollow(ServerContext* context, const Request* request, Reply* reply) {
+  // Get the username of the requester
+  std::string user = request->username();
+
+  // Check if an argument (user to unfollow) is provided
+  if (request->arguments_size() == 0) { reply->set_msg("INVALID"); return Status::OK; }
+  std::string user_to_unfollow = request->arguments(0);
+
+  // Prevent self-unfollowing
+  if (user == user_to_unfollow) { reply->set_msg("INVALID_USERNAME"); return Status::OK; }
+
+  // Find the client objects for both users
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* user_client = FindClient(user);
+  Client* unfollow_client = FindClient(user_to_unfollow);
+  Status admitted = Admit(context, Admission::kRpc, user_client);
+  if (!admitted.ok()) return admitted;
+
+  // Check if both users exist
+  if (!user_client || !unfollow_client) { reply->set_msg("User does not exist"); return Status::OK; }
+  RenewLease(user_client, request->session());
+
+  // Remove the edge from both sides
+  if (!social_graph.UnFollow(user_client->id, unfollow_client->id)) {
+    reply->set_msg("Not following user");
+    return Status::OK;
+  }
+  graph_log.Append(GraphLog::kUnFollow, user_client->id, unfollow_client->id);
+  unfollow_client->follower_changes.Record(user_client->id, false);
+  if (!unfollow_client->home.empty()) ForwardFollow(user_client, unfollow_client, true, 0);
+  auto& online = unfollow_client->online_followers;
+  online.erase(std::remove_if(online.begin(), online.end(),
+                              [&](const OnlineRef& r) { return r.user == user_client->id; }),
+               online.end());
+
+  reply->set_msg("OK");
+  return Status::OK;
+}
+
+Status SNSServiceImpl::Login(ServerContext* context, const Request* request, Reply* reply) {
+  // Get the username from the request
+  std::string user = request->username();
+
+  Pins pins(this);
+  Client* c;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    c = FindClient(user);
+    // Its client asks the coordinator again and finds the new server
+    if (c && !c->home.empty()) return Status(grpc::StatusCode::UNAVAILABLE, "User moved to another server");
+    if (c) {
+      // Someone else holds the lease; the holder itself may log in again
+      if (c->HasLease() && request->session() != c->session) {
+        reply->set_msg("User already logged in");
+        return Status::OK;
+      }
+      // A user recovered without one gets a session here too
+      if (!c->session || request->session() != c->session) c->session = NewSessionId();
+      reply->set_msg("Login successful");
+    } else {
+      // Create new user if not found
+      c = AddClient(user);
+      c->session = NewSessionId();
+      std::ofstream(users_file, std::ios::app) << user << "\n";
+      users_log_bytes += user.size() + 1;
+      reply->set_msg("New user created and logged in");
+    }
+    c->lease_deadline = std::chrono::steady_clock::now() + kLeaseTtl;
+    reply->set_session(c->session);
+    pins.Add(c);
+  }
+  // A client that starts over numbers its posts on from the last one stored.
+  // The window is seeded here, off db_mutex, and the stream reuses it.
+  SeedPostWindow(c);
+  std::lock_guard<std::mutex> lock(c->stream_mu);
+  reply->set_last_seq(c->posted.high());
+  return Status::OK;
+}
+
+Status SNSServiceImpl::KeepAlive(ServerContext* context, const Request* request, Reply* reply) {
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* c = FindClient(request->username());
+  if (!c || !request->session() || c->session != request->session()) {
+    reply->set_msg("NO_SESSION");
+    return Status::OK;
+  }
+  RenewLease(c, request->session());
+  reply->set_msg("OK");
+  return Status::OK;
+}
+
+Status SNSServiceImpl::GetHomeTimeline(ServerContext* context, const HomeTimelineQuery* query,
+                                       HomeTimelinePage* page) {
+  // Only for a caller that asks; see GetTimeline
+  if (compression && AsksFor(context, "page-encoding", "gzip")) {
+    context->set_compression_level(GRPC_COMPRESS_LEVEL_HIGH);
+  }
+  size_t limit = query->limit() ? std::min<size_t>(query->limit(), kMaxHomeLimit) : kHomeLimit;
+
+  // Copy out who the user follows and since when; the merge runs unlocked
+  std::vector<HomeSource> sources;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    Client* c = FindClient(query->username());
+    if (!c) return Status(grpc::StatusCode::NOT_FOUND, "User not found");
+    Status admitted = Admit(context, Admission::kRpc, c);
+    if (!admitted.ok()) return admitted;
+    if (!c->follow_since_loaded) LoadFollowTimes(c);
+    const auto& following = social_graph.Following(c->id);
+    sources.resize(following.size());
+    for (size_t i = 0; i < following.size(); i++) {
+      sources[i].username = directory.Name(following[i]);
+      auto it = c->follow_since.find(following[i]);
+      if (it != c->follow_since.end()) sources[i].since = it->second;
+    }
+  }
+
+  HomePosition from, next;
+  if (query->has_cursor()) {
+    from.time = query->cursor().time();
+    from.username = query->cursor().username();
+    from.ordinal = query->cursor().ordinal();
+  }
+  std::vector<HomeEntry> entries;
+  bool more = BuildHomePage(timeline_store, sources, query->has_cursor() ? &from : nullptr,
+                            limit, &entries, &next);
+  for (const auto& e : entries) {
+    if (!page->add_posts()->ParseFromArray(e.record.payload.begin(), e.record.payload.size())) {
+      page->mutable_posts()->RemoveLast();
+    }
+  }
+  if (more) {
+    page->mutable_next_cursor()->set_time(next.time);
+    page->mutable_next_cursor()->set_username(next.username);
+    page->mutable_next_cursor()->set_ordinal(next.ordinal);
+  }
+  return Status::OK;
+}
+
+Status SNSServiceImpl::Search(ServerContext* context, const SearchQuery* query, SearchReply* reply) {
+  std::vector<std::string> terms;
+  SearchIndex::Tokenize(query->query(), &terms);
+  if (terms.empty()) return Status(grpc::StatusCode::INVALID_ARGUMENT, "Query has no words");
+  // Queries are anonymous, so only the server-wide limit applies
+  Status admitted = Admit(context, Admission::kRpc, nullptr);
+  if (!admitted.ok()) return admitted;
+  size_t limit = query->limit() ? std::min<size_t>(query->limit(), kMaxSearchLimit) : kSearchLimit;
+
+  std::vector<SearchHit> hits;
+  reply->set_next_cursor(search_index.Search(query->query(), limit, query->cursor(), &hits));
+  for (const auto& hit : hits) {
+    if (!ReadPost(hit.author, hit.ordinal, reply->add_posts())) reply->mutable_posts()->RemoveLast();
+  }
+  return Status::OK;
+}
+
+grpc::ServerWriteReactor<grpc::ByteBuffer>* SNSServiceImpl::GetTimeline(grpc::CallbackServerContext* context,
+                                                                       const grpc::ByteBuffer* request) {
+  // Pages go out as slices of the mapped log. Compressing one copies and
+  // deflates up to kPageBytes, so it is done only for a caller that asks with
+  // "page-encoding: gzip", such as one on a slow link
+  if (compression && AsksFor(context, "page-encoding", "gzip")) {
+    context->set_compression_level(GRPC_COMPRESS_LEVEL_HIGH);
+  }
+  return new TimelinePageWriter(this, request);
+}
+
+grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* SNSServiceImpl::Timeline(grpc::CallbackServerContext* context) {
+  return new TimelineSession(this, context);
+}
+
+void SNSServiceImpl::set_address(const std::string& address, Forwarder::ChannelFactory channels) {
+  // Forwarded posts, copied logs and migrated users are bulk, and may cross
+  // slow links between clusters
+  if (!channels && compression) {
+    channels = [](const std::string& to) {
+      grpc::ChannelArguments args;
+      args.SetCompressionAlgorithm(GRPC_COMPRESS_GZIP);
+      return grpc::CreateCustomChannel(to, grpc::InsecureChannelCredentials(), args);
+    };
+  }
+  forwarder.Configure(address, std::move(channels));
+}
+
+//Looks a user up by name, adding it as living at home if it is new here;
+//db_mutex must be held
+Client* SNSServiceImpl::FindOrAddRemote(const std::string& username, const std::string& home) {
+  Client* c = FindClient(username);
+  if (c) return c;
+  c = AddClient(username);
+  std::ofstream(users_file, std::ios::app) << username << "\n";
+  users_log_bytes += username.size() + 1;
+  SetHome(c, home);
+  return c;
+}
+
+//Records that c lives at home (this server if empty or our own address);
+//db_mutex must be held
+void SNSServiceImpl::SetHome(Client* c, const std::string& home) {
+  const std::string& h = home == forwarder.self() ? std::string() : home;
+  if (c->home == h) return;
+  c->home = h;
+  if (h.empty()) remote_users.Clear(c->id);
+  else remote_users.Set(c->id);
+  std::ofstream(homes_file, std::ios::app) << c->username << "\t" << h << "\n";
+}
+
+//Copies c's posts from its log on home until ours holds upto of them (all
+//there are if upto is 0). mirror_mu must be held.
+bool SNSServiceImpl::SyncMirror(Client* c, const std::string& home, uint64_t upto) {
+  uint64_t size = timeline_store.Size(c->username);
+  if (upto && size >= upto) return true;
+  TimelineQuery query;
+  query.set_username(c->username);
+  query.set_cursor(size);
+  if (upto) query.set_limit(static_cast<uint32_t>(upto - size));
+
+  grpc::ClientContext ctx;
+  ctx.set_deadline(std::chrono::system_clock::now() + kMirrorDeadline);
+  auto stub = csce438::SNSService::NewStub(forwarder.Channel(home));
+  auto reader = stub->GetTimeline(&ctx, query);
+  csce438::TimelinePage page;
+  while (reader->Read(&page)) {
+    for (const auto& post : page.posts()) {
+      uint64_t ordinal = timeline_store.Append(c->username, post);
+      if (ordinal == TimelineStore::kAppendFailed) {
+        ctx.TryCancel();
+        reader->Finish();
+        log(ERROR, "Cannot store the copied posts of " + c->username);
+        return false;
+      }
+      search_index.Add(c->id, ordinal, post.msg());
+    }
+  }
+  Status status = reader->Finish();
+  if (!status.ok()) {
+    log(WARNING, "Cannot copy the posts of " + c->username + " from " + home + ": " + status.error_message());
+    return false;
+  }
+  return !upto || timeline_store.Size(c->username) >= upto;
+}
+
+//Sends a post of author on to its followers that live on other servers, one
+//item per server; db_mutex must be held
+void SNSServiceImpl::ForwardPost(Client* author, uint64_t ordinal, const std::string& wire,
+                                 const std::vector<uint32_t>& followers, uint32_t hops) {
+  std::map<std::string, Forwarded> items;
+  for (auto f : followers) items[client_db[f]->home].add_followers(client_db[f]->username);
+  for (auto& it : items) {
+    Forwarded& item = it.second;
+    item.set_post(wire);
+    item.set_ordinal(ordinal);
+    item.set_author(author->username);
+    item.set_home(author->home);
+    item.set_hops(hops);
+    forwarder.Send(it.first, std::move(item));
+  }
+}
+
+//Tells the server followee lives on about a follow change; db_mutex must be held
+void SNSServiceImpl::ForwardFollow(Client* follower, Client* followee, bool unfollow, uint32_t hops) {
+  Forwarded item;
+  item.set_follower(follower->username);
+  item.set_home(follower->home);
+  item.set_followee(followee->username);
+  item.set_unfollow(unfollow);
+  item.set_hops(hops);
+  forwarder.Send(followee->home, std::move(item));
+}
+
+void SNSServiceImpl::ApplyForwardedFollow(const std::string& from, const Forwarded& item) {
+  std::lock_guard<std::mutex> lock(db_mutex);
+  Client* followee = FindClient(item.followee());
+  if (!followee) return;
+  Client* follower = FindOrAddRemote(item.follower(), item.home().empty() ? from : item.home());
+  if (follower == followee) return;
+  bool changed = item.unfollow() ? social_graph.UnFollow(follower->id, followee->id)
+                                 : social_graph.Follow(follower->id, followee->id);
+  if (changed) {
+    graph_log.Append(item.unfollow() ? GraphLog::kUnFollow : GraphLog::kFollow, follower->id, followee->id);
+    followee->follower_changes.Record(follower->id, !item.unfollow());
+  }
+  // The followee has moved on from here as well
+  if (!followee->home.empty() && followee->home != from && item.hops() < kMaxHops) {
+    ForwardFollow(follower, followee, item.unfollow(), item.hops() + 1);
+  }
+}
+
+//Stores a forwarded post in our copy of its author's log and delivers it to
+//the followers it names. UNAVAILABLE if the posts before it could not be
+//copied; the sender then retries the call.
+Status SNSServiceImpl::DeliverForwarded(const std::string& from, const Forwarded& item) {
+  Message post;
+  if (!post.ParseFromString(item.post())) return Status::OK;
+  Pins pins(this);
+  Client* author;
+  std::string home;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    author = pins.Add(FindOrAddRemote(post.username(), item.home().empty() ? from : item.home()));
+    home = author->home;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mirror_mu);
+    uint64_t& next = forwarded[{author->id, from}];
+    if (item.ordinal() < next) return Status::OK;
+    uint64_t size = timeline_store.Size(author->username);
+    if (home.empty()) {
+      // The author has moved here since; its posts came along, so this one
+      // is only delivered. One this server never saw went astray.
+      if (item.ordinal() >= size) return Status::OK;
+    } else {
+      if (item.ordinal() > size && !SyncMirror(author, home, item.ordinal())) {
+        return Status(grpc::StatusCode::UNAVAILABLE, "Cannot copy the posts of " + author->username);
+      }
+      // A copy made meanwhile may hold the post already
+      if (item.ordinal() >= timeline_store.Size(author->username)) {
+        if (timeline_store.Append(author->username, item.post(), post.timestamp().seconds()) ==
+            TimelineStore::kAppendFailed) {
+          return Status(grpc::StatusCode::UNAVAILABLE, "Cannot store the post of " + author->username);
+        }
+        search_index.Add(author->id, item.ordinal(), post.msg());
+      }
+    }
+    next = item.ordinal() + 1;
+  }
+
+  OutgoingPost out(item.post(), author->id + 1);
+  InboxRef ref;
+  ref.author = author->id;
+  ref.ordinal = item.ordinal();
+  std::vector<uint32_t> onward;
+  std::lock_guard<std::mutex> lock(db_mutex);
+  for (const auto& name : item.followers()) {
+    Client* f = FindClient(name);
+    if (!f) continue;
+    if (!f->home.empty()) {
+      onward.push_back(f->id);
+    } else {
+      // A stream that is closed or has fallen behind leaves it to the inbox
+      bool sent = false;
+      if (online_users.Test(f->id)) {
+        std::lock_guard<std::mutex> stream_lock(f->stream_mu);
+        sent = f->stream && f->stream->SendPost(&out, post.trace_id());
+      }
+      if (!sent) inbox_store.Append(f->username, ref);
+    }
+  }
+  if (!onward.empty() && item.hops() < kMaxHops) ForwardPost(author, item.ordinal(), item.post(), onward, item.hops() + 1);
+  return Status::OK;
+}
+
+//Delivers the posts a note says the sender dropped from its queue to the
+//followers it names, from our copy of the author's log. UNAVAILABLE if that
+//copy cannot be brought up to date; the sender then retries the call.
+Status SNSServiceImpl::DeliverMissed(const std::string& from, const Forwarded& note) {
+  Pins pins(this);
+  Client* author;
+  std::string home;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    author = pins.Add(FindOrAddRemote(note.author(), note.home().empty() ? from : note.home()));
+    home = author->home;
+  }
+  uint64_t first, upto = note.ordinal() + 1;
+  {
+    std::lock_guard<std::mutex> lock(mirror_mu);
+    uint64_t& next = missed_next[{author->id, from}];
+    first = std::max(next, note.missed_from());
+    if (first >= upto) return Status::OK;
+    if (!home.empty() && !SyncMirror(author, home, upto)) {
+      return Status(grpc::StatusCode::UNAVAILABLE, "Cannot copy the posts of " + author->username);
+    }
+    next = upto;
+  }
+
+  TimelineRange range;
+  range.cursor = first;
+  range.limit = upto - first;
+  std::vector<TimelineRecord> records;
+  timeline_store.Scan(author->username, range, &records);
+  std::vector<std::string> wires;
+  std::vector<std::unique_ptr<OutgoingPost>> posts;
+  wires.reserve(records.size());
+  for (const auto& r : records) {
+    wires.emplace_back(reinterpret_cast<const char*>(r.payload.begin()), r.payload.size());
+    posts.emplace_back(new OutgoingPost(wires.back(), author->id + 1));
+  }
+
+  InboxRef ref;
+  ref.author = author->id;
+  std::lock_guard<std::mutex> lock(db_mutex);
+  for (const auto& name : note.followers()) {
+    Client* f = FindClient(name);
+    // Followers that unfollowed meanwhile, or moved on, go without
+    if (!f || !f->home.empty() || !social_graph.Follows(f->id, author->id)) continue;
+    // Posts a stream refuses, and every post after, go to the inbox
+    size_t sent = 0;
+    if (online_users.Test(f->id)) {
+      std::lock_guard<std::mutex> stream_lock(f->stream_mu);
+      while (sent < posts.size() && f->stream && f->stream->SendPost(posts[sent].get())) sent++;
+    }
+    for (size_t i = sent; i < records.size(); i++) {
+      ref.ordinal = records[i].ordinal;
+      inbox_store.Append(f->username, ref);
+    }
+  }
+  return Status::OK;
+}
+
+Status SNSServiceImpl::Forward(ServerContext* context, const ForwardRequest* request, Reply* reply) {
+  for (const auto& item : request->items()) {
+    if (!item.followee().empty()) {
+      ApplyForwardedFollow(request->from(), item);
+      continue;
+    }
+    // The sender retries the whole call; what got through is recognized then
+    Status status = item.post().empty() ? DeliverMissed(request->from(), item)
+                                        : DeliverForwarded(request->from(), item);
+    if (!status.ok()) return status;
+  }
+  reply->set_msg("OK");
+  return Status::OK;
+}
+
+//Adds the users c follows and is followed by to t, with where they live;
+//db_mutex must be held
+void SNSServiceImpl::AddPeers(Client* c, UserTransfer* t) {
+  if (!c->follow_since_loaded) LoadFollowTimes(c);
+  for (auto f : social_graph.Following(c->id)) {
+    csce438::Peer* p = t->add_following();
+    p->set_username(directory.Name(f));
+    p->set_home(HomeOf(f));
+    auto it = c->follow_since.find(f);
+    if (it != c->follow_since.end()) p->set_since(it->second);
+  }
+  for (auto f : social_graph.Followers(c->id)) {
+    csce438::Peer* p = t->add_followers();
+    p->set_username(directory.Name(f));
+    p->set_home(HomeOf(f));
+  }
+}
+
+//Moves users to request->destination() in two calls from the coordinator.
+//The first copies their posts while they stay here. The cutover then sends
+//what they posted since, their follows and undelivered inbox, and hands them
+//over: their streams end, and from then on this server forwards whatever
+//reaches them. Should the destination fail, they stay here.
+Status SNSServiceImpl::MigrateOut(ServerContext* context, const MigrateRequest* request, MigrateReply* reply) {
+  const std::string& to = request->destination();
+  if (forwarder.self().empty()) {
+    return Status(grpc::StatusCode::FAILED_PRECONDITION, "Server address is not set");
+  }
+  if (to.empty() || to == forwarder.self()) {
+    return Status(grpc::StatusCode::INVALID_ARGUMENT, "No destination to migrate to");
+  }
+
+  Pins pins(this);
+  std::vector<Client*> users;
+  {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    for (const auto& name : request->usernames()) {
+      Client* c = FindClient(name);
+      if (c && c->home.empty()) users.push_back(pins.Add(c));
+    }
+  }
+
+  grpc::ClientContext ctx;
+  ctx.AddMetadata("from", forwarder.self());
+  Reply import_reply;
+  auto stub = csce438::SNSService::NewStub(forwarder.Channel(to));
+  auto writer = stub->Import(&ctx, &import_reply);
+
+  // Streams posts [from, upto) of c's log
+  auto send_posts = [&](Client* c, uint64_t from, uint64_t upto) {
+    UserTransfer t;
+    std::vector<TimelineRecord> records;
+    while (from < upto) {
+      TimelineRange range;
+      range.cursor = from;
+      range.limit = upto - from;
+      range.max_bytes = kTransferBytes;
+      records.clear();
+      timeline_store.Scan(c->username, range, &records);
+      if (records.empty()) break;
+      t.Clear();
+      t.set_username(c->username);
+      t.set_first_post(from);
+      for (const auto& r : records) {
+        t.add_posts(reinterpret_cast<const char*>(r.payload.begin()), r.payload.size());
+        reply->set_bytes(reply->bytes() + r.payload.size());
+      }
+      reply->set_posts(reply->posts() + records.size());
+      if (!writer->Write(t)) return false;
+      from = records.back().ordinal + 1;
+    }
+    return true;
+  };
+
+  if (!request->cutover()) {
+    for (Client* c : users) {
+      UserTransfer t;
+      t.set_username(c->username);
+      {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        AddPeers(c, &t);
+      }
+      uint64_t size = timeline_store.Size(c->username);
+      if (!writer->Write(t) || !send_posts(c, 0, size)) break;
+      // Keeps c resident (Evictable) until the cutover
+      std::lock_guard<std::mutex> lock(db_mutex);
+      c->migrated_posts = size;
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+    if (!status.ok()) return status;
+    reply->set_users(users.size());
+    return Status::OK;
+  }
+
+  // Posts for these users wait until they have arrived
+  forwarder.Hold(to);
+  std::vector<UserTransfer> moves(users.size());
+  {
+    std::unique_lock<std::mutex> lock(db_mutex);
+    AwaitFanouts(lock);
+    for (size_t i = 0; i < users.size(); i++) {
+      Client* c = users[i];
+      std::lock_guard<std::mutex> stream_lock(c->stream_mu);
+      SetHome(c, to);
+      c->moved_at = timeline_store.Size(c->username);
+      UserTransfer& t = moves[i];
+      t.set_username(c->username);
+      t.set_first_post(c->moved_at);
+      t.set_moved(true);
+      t.set_session(c->session);
+      AddPeers(c, &t);
+      // What is queued still reaches the client; it then reconnects, and
+      // Login sends it to the coordinator, which routes it to the new server
+      if (c->stream) {
+        c->stream->Drain(Status(grpc::StatusCode::UNAVAILABLE, "User moved to another server"));
+        c->stream = nullptr;
+        online_users.Clear(c->id);
+      }
+    }
+  }
+
+  std::vector<uint64_t> inbox_end(users.size());
+  bool sent = true;
+  for (size_t i = 0; i < users.size() && sent; i++) {
+    Client* c = users[i];
+    UserTransfer& t = moves[i];
+    uint64_t copied;
+    {
+      std::lock_guard<std::mutex> lock(db_mutex);
+      copied = c->migrated_posts;
+    }
+    uint64_t pos = inbox_store.Cursor(c->username);
+    std::vector<InboxRef> refs;
+    while (true) {
+      refs.clear();
+      uint64_t next = inbox_store.Read(c->username, pos, kReplayBatch, &refs);
+      if (refs.empty()) break;
+      std::lock_guard<std::mutex> lock(db_mutex);
+      for (const auto& r : refs) {
+        if (r.author >= client_db.size()) continue;
+        csce438::InboxEntry* e = t.add_inbox();
+        e->set_author(directory.Name(r.author));
+        e->set_author_home(HomeOf(r.author));
+        e->set_ordinal(r.ordinal);
+      }
+      pos = next;
+    }
+    inbox_end[i] = pos;
+    reply->set_inbox(reply->inbox() + t.inbox_size());
+    sent = send_posts(c, copied, c->moved_at) && writer->Write(t);
+  }
+  writer->WritesDone();
+  Status status = writer->Finish();
+  if (!status.ok()) {
+    std::lock_guard<std::mutex> lock(db_mutex);
+    for (Client* c : users) {
+      std::lock_guard<std::mutex> stream_lock(c->stream_mu);
+      SetHome(c, "");
+    }
+    forwarder.Release(to);
+    log(WARNING, "Migration of " + std::to_string(users.size()) + " users to " + to + " failed: " +
+        status.error_message());
+    return status;
+  }
+
+  for (size_t i = 0; i < users.size(); i++) {
+    inbox_store.Commit(users[i]->username, inbox_end[i]);
+    std::lock_guard<std::mutex> lock(db_mutex);
+    users[i]->session = 0;
+    users[i]->migrated_posts = 0;
+  }
+  forwarder.Release(to);
+  reply->set_users(users.size());
+  log(INFO, "Migrated " + std::to_string(users.size()) + " users to " + to + " (" +
+      std::to_string(reply->posts()) + " posts, " + std::to_string(reply->inbox()) + " inbox entries)");
+  return Status::OK;
+}
+
+//Receiving end of MigrateOut on the destination. Posts are stored as they
+//arrive; the users handed over only move here once the whole stream is in,
+//so a source that fails halfway through keeps them.
+Status SNSServiceImpl::Import(ServerContext* context, grpc::ServerReader<UserTransfer>* reader, Reply* reply) {
+  auto md = context->client_metadata().find("from");
+  if (md == context->client_metadata().end()) {
+    return Status(grpc::StatusCode::INVALID_ARGUMENT, "Source server not given");
+  }
+  std::string from(md->second.data(), md->second.length());
+  Pins pins(this);
+
+  // Users they follow that live elsewhere, and the authors of posts in their
+  // inbox, get their posts copied here so those can be read; each once per call
+  std::unordered_map<uint32_t, bool> synced;
+  auto sync = [&](Client* a, const std::string& home, uint64_t upto) {
+    if (!upto && synced.count(a->id)) return synced[a->id];
+    std::lock_guard<std::mutex> lock(mirror_mu);
+    return synced[a->id] = SyncMirror(a, home, upto);
+  };
+
+  // Adds what t says about its user's follows, and with moved set also the
+  // follows themselves, its session and its inbox
+  auto settle = [&](Client* c, const UserTransfer& t) {
+    std::vector<std::pair<Client*, std::string>> mirrors;
+    std::vector<std::pair<Client*, InboxRef>> inbox;
+    {
+      std::lock_guard<std::mutex> lock(db_mutex);
+      for (const auto& p : t.following()) {
+        Client* f = FindOrAddRemote(p.username(), p.home().empty() ? from : p.home());
+        if (f == c) continue;
+        if (!f->home.empty()) mirrors.push_back({pins.Add(f), f->home});
+        if (!t.moved() || !social_graph.Follow(c->id, f->id)) continue;
+        graph_log.Append(GraphLog::kFollow, c->id, f->id);
+        f->follower_changes.Record(c->id, true);
+        if (p.since()) {
+          std::ofstream(Path(c->username + "_follow_time.txt"), std::ios::app) << p.username() << "|" << p.since() << "\n";
+          if (c->follow_since_loaded) c->follow_since[f->id] = p.since();
+        }
+      }
+      for (const auto& p : t.followers()) {
+        Client* f = FindOrAddRemote(p.username(), p.home().empty() ? from : p.home());
+        if (f == c || !t.moved() || !social_graph.Follow(f->id, c->id)) continue;
+        graph_log.Append(GraphLog::kFollow, f->id, c->id);
+        c->follower_changes.Record(f->id, true);
+      }
+      for (const auto& e : t.inbox()) {
+        Client* a = pins.Add(FindOrAddRemote(e.author(), e.author_home().empty() ? from : e.author_home()));
+        InboxRef ref;
+        ref.author = a->id;
+        ref.ordinal = e.ordinal();
+        inbox.push_back({a, ref});
+      }
+      if (t.moved()) {
+        SetHome(c, "");
+        c->session = t.session();
+        c->lease_deadline = std::chrono::steady_clock::now() + kLeaseTtl;
+        std::lock_guard<std::mutex> seeding(c->stream_mu);
+        c->posted_seeded = false;
+      }
+    }
+
+    for (auto& m : mirrors) sync(m.first, m.second, 0);
+    for (auto& e : inbox) {
+      std::string home;
+      {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        home = e.first->home;
+      }
+      if (!home.empty() && !sync(e.first, home, e.second.ordinal + 1)) continue;
+      inbox_store.Append(c->username, e.second);
+    }
+  };
+
+  UserTransfer t;
+  Message post;
+  std::vector<std::pair<Client*, UserTransfer>> moved;
+  while (reader->Read(&t)) {
+    Client* c;
+    {
+      std::lock_guard<std::mutex> lock(db_mutex);
+      c = pins.Add(FindOrAddRemote(t.username(), from));
+    }
+
+    if (t.posts_size()) {
+      std::lock_guard<std::mutex> lock(mirror_mu);
+      uint64_t size = timeline_store.Size(c->username);
+      if (t.first_post() > size) {
+        return Status(grpc::StatusCode::FAILED_PRECONDITION, "Posts of " + c->username + " arrived out of order");
+      }
+      for (int i = 0; i < t.posts_size(); i++) {
+        // Already here from an earlier attempt or a forwarded post
+        if (t.first_post() + i < size) continue;
+        if (!post.ParseFromString(t.posts(i))) post.Clear();
+        uint64_t ordinal = timeline_store.Append(c->username, t.posts(i), post.timestamp().seconds());
+        if (ordinal == TimelineStore::kAppendFailed) {
+          return Status(grpc::StatusCode::INTERNAL, "Cannot store the posts of " + c->username);
+        }
+        search_index.Add(c->id, ordinal, post.msg());
+      }
+    }
+
+    if (t.moved()) moved.push_back({c, std::move(t)});
+    else settle(c, t);
+  }
+
+  // Read also ends when the source's call is cancelled or its connection
+  // breaks. The source then keeps its users, so these must not move here
+  if (context->IsCancelled()) {
+    log(WARNING, "Migration from " + from + " broke off; " + std::to_string(moved.size()) +
+        " users stay there");
+    return Status(grpc::StatusCode::CANCELLED, "Transfer broke off");
+  }
+  for (auto& m : moved) settle(m.first, m.second);
+  reply->set_msg("OK");
+  return Status::OK;
+}
@@ -0,0 +1,380 @@
+#ifndef SNS_SERVICE_H
+#define SNS_SERVICE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+#include "admission.h"
+#include "change_log.h"
+#include "executor.h"
+#include "fanout_pool.h"
+#include "forwarder.h"
+#include "home_timeline.h"
+#include "inbox_store.h"
+#include "post_stream.h"
+#include "presence.h"
+#include "search_index.h"
+#include "seq_window.h"
+#include "snapshot.h"
+#include "social_graph.h"
+#include "timeline_store.h"
+#include "user_directory.h"
+#include "user_pages.h"
+
+// Entry of a user's online-follower list. It goes stale when the follower's
+// stream closes (its online_users bit is cleared) or is replaced by a newer
+// one (epoch mismatch); fan-out drops stale entries as it walks the list.
+// The list is sorted by user and holds at most one entry per follower.
+struct OnlineRef {
+  uint32_t user;   // Client::id of the follower
+  uint32_t epoch;
+};
+
+// A user's state while it is resident in memory. Users that go unused are
+// paged out (see SNSServiceImpl::EvictCold) and get a new Client when next
+// looked up.
+struct Client {
+  uint32_t id = 0;                // index in client_db
+  std::string username;
+  int following_file_size = 0;
+  std::vector<OnlineRef> online_followers;  // followers with an open stream
+  PostStream* stream = 0;          // outbound side of the open Timeline stream
+  std::mutex stream_mu;           // guards stream against the session ending
+  uint32_t online_epoch = 0;      // new from online_epochs every time a stream attaches
+  uint64_t session = 0;           // id of the current session lease
+  std::chrono::steady_clock::time_point lease_deadline;
+  TokenBucket post_bucket;        // per-user admission limits
+  TokenBucket rpc_bucket;
+  SeqWindow posted;               // dedup window over this user's post seqs; stream_mu
+  bool posted_seeded = false;     // stream_mu
+  // Follow time of each followee by Client::id, from <username>_follow_time.txt
+  std::unordered_map<uint32_t, int64_t> follow_since;
+  bool follow_since_loaded = false;
+  ChangeLog follower_changes;     // versions this user's followers for List
+  // Empty if the user lives on this server. Otherwise the address of the tsd
+  // that holds it: the user was migrated away, or is known here only through
+  // a follow with a user of this server. Posts for it are forwarded there,
+  // and its log here is a copy kept ordinal for ordinal in step with that
+  // server's (see SyncMirror).
+  std::string home;
+  uint64_t migrated_posts = 0;    // posts already copied to a migration's destination; db_mutex
+  uint64_t moved_at = 0;          // size of its log when the user was handed over
+  uint32_t pins = 0;              // users of it outside db_mutex; keep it resident
+  size_t charged = 0;             // bytes it counts for against the memory budget
+  std::list<uint32_t>::iterator lru;   // its entry in SNSServiceImpl::lru
+  // The lease is held while a Timeline stream is open and otherwise lapses
+  // kLeaseTtl after the last RPC or KeepAlive ping of the session.
+  bool HasLease() const {
+    return stream || std::chrono::steady_clock::now() < lease_deadline;
+  }
+  bool operator==(const Client& c1) const{
+    return (username == c1.username);
+  }
+};
+
+// Where a server's users are: in memory or paged out (see SNSServiceImpl::EvictCold)
+struct ResidencyStats {
+  size_t users = 0;              // every user the server knows
+  size_t resident = 0;           // with a Client in memory
+  size_t resident_bytes = 0;     // what those hold, as last counted
+  size_t budget = 0;
+  size_t directory_bytes = 0;    // names and ids of every user
+  size_t paged = 0;              // with a record in users.pages
+  uint64_t page_file_bytes = 0;
+  uint64_t faults = 0;           // users brought back into memory
+  uint64_t evictions = 0;
+};
+
+using SNSServiceBase = csce438::SNSService::WithRawCallbackMethod_Timeline<
+    csce438::SNSService::WithRawCallbackMethod_GetTimeline<csce438::SNSService::Service>>;
+
+/*
+ * One SNS server: the user directory, follow graph and post stores, and the
+ * RPC handlers over them. Every file it writes lives under its data
+ * directory, so several instances can run in one process side by side
+ * (bench/cluster_sim.cc does) or take over each other's directory.
+ */
+class SNSServiceImpl final : public SNSServiceBase {
+public:
+  // dir is the data directory; tsd uses its working directory.
+  explicit SNSServiceImpl(std::string dir = ".", const AdmissionLimits& limits = AdmissionLimits());
+  ~SNSServiceImpl();
+
+  //Rebuilds users, sessions, the follow graph and the search index from the
+  //data directory;
+  //call once, before serving. snapshot, if given, is the checkpoint sent by
+  //the tsd this one takes over from, read instead of the file; the search
+  //index is then left to TakeOver
+  void Recover(const std::string* snapshot = nullptr);
+
+  //Starts and stops the inbox and index flush and checkpoint threads
+  void Start();
+  void Stop();
+
+  void Checkpoint();
+
+  //Handing the data directory over to a new process (handover.h). The old
+  //one: BeginHandover checkpoints into snap and holds later checkpoints off
+  //until EndHandover, which the caller only needs if it gives up (or false
+  //if the checkpoint failed, holding nothing off); Drain ends
+  //every Timeline stream, telling the client when to reconnect; once the
+  //calls in flight and Stop() are done, SaveHandoverState fills in what is only
+  //in memory. The new one: Recover(&snapshot), then TakeOver(state) to pick
+  //up what the old one did after the checkpoint
+  bool BeginHandover(Snapshot* snap);
+  void EndHandover();
+  void Drain();
+  void SaveHandoverState(csce438::HandoverState* state);
+  void TakeOver(const csce438::HandoverState& state);
+  //Undoes BeginHandover, Drain and Stop when the successor went away during
+  //the cutover, so the old one serves on
+  void Resume();
+
+  //Whether to compress: Timeline posts for readers that ask for
+  //post_codec.h's encoding, GetTimeline and GetHomeTimeline replies in
+  //whichever of gzip and deflate the client accepts, and calls to other
+  //servers on the default channels, with gzip. On by default. Set before
+  //set_address
+  void set_compression(bool on) { compression = on; }
+
+  //Address other servers reach this one at, and how to open channels to
+  //them (insecure TCP if unset); needed to forward posts and migrate users
+  void set_address(const std::string& address, Forwarder::ChannelFactory channels = nullptr);
+
+  //Bytes of user state to keep in memory; idle users beyond it are paged
+  //out to disk. 0 (the default) keeps everyone resident. Set before Recover
+  void set_memory_budget(size_t bytes) { memory_budget = bytes; }
+
+  //Threads, besides the posting one, that fan a post out to a long follower
+  //list (fanout_pool.h). 0 (the default) fans every post out inline. Set
+  //before serving
+  void set_fanout_threads(unsigned threads) { fanout.reset(new FanoutPool(threads)); }
+
+  ResidencyStats Residency();
+
+  //Benchmark hooks (bench/micro_bench.cc), not for a serving instance.
+  //AddFollowerForTest makes follower follow author, adding either user as
+  //needed, and with stream set attaches it as the follower's open Timeline
+  //stream; it returns author. FanOutForTest fans author's stored post at
+  //ordinal, serialized as wire, out as HandleMessage does
+  Client* AddFollowerForTest(const std::string& author, const std::string& follower, PostStream* stream);
+  void FanOutForTest(Client* author, uint64_t ordinal, const std::string& wire);
+
+  const std::string& dir() const { return dir_; }
+
+private:
+  friend class TimelineSession;
+  friend class TimelinePageWriter;
+
+  // Keeps the clients added to it resident until it goes out of scope, for
+  // code that uses them outside db_mutex. Destroy it with db_mutex released.
+  class Pins {
+  public:
+    explicit Pins(SNSServiceImpl* service) : service_(service) {}
+    ~Pins();
+    // db_mutex must be held
+    Client* Add(Client* c);
+
+  private:
+    SNSServiceImpl* service_;
+    std::vector<Client*> clients_;
+  };
+
+  grpc::Status List(grpc::ServerContext* context, const csce438::Request* request,
+                    csce438::ListReply* list_reply) override;
+  grpc::Status Follow(grpc::ServerContext* context, const csce438::Request* request,
+                      csce438::Reply* reply) override;
+  grpc::Status UnFollow(grpc::ServerContext* context, const csce438::Request* request,
+                        csce438::Reply* reply) override;
+  grpc::Status Login(grpc::ServerContext* context, const csce438::Request* request,
+                     csce438::Reply* reply) override;
+  grpc::Status KeepAlive(grpc::ServerContext* context, const csce438::Request* request,
+                         csce438::Reply* reply) override;
+  grpc::Status GetHomeTimeline(grpc::ServerContext* context, const csce438::HomeTimelineQuery* query,
+                               csce438::HomeTimelinePage* page) override;
+  grpc::Status Search(grpc::ServerContext* context, const csce438::SearchQuery* query,
+                      csce438::SearchReply* reply) override;
+  grpc::ServerWriteReactor<grpc::ByteBuffer>* GetTimeline(grpc::CallbackServerContext* context,
+                                                         const grpc::ByteBuffer* request) override;
+  grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>* Timeline(
+      grpc::CallbackServerContext* context) override;
+  grpc::Status Forward(grpc::ServerContext* context, const csce438::ForwardRequest* request,
+                       csce438::Reply* reply) override;
+  grpc::Status MigrateOut(grpc::ServerContext* context, const csce438::MigrateRequest* request,
+                          csce438::MigrateReply* reply) override;
+  grpc::Status Import(grpc::ServerContext* context, grpc::ServerReader<csce438::UserTransfer>* reader,
+                      csce438::Reply* reply) override;
+
+  Client* FindClient(const std::string& username);
+  Client* ClientAt(uint32_t id);
+  Client* AddClient(const std::string& username);
+  Client* MakeResident(uint32_t id);
+  const std::string& HomeOf(uint32_t id) const;
+  bool PageOut(uint32_t id, uint64_t session, uint64_t changes);
+  bool Evictable(Client* c);
+  void AddOnlineFollower(Client* c, const Client* follower);
+  bool Evict(Client* c);
+  void EvictCold();
+  size_t Footprint(const Client* c) const;
+  Client* FindOrAddRemote(const std::string& username, const std::string& home);
+  void SetHome(Client* c, const std::string& home);
+  bool SyncMirror(Client* c, const std::string& home, uint64_t upto);
+  void ForwardPost(Client* author, uint64_t ordinal, const std::string& wire,
+                   const std::vector<uint32_t>& followers, uint32_t hops);
+  void ForwardFollow(Client* follower, Client* followee, bool unfollow, uint32_t hops);
+  void ApplyForwardedFollow(const std::string& from, const csce438::Forwarded& item);
+  grpc::Status DeliverForwarded(const std::string& from, const csce438::Forwarded& item);
+  grpc::Status DeliverMissed(const std::string& from, const csce438::Forwarded& note);
+  void AddPeers(Client* c, csce438::UserTransfer* t);
+  void RenewLease(Client* c, uint64_t session);
+  // lock holds db_mutex; both release it while they wait
+  void BeginFanout(std::unique_lock<std::mutex>& lock);
+  void AwaitFanouts(std::unique_lock<std::mutex>& lock);
+  void EndFanout();
+  void FanOut(Client* author, const InboxRef& ref, const std::string& wire, uint64_t trace);
+  // OK, or RESOURCE_EXHAUSTED with a retry-after-ms trailer if the request
+  // (by c, if known) is over a rate limit or the server is shedding load
+  grpc::Status Admit(grpc::ServerContextBase* context, Admission::Kind kind, Client* c);
+  uint64_t NewSessionId();
+  void SeedPostWindow(Client* c);
+  void LoadFollowTimes(Client* c);
+  void ReindexPosts();
+  void ReadUsersLog();
+  void ApplyGraphChange(GraphLog::Op op, uint32_t follower, uint32_t followee);
+  void LoadHomes();
+  bool WriteCheckpoint(bool force, Snapshot* out);
+  bool ReadPost(uint32_t author, uint64_t ordinal, csce438::Message* msg);
+  std::string Path(const std::string& name) const { return dir_ + "/" + name; }
+
+  void FlushInboxes();
+  void CheckpointLoop();
+  // Sleeps for d; returns false instead once Stop() is called.
+  bool Sleep(std::chrono::milliseconds d);
+
+  std::string dir_;
+
+  //Every user this server has seen: username <-> Client::id
+  UserDirectory directory;
+
+  //The resident users, indexed by Client::id; null for a user that is paged
+  //out or was not needed since startup. Look users up through FindClient
+  //and ClientAt, which bring them in
+  std::vector<Client*> client_db;
+
+  //Resident users, most recently looked up first, and their bytes. Past
+  //memory_budget (if set) EvictCold pages the idlest out to user_pages
+  std::list<uint32_t> lru;
+  size_t resident_bytes = 0;
+  size_t memory_budget = 0;
+  UserPages user_pages;
+  uint64_t faults = 0;
+  uint64_t evictions = 0;
+
+  //Who follows whom, by Client::id
+  SocialGraph social_graph;
+
+  //Every user this server has seen, one per line; line i is the user with Client::id i
+  std::string users_file;
+  uint64_t users_log_bytes = 0;
+
+  //Checkpoint of client_db and social_graph, and the graph changes made since
+  std::string snapshot_file;
+  GraphLog graph_log;
+  size_t checkpointed_users = 0;
+  //Serializes checkpoints; none is taken while handing_over
+  std::mutex checkpoint_mu;
+  bool handing_over = false;
+  //Set by Drain: Timeline streams are ended with a reconnect hint
+  std::atomic<bool> draining{false};
+  bool compression = true;
+
+  //Guards directory, client_db, lru, user_pages, social_graph, online-follower
+  //lists and online_users
+  std::mutex db_mutex;
+  //Lets fan-out read names from directory without db_mutex; adding a user
+  //takes it exclusively, with db_mutex held
+  std::shared_mutex directory_mu;
+
+  //Fan-outs past their copy of the follower lists, which they work through
+  //without db_mutex (FanOut). Whoever sets or clears a bit of online_users
+  //first waits for them in AwaitFanouts, and no new one starts meanwhile, so
+  //no follower comes online or goes offline in the middle of a fan-out.
+  //Guarded by db_mutex
+  std::condition_variable fanout_cv;
+  int fanouts_running = 0;
+  int presence_waiting = 0;
+
+  //Users with an open Timeline stream, by Client::id
+  OnlineSet online_users;
+  //Source of Client::online_epoch, unique across users, so an online-list
+  //entry left from before a user was paged out never matches again
+  uint32_t online_epochs = 0;
+
+  std::mt19937_64 session_rng;
+
+  //Tells List versions issued by this instance from any other's; the user
+  //directory's version is its size, since users are only ever added
+  uint64_t list_epoch;
+
+  //Names this data directory's inboxes in the resume tokens readers keep
+  //(Message.inbox_resume). Any server that takes the directory over accepts
+  //them, since inbox positions are never reused.
+  std::string inbox_id;
+
+  //Binary post log that backs GetTimeline
+  TimelineStore timeline_store;
+
+  //Posts that followers missed while offline, replayed when they reconnect
+  InboxStore inbox_store;
+
+  //Inverted index over post text that backs Search
+  SearchIndex search_index;
+
+  //Users that live on another server (Client::home set), by Client::id
+  OnlineSet remote_users;
+  //Every change of a Client::home, one "<username>\t<home>" line each
+  std::string homes_file;
+
+  //Posts and follow changes on their way to other servers
+  Forwarder forwarder;
+  //Serializes appends to the copies of remote users' logs. forwarded holds,
+  //per author and sending server, the ordinal after the last post delivered,
+  //and missed_next the same for posts delivered from notes of dropped ones,
+  //so a retried Forward call delivers nothing twice.
+  std::mutex mirror_mu;
+  std::map<std::pair<uint32_t, std::string>, uint64_t> forwarded;
+  std::map<std::pair<uint32_t, std::string>, uint64_t> missed_next;
+
+  //Rate limits and load shedding for posts and RPCs
+  Admission admission;
+
+  //Runs the fan-out of posts to long follower lists in parallel
+  std::unique_ptr<FanoutPool> fanout;
+
+  //Runs the steps of Timeline streams that may block, off gRPC's threads
+  std::unique_ptr<Executor> sessions;
+
+  std::mutex stop_mu;
+  std::condition_variable stop_cv;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+#endif
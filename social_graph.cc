@@ -0,0 +1,292 @@
+#include "social_graph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+size_t IdSet::ChunkFor(Id id) const {
+  auto it = std::lower_bound(chunks_.begin(), chunks_.end(), id,
+                             [](const std::shared_ptr<Chunk>& c, Id v) { return c->back() < v; });
+  return it == chunks_.end() ? chunks_.size() - 1 : it - chunks_.begin();
+}
+
+// Snapshots are only taken, and so only gain a reference, under the same
+// lock as this runs under; a count that is stale by a released snapshot
+// costs a needless copy at most
+IdSet::Chunk& IdSet::Own(size_t i) {
+  if (chunks_[i].use_count() > 1) chunks_[i] = std::make_shared<Chunk>(*chunks_[i]);
+  return *chunks_[i];
+}
+
+bool IdSet::Insert(Id id) {
+  if (chunks_.empty()) {
+    chunks_.push_back(std::make_shared<Chunk>(1, id));
+    size_ = 1;
+    return true;
+  }
+  size_t c = ChunkFor(id);
+  const Chunk& shared = *chunks_[c];
+  auto at = std::lower_bound(shared.begin(), shared.end(), id);
+  if (at != shared.end() && *at == id) return false;
+  size_t pos = at - shared.begin();
+  auto& ids = Own(c);
+  ids.insert(ids.begin() + pos, id);
+  size_++;
+  if (ids.size() > kChunk) {
+    // Split a full chunk in half
+    auto upper = std::make_shared<Chunk>(ids.begin() + ids.size() / 2, ids.end());
+    ids.resize(ids.size() / 2);
+    chunks_.insert(chunks_.begin() + c + 1, std::move(upper));
+  }
+  return true;
+}
+
+bool IdSet::Erase(Id id) {
+  if (chunks_.empty()) return false;
+  size_t c = ChunkFor(id);
+  const Chunk& shared = *chunks_[c];
+  auto at = std::lower_bound(shared.begin(), shared.end(), id);
+  if (at == shared.end() || *at != id) return false;
+  size_--;
+  if (shared.size() == 1) {
+    chunks_.erase(chunks_.begin() + c);
+    return true;
+  }
+  size_t pos = at - shared.begin();
+  auto& ids = Own(c);
+  ids.erase(ids.begin() + pos);
+  return true;
+}
+
+bool IdSet::Contains(Id id) const {
+  if (chunks_.empty()) return false;
+  const auto& ids = *chunks_[ChunkFor(id)];
+  return std::binary_search(ids.begin(), ids.end(), id);
+}
+
+void IdSet::Assign(const char* data, size_t n) {
+  chunks_.clear();
+  chunks_.reserve((n + kChunk - 1) / kChunk);
+  for (size_t i = 0; i < n; i += kChunk) {
+    size_t count = n - i < kChunk ? n - i : kChunk;
+    chunks_.push_back(std::make_shared<Chunk>(count));
+    memcpy(chunks_.back()->data(), data + i * sizeof(Id), count * sizeof(Id));
+  }
+  size_ = n;
+}
+
+void IdSet::AppendTo(std::string* out) const {
+  for (const auto& ids : chunks_) {
+    out->append(reinterpret_cast<const char*>(ids->data()), ids->size() * sizeof(Id));
+  }
+}
+
+size_t IdSet::MemoryBytes() const {
+  // Each chunk is one make_shared block (its counts and the vector) plus its ids
+  size_t bytes = chunks_.capacity() * sizeof(std::shared_ptr<Chunk>);
+  for (const auto& ids : chunks_) bytes += 16 + sizeof(Chunk) + ids->capacity() * sizeof(Id);
+  return bytes;
+}
+
+void IdSet::shrink_to_fit() {
+  // A chunk a snapshot still reads is left as it is
+  for (auto& ids : chunks_) {
+    if (ids.use_count() == 1) ids->shrink_to_fit();
+  }
+  chunks_.shrink_to_fit();
+}
+
+namespace {
+
+using UserId = SocialGraph::UserId;
+
+bool Insert(std::vector<UserId>* ids, UserId id) {
+  auto it = std::lower_bound(ids->begin(), ids->end(), id);
+  if (it != ids->end() && *it == id) return false;
+  ids->insert(it, id);
+  return true;
+}
+
+bool Erase(std::vector<UserId>* ids, UserId id) {
+  auto it = std::lower_bound(ids->begin(), ids->end(), id);
+  if (it == ids->end() || *it != id) return false;
+  ids->erase(it);
+  return true;
+}
+
+}  // namespace
+
+const SocialGraph::Node SocialGraph::kNoFollows;
+
+SocialGraph::Node& SocialGraph::mutable_node(UserId user) {
+  if (!nodes_[user]) nodes_[user] = std::make_unique<Node>();
+  return *nodes_[user];
+}
+
+void SocialGraph::Resize(size_t n) {
+  if (n > nodes_.size()) nodes_.resize(n);
+}
+
+bool SocialGraph::Follow(UserId follower, UserId followee) {
+  Resize(std::max(follower, followee) + size_t(1));
+  if (!Insert(&mutable_node(follower).following, followee)) return false;
+  mutable_node(followee).followers.Insert(follower);
+  edges_++;
+  return true;
+}
+
+bool SocialGraph::UnFollow(UserId follower, UserId followee) {
+  if (std::max(follower, followee) >= nodes_.size() || !nodes_[follower]) return false;
+  if (!Erase(&nodes_[follower]->following, followee)) return false;
+  mutable_node(followee).followers.Erase(follower);
+  edges_--;
+  return true;
+}
+
+bool SocialGraph::Follows(UserId follower, UserId followee) const {
+  if (follower >= nodes_.size()) return false;
+  const auto& ids = node(follower).following;
+  return std::binary_search(ids.begin(), ids.end(), followee);
+}
+
+size_t SocialGraph::NodeBytes(UserId user) const {
+  const Node* n = user < nodes_.size() ? nodes_[user].get() : nullptr;
+  return n ? sizeof(Node) + n->following.capacity() * sizeof(UserId) + n->followers.MemoryBytes() : 0;
+}
+
+size_t SocialGraph::MemoryBytes() const {
+  size_t bytes = nodes_.capacity() * sizeof(nodes_[0]) + paged_.capacity() / 8;
+  for (UserId u = 0; u < nodes_.size(); u++) bytes += NodeBytes(u);
+  return bytes;
+}
+
+void SocialGraph::Compact() {
+  for (auto& n : nodes_) {
+    if (!n) continue;
+    n->following.shrink_to_fit();
+    n->followers.shrink_to_fit();
+  }
+}
+
+bool SocialGraph::PageOut(UserId user, std::string* out) {
+  std::unique_ptr<Node> n = std::move(nodes_[user]);
+  if (!n || (n->following.empty() && n->followers.empty())) return false;
+  uint32_t counts[2] = {static_cast<uint32_t>(n->following.size()), static_cast<uint32_t>(n->followers.size())};
+  out->reserve(out->size() + sizeof(counts) + (counts[0] + counts[1]) * sizeof(UserId));
+  out->append(reinterpret_cast<const char*>(counts), sizeof(counts));
+  out->append(reinterpret_cast<const char*>(n->following.data()), counts[0] * sizeof(UserId));
+  n->followers.AppendTo(out);
+  if (paged_.size() < nodes_.size()) paged_.resize(nodes_.size());
+  paged_[user] = true;
+  return true;
+}
+
+bool SocialGraph::PageIn(UserId user, const char* data, size_t size) {
+  uint32_t counts[2];
+  if (size < sizeof(counts)) return false;
+  memcpy(counts, data, sizeof(counts));
+  if (size != sizeof(counts) + (uint64_t(counts[0]) + counts[1]) * sizeof(UserId)) return false;
+  auto n = std::make_unique<Node>();
+  n->following.resize(counts[0]);
+  memcpy(n->following.data(), data + sizeof(counts), counts[0] * sizeof(UserId));
+  n->followers.Assign(data + sizeof(counts) + counts[0] * sizeof(UserId), counts[1]);
+  nodes_[user] = std::move(n);
+  paged_[user] = false;
+  return true;
+}
+
+bool SocialGraph::Serialize(std::string* out, const PageReader& pages) const {
+  uint64_t header[2] = {nodes_.size(), edges_};
+  out->reserve(out->size() + sizeof(header) + nodes_.size() * 8 + edges_ * 8);
+  out->append(reinterpret_cast<const char*>(header), sizeof(header));
+  // A paged-out user's counts and ids, straight from its record; null if
+  // the record is missing or shorter than its counts say
+  auto record = [&](UserId u, uint32_t counts[2]) -> const char* {
+    size_t size = 0;
+    const char* data = pages ? pages(u, &size) : nullptr;
+    if (!data || size < 2 * sizeof(uint32_t)) return nullptr;
+    memcpy(counts, data, 2 * sizeof(uint32_t));
+    if ((size - 2 * sizeof(uint32_t)) / sizeof(UserId) < static_cast<uint64_t>(counts[0]) + counts[1]) {
+      return nullptr;
+    }
+    return data + 2 * sizeof(uint32_t);
+  };
+  uint32_t counts[2];
+  for (int side = 0; side < 2; side++) {
+    for (UserId u = 0; u < nodes_.size(); u++) {
+      if (paged(u)) {
+        // Checked here, on the first pass; the later ones read the same records
+        if (!record(u, counts)) return false;
+      } else {
+        counts[0] = static_cast<uint32_t>(node(u).following.size());
+        counts[1] = static_cast<uint32_t>(node(u).followers.size());
+      }
+      out->append(reinterpret_cast<const char*>(&counts[side]), sizeof(uint32_t));
+    }
+  }
+  for (UserId u = 0; u < nodes_.size(); u++) {
+    if (paged(u)) {
+      const char* ids = record(u, counts);
+      out->append(ids, counts[0] * sizeof(UserId));
+    } else {
+      const auto& following = node(u).following;
+      out->append(reinterpret_cast<const char*>(following.data()), following.size() * sizeof(UserId));
+    }
+  }
+  for (UserId u = 0; u < nodes_.size(); u++) {
+    if (paged(u)) {
+      const char* ids = record(u, counts);
+      out->append(ids + counts[0] * sizeof(UserId), counts[1] * sizeof(UserId));
+    } else {
+      node(u).followers.AppendTo(out);
+    }
+  }
+  return true;
+}
+
+bool SocialGraph::Deserialize(const char* data, size_t size, unsigned threads) {
+  uint64_t header[2];
+  if (size < sizeof(header)) return false;
+  memcpy(header, data, sizeof(header));
+  uint64_t users = header[0], edges = header[1];
+  if (users > size || edges > size || size != sizeof(header) + users * 8 + edges * 8) return false;
+
+  const char* counts = data + sizeof(header);
+  // Where each user's arrays start, as indexes into the two id sections.
+  std::vector<uint64_t> following_at(users + 1), followers_at(users + 1);
+  for (uint64_t u = 0; u < users; u++) {
+    uint32_t nf, nr;
+    memcpy(&nf, counts + u * 4, 4);
+    memcpy(&nr, counts + (users + u) * 4, 4);
+    following_at[u + 1] = following_at[u] + nf;
+    followers_at[u + 1] = followers_at[u] + nr;
+  }
+  if (following_at[users] != edges || followers_at[users] != edges) return false;
+
+  nodes_.clear();
+  nodes_.resize(users);
+  paged_.clear();
+  edges_ = edges;
+  const char* following_ids = counts + users * 8;
+  const char* follower_ids = following_ids + edges * 4;
+  auto fill = [&](uint64_t begin, uint64_t end) {
+    for (uint64_t u = begin; u < end; u++) {
+      uint64_t nf = following_at[u + 1] - following_at[u];
+      uint64_t nr = followers_at[u + 1] - followers_at[u];
+      if (!nf && !nr) continue;
+      nodes_[u] = std::make_unique<Node>();
+      nodes_[u]->following.resize(nf);
+      memcpy(nodes_[u]->following.data(), following_ids + following_at[u] * 4, nf * 4);
+      nodes_[u]->followers.Assign(follower_ids + followers_at[u] * 4, nr);
+    }
+  };
+
+  threads = std::max(1u, threads);
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++) {
+    workers.emplace_back(fill, users * t / threads, users * (t + 1) / threads);
+  }
+  fill(0, users / threads);
+  for (auto& w : workers) w.join();
+  return true;
+}
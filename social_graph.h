@@ -0,0 +1,170 @@
+#ifndef SOCIAL_GRAPH_H
+#define SOCIAL_GRAPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Sorted set of 32-bit user ids stored as a list of sorted chunks of at most
+ * kChunk ids. Membership is a binary search over the chunks and then within
+ * one; Insert and Erase move at most one chunk's worth of ids, however large
+ * the set. Iteration walks each chunk's contiguous array in turn.
+ *
+ * Chunks are shared with Share()'s snapshots and copied before a change
+ * while one is, so a snapshot taken under the lock guarding the set can be
+ * walked after that lock is released.
+ */
+class IdSet {
+public:
+  using Id = uint32_t;
+  using Chunk = std::vector<Id>;
+  static const size_t kChunk = 1024;
+
+  class const_iterator {
+  public:
+    const_iterator(const std::vector<std::shared_ptr<Chunk>>* chunks, size_t chunk, size_t pos)
+        : chunks_(chunks), chunk_(chunk), pos_(pos) {}
+    Id operator*() const { return (*(*chunks_)[chunk_])[pos_]; }
+    const_iterator& operator++() {
+      if (++pos_ == (*chunks_)[chunk_]->size()) {
+        ++chunk_;
+        pos_ = 0;
+      }
+      return *this;
+    }
+    bool operator!=(const const_iterator& o) const { return chunk_ != o.chunk_ || pos_ != o.pos_; }
+    bool operator==(const const_iterator& o) const { return !(*this != o); }
+
+  private:
+    const std::vector<std::shared_ptr<Chunk>>* chunks_;
+    size_t chunk_, pos_;
+  };
+
+  // Both return false if the set already was in the requested state.
+  bool Insert(Id id);
+  bool Erase(Id id);
+  bool Contains(Id id) const;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const_iterator begin() const { return const_iterator(&chunks_, 0, 0); }
+  const_iterator end() const { return const_iterator(&chunks_, chunks_.size(), 0); }
+
+  // The sorted chunks, in order, for walking parts of a large set in parallel
+  size_t chunks() const { return chunks_.size(); }
+  const Chunk& chunk(size_t i) const { return *chunks_[i]; }
+
+  // The chunks as they are now. They stay as they are however the set
+  // changes later, and outlive it; copying them costs a pointer per chunk.
+  using Snapshot = std::vector<std::shared_ptr<const Chunk>>;
+  Snapshot Share() const { return Snapshot(chunks_.begin(), chunks_.end()); }
+
+  // Replaces the contents with the n ids stored back to back at data, which
+  // must be sorted and unique. data need not be aligned.
+  void Assign(const char* data, size_t n);
+  // Appends the ids in order.
+  void AppendTo(std::string* out) const;
+
+  size_t MemoryBytes() const;
+  void shrink_to_fit();
+
+private:
+  // First chunk whose last id is >= id, or the last chunk.
+  size_t ChunkFor(Id id) const;
+  // Chunk i, copied first if a snapshot shares it
+  Chunk& Own(size_t i);
+
+  std::vector<std::shared_ptr<Chunk>> chunks_;   // each sorted and non-empty
+  size_t size_ = 0;
+};
+
+/*
+ * Follow graph over dense 32-bit user ids (Client::id in tsd).
+ *
+ * Who a user follows is a plain sorted array, so "does a follow b" is a
+ * binary search over a's (usually short) following list. Who follows them is
+ * an IdSet: a popular user can have millions of followers, and a follow or
+ * unfollow there moves at most IdSet::kChunk ids instead of shifting or
+ * scanning the whole list. Both are walked in id order. Not thread safe; tsd
+ * guards it with db_mutex.
+ *
+ * A user's arrays are allocated on its first follow, so the many users with
+ * none cost a pointer each. PageOut() moves a user's arrays into a record the
+ * caller keeps elsewhere (tsd's UserPages) and PageIn() brings them back. A
+ * paged-out user reads as following and followed by no one, so callers page
+ * a user back in before they look at or change its follows.
+ */
+class SocialGraph {
+public:
+  using UserId = uint32_t;
+
+  // Makes ids [0, n) valid.
+  void Resize(size_t n);
+  size_t users() const { return nodes_.size(); }
+
+  // Both return false if the graph already was in the requested state.
+  bool Follow(UserId follower, UserId followee);
+  bool UnFollow(UserId follower, UserId followee);
+
+  bool Follows(UserId follower, UserId followee) const;
+
+  // Sorted by id.
+  const IdSet& Followers(UserId user) const { return node(user).followers; }
+  const std::vector<UserId>& Following(UserId user) const { return node(user).following; }
+
+  size_t edges() const { return edges_; }
+
+  // Heap bytes held by the adjacency arrays, including unused capacity.
+  size_t MemoryBytes() const;
+
+  // Heap bytes held by one user's arrays.
+  size_t NodeBytes(UserId user) const;
+
+  // Drops unused capacity from every adjacency array.
+  void Compact();
+
+  // Appends user's arrays to out as [u32 following count][u32 follower count]
+  // [following ids][follower ids] and frees them. Returns false, and appends
+  // nothing, if the user follows and is followed by no one.
+  bool PageOut(UserId user, std::string* out);
+  // Restores a user from a PageOut record. Returns false if it is malformed.
+  bool PageIn(UserId user, const char* data, size_t size);
+  bool paged(UserId user) const { return user < paged_.size() && paged_[user]; }
+
+  // Where Serialize finds the PageOut record of a paged-out user: its
+  // address, with its size in *size, or null if there is none
+  using PageReader = std::function<const char*(UserId user, size_t* size)>;
+
+  // Appends the whole graph to out as
+  //   [u64 users][u64 edges][u32 following count x users][u32 follower count x users]
+  //   [following ids][follower ids]
+  // so that Deserialize can rebuild each user's arrays independently.
+  // Paged-out users are read through pages. Returns false, with out only
+  // partly written, if a paged-out user's record is missing or too short.
+  bool Serialize(std::string* out, const PageReader& pages = nullptr) const;
+
+  // Replaces the graph with one written by Serialize, filling the arrays on
+  // up to threads threads. Returns false if data is malformed.
+  bool Deserialize(const char* data, size_t size, unsigned threads);
+
+private:
+  struct Node {
+    std::vector<UserId> following;
+    IdSet followers;
+  };
+
+  const Node& node(UserId user) const { return nodes_[user] ? *nodes_[user] : kNoFollows; }
+  Node& mutable_node(UserId user);
+
+  static const Node kNoFollows;
+
+  std::vector<std::unique_ptr<Node>> nodes_;   // null: no follows, or paged out
+  std::vector<bool> paged_;
+  size_t edges_ = 0;
+};
+
+#endif
@@ -0,0 +1,89 @@
+// Checks for InboxStore (inbox_store.h). Exits with 1 on the first failure.
+//
+//   ./test/inbox_store_test
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "inbox_store.h"
+
+namespace {
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                         \
+    }                                                                  \
+  } while (0)
+
+// Reads username's whole undelivered inbox and checks it holds the ordinals
+// first, first + 1, ... up to end
+void CheckRefs(InboxStore* store, const std::string& username, uint64_t first, uint64_t end) {
+  std::vector<InboxRef> refs;
+  uint64_t pos = 0;
+  while (true) {
+    size_t before = refs.size();
+    pos = store->Read(username, pos, 1 << 16, &refs);
+    if (refs.size() == before) break;
+  }
+  CHECK(refs.size() == end - first);
+  for (size_t i = 0; i < refs.size(); i++) CHECK(refs[i].ordinal == first + i);
+}
+
+// More than kMaxPending appends with no flush between them: the oldest are
+// dropped while still buffered, and the flush that follows compacts.
+void OverflowBeforeFlush(const std::string& root) {
+  const uint64_t n = 2 * InboxStore::kMaxPending + 10;
+  {
+    InboxStore store(root);
+    InboxRef ref;
+    ref.author = 1;
+    for (uint64_t i = 0; i < n; i++) {
+      ref.ordinal = i;
+      store.Append("reader", ref);
+    }
+    CHECK(store.Stats().dropped == n - InboxStore::kMaxPending);
+    store.Flush();
+    CHECK(store.Cursor("reader") == n - InboxStore::kMaxPending);
+    CheckRefs(&store, "reader", n - InboxStore::kMaxPending, n);
+  }
+  // And from disk
+  InboxStore reopened(root);
+  CheckRefs(&reopened, "reader", n - InboxStore::kMaxPending, n);
+  std::error_code ec;
+  CHECK(std::filesystem::file_size(root + "/reader.inbox", ec) ==
+        InboxStore::kHeader + InboxStore::kMaxPending * InboxStore::kRefBytes);
+}
+
+// Part of the inbox flushed, then enough appends to drop past it
+void OverflowAfterFlush(const std::string& root) {
+  const uint64_t flushed = 1000;
+  const uint64_t n = flushed + 2 * InboxStore::kMaxPending;
+  InboxStore store(root);
+  InboxRef ref;
+  for (uint64_t i = 0; i < n; i++) {
+    ref.ordinal = i;
+    store.Append("late", ref);
+    if (i + 1 == flushed) store.Flush();
+  }
+  store.Flush();
+  CheckRefs(&store, "late", n - InboxStore::kMaxPending, n);
+}
+
+}  // namespace
+
+int main() {
+  std::string root = std::filesystem::temp_directory_path() / ("inbox_store_test." + std::to_string(getpid()));
+  std::filesystem::create_directories(root);
+  OverflowBeforeFlush(root);
+  OverflowAfterFlush(root);
+  std::filesystem::remove_all(root);
+  printf("inbox_store_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include "timeline_cache.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using csce438::Message;
+
+namespace {
+
+const uint32_t kMagic = 0x43435354;   // "TSCC"
+const size_t kFileBytes = TimelineCache::kHeader + TimelineCache::kSlots * TimelineCache::kSlotBytes;
+
+}  // namespace
+
+struct TimelineCache::Header {
+  uint32_t magic;
+  uint32_t slots;
+  uint64_t added;
+  uint32_t resume_len;
+  char resume[kHeader - 20];
+};
+
+TimelineCache::~TimelineCache() {
+  if (base_) munmap(base_, kFileBytes);
+}
+
+bool TimelineCache::Open(const std::string& path) {
+  static_assert(sizeof(Header) == kHeader, "header layout");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+  struct stat st;
+  bool fresh = fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != kFileBytes;
+  if (fresh && ftruncate(fd, 0) != 0) fresh = false;
+  if (ftruncate(fd, kFileBytes) != 0) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(nullptr, kFileBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+  base_ = static_cast<char*>(base);
+
+  Header* h = header();
+  if (fresh || h->magic != kMagic || h->slots != kSlots || h->resume_len > sizeof(h->resume)) {
+    memset(base_, 0, kFileBytes);
+    h->magic = kMagic;
+    h->slots = kSlots;
+  }
+
+  Message m;
+  uint64_t first = h->added > kSlots ? h->added - kSlots : 0;
+  for (uint64_t i = first; i < h->added; i++) {
+    if (Load(i, &m) && m.seq()) seen_.insert({m.username(), m.seq()});
+  }
+  return true;
+}
+
+std::vector<Message> TimelineCache::Posts() const {
+  std::vector<Message> out;
+  if (!base_) return out;
+  uint64_t added = header()->added;
+  uint64_t first = added > kSlots ? added - kSlots : 0;
+  Message m;
+  for (uint64_t i = first; i < added; i++) {
+    if (Load(i, &m)) out.push_back(m);
+  }
+  return out;
+}
+
+bool TimelineCache::Add(const Message& m) {
+  if (!base_) return true;
+  if (m.seq() && !seen_.insert({m.username(), m.seq()}).second) return false;
+
+  Header* h = header();
+  Message evicted;
+  if (h->added >= kSlots && Load(h->added - kSlots, &evicted) && evicted.seq()) {
+    seen_.erase({evicted.username(), evicted.seq()});
+  }
+
+  Message copy = m;
+  copy.clear_trace_id();
+  copy.clear_trace_sent_ns();
+  // An over-long post keeps as much of its text as fits in a slot
+  size_t room = kSlotBytes - sizeof(uint32_t);
+  if (copy.ByteSizeLong() > room) {
+    size_t over = copy.ByteSizeLong() - room;
+    copy.mutable_msg()->resize(copy.msg().size() > over + 8 ? copy.msg().size() - over - 8 : 0);
+  }
+  char* s = slot(h->added);
+  uint32_t len = static_cast<uint32_t>(copy.ByteSizeLong());
+  if (len > room || !copy.SerializeToArray(s + sizeof(len), room)) return true;
+  memcpy(s, &len, sizeof(len));
+  h->added++;
+  return true;
+}
+
+std::string TimelineCache::resume() const {
+  if (!base_) return "";
+  return std::string(header()->resume, header()->resume_len);
+}
+
+void TimelineCache::set_resume(const std::string& token) {
+  if (!base_ || token.size() > sizeof(header()->resume)) return;
+  // Text first: positions only grow, so a tsc killed in between leaves a
+  // prefix of the new token, which resumes no further than the old one
+  memcpy(header()->resume, token.data(), token.size());
+  header()->resume_len = static_cast<uint32_t>(token.size());
+}
+
+TimelineCache::Header* TimelineCache::header() const { return reinterpret_cast<Header*>(base_); }
+
+char* TimelineCache::slot(uint64_t i) const { return base_ + kHeader + (i % kSlots) * kSlotBytes; }
+
+bool TimelineCache::Load(uint64_t i, Message* m) const {
+  const char* s = slot(i);
+  uint32_t len;
+  memcpy(&len, s, sizeof(len));
+  return len <= kSlotBytes - sizeof(len) && m->ParseFromArray(s + sizeof(len), len);
+}
@@ -0,0 +1,70 @@
+#ifndef TIMELINE_CACHE_H
+#define TIMELINE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sns.pb.h"
+
+/*
+ * tsc's local cache of the timeline: the last kSlots posts it displayed and
+ * the inbox resume token (Message.inbox_resume) the server sent last, in one
+ * memory-mapped file. On TIMELINE, tsc renders the cached posts before it has
+ * even connected, then presents the token so the server only sends what is
+ * newer.
+ *
+ * Layout: tsc-<user>.cache
+ *   [u32 magic][u32 slots][u64 added][u32 token length][token ...]   kHeader bytes
+ *   [u32 length][serialized Message ...]                  kSlotBytes per slot
+ *
+ * Post i (counting from the first ever added) lives in slot i % kSlots. A
+ * post is written before added is bumped, so a tsc killed halfway through
+ * leaves the previous state intact. Writes go to the shared mapping and reach
+ * the disk whenever the kernel writes them back; only a crash of the whole
+ * host loses them, and then the server just replays a little more.
+ *
+ * Not thread-safe: tsc adds posts from its stream reader thread only.
+ */
+class TimelineCache {
+public:
+  static const size_t kSlots = 256;
+  static const size_t kSlotBytes = 1024;
+  static const size_t kHeader = 128;
+
+  TimelineCache() = default;
+  ~TimelineCache();
+
+  TimelineCache(const TimelineCache&) = delete;
+  TimelineCache& operator=(const TimelineCache&) = delete;
+
+  // Maps the cache at path, creating it if needed. A file in any other
+  // layout is started over. Returns false (and caches nothing) on IO errors.
+  bool Open(const std::string& path);
+
+  // The cached posts, oldest first.
+  std::vector<csce438::Message> Posts() const;
+
+  // Caches m unless a post with the same author and seq is already cached.
+  // Returns false for such a duplicate, which the caller has shown already.
+  bool Add(const csce438::Message& m);
+
+  std::string resume() const;
+  void set_resume(const std::string& token);
+
+private:
+  struct Header;
+
+  Header* header() const;
+  char* slot(uint64_t i) const;
+  bool Load(uint64_t i, csce438::Message* m) const;
+
+  char* base_ = nullptr;
+  // Author and seq of every cached post
+  std::set<std::pair<std::string, uint64_t>> seen_;
+};
+
+#endif
@@ -0,0 +1,351 @@
+#include "timeline_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <grpc/slice.h>
+
+namespace fs = std::filesystem;
+
+struct TimelineStore::Mapping {
+  const char* addr = nullptr;
+  uint64_t length = 0;
+  ~Mapping() {
+    if (addr) munmap(const_cast<char*>(addr), length);
+  }
+};
+
+struct IndexEntry {
+  int64_t time;
+  uint32_t offset;   // of the record header inside the segment
+  uint32_t length;   // of the payload
+};
+
+struct TimelineStore::Segment {
+  std::string path;
+  uint64_t base = 0;    // ordinal of the first record
+  uint64_t bytes = 0;   // bytes of complete records
+  std::vector<IndexEntry> index;
+  std::shared_ptr<Mapping> map;
+};
+
+struct TimelineStore::UserLog {
+  std::mutex mu;
+  std::string dir;
+  std::vector<std::unique_ptr<Segment>> segments;
+  int fd = -1;          // append handle of the last segment
+  int64_t last_time = 0;
+  uint64_t count = 0;
+
+  ~UserLog() {
+    if (fd >= 0) close(fd);
+  }
+};
+
+namespace {
+
+size_t PutVarint(uint64_t v, char* out) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = static_cast<char>(v);
+  return n;
+}
+
+// Smallest mapping of a segment; mappings double from here as it grows
+const uint64_t kMinMapBytes = 64 << 10;
+
+std::string SegmentName(uint64_t base) {
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.seg", static_cast<unsigned long long>(base));
+  return name;
+}
+
+}  // namespace
+
+TimelineStore::TimelineStore(std::string root) : root_(std::move(root)) {}
+
+TimelineStore::~TimelineStore() = default;
+
+void TimelineStore::ReleaseMapping(void* user_data) {
+  delete static_cast<std::shared_ptr<Mapping>*>(user_data);
+}
+
+std::shared_ptr<TimelineStore::Mapping> TimelineStore::Map(Segment* seg, uint64_t bytes) {
+  if (seg->map && seg->map->length >= bytes) return seg->map;
+  // The file only ever grows by appends, and a shared mapping sees them, so
+  // a mapping twice the size needed serves reads until the file outgrows it.
+  // Pages past the end of the file are reserved but never touched. Slices
+  // still pointing into a replaced mapping keep it alive.
+  uint64_t length = seg->map ? seg->map->length : kMinMapBytes;
+  while (length < bytes) length *= 2;
+  if (length > kSegmentBytes) length = std::max(bytes, uint64_t{kSegmentBytes});
+  int fd = open(seg->path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return nullptr;
+  seg->map = std::make_shared<Mapping>();
+  seg->map->addr = static_cast<const char*>(addr);
+  seg->map->length = length;
+  return seg->map;
+}
+
+void TimelineStore::LoadSegment(Segment* seg) {
+  struct stat st;
+  if (stat(seg->path.c_str(), &st) != 0) return;
+  uint64_t size = static_cast<uint64_t>(st.st_size);
+  if (size == 0) return;
+  auto map = Map(seg, size);
+  if (!map) return;
+
+  uint64_t off = 0;
+  while (off + kRecordHeader <= size) {
+    uint32_t len;
+    int64_t time;
+    memcpy(&len, map->addr + off, sizeof(len));
+    memcpy(&time, map->addr + off + 8, sizeof(time));
+    if (off + kRecordHeader + len > size) break;
+    seg->index.push_back({time, static_cast<uint32_t>(off), len});
+    off += kRecordHeader + len;
+  }
+  // Drop a record that was only partially written before a crash.
+  if (off != size) truncate(seg->path.c_str(), static_cast<off_t>(off));
+  seg->bytes = off;
+}
+
+// Null, without remembering anything, for a user that has no log unless
+// create is set
+std::shared_ptr<TimelineStore::UserLog> TimelineStore::Open(const std::string& username, bool create) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = logs_.find(username);
+  if (it != logs_.end()) return it->second;
+
+  auto log = std::make_shared<UserLog>();
+  log->dir = root_ + "/" + username + ".timeline.d";
+
+  std::error_code ec;
+  if (!fs::is_directory(log->dir, ec)) {
+    if (!create) return nullptr;
+  } else {
+    std::vector<std::unique_ptr<Segment>> found;
+    for (const auto& entry : fs::directory_iterator(log->dir, ec)) {
+      if (entry.path().extension() != ".seg") continue;
+      auto seg = std::make_unique<Segment>();
+      seg->path = entry.path().string();
+      seg->base = std::stoull(entry.path().stem().string());
+      found.push_back(std::move(seg));
+    }
+    std::sort(found.begin(), found.end(),
+              [](const std::unique_ptr<Segment>& a, const std::unique_ptr<Segment>& b) {
+                return a->base < b->base;
+              });
+    for (auto& seg : found) {
+      LoadSegment(seg.get());
+      log->count = seg->base + seg->index.size();
+      if (!seg->index.empty()) log->last_time = seg->index.back().time;
+      log->segments.push_back(std::move(seg));
+    }
+    if (!log->segments.empty()) {
+      log->fd = open(log->segments.back()->path.c_str(), O_WRONLY | O_APPEND);
+    }
+  }
+
+  logs_[username] = log;
+  return log;
+}
+
+void TimelineStore::Evict(const std::string& username) {
+  std::lock_guard<std::mutex> lock(mu_);
+  logs_.erase(username);
+}
+
+bool TimelineStore::StartSegment(UserLog* log) {
+  if (log->fd >= 0) close(log->fd);
+  std::error_code ec;
+  fs::create_directories(log->dir, ec);
+
+  // After a failed write the last segment may hold no records yet, only the
+  // torn one; it is started over
+  bool reuse = !log->segments.empty() && log->segments.back()->base == log->count;
+  auto seg = std::make_unique<Segment>();
+  seg->base = log->count;
+  seg->path = log->dir + "/" + SegmentName(seg->base);
+  log->fd = open(seg->path.c_str(), O_WRONLY | O_APPEND | O_CREAT | (reuse ? O_TRUNC : 0), 0644);
+  if (log->fd < 0) return false;
+  if (!reuse) log->segments.push_back(std::move(seg));
+  return true;
+}
+
+uint64_t TimelineStore::Append(const std::string& username, const csce438::Message& msg) {
+  return Append(username, msg.SerializeAsString(), msg.timestamp().seconds());
+}
+
+uint64_t TimelineStore::Append(const std::string& username, const std::string& payload,
+                               int64_t msg_time) {
+  auto log = Open(username, true);
+  std::lock_guard<std::mutex> lock(log->mu);
+
+  uint64_t need = kRecordHeader + payload.size();
+  if (log->segments.empty() || log->fd < 0 ||
+      (log->segments.back()->bytes > 0 && log->segments.back()->bytes + need > kSegmentBytes)) {
+    if (!StartSegment(log.get())) return kAppendFailed;
+  }
+  Segment* seg = log->segments.back().get();
+
+  // Index time must be monotonic for range search; client clocks are not.
+  int64_t time = std::max<int64_t>(log->last_time, msg_time);
+
+  char header[kRecordHeader] = {0};
+  uint32_t len = static_cast<uint32_t>(payload.size());
+  memcpy(header, &len, sizeof(len));
+  memcpy(header + 8, &time, sizeof(time));
+  struct iovec iov[2] = {{header, kRecordHeader},
+                         {const_cast<char*>(payload.data()), payload.size()}};
+  if (writev(log->fd, iov, 2) != static_cast<ssize_t>(need)) {
+    // Cut off whatever part did reach the file, or later records would land
+    // after it and not where the index says. Should that fail too, the next
+    // append starts a new segment; LoadSegment trims this one on restart.
+    if (ftruncate(log->fd, static_cast<off_t>(seg->bytes)) != 0) {
+      close(log->fd);
+      log->fd = -1;
+    }
+    return kAppendFailed;
+  }
+
+  seg->index.push_back({time, static_cast<uint32_t>(seg->bytes), len});
+  seg->bytes += need;
+  log->last_time = time;
+  return log->count++;
+}
+
+uint64_t TimelineStore::Scan(const std::string& username, const TimelineRange& range,
+                             std::vector<TimelineRecord>* out) {
+  auto log = Open(username, false);
+  if (!log) return 0;
+  std::lock_guard<std::mutex> lock(log->mu);
+
+  size_t taken = 0;
+  size_t bytes = 0;
+  for (auto& seg_ptr : log->segments) {
+    Segment* seg = seg_ptr.get();
+    if (seg->index.empty()) continue;
+    uint64_t end = seg->base + seg->index.size();
+    if (end <= range.cursor) continue;
+    if (range.since && seg->index.back().time < range.since) continue;
+
+    auto first = seg->index.begin();
+    if (range.cursor > seg->base) first += range.cursor - seg->base;
+    if (range.since) {
+      first = std::lower_bound(first, seg->index.end(), range.since,
+                               [](const IndexEntry& e, int64_t t) { return e.time < t; });
+    }
+
+    auto map = Map(seg, seg->bytes);
+    if (!map) return 0;
+    for (auto e = first; e != seg->index.end(); ++e) {
+      uint64_t ordinal = seg->base + (e - seg->index.begin());
+      if (range.until && e->time > range.until) return 0;
+      if ((range.limit && taken == range.limit) ||
+          (range.max_bytes && taken > 0 && bytes + e->length > range.max_bytes)) {
+        return ordinal;
+      }
+
+      auto* ref = new std::shared_ptr<Mapping>(map);
+      grpc_slice s = grpc_slice_new_with_user_data(
+          const_cast<char*>(map->addr + e->offset + kRecordHeader), e->length,
+          ReleaseMapping, ref);
+      out->push_back({ordinal, e->time, grpc::Slice(s, grpc::Slice::STEAL_REF)});
+      ++taken;
+      bytes += e->length;
+    }
+  }
+  return 0;
+}
+
+uint64_t TimelineStore::ScanBack(const std::string& username, const TimelineRange& range,
+                                 std::vector<TimelineRecord>* out) {
+  auto log = Open(username, false);
+  if (!log) return 0;
+  std::lock_guard<std::mutex> lock(log->mu);
+
+  size_t taken = 0;
+  size_t bytes = 0;
+  for (auto it = log->segments.rbegin(); it != log->segments.rend(); ++it) {
+    Segment* seg = it->get();
+    if (seg->index.empty()) continue;
+    if (range.cursor && seg->base >= range.cursor) continue;
+    if (range.since && seg->index.back().time < range.since) return 0;
+
+    auto last = seg->index.end();
+    if (range.cursor && range.cursor < seg->base + seg->index.size()) {
+      last = seg->index.begin() + (range.cursor - seg->base);
+    }
+    if (range.until) {
+      last = std::upper_bound(seg->index.begin(), last, range.until,
+                              [](int64_t t, const IndexEntry& e) { return t < e.time; });
+    }
+
+    auto map = Map(seg, seg->bytes);
+    if (!map) return 0;
+    for (auto e = last; e != seg->index.begin();) {
+      --e;
+      uint64_t ordinal = seg->base + (e - seg->index.begin());
+      if (range.since && e->time < range.since) return 0;
+      if ((range.limit && taken == range.limit) ||
+          (range.max_bytes && taken > 0 && bytes + e->length > range.max_bytes)) {
+        return ordinal + 1;
+      }
+
+      auto* ref = new std::shared_ptr<Mapping>(map);
+      grpc_slice s = grpc_slice_new_with_user_data(
+          const_cast<char*>(map->addr + e->offset + kRecordHeader), e->length,
+          ReleaseMapping, ref);
+      out->push_back({ordinal, e->time, grpc::Slice(s, grpc::Slice::STEAL_REF)});
+      ++taken;
+      bytes += e->length;
+    }
+  }
+  return 0;
+}
+
+uint64_t TimelineStore::Size(const std::string& username) {
+  auto log = Open(username, false);
+  if (!log) return 0;
+  std::lock_guard<std::mutex> lock(log->mu);
+  return log->count;
+}
+
+bool TimelineStore::Exists(const std::string& username) {
+  return Open(username, false) != nullptr;
+}
+
+grpc::ByteBuffer BuildTimelinePage(const std::vector<TimelineRecord>& records,
+                                   uint64_t next_cursor) {
+  std::vector<grpc::Slice> slices;
+  slices.reserve(records.size() * 2 + 1);
+  char frame[16];
+  for (const auto& r : records) {
+    // TimelinePage.posts = 1, length-delimited
+    frame[0] = 0x0A;
+    size_t n = 1 + PutVarint(r.payload.size(), frame + 1);
+    slices.emplace_back(frame, n);
+    slices.push_back(r.payload);
+  }
+  if (next_cursor) {
+    // TimelinePage.next_cursor = 2, varint
+    frame[0] = 0x10;
+    size_t n = 1 + PutVarint(next_cursor, frame + 1);
+    slices.emplace_back(frame, n);
+  }
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
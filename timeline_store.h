@@ -0,0 +1,110 @@
+#ifndef TIMELINE_STORE_H
+#define TIMELINE_STORE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
+
+#include "sns.pb.h"
+
+/*
+ * TimelineStore keeps every user's posts as an append-only binary log next
+ * to the human readable <username>.timeline file.
+ *
+ * Layout: <root>/<username>.timeline.d/<first ordinal>.seg
+ * Record: [u32 payload length][u32 reserved][i64 index time][serialized Message]
+ *
+ * A record's ordinal is its 0-based position in the user's log and doubles as
+ * the GetTimeline cursor. Reads hand out grpc::Slices that point straight into
+ * the mmap'ed segment, so a page can be sent without parsing or re-serializing
+ * any record.
+ */
+
+struct TimelineRecord {
+  uint64_t ordinal = 0;
+  int64_t time = 0;        // seconds; clamped so it never decreases within a log
+  grpc::Slice payload;     // serialized csce438::Message
+};
+
+struct TimelineRange {
+  int64_t since = 0;       // inclusive, seconds; 0 = unbounded
+  int64_t until = 0;       // inclusive, seconds; 0 = unbounded
+  uint64_t cursor = 0;     // first ordinal to consider
+  size_t limit = 0;        // max records to return
+  size_t max_bytes = 0;    // stop once this many payload bytes are collected; 0 = no cap
+};
+
+class TimelineStore {
+public:
+  static const uint64_t kSegmentBytes = 64ull << 20;
+  static const size_t kRecordHeader = 16;
+  // What Append returns for a post it could not store
+  static const uint64_t kAppendFailed = UINT64_MAX;
+
+  explicit TimelineStore(std::string root = ".");
+  ~TimelineStore();
+
+  TimelineStore(const TimelineStore&) = delete;
+  TimelineStore& operator=(const TimelineStore&) = delete;
+
+  // Appends msg to username's log and returns the ordinal it was stored at,
+  // or kAppendFailed if it could not be written; the log is then unchanged.
+  uint64_t Append(const std::string& username, const csce438::Message& msg);
+  // Same, for a Message the caller already serialized; time is its timestamp.
+  uint64_t Append(const std::string& username, const std::string& payload, int64_t time);
+
+  // Collects records of username's log that fall inside range, in ordinal
+  // order. Returns the ordinal to resume from, or 0 when the log is exhausted.
+  uint64_t Scan(const std::string& username, const TimelineRange& range,
+                std::vector<TimelineRecord>* out);
+
+  // Same, newest first: collects records below ordinal range.cursor (0 = from
+  // the newest). Returns the cursor to continue with, or 0 once nothing in
+  // range is left.
+  uint64_t ScanBack(const std::string& username, const TimelineRange& range,
+                    std::vector<TimelineRecord>* out);
+
+  // Number of records in username's log.
+  uint64_t Size(const std::string& username);
+
+  // Whether username has a log. Reads of a user without one find nothing and
+  // leave nothing behind; only Append creates it.
+  bool Exists(const std::string& username);
+
+  // Forgets username's log until it is used again: its index, mappings and
+  // append handle. Calls already reading it finish on the old copy, so no
+  // one may append to it meanwhile.
+  void Evict(const std::string& username);
+
+  const std::string& root() const { return root_; }
+
+private:
+  struct Mapping;
+  struct Segment;
+  struct UserLog;
+
+  std::shared_ptr<UserLog> Open(const std::string& username, bool create);
+  void LoadSegment(Segment* seg);
+  bool StartSegment(UserLog* log);
+  // The segment's mapping, replaced by a larger one if it does not cover bytes
+  std::shared_ptr<Mapping> Map(Segment* seg, uint64_t bytes);
+  static void ReleaseMapping(void* user_data);
+
+  std::string root_;
+  std::mutex mu_;
+  std::unordered_map<std::string, std::shared_ptr<UserLog>> logs_;
+};
+
+// Serializes a csce438::TimelinePage around already-serialized records. Each
+// record becomes one slice of the returned buffer; only the few bytes of field
+// framing are newly written.
+grpc::ByteBuffer BuildTimelinePage(const std::vector<TimelineRecord>& records,
+                                   uint64_t next_cursor);
+
+#endif
@@ -0,0 +1,145 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// Spans per thread that may wait for the flusher
+const size_t kRing = 4096;
+const std::chrono::milliseconds kFlushInterval(200);
+
+struct Span {
+  const char* name;
+  uint64_t trace_id;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+// Written only by its thread (head_) and read only by the flusher (tail_)
+struct Ring {
+  uint32_t tid;
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+  Span spans[kRing];
+};
+
+std::atomic<bool> started{false};
+std::atomic<uint64_t> sample_below{0};   // Sample() keeps an id below this
+
+// Rings are registered once per thread and never freed, so the flusher can
+// read them after their thread has exited.
+std::mutex rings_mu;
+std::vector<Ring*> rings;
+
+// Guards the output file and the flush itself
+std::mutex out_mu;
+FILE* out = nullptr;
+int pid = 0;
+
+Ring* ThisThreadRing() {
+  thread_local Ring* ring = nullptr;
+  if (!ring) {
+    ring = new Ring();
+    std::lock_guard<std::mutex> lock(rings_mu);
+    ring->tid = static_cast<uint32_t>(rings.size() + 1);
+    rings.push_back(ring);
+  }
+  return ring;
+}
+
+uint64_t RandomId() {
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  return rng();
+}
+
+}  // namespace
+
+bool Tracer::Start(const std::string& path, const std::string& process_name, double sample_rate) {
+  std::lock_guard<std::mutex> lock(out_mu);
+  if (out) return false;
+  out = fopen(path.c_str(), "w");
+  if (!out) return false;
+  pid = getpid();
+  // Chrome's array format: the closing ] is optional, so spans can be
+  // appended for as long as the process runs.
+  fprintf(out, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n", pid,
+          process_name.c_str());
+  fflush(out);
+  if (sample_rate >= 1) sample_below = UINT64_MAX;
+  else if (sample_rate > 0) sample_below = static_cast<uint64_t>(sample_rate * 18446744073709551615.0);
+  started = true;
+  std::thread([] {
+    while (true) {
+      std::this_thread::sleep_for(kFlushInterval);
+      Flush();
+    }
+  }).detach();
+  return true;
+}
+
+bool Tracer::enabled() { return started.load(std::memory_order_relaxed); }
+
+uint64_t Tracer::Sample() {
+  uint64_t below = sample_below.load(std::memory_order_relaxed);
+  if (!below) return 0;
+  uint64_t r = RandomId();
+  if (r >= below) return 0;
+  return RandomId() | 1;   // never 0
+}
+
+int64_t Tracer::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::Record(const char* name, uint64_t trace_id, int64_t start_ns, int64_t end_ns) {
+  if (!trace_id || !enabled()) return;
+  Ring* ring = ThisThreadRing();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) == kRing) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring->spans[head % kRing] = {name, trace_id, start_ns, end_ns};
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::Flush() {
+  std::vector<Ring*> all;
+  {
+    std::lock_guard<std::mutex> lock(rings_mu);
+    all = rings;
+  }
+  std::lock_guard<std::mutex> lock(out_mu);
+  if (!out) return;
+  for (Ring* ring : all) {
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail < head; tail++) {
+      const Span& s = ring->spans[tail % kRing];
+      // Complete events, in microseconds
+      fprintf(out,
+              "{\"name\":\"%s\",\"cat\":\"post\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":%u,\"args\":{\"trace\":\"%016llx\"}},\n",
+              s.name, static_cast<long long>(s.start_ns / 1000), static_cast<long long>(s.start_ns % 1000),
+              (s.end_ns - s.start_ns) / 1e3, pid, ring->tid, static_cast<unsigned long long>(s.trace_id));
+    }
+    ring->tail.store(head, std::memory_order_release);
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+      fprintf(out,
+              "{\"name\":\"dropped %llu spans\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":%d,\"tid\":%u},\n",
+              static_cast<unsigned long long>(dropped), static_cast<long long>(Now() / 1000), pid, ring->tid);
+    }
+  }
+  fflush(out);
+}
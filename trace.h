@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Sampled tracing of posts from the poster's tsc through tsd to each
+ * follower's tsc.
+ *
+ * A traced post carries a trace id (Message.trace_id) and the poster's send
+ * time, and every process it passes through records spans under that id.
+ * Spans go to a fixed-size ring per thread: one writer (the thread), one
+ * reader (the flusher), so recording is two relaxed loads and a release store
+ * and never blocks. A full ring drops the span. A background thread drains
+ * the rings every 200 ms and appends the spans to a file in Chrome's JSON
+ * trace format (chrome://tracing, ui.perfetto.dev).
+ *
+ * Times are wall-clock nanoseconds, so files written by processes on one host
+ * line up; merge them by dropping the first line ("[") of all but one:
+ *   { cat trace-tsd-5000.json; tail -qn +2 trace-tsc-*.json; } > trace.json
+ */
+class Tracer {
+public:
+  // Starts writing spans to path, naming the process process_name in the
+  // viewer, and samples posts at sample_rate (0..1). Call once, early; a
+  // process that never calls it records nothing.
+  static bool Start(const std::string& path, const std::string& process_name, double sample_rate);
+
+  static bool enabled();
+
+  // A new trace id for a post sampled at the configured rate, else 0
+  static uint64_t Sample();
+
+  // Wall-clock nanoseconds
+  static int64_t Now();
+
+  // Records a span of trace_id (no-op for 0 or when not started). name must
+  // outlive the process, e.g. a string literal.
+  static void Record(const char* name, uint64_t trace_id, int64_t start_ns, int64_t end_ns);
+
+  // Writes out every span recorded so far.
+  static void Flush();
+};
+
+// Records the span from construction to destruction.
+class TraceSpan {
+public:
+  TraceSpan(const char* name, uint64_t trace_id)
+      : name_(name), trace_id_(trace_id), start_(trace_id ? Tracer::Now() : 0) {}
+  ~TraceSpan() {
+    if (trace_id_) Tracer::Record(name_, trace_id_, start_, Tracer::Now());
+  }
+
+private:
+  const char* name_;
+  uint64_t trace_id_;
+  int64_t start_;
+};
+
+#endif
@@ -6,7 +6,16 @@
 #include <unistd.h>
 #include <grpc++/grpc++.h>
 #include <chrono>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
 #include "client.h"
+#include "coord_service.h"
+#include "post_codec.h"
+#include "timeline_cache.h"
+#include "trace.h"
 
 #include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
@@ -60,38 +69,96 @@ private:
     IReply UnFollow(const std::string& username);
     void Timeline(const std::string& username);
 
+    bool connect();
     bool canReachServer();
+    void keepAlive();
+    long streamTimeline(const std::string& username);
+    void showPost(Message& m, std::unordered_map<uint32_t, std::string>* authors);
+    void post(const std::string& text);
+    void acknowledge(uint64_t seq);
+
+    // Posts not yet acknowledged by the server. They are re-sent with their
+    // original sequence numbers whenever a new timeline stream is opened.
+    std::mutex post_mu_;
+    std::deque<Message> inflight_;
+    // Raised past the server's last stored seq at every login, so numbers
+    // keep increasing across restarts
+    uint64_t next_seq_ = 1;
+    ClientReaderWriter<Message, Message>* stream_ = nullptr;
+
+    // Last List result, kept so the next List only fetches what changed
+    uint64_t list_epoch_ = 0;
+    uint64_t users_version_ = 0;
+    uint64_t followers_version_ = 0;
+    std::vector<std::string> all_users_;
+    std::vector<std::string> followers_;
+
+    // Posts shown lately and how far the server has sent our inbox, kept
+    // across runs so TIMELINE can show them at once and resume from there
+    TimelineCache cache_;
+
+    // Session lease granted by Login. The pinger and timeline threads read
+    // the server address and session under conn_mu_ since connect() may swap
+    // both.
+    std::mutex conn_mu_;
+    uint64_t session_ = 0;
+    bool pinging_ = false;
 };
 
+// Well inside the server's 15s lease, so one lost ping does not expire it
+static const std::chrono::seconds kPingInterval(5);
+
 //////////////////////// connectTo ////////////////////////
 int Client::connectTo() {
-    std::string coord_addr = hostname + ":" + port;
-    auto coord_channel = grpc::CreateChannel(coord_addr, grpc::InsecureChannelCredentials());
-    auto coord_stub = CoordService::NewStub(coord_channel);
+    if (!connect()) {
+        std::cout << "Command failed" << std::endl;
+        return -1;
+    }
+    std::cout << "Command completed successfully" << std::endl;
+    if (!pinging_) {
+        pinging_ = true;
+        std::thread(&Client::keepAlive, this).detach();
+    }
+    return 1;
+}
+
+// Asks the coordinator for this user's server, connects and logs in.
+// Also used to fail over to another server when the timeline stream breaks.
+bool Client::connect() {
+    // -h may list several coordinators (replicas); start at a random one so
+    // clients spread over them, and try the rest in turn
+    std::vector<std::string> coord_addrs = coordinatorAddresses(hostname, port);
+    size_t first = std::random_device{}() % coord_addrs.size();
 
     ID id; id.set_id(std::stoi(username));
     ServerInfo serverinfo;
-    ClientContext ctx;
-
-    std::cout << "Requesting server assignment from Coordinator (" << coord_addr << ")..." << std::endl;
-    log(INFO, "Requesting server assignment from Coordinator at " + coord_addr);
-
-    Status stat = coord_stub->GetServer(&ctx, id, &serverinfo);
-    if (!stat.ok()) { 
-        std::cout << "Command failed" << std::endl; 
+    Status stat;
+    for (size_t i = 0; i < coord_addrs.size(); i++) {
+        const std::string& coord_addr = coord_addrs[(first + i) % coord_addrs.size()];
+        auto coord_stub = CoordService::NewStub(grpc::CreateChannel(coord_addr, grpc::InsecureChannelCredentials()));
+        ClientContext ctx;
+        ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(2));
+
+        std::cout << "Requesting server assignment from Coordinator (" << coord_addr << ")..." << std::endl;
+        log(INFO, "Requesting server assignment from Coordinator at " + coord_addr);
+
+        stat = coord_stub->GetServer(&ctx, id, &serverinfo);
+        if (stat.ok()) break;
         log(ERROR, "Coordinator GetServer failed: " + stat.error_message());
-        return -1; 
     }
+    if (!stat.ok()) return false;
 
-    server_address_ = serverinfo.hostname() + ":" + serverinfo.port();
+    {
+        std::lock_guard<std::mutex> lock(conn_mu_);
+        server_address_ = serverinfo.hostname() + ":" + serverinfo.port();
+    }
     std::cout << "Assigned to Server at " << server_address_ << std::endl;
     log(INFO, "Assigned to Server at " + server_address_);
 
     auto channel = grpc::CreateChannel(server_address_, grpc::InsecureChannelCredentials());
     if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5))) {
-        std::cout << "Command failed" << std::endl; 
         log(ERROR, "Failed to connect to server " + server_address_);
-        return -1;
+        return false;
     }
 
     stub_ = SNSService::NewStub(channel);
@@ -99,20 +166,46 @@ int Client::connectTo() {
 
     IReply ire = Login();
     if (!ire.grpc_status.ok() || ire.comm_status != SUCCESS) { 
-        std::cout << "Command failed" << std::endl; 
         log(ERROR, "Login RPC failed for user " + username);
-        return -1; 
+        return false; 
     }
 
-    std::cout << "Command completed successfully" << std::endl;
     log(INFO, "Login successful for user " + username);
-    return 1;
+    return true;
+}
+
+// Renews the session lease every kPingInterval so the server keeps the
+// username reserved for us while no timeline stream is open.
+void Client::keepAlive() {
+    std::string addr;
+    std::unique_ptr<SNSService::Stub> stub;
+    while (true) {
+        std::this_thread::sleep_for(kPingInterval);
+        Request req; req.set_username(username);
+        {
+            std::lock_guard<std::mutex> lock(conn_mu_);
+            if (addr != server_address_) {
+                addr = server_address_;
+                stub = SNSService::NewStub(grpc::CreateChannel(addr, grpc::InsecureChannelCredentials()));
+            }
+            req.set_session(session_);
+        }
+        Reply rep; ClientContext ctx;
+        ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(2));
+        Status s = stub->KeepAlive(&ctx, req, &rep);
+        if (s.ok() && rep.msg() != "OK") log(WARNING, "Session lease lost: " + rep.msg());
+    }
 }
 
 //////////////////////// utility ////////////////////////
 bool Client::canReachServer() {
-    if (server_address_.empty()) return false;
-    auto ch = grpc::CreateChannel(server_address_, grpc::InsecureChannelCredentials());
+    std::string address;
+    {
+        std::lock_guard<std::mutex> lock(conn_mu_);
+        address = server_address_;
+    }
+    if (address.empty()) return false;
+    auto ch = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
     if (!ch->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(2))) return false;
 
     auto stub = SNSService::NewStub(ch);
@@ -190,6 +283,10 @@ IReply Client::List() {
 
     Request req;
     req.set_username(username);
+    req.set_session(session_);
+    req.set_list_epoch(list_epoch_);
+    req.set_users_version(users_version_);
+    req.set_followers_version(followers_version_);
     ListReply lr;
     ClientContext ctx;
 
@@ -200,17 +297,29 @@ IReply Client::List() {
     if (s.ok()) {
         ire.comm_status = SUCCESS;
 
-        // Populate all_users
+        // Apply the reply to the cached lists: either replacements or deltas
+        if (!lr.users_delta()) all_users_.clear();
         for (const auto& user : lr.all_users()) {
-            ire.all_users.push_back(user);
+            all_users_.push_back(user);
+        }
+        if (!lr.followers_delta()) followers_.clear();
+        for (const auto& follower : lr.removed_followers()) {
+            followers_.erase(std::remove(followers_.begin(), followers_.end(), follower), followers_.end());
         }
-
-        // Populate followers
         for (const auto& follower : lr.followers()) {
-            ire.followers.push_back(follower);
+            if (std::find(followers_.begin(), followers_.end(), follower) == followers_.end()) {
+                followers_.push_back(follower);
+            }
         }
-
-        log(INFO, "List RPC success. Total users: " + std::to_string(lr.all_users_size()));
+        list_epoch_ = lr.list_epoch();
+        users_version_ = lr.users_version();
+        followers_version_ = lr.followers_version();
+        ire.all_users = all_users_;
+        ire.followers = followers_;
+
+        log(INFO, "List RPC success. Total users: " + std::to_string(all_users_.size()) + ", " +
+            std::to_string(lr.all_users_size() + lr.followers_size() + lr.removed_followers_size()) +
+            " names sent");
     } else {
         ire.comm_status = FAILURE_UNKNOWN;
         log(ERROR, "List RPC failed: " + s.error_message());
@@ -222,6 +331,7 @@ IReply Client::List() {
 IReply Client::Follow(const std::string& u2) {
     IReply ire;
     Request req; req.set_username(username); req.add_arguments(u2);
+    req.set_session(session_);
     Reply rep; ClientContext ctx;
     log(INFO, "Sending Follow RPC from " + username + " → " + u2);
     Status s = stub_->Follow(&ctx, req, &rep);
@@ -234,6 +344,7 @@ IReply Client::Follow(const std::string& u2) {
 IReply Client::UnFollow(const std::string& u2) {
     IReply ire;
     Request req; req.set_username(username); req.add_arguments(u2);
+    req.set_session(session_);
     Reply rep; ClientContext ctx;
     log(INFO, "Sending UnFollow RPC from " + username + " → " + u2);
     Status s = stub_->UnFollow(&ctx, req, &rep);
@@ -245,78 +356,210 @@ IReply Client::UnFollow(const std::string& u2) {
 
 IReply Client::Login() {
     IReply ire;
-    Request req; req.set_username(username);
+    // Presenting our session lets a reconnect take the name back while the
+    // server still holds the lease for us.
+    Request req; req.set_username(username); req.set_session(session_);
     Reply rep; ClientContext ctx;
     log(INFO, "Attempting Login RPC for user " + username);
     Status s = stub_->Login(&ctx, req, &rep);
     ire.grpc_status = s;
     ire.comm_status = s.ok() ? SUCCESS : FAILURE_UNKNOWN;
-    if (!s.ok()) log(ERROR, "Login RPC failed: " + s.error_message());
+    if (!s.ok()) {
+        log(ERROR, "Login RPC failed: " + s.error_message());
+    } else if (rep.msg() == "User already logged in") {
+        ire.comm_status = FAILURE_ALREADY_EXISTS;
+        log(ERROR, "User " + username + " is already logged in elsewhere");
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(conn_mu_);
+            session_ = rep.session();
+        }
+        std::lock_guard<std::mutex> lock(post_mu_);
+        next_seq_ = std::max(next_seq_, rep.last_seq() + 1);
+    }
     return ire;
 }
 
 //////////////////////// Timeline(Pass "Now you are in the timeline" to framework) ////////////////////////
 extern std::string getPostMessage();
+void displayReConnectionMessage(const std::string& host, const std::string& port);
+
 void Client::Timeline(const std::string& username) {
+    std::string cache_path = "tsc-" + username + ".cache";
+    if (cache_.Open(cache_path)) {
+        for (const auto& m : cache_.Posts()) {
+            std::time_t tt = static_cast<std::time_t>(m.timestamp().seconds());
+            displayPostMessage(m.username(), m.msg(), tt);
+        }
+    } else {
+        log(WARNING, "Cannot open timeline cache " + cache_path + ", starting without it");
+    }
+
+    // Input has its own thread so a broken stream can be replaced without
+    // losing what the user types meanwhile; posts queue up in inflight_.
+    std::thread writer([this]() {
+        while (true) post(getPostMessage());
+    });
+    writer.detach();
+
+    while (true) {
+        // Over the server's limits, or the server is being replaced: wait as
+        // told, then resume on the same server. The wait comes after the old
+        // call is released, which a server being replaced waits for
+        long wait_ms = streamTimeline(username);
+        if (wait_ms >= 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            continue;
+        }
+        // The stream broke: fail over through the coordinator and resume.
+        displayReConnectionMessage(hostname, port);
+        log(WARNING, "Timeline stream lost for user " + username + ", reconnecting");
+        while (!connect()) std::this_thread::sleep_for(std::chrono::seconds(2));
+    }
+}
+
+// Shows a post from the timeline stream unless it was shown already. A frame
+// that only names an author token is remembered instead.
+void Client::showPost(Message& m, std::unordered_map<uint32_t, std::string>* authors) {
+    if (m.author()) {
+        if (m.msg().empty() && !m.username().empty()) {
+            (*authors)[m.author()] = m.username();
+            return;
+        }
+        auto it = authors->find(m.author());
+        if (it != authors->end()) m.set_username(it->second);
+        m.clear_author();
+    }
+    if (!cache_.Add(m)) return;
+    std::time_t tt = static_cast<std::time_t>(m.timestamp().seconds());
+    {
+        TraceSpan span("tsc.display", m.trace_id());
+        displayPostMessage(m.username(), m.msg(), tt);
+    }
+    // From the poster's send to on screen here
+    if (m.trace_sent_ns()) Tracer::Record("post.delivered", m.trace_id(), m.trace_sent_ns(), Tracer::Now());
+}
+
+// Runs one timeline stream until it breaks. Returns how long to wait before
+// opening it again on the same server: the retry-after-ms of a server that
+// closed it for going over a rate limit, or the reconnect-after-ms of one
+// handing over to a new process on its port. Returns -1 if the client should
+// fail over instead.
+long Client::streamTimeline(const std::string& username) {
     grpc::ClientContext ctx;
     ctx.AddMetadata("username", username);
-    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
-
-    auto ch = grpc::CreateChannel(server_address_, grpc::InsecureChannelCredentials());
+    std::string address;
+    {
+        std::lock_guard<std::mutex> lock(conn_mu_);
+        address = server_address_;
+        ctx.AddMetadata("session", std::to_string(session_));
+    }
+    std::string resume = cache_.resume();
+    if (!resume.empty()) ctx.AddMetadata("inbox-resume", resume);
+    // Posts packed and with interned usernames, if the server can send them
+    ctx.AddMetadata("post-encoding", kPostEncoding);
+
+    // A connection of its own: one shared with the last stream may be to a
+    // server that is handing over, and about to close
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    auto ch = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
     if (!ch->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(2))) {
-        // Do not print message here either, let run() print once based on Finish() status
         log(ERROR, "Timeline connection failed for user " + username);
-        return;
+        return -1;
     }
 
     auto stub = SNSService::NewStub(ch);
     auto stream = stub->Timeline(&ctx);
     if (!stream) {
         log(ERROR, "Timeline stream creation failed for user " + username);
-        return;
+        return -1;
     }
 
     log(INFO, "Timeline stream started for user " + username);
-    Message handshake = MakeMessage(username, "[handshake]");
-    if (!stream->Write(handshake)) return;
-
-    auto* s = stream.get();
-    std::thread reader([&]() {
-        Message msg;
-        while (s->Read(&msg)) {
-            std::time_t tt = static_cast<std::time_t>(msg.timestamp().seconds());
-            displayPostMessage(msg.username(), msg.msg(), tt);
-        }
-        log(INFO, "Timeline reader thread ended for user " + username);
-    });
+    {
+        std::lock_guard<std::mutex> lock(post_mu_);
+        if (!stream->Write(MakeMessage(username, "[handshake]"))) return -1;
+        // Posts may be pipelined without waiting for acks: anything the last
+        // server did store is recognized by its seq and dropped.
+        for (const auto& m : inflight_) stream->Write(m);
+        if (!inflight_.empty()) log(INFO, "Re-sent " + std::to_string(inflight_.size()) + " unacknowledged posts");
+        stream_ = stream.get();
+    }
 
-    std::thread writer([&]() {
-        while (true) {
-            std::string text = getPostMessage();
-            Message m = MakeMessage(username, text);
-            if (!s->Write(m)) break;
+    // Author tokens the server has named on this stream
+    std::unordered_map<uint32_t, std::string> authors;
+    std::string raw;
+    Message msg;
+    while (stream->Read(&msg)) {
+        if (msg.ack()) { acknowledge(msg.ack()); continue; }
+        if (!msg.inbox_resume().empty()) { cache_.set_resume(msg.inbox_resume()); continue; }
+        if (msg.packed().empty()) {
+            showPost(msg, &authors);
+            continue;
         }
-        s->WritesDone();
-        log(INFO, "Timeline writer thread ended for user " + username);
-    });
-
-    writer.join();
-    reader.join();
+        if (!UnpackFrame(msg.packed(), &raw)) {
+            log(WARNING, "Dropped a corrupt frame on the timeline stream of user " + username);
+            continue;
+        }
+        const char* data;
+        size_t size;
+        for (size_t pos = 0; NextInFrame(raw, &pos, &data, &size);) {
+            Message m;
+            if (m.ParseFromArray(data, static_cast<int>(size))) showPost(m, &authors);
+        }
+    }
 
+    {
+        std::lock_guard<std::mutex> lock(post_mu_);
+        stream_ = nullptr;
+    }
     Status st = stream->Finish();
-    (void)st; // Framework handles unified printing
-    log(INFO, "Timeline session closed for user " + username);
+    log(INFO, "Timeline stream closed for user " + username + ": " + st.error_message());
+    const auto& trailers = ctx.GetServerTrailingMetadata();
+    if (st.error_code() == grpc::StatusCode::UNAVAILABLE) {
+        auto it = trailers.find("reconnect-after-ms");
+        if (it == trailers.end()) return -1;
+        return atol(std::string(it->second.data(), it->second.length()).c_str());
+    }
+    if (st.error_code() != grpc::StatusCode::RESOURCE_EXHAUSTED) return -1;
+
+    long retry_ms = 1000;
+    auto it = trailers.find("retry-after-ms");
+    if (it != trailers.end()) retry_ms = atol(std::string(it->second.data(), it->second.length()).c_str());
+    return retry_ms;
+}
+
+void Client::post(const std::string& text) {
+    Message m = MakeMessage(username, text);
+    uint64_t trace = Tracer::Sample();
+    if (trace) {
+        m.set_trace_id(trace);
+        m.set_trace_sent_ns(Tracer::Now());
+    }
+    std::lock_guard<std::mutex> lock(post_mu_);
+    m.set_seq(next_seq_++);
+    inflight_.push_back(m);
+    if (stream_) stream_->Write(m);
+    if (trace) Tracer::Record("tsc.send", trace, m.trace_sent_ns(), Tracer::Now());
+}
+
+void Client::acknowledge(uint64_t seq) {
+    std::lock_guard<std::mutex> lock(post_mu_);
+    while (!inflight_.empty() && inflight_.front().seq() <= seq) inflight_.pop_front();
 }
 
 //////////////////////// main ////////////////////////
 int main(int argc, char** argv) {
     std::string host = "localhost", user = "1", port = "9090";
+    double trace_rate = -1;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "h:k:u:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:k:u:t:")) != -1) {
         switch (opt) {
         case 'h': host = optarg; break;
         case 'k': port = optarg; break;
         case 'u': user = optarg; break;
+        case 't': trace_rate = atof(optarg); break;
         default: std::cout << "Invalid Command Line Argument\n";
         }
     }
@@ -326,6 +569,11 @@ int main(int argc, char** argv) {
     google::InitGoogleLogging(log_file_name.c_str());
     log(INFO, "Logging Initialized. Client starting...");
 
+    // -t <rate>: trace that fraction of our posts, and every traced post we see
+    if (trace_rate >= 0 && !Tracer::Start("trace-tsc-" + user + ".json", "tsc " + user, trace_rate)) {
+        log(ERROR, "Could not open trace-tsc-" + user + ".json");
+    }
+
     std::cout << "Logging Initialized. Client starting..." << std::endl;
     Client c(host, user, port);
     c.run();  // Framework handles unified printing: success/failure + "Now you are in the timeline"
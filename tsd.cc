@@ -31,70 +31,44 @@
  *
  */
 
-#include <ctime>
-#include <unordered_map>
-#include <algorithm>
 #include <thread>   // Added for heartbeat thread support
 
-#include <google/protobuf/timestamp.pb.h>
-#include <google/protobuf/duration.pb.h>
-
-#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <stdlib.h>
 #include <unistd.h>
-#include <google/protobuf/util/time_util.h>
 #include <grpc++/grpc++.h>
-#include<glog/logging.h>
-#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
 
-#include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"   // Added for coordinator communication
 #include "coordinator.pb.h"
+#include "coord_service.h"
+#include "handover.h"
+#include "sns_service.h"
+#include "trace.h"
+
+#include<glog/logging.h>
+#define log(severity, msg) LOG(severity) << msg; google::FlushLogFiles(google::severity); 
 
-using google::protobuf::Timestamp;
-using google::protobuf::Duration;
 using grpc::Server;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
-using grpc::ServerReader;
-using grpc::ServerReaderWriter;
-using grpc::ServerWriter;
 using grpc::Status;
-using csce438::Message;
-using csce438::ListReply;
-using csce438::Request;
-using csce438::Reply;
-using csce438::SNSService;
 using csce438::CoordService;       // Added
 using csce438::ServerInfo;         // Added
 using csce438::Confirmation;       // Added
 
-
-struct Client {
-  std::string username;
-  bool connected = true;
-  int following_file_size = 0;
-  std::vector<Client*> client_followers;
-  std::vector<Client*> client_following;
-  ServerReaderWriter<Message, Message>* stream = 0;
-  bool operator==(const Client& c1) const{
-    return (username == c1.username);
-  }
-};
-
-//Vector that stores every client that has been created
-std::vector<Client*> client_db;
-
 // New: Heartbeat thread function
-void SendHeartbeat(std::string coord_ip, std::string coord_port,
+// Heartbeats go to the first coordinator in coord_addrs that answers, moving
+// on to the next one whenever the current one fails.
+void SendHeartbeat(std::vector<std::string> coord_addrs,
                    int cluster_id, int server_id, std::string server_port) {
-  // Create a gRPC channel to the Coordinator
-  auto channel = grpc::CreateChannel(coord_ip + ":" + coord_port,
-                                     grpc::InsecureChannelCredentials());
-  std::unique_ptr<CoordService::Stub> coord_stub = CoordService::NewStub(channel);
+  // Create a gRPC channel to each Coordinator
+  std::vector<std::unique_ptr<CoordService::Stub>> coord_stubs;
+  for (const auto& addr : coord_addrs) {
+    coord_stubs.push_back(CoordService::NewStub(grpc::CreateChannel(addr, grpc::InsecureChannelCredentials())));
+  }
+  size_t current = 0;
+  size_t failed = 0;   // coordinators that failed in a row
 
   // Prepare server info for registration
   csce438::ServerInfo info;
@@ -105,210 +79,90 @@ void SendHeartbeat(std::string coord_ip, std::string coord_port,
 
   while (true) {
     grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(2));
     csce438::Confirmation conf;
-    Status s = coord_stub->Heartbeat(&ctx, info, &conf);
+    Status s = coord_stubs[current]->Heartbeat(&ctx, info, &conf);
     if (s.ok() && conf.status()) {
-      log(INFO, "💓 Heartbeat sent to Coordinator (" + coord_ip + ":" + coord_port + ")");
+      log(INFO, "💓 Heartbeat sent to Coordinator (" + coord_addrs[current] + ")");
     } else {
-      log(ERROR, "❌ Heartbeat failed: " + s.error_message());
+      log(ERROR, "❌ Heartbeat to " + coord_addrs[current] + " failed: " + s.error_message());
+      current = (current + 1) % coord_stubs.size();
+      if (++failed < coord_stubs.size()) continue;   // try the next one right away
     }
+    failed = 0;
     std::this_thread::sleep_for(std::chrono::seconds(5)); // send every 5s
   }
 }
 
+void RunServer(SNSServiceImpl* service, std::string port_no, std::string coord_ip,
+               std::string coord_port, int cluster_id, int server_id,
+               HandoverClient* predecessor) {   // Added new args
+  std::string server_address = "127.0.0.1:"+port_no;
 
-class SNSServiceImpl final : public SNSService::Service {
-  
-  Status List(ServerContext* context, const Request* request, ListReply* list_reply) override {
-    // Get the username from the request
-    std::string user = request->username();
-
-    // Add all registered users to the all_users list in the reply
-    for(auto c: client_db){
-      list_reply->add_all_users(c->username);
-    }
-
-    // Find the current user and add their followers to the followers list
-    for(auto c: client_db){
-      if(c->username == user){
-        for(auto f: c->client_followers){
-          list_reply->add_followers(f->username);
-        }
-        break;
-      }
-    }
-    return Status::OK;
-  }
-
-  Status Follow(ServerContext* context, const Request* request, Reply* reply) override {
-    // Get the username of the requester
-    std::string user = request->username();
-
-    // Check if an argument (user to follow) is provided
-    if (request->arguments_size() == 0) { reply->set_msg("INVALID"); return Status::OK; }
-    std::string user_to_follow = request->arguments(0);
-
-    // Prevent self-following
-    if (user == user_to_follow) { reply->set_msg("INVALID_USERNAME"); return Status::OK; }
-
-    // Find the client objects for both users
-    Client* user_client = nullptr;
-    Client* follow_client = nullptr;
-    for (auto c : client_db) {
-      if (c->username == user) user_client = c;
-      if (c->username == user_to_follow) follow_client = c;
-      if (user_client && follow_client) break;
-    }
-
-    // Check if both users exist
-    if (!user_client || !follow_client) { reply->set_msg("User does not exist"); return Status::OK; }
-
-    // Check if already following
-    for (auto c : user_client->client_following) {
-      if (c->username == user_to_follow) { reply->set_msg("Already following user"); return Status::OK; }
-    }
-
-    // Establish the follow relationship
-    user_client->client_following.push_back(follow_client);
-    follow_client->client_followers.push_back(user_client);
-
-    // Record the follow time for timeline filtering
-    {
-      std::ofstream ofs(user + std::string("_follow_time.txt"), std::ios::app);
-      ofs << user_to_follow << "|" << static_cast<long long>(time(nullptr)) << "\n";
-    }
-
-    reply->set_msg("OK");
-    return Status::OK;
+  // Connections are accepted here rather than by gRPC, so the listening
+  // socket can be handed over to a successor (handover.h)
+  CallCounter calls;
+  auto build = [&]() {
+    ServerBuilder builder;
+    builder.RegisterService(service);
+    std::vector<std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>> interceptors;
+    interceptors.push_back(calls.Factory());
+    builder.experimental().SetInterceptorCreators(std::move(interceptors));
+    return std::unique_ptr<Server>(builder.BuildAndStart());
+  };
+  std::unique_ptr<Server> server = build();
+  int listen_fd = predecessor ? predecessor->Cutover(service) : ListenTcp("127.0.0.1", port_no);
+  if (listen_fd < 0) {
+    std::cerr << "Cannot listen on " << server_address << std::endl;
+    log(ERROR, "Cannot listen on "+server_address);
+    return;
   }
-
-  Status UnFollow(ServerContext* context, const Request* request, Reply* reply) override {
-    // Get the username of the requester
-    std::string user = request->username();
-
-    // Check if an argument (user to unfollow) is provided
-    if (request->arguments_size() == 0) { reply->set_msg("INVALID"); return Status::OK; }
-    std::string user_to_unfollow = request->arguments(0);
-
-    // Prevent self-unfollowing
-    if (user == user_to_unfollow) { reply->set_msg("INVALID_USERNAME"); return Status::OK; }
-
-    // Find the client objects for both users
-    Client* user_client = nullptr;
-    Client* unfollow_client = nullptr;
-    for (auto c : client_db) {
-      if (c->username == user) user_client = c;
-      if (c->username == user_to_unfollow) unfollow_client = c;
-      if (user_client && unfollow_client) break;
-    }
-
-    // Check if both users exist
-    if (!user_client || !unfollow_client) { reply->set_msg("User does not exist"); return Status::OK; }
-
-    // Remove from following list
-    bool found = false;
-    for (auto it = user_client->client_following.begin(); it != user_client->client_following.end(); ++it) {
-      if ((*it)->username == user_to_unfollow) {
-        user_client->client_following.erase(it);
-        found = true;
-        break;
-      }
-    }
-    if (!found) { reply->set_msg("Not following user"); return Status::OK; }
-
-    // Remove from followers list of the unfollowed user
-    for (auto it = unfollow_client->client_followers.begin(); it != unfollow_client->client_followers.end(); ++it) {
-      if ((*it)->username == user) { unfollow_client->client_followers.erase(it); break; }
-    }
-
-    reply->set_msg("OK");
-    return Status::OK;
+  auto acceptor = std::make_unique<Acceptor>(listen_fd, server.get());
+  acceptor->Start();
+  if (predecessor) {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    int64_t gap = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - predecessor->stopped_ns();
+    std::cout << "Took over " << server_address << ", service gap " << gap / 1000000.0 << " ms" << std::endl;
+    log(INFO, "Took over "+server_address+", service gap "+std::to_string(gap / 1000000.0)+" ms");
+  } else {
+    std::cout << "Server listening on " << server_address << std::endl;
+    log(INFO, "Server listening on "+server_address);
   }
 
-  Status Login(ServerContext* context, const Request* request, Reply* reply) override {
-    // Get the username from the request
-    std::string user = request->username();
-
-    // Check if user already exists
-    for (auto c : client_db) {
-      if (c->username == user) {
-        // If already connected, reject login
-        if (c->connected) { reply->set_msg("User already logged in"); return Status::OK; }
-        // Reconnect existing user
-        c->connected = true;
-        reply->set_msg("Login successful");
-        return Status::OK;
-      }
-    }
+  // Start heartbeat thread after server starts
+  std::thread hb(SendHeartbeat, coordinatorAddresses(coord_ip, coord_port), cluster_id, server_id, port_no);
+  hb.detach();
 
-    // Create new user if not found
-    Client* new_client = new Client();
-    new_client->username = user;
-    new_client->connected = true;
-    client_db.push_back(new_client);
-    reply->set_msg("New user created and logged in");
-    return Status::OK;
+  service->Start();
+
+  // Until a successor takes over (tsd -u). Servers shut down by a cutover
+  // that failed finish shutting down on their own, and must outlive
+  // successor, which waits for that
+  std::vector<std::unique_ptr<Server>> retired;
+  HandoverServer successor(HandoverPath("."));
+  if (!successor.Open()) {
+    log(ERROR, "Cannot listen on " + HandoverPath(".") + "; this server cannot be taken over");
+    server->Wait();
+    return;
   }
-
-  Status Timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream) override {
-    // Original MP1 timeline implementation — unchanged
-    std::string username;
-    const auto& md = context->client_metadata();
-    auto it = md.find("username");
-    if (it != md.end()) {
-      username.assign(it->second.data(), it->second.length());
-    } else {
-      return Status(grpc::StatusCode::UNAUTHENTICATED, "No username in metadata");
-    }
-
-    Client* user_client = nullptr;
-    for (auto c : client_db) if (c->username == username) { user_client = c; break; }
-    if (!user_client) return Status(grpc::StatusCode::NOT_FOUND, "User not found");
-
-    user_client->stream = stream;
-
-    Message incoming;
-    while (stream->Read(&incoming)) {
-      const std::string self_file = user_client->username + ".timeline";
-      std::ofstream fout(self_file, std::ios::app);
-      if (fout) {
-        char buf[32];
-        time_t sec = static_cast<time_t>(incoming.timestamp().seconds());
-        std::tm* tm_ptr = localtime(&sec);
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tm_ptr);
-        fout << "T " << buf << "\n"
-            << "U " << incoming.username() << "\n"
-            << "W " << incoming.msg() << "\n\n";
-      }
-
-      for (auto f : user_client->client_followers) {
-        if (f->stream) {
-          f->stream->Write(incoming);
-        }
-      }
+  while (true) {
+    HandoverServer::Result result = successor.Serve(service, server.get(), acceptor.get(), &calls);
+    if (result == HandoverServer::kHandedOver) {
+      log(INFO, "Handed over to a successor, exiting");
+      // Closes the connections still open, whose clients then reconnect
+      // to the successor; everything else is written out already
+      Tracer::Flush();
+      _exit(0);
     }
-
-    user_client->stream = nullptr;
-    return Status::OK;
+    if (result != HandoverServer::kResumed) break;
+    // The listening socket is still open; connections queued on it meanwhile
+    // go to the new server
+    retired.push_back(std::move(server));
+    server = build();
+    acceptor = std::make_unique<Acceptor>(listen_fd, server.get());
+    acceptor->Start();
+    log(INFO, "Serving again on " + server_address);
   }
-};
-
-void RunServer(std::string port_no, std::string coord_ip, std::string coord_port,
-               int cluster_id, int server_id) {   // Added new args
-  std::string server_address = "127.0.0.1:"+port_no;
-  SNSServiceImpl service;
-
-  ServerBuilder builder;
-  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
-  std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_address << std::endl;
-  log(INFO, "Server listening on "+server_address);
-
-  // Start heartbeat thread after server starts
-  std::thread hb(SendHeartbeat, coord_ip, coord_port, cluster_id, server_id, port_no);
-  hb.detach();
-
   server->Wait();
 }
 
@@ -319,15 +173,34 @@ int main(int argc, char** argv) {
   std::string coord_port = "9090";      // ✅ new
   int cluster_id = 1;                   // ✅ new
   int server_id = 1;                    // ✅ new
+  AdmissionLimits limits;
+  std::string bad_limit;
+  double trace_rate = -1;
+  size_t memory_mb = 1024;
+  bool take_over = false;
+  unsigned hw = std::thread::hardware_concurrency();
+  unsigned fanout_threads = hw > 1 ? hw - 1 : 0;
+  bool compression = true;
   
   int opt = 0;
-  while ((opt = getopt(argc, argv, "c:s:h:k:p:")) != -1){   // ✅ expanded args
+  while ((opt = getopt(argc, argv, "c:s:h:k:p:l:t:m:uf:z:")) != -1){   // ✅ expanded args
     switch(opt) {
       case 'c': cluster_id = atoi(optarg); break;
       case 's': server_id = atoi(optarg); break;
       case 'h': coord_ip = optarg; break;
       case 'k': coord_port = optarg; break;
       case 'p': port = optarg; break;
+      case 't': trace_rate = atof(optarg); break;
+      case 'm': memory_mb = strtoull(optarg, nullptr, 10); break;
+      case 'u': take_over = true; break;
+      case 'f': fanout_threads = atoi(optarg); break;
+      case 'z': compression = std::string(optarg) != "none"; break;
+      case 'l':
+        if (!limits.Parse(optarg, &bad_limit)) {
+          std::cerr << "Invalid limit: " << bad_limit << "\n";
+          return 1;
+        }
+        break;
       default:
 	  std::cerr << "Invalid Command Line Argument\n";
     }
@@ -337,7 +210,36 @@ int main(int argc, char** argv) {
   google::InitGoogleLogging(log_file_name.c_str());
   log(INFO, "Logging Initialized. Server starting...");
 
-  RunServer(port, coord_ip, coord_port, cluster_id, server_id);  // ✅ updated
+  // -t <rate>: trace that fraction of posts, plus every post a client traced
+  if (trace_rate >= 0 && !Tracer::Start("trace-tsd-" + port + ".json", "tsd " + port, trace_rate)) {
+    log(ERROR, "Could not open trace-tsd-" + port + ".json");
+  }
+
+  SNSServiceImpl service(".", limits);
+  // -m <MB>: user state kept in memory; idle users beyond it are paged to
+  // users.pages (0 keeps everyone in memory)
+  service.set_memory_budget(memory_mb << 20);
+  // -f <threads>: threads, besides the posting one, that fan posts out to
+  // long follower lists (default: one per core after the first)
+  service.set_fanout_threads(fanout_threads);
+  // -z none: send everything uncompressed (post_codec.h)
+  service.set_compression(compression);
+  // -u: take over from the tsd serving this directory, e.g. to upgrade it,
+  // recovering from the checkpoint it sends while it keeps serving
+  std::unique_ptr<HandoverClient> predecessor;
+  if (take_over) {
+    predecessor.reset(new HandoverClient(HandoverPath(".")));
+    if (!predecessor->Prepare(&service)) {
+      std::cerr << "No tsd to take over from at " << HandoverPath(".") << std::endl;
+      return 1;
+    }
+  } else {
+    service.Recover();
+  }
+  // Other servers forward posts here and import migrated users at this address
+  service.set_address("127.0.0.1:" + port);
+
+  RunServer(&service, port, coord_ip, coord_port, cluster_id, server_id, predecessor.get());  // ✅ updated
 
   return 0;
 }
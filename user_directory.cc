@@ -0,0 +1,87 @@
+#include "user_directory.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+namespace {
+
+size_t Hash(const char* name, size_t len) { return std::hash<std::string_view>()(std::string_view(name, len)); }
+
+// Reads the varint length at p and leaves p at the name
+size_t ReadLength(const char*& p) {
+  size_t len = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t b = static_cast<uint8_t>(*p++);
+    len |= static_cast<size_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) return len;
+  }
+}
+
+}  // namespace
+
+size_t UserDirectory::Probe(const char* name, size_t len) const {
+  size_t mask = slots_.size() - 1;
+  for (size_t s = Hash(name, len) & mask;; s = (s + 1) & mask) {
+    if (!slots_[s]) return s;
+    const char* p = arena_.data() + offsets_[slots_[s] - 1];
+    if (ReadLength(p) == len && memcmp(p, name, len) == 0) return s;
+  }
+}
+
+void UserDirectory::Rehash(size_t slots) {
+  std::vector<uint32_t> old;
+  old.swap(slots_);
+  slots_.assign(slots, 0);
+  size_t mask = slots_.size() - 1;
+  for (uint32_t slot : old) {
+    if (!slot) continue;
+    const char* p = arena_.data() + offsets_[slot - 1];
+    size_t len = ReadLength(p);
+    size_t s = Hash(p, len) & mask;
+    while (slots_[s]) s = (s + 1) & mask;
+    slots_[s] = slot;
+  }
+}
+
+UserDirectory::Id UserDirectory::Add(const std::string& name) {
+  // At most three quarters full, so a probe stays short
+  if ((offsets_.size() + 1) * 4 > slots_.size() * 3) Rehash(slots_.empty() ? 1024 : slots_.size() * 2);
+  Id id = static_cast<Id>(offsets_.size());
+  offsets_.push_back(static_cast<uint32_t>(arena_.size()));
+  size_t len = name.size();
+  do {
+    arena_.push_back(static_cast<char>((len & 0x7f) | (len > 0x7f ? 0x80 : 0)));
+    len >>= 7;
+  } while (len);
+  arena_ += name;
+  slots_[Probe(name.data(), name.size())] = id + 1;
+  return id;
+}
+
+void UserDirectory::Reserve(size_t users, size_t name_bytes) {
+  offsets_.reserve(users);
+  arena_.reserve(name_bytes + users);   // one length byte each, for names under 128 bytes
+  size_t slots = std::max<size_t>(slots_.size(), 1024);
+  while (users * 4 > slots * 3) slots *= 2;
+  if (slots > slots_.size()) Rehash(slots);
+}
+
+bool UserDirectory::Find(const std::string& name, Id* id) const {
+  if (slots_.empty()) return false;
+  uint32_t slot = slots_[Probe(name.data(), name.size())];
+  if (!slot) return false;
+  *id = slot - 1;
+  return true;
+}
+
+std::string UserDirectory::Name(Id id) const {
+  const char* p = arena_.data() + offsets_[id];
+  size_t len = ReadLength(p);
+  return std::string(p, len);
+}
+
+size_t UserDirectory::MemoryBytes() const {
+  return arena_.capacity() + offsets_.capacity() * sizeof(uint32_t) + slots_.capacity() * sizeof(uint32_t);
+}
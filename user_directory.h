@@ -0,0 +1,49 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Every username a tsd has seen, interned to a dense 32-bit id (Client::id)
+ * in the order they were added.
+ *
+ * Names are packed back to back into one arena, each behind a varint length,
+ * and found through an open-addressing table of ids with linear probing. A
+ * user costs its name plus about 10 bytes, whether or not anything else of
+ * it is in memory; an unordered_map<string, uint32_t> costs some 70 bytes
+ * more. Not thread safe; tsd guards it with db_mutex, and fan-out reads
+ * names without that under SNSServiceImpl::directory_mu.
+ */
+class UserDirectory {
+public:
+  using Id = uint32_t;
+
+  // Adds name, which must not be in the directory yet, under the next id.
+  Id Add(const std::string& name);
+
+  bool Find(const std::string& name, Id* id) const;
+
+  // Makes room for users names of name_bytes in all without reallocating.
+  void Reserve(size_t users, size_t name_bytes);
+
+  std::string Name(Id id) const;
+
+  size_t size() const { return offsets_.size(); }
+
+  // Heap bytes held, including unused capacity.
+  size_t MemoryBytes() const;
+
+private:
+  // Slot of name in slots_, or of the empty slot it would go in.
+  size_t Probe(const char* name, size_t len) const;
+  void Rehash(size_t slots);
+
+  std::string arena_;
+  std::vector<uint32_t> offsets_;   // by id, into arena_
+  std::vector<uint32_t> slots_;     // id + 1, or 0 if empty; a power of two long
+};
+
+#endif
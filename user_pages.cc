@@ -0,0 +1,137 @@
+#include "user_pages.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+const uint64_t kMinMapBytes = 16 << 20;
+
+}  // namespace
+
+UserPages::~UserPages() {
+  if (map_) munmap(const_cast<char*>(map_), map_bytes_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool UserPages::Open() {
+  if (map_) munmap(const_cast<char*>(map_), map_bytes_);
+  map_ = nullptr;
+  map_bytes_ = 0;
+  if (fd_ >= 0) close(fd_);
+  // A new file rather than the old one truncated: a tsd handing over to this
+  // one still reads its records from the old one (handover.h)
+  unlink(path_.c_str());
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  file_bytes_ = live_bytes_ = 0;
+  records_ = 0;
+  at_.clear();
+  return fd_ >= 0 && Map(kMinMapBytes);
+}
+
+// Maps the first bytes of the file, which may run past its end: the file only
+// grows by appends, and a shared mapping sees them without being remapped.
+// On failure the old mapping stays.
+bool UserPages::Map(uint64_t bytes) {
+  void* addr = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) return false;
+  if (map_) munmap(const_cast<char*>(map_), map_bytes_);
+  map_ = static_cast<const char*>(addr);
+  map_bytes_ = bytes;
+  return true;
+}
+
+bool UserPages::Put(uint32_t id, const std::string& record) {
+  if (fd_ < 0 || !map_) return false;
+  Drop(id);
+  uint32_t header[2] = {id, static_cast<uint32_t>(record.size())};
+  std::string buf(reinterpret_cast<const char*>(header), kHeader);
+  buf += record;
+  if (pwrite(fd_, buf.data(), buf.size(), file_bytes_) != static_cast<ssize_t>(buf.size())) return false;
+  if (file_bytes_ + buf.size() > map_bytes_ && !Map(std::max(map_bytes_ * 2, file_bytes_ + buf.size()))) {
+    return false;
+  }
+  if (id >= at_.size()) at_.resize(id + 1);
+  at_[id] = file_bytes_ + 1;
+  file_bytes_ += buf.size();
+  live_bytes_ += buf.size();
+  records_++;
+  if (file_bytes_ >= kCompactBytes && live_bytes_ * 2 < file_bytes_) Compact();
+  return true;
+}
+
+bool UserPages::Get(uint32_t id, const char** data, size_t* size) const {
+  if (id >= at_.size() || !at_[id]) return false;
+  const char* header = map_ + at_[id] - 1;
+  uint32_t len;
+  memcpy(&len, header + 4, sizeof(len));
+  *data = header + kHeader;
+  *size = len;
+  return true;
+}
+
+void UserPages::Drop(uint32_t id) {
+  if (id >= at_.size() || !at_[id]) return;
+  uint32_t len;
+  memcpy(&len, map_ + at_[id] - 1 + 4, sizeof(len));
+  live_bytes_ -= kHeader + len;
+  records_--;
+  at_[id] = 0;
+}
+
+// Writes the live records, in id order, to a new file and swaps it in. On
+// failure the old file stays as it is.
+void UserPages::Compact() {
+  std::string tmp = path_ + ".tmp";
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  std::vector<uint64_t> at(at_.size());
+  std::string buf;
+  uint64_t bytes = 0;
+  bool ok = true;
+  for (size_t id = 0; id < at_.size() && ok; id++) {
+    if (!at_[id]) continue;
+    const char* header = map_ + at_[id] - 1;
+    uint32_t len;
+    memcpy(&len, header + 4, sizeof(len));
+    at[id] = bytes + buf.size() + 1;
+    buf.append(header, kHeader + len);
+    if (buf.size() >= (1 << 20)) {
+      ok = pwrite(fd, buf.data(), buf.size(), bytes) == static_cast<ssize_t>(buf.size());
+      bytes += buf.size();
+      buf.clear();
+    }
+  }
+  if (ok && !buf.empty()) {
+    ok = pwrite(fd, buf.data(), buf.size(), bytes) == static_cast<ssize_t>(buf.size());
+    bytes += buf.size();
+  }
+  uint64_t map_bytes = std::max(kMinMapBytes, bytes * 2);
+  void* addr = ok ? mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (addr == MAP_FAILED || rename(tmp.c_str(), path_.c_str()) != 0) {
+    if (addr != MAP_FAILED) munmap(addr, map_bytes);
+    close(fd);
+    unlink(tmp.c_str());
+    return;
+  }
+  munmap(const_cast<char*>(map_), map_bytes_);
+  close(fd_);
+  fd_ = fd;
+  map_ = static_cast<const char*>(addr);
+  map_bytes_ = map_bytes;
+  at_.swap(at);
+  file_bytes_ = bytes;
+}
+
+UserPagesStats UserPages::Stats() const {
+  UserPagesStats stats;
+  stats.records = records_;
+  stats.live_bytes = live_bytes_;
+  stats.file_bytes = file_bytes_;
+  return stats;
+}
@@ -0,0 +1,68 @@
+#ifndef USER_PAGES_H
+#define USER_PAGES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * On-disk store for the state of users that tsd paged out of memory: one
+ * opaque record per user id, appended to a single file and read back in
+ * place through a read-only mapping of it. Replacing or dropping a record
+ * leaves the old bytes behind; once they make up more than half of a file
+ * of at least kCompactBytes, the live records are rewritten into a new one.
+ *
+ * The records only describe this process's memory, so Open() starts from
+ * an empty file; recovery rebuilds everything from the snapshot and logs.
+ * Not thread safe; tsd guards it with db_mutex.
+ */
+
+struct UserPagesStats {
+  size_t records = 0;
+  uint64_t live_bytes = 0;   // bytes of current records, headers included
+  uint64_t file_bytes = 0;
+};
+
+class UserPages {
+public:
+  static const size_t kHeader = 8;                  // [u32 id][u32 length]
+  static const uint64_t kCompactBytes = 64 << 20;
+
+  explicit UserPages(std::string path) : path_(std::move(path)) {}
+  ~UserPages();
+
+  UserPages(const UserPages&) = delete;
+  UserPages& operator=(const UserPages&) = delete;
+
+  // Creates or truncates the file. Returns false if it cannot be written;
+  // Put then keeps nothing.
+  bool Open();
+
+  // Stores record as id's, replacing any earlier one. Returns false if it
+  // could not be written.
+  bool Put(uint32_t id, const std::string& record);
+
+  // Points data at id's record, valid until the next Put or Drop. Returns
+  // false if there is none.
+  bool Get(uint32_t id, const char** data, size_t* size) const;
+
+  void Drop(uint32_t id);
+
+  UserPagesStats Stats() const;
+
+private:
+  bool Map(uint64_t bytes);
+  void Compact();
+
+  std::string path_;
+  int fd_ = -1;
+  const char* map_ = nullptr;
+  uint64_t map_bytes_ = 0;
+  uint64_t file_bytes_ = 0;
+  uint64_t live_bytes_ = 0;
+  size_t records_ = 0;
+  std::vector<uint64_t> at_;   // by id: offset of its record + 1, or 0
+};
+
+#endif